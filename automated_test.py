@@ -1,3 +1,5 @@
+import json
+import sys
 import pytest
 import numpy as np
 import fastmorph
@@ -333,3 +335,972 @@ def test_grey_dilate_bool():
 	assert np.all(out == True)
 
 
+
+def weighted_grey_reference(labels, weights, dilate):
+	# brute force max-plus / min-plus over in-bounds offsets
+	info = np.iinfo(labels.dtype)
+	padded_shape = tuple(s + 2 for s in labels.shape)
+	fill = -np.inf if dilate else np.inf
+	padded = np.full(padded_shape, fill, dtype=np.float64)
+	padded[(slice(1,-1),) * labels.ndim] = labels
+	out = np.full(labels.shape, fill, dtype=np.float64)
+
+	for offset in np.ndindex(weights.shape):
+		w = weights[offset]
+		if not np.isfinite(w):
+			continue
+		d = np.array(offset) - 1
+		if dilate:
+			d = -d
+		window = tuple(slice(1 + di, 1 + di + s) for di, s in zip(d, labels.shape))
+		shifted = padded[window]
+		if dilate:
+			out = np.maximum(out, np.clip(shifted + w, info.min, info.max))
+		else:
+			out = np.minimum(out, np.clip(shifted - w, info.min, info.max))
+
+	return np.clip(out, info.min, info.max).astype(labels.dtype)
+
+@pytest.mark.parametrize('dtype', [ np.uint8, np.int16, np.uint32, np.int64 ])
+@pytest.mark.parametrize('shape', [ (13,11,9), (17,15) ])
+def test_grey_weighted(dtype, shape):
+	rng = np.random.default_rng(12)
+	labels = rng.integers(0, 100, size=shape).astype(dtype)
+
+	zeros = np.zeros((3,) * len(shape))
+	out = fastmorph.dilate(labels, mode=fastmorph.Mode.grey, weights=zeros)
+	assert np.all(out == weighted_grey_reference(labels, zeros, dilate=True))
+	out = fastmorph.erode(labels, mode=fastmorph.Mode.grey, weights=zeros)
+	assert np.all(out == fastmorph.erode(labels, mode=fastmorph.Mode.grey))
+
+	# general path
+	weights = rng.integers(-20, 20, size=zeros.shape).astype(np.float64)
+	weights[(0,) * len(shape)] = -np.inf
+	for parallel in (1,2):
+		out = fastmorph.dilate(labels, mode=fastmorph.Mode.grey, weights=weights, parallel=parallel)
+		assert np.all(out == weighted_grey_reference(labels, weights, dilate=True))
+		out = fastmorph.erode(labels, mode=fastmorph.Mode.grey, weights=weights, parallel=parallel)
+		assert np.all(out == weighted_grey_reference(labels, weights, dilate=False))
+
+	# separable path (rolling ball style, all weights <= 0)
+	axes = [ -np.array([2, 0, 1]) ] * len(shape)
+	weights = np.add.outer(axes[0], axes[1])
+	if len(shape) == 3:
+		weights = np.add.outer(weights, axes[2])
+	with fastmorph.record_trace() as trace:
+		out = fastmorph.dilate(labels, mode=fastmorph.Mode.grey, weights=weights)
+		assert np.all(out == weighted_grey_reference(labels, weights, dilate=True))
+		out = fastmorph.erode(labels, mode=fastmorph.Mode.grey, weights=weights)
+		assert np.all(out == weighted_grey_reference(labels, weights, dilate=False))
+
+	# 2D stencils take the separable path too
+	names = set(e["name"] for e in trace.events if e.get("cat") == "block")
+	assert names == set([ "grey_dilate_weighted:separable", "grey_erode_weighted:separable" ])
+
+@pytest.mark.parametrize('shape', [ (140,70,9), (1040,30) ])
+def test_grey_weighted_blocks(shape):
+	# several blocks along each axis, so the general and separable
+	# paths read their neighbors' voxels across block borders
+	rng = np.random.default_rng(13)
+	labels = rng.integers(0, 1000, size=shape).astype(np.int32)
+
+	weights = rng.integers(-20, 20, size=(3,) * len(shape)).astype(np.float64)
+	axes = [ -np.array([2, 0, 1]) ] * len(shape)
+	separable = np.add.outer(axes[0], axes[1])
+	if len(shape) == 3:
+		separable = np.add.outer(separable, axes[2])
+
+	for w in (weights, separable):
+		dilated = weighted_grey_reference(labels, w, dilate=True)
+		eroded = weighted_grey_reference(labels, w, dilate=False)
+		for parallel in (1,4):
+			out = fastmorph.dilate(labels, mode=fastmorph.Mode.grey, weights=w, parallel=parallel)
+			assert np.all(out == dilated)
+			out = fastmorph.erode(labels, mode=fastmorph.Mode.grey, weights=w, parallel=parallel)
+			assert np.all(out == eroded)
+
+def test_grey_weighted_saturation():
+	# uint8 values next to 0 and 255 pushed past them by the weights
+	rng = np.random.default_rng(14)
+	labels = rng.choice(np.array([ 0, 1, 3, 128, 252, 254, 255 ], dtype=np.uint8), size=(35,20,9))
+
+	general = rng.integers(-6, 6, size=(3,3,3)).astype(np.float64)
+	axes = np.array([5, 0, 2])
+	separable = np.add.outer(np.add.outer(axes, axes), axes)
+
+	for w in (general, separable, -separable):
+		for parallel in (1,2):
+			out = fastmorph.dilate(labels, mode=fastmorph.Mode.grey, weights=w, parallel=parallel)
+			assert np.all(out == weighted_grey_reference(labels, w, dilate=True))
+			out = fastmorph.erode(labels, mode=fastmorph.Mode.grey, weights=w, parallel=parallel)
+			assert np.all(out == weighted_grey_reference(labels, w, dilate=False))
+
+@pytest.mark.parametrize('dtype', [ np.int64, np.uint64 ])
+def test_grey_weighted_64bit(dtype):
+	# weights past 2^40 are not clamped for 64 bit images
+	rng = np.random.default_rng(15)
+	labels = rng.integers(0, 100, size=(13,11,9)).astype(dtype)
+
+	big = 2.0 ** 41
+	general = rng.integers(-6, 6, size=(3,3,3)).astype(np.float64) + big
+	general[0,0,0] = -np.inf
+	separable = np.full((3,3,3), big)
+	negated = -general
+	negated[0,0,0] = -np.inf
+	for w in (general, separable, negated, -separable):
+		out = fastmorph.dilate(labels, mode=fastmorph.Mode.grey, weights=w)
+		assert np.all(out == weighted_grey_reference(labels, w, dilate=True))
+		out = fastmorph.erode(labels, mode=fastmorph.Mode.grey, weights=w)
+		assert np.all(out == weighted_grey_reference(labels, w, dilate=False))
+
+	info = np.iinfo(dtype)
+	labels = np.full((5,5,5), info.max - 10, dtype=dtype)
+	out = fastmorph.dilate(labels, mode=fastmorph.Mode.grey, weights=separable)
+	assert np.all(out == info.max)
+	out = fastmorph.erode(labels, mode=fastmorph.Mode.grey, weights=separable)
+	assert np.all(out == info.max - 10 - (2 ** 41))
+
+def test_grey_weighted_errors():
+	labels = np.zeros((5,5,5), dtype=np.uint8)
+	with pytest.raises(ValueError):
+		fastmorph.dilate(labels, weights=np.zeros((3,3,3)))
+	with pytest.raises(ValueError):
+		fastmorph.dilate(labels, mode=fastmorph.Mode.grey, weights=np.zeros((3,3)))
+
+@pytest.mark.parametrize('dtype', [ np.uint8, np.int8, np.int16, np.uint32 ])
+@pytest.mark.parametrize('shape', [ (70,9,5), (70,45) ])
+def test_grey_saturated(dtype, shape):
+	# the integer kernels skip ahead past columns holding the dtype's
+	# maximum (dilate) or minimum (erode), skipped voxels must be written
+	info = np.iinfo(dtype)
+	rng = np.random.default_rng(5)
+	labels = rng.integers(10, 20, size=shape).astype(dtype)
+	labels[rng.random(shape) < 0.125] = info.max
+	labels[rng.random(shape) < 0.125] = info.min
+	labels = np.asfortranarray(labels)
+
+	zeros = np.zeros((3,) * len(shape))
+	for parallel in (1,2):
+		out = fastmorph.dilate(labels, mode=fastmorph.Mode.grey, parallel=parallel)
+		assert np.all(out == weighted_grey_reference(labels, zeros, dilate=True))
+		out = fastmorph.erode(labels, mode=fastmorph.Mode.grey, parallel=parallel)
+		assert np.all(out == weighted_grey_reference(labels, zeros, dilate=False))
+
+def grey_float_reference(labels, dilate):
+	fill = -np.inf if dilate else np.inf
+	padded = np.pad(labels, 1, constant_values=fill)
+	reduce = np.maximum if dilate else np.minimum
+	out = np.full(labels.shape, fill, dtype=labels.dtype)
+	for d in np.ndindex((3,) * labels.ndim):
+		window = tuple(slice(di, di + s) for di, s in zip(d, labels.shape))
+		out = reduce(out, padded[window])
+	return out
+
+@pytest.mark.parametrize('dtype', [ np.float32, np.float64 ])
+@pytest.mark.parametrize('shape', [ (37,29,23), (45,31) ])
+def test_grey_float(dtype, shape):
+	rng = np.random.default_rng(7)
+	labels = rng.normal(size=shape).astype(dtype)
+	labels[(5,) * len(shape)] = np.inf
+	labels[(20,) * len(shape)] = -np.inf
+
+	for parallel in (1,2):
+		out = fastmorph.dilate(labels, mode=fastmorph.Mode.grey, parallel=parallel)
+		assert out.dtype == dtype
+		assert np.array_equal(out, grey_float_reference(labels, dilate=True))
+		out = fastmorph.erode(labels, mode=fastmorph.Mode.grey, parallel=parallel)
+		assert np.array_equal(out, grey_float_reference(labels, dilate=False))
+
+	# NaN spreads like np.maximum / np.minimum
+	labels[(10,) * len(shape)] = np.nan
+	for dilate in (True, False):
+		fn = fastmorph.dilate if dilate else fastmorph.erode
+		out = fn(labels, mode=fastmorph.Mode.grey)
+		assert np.array_equal(out, grey_float_reference(labels, dilate), equal_nan=True)
+		assert np.count_nonzero(np.isnan(out)) == 3 ** len(shape)
+
+	# weights are not rounded
+	labels = rng.random(size=shape).astype(dtype)
+	weights = np.full((3,) * len(shape), -0.25)
+	weights[(1,) * len(shape)] = 0
+	weights[(0,) * len(shape)] = -np.inf
+	out = fastmorph.dilate(labels, mode=fastmorph.Mode.grey, weights=weights)
+	padded = np.pad(labels.astype(np.float64), 1, constant_values=-np.inf)
+	expected = np.full(shape, -np.inf)
+	for d in np.ndindex(weights.shape):
+		window = tuple(slice(di, di + s) for di, s in zip(d, shape))
+		flipped = tuple(2 - di for di in d)
+		expected = np.maximum(expected, padded[window] + weights[flipped])
+	assert np.allclose(out, expected)
+
+def test_grey_float_errors():
+	labels = np.zeros((5,5,5), dtype=np.float16)
+	with pytest.raises(ValueError):
+		fastmorph.dilate(labels, mode=fastmorph.Mode.grey)
+	labels = np.zeros((5,5,5), dtype=np.float32)
+	with pytest.raises(ValueError):
+		fastmorph.until_stable(labels, "dilate", mode=fastmorph.Mode.grey)
+
+@pytest.mark.parametrize('dtype', [ np.uint8, np.uint32, np.int64 ])
+def test_per_label_morph(dtype):
+	labels = np.zeros((40,40,40), dtype=dtype, order="F")
+	labels[2:18,2:18,2:18] = 1
+	labels[22:38,22:38,22:38] = 2
+	labels[5:10,25:30,5:10] = 3
+
+	# radius +/-1 is the same as one dilate or erode
+	out = fastmorph.per_label_morph(labels, { 1: 1, 2: 1, 3: 1 })
+	assert np.all(out == fastmorph.dilate(labels))
+	out = fastmorph.per_label_morph(labels, {}, default_radius=-1)
+	assert np.all(out == fastmorph.erode(labels))
+
+	# shrink 1 by 3, leave 2 alone, grow 3 by 2
+	out = fastmorph.per_label_morph(labels, { 1: -3, 2: 0, 3: 2 }, parallel=2)
+	assert np.count_nonzero(out == 1) == 10 ** 3
+	assert np.all(out[5:15,5:15,5:15] == 1)
+	assert np.all(out[22:38,22:38,22:38] == 2)
+	assert np.count_nonzero(out == 2) == 16 ** 3
+	assert np.all(out[3:12,23:32,3:12] == 3)
+	assert np.count_nonzero(out == 3) == 9 ** 3
+
+	# lookup array over the label space gives the same result
+	lut = np.array([ 0, -3, 0, 2 ])
+	out2 = fastmorph.per_label_morph(labels, lut)
+	assert np.all(out == out2)
+
+	# whole float radii are fine, fractional ones are not truncated
+	out2 = fastmorph.per_label_morph(labels, lut.astype(np.float32))
+	assert np.all(out == out2)
+	with pytest.raises(ValueError):
+		fastmorph.per_label_morph(labels, np.array([ 0, -3, 0, 1.9 ]))
+	with pytest.raises(ValueError):
+		fastmorph.per_label_morph(labels, { 3: 1.9 })
+	with pytest.raises(ValueError):
+		fastmorph.per_label_morph(labels, {}, default_radius=0.5)
+
+	# a lookup array can't have more entries than the dtype has labels
+	if dtype == np.uint8:
+		with pytest.raises(ValueError):
+			fastmorph.per_label_morph(labels, np.zeros(257))
+
+	out = fastmorph.per_label_morph(labels[:,:,7], { 1: -3, 3: 2 })
+	assert np.count_nonzero(out == 1) == 10 ** 2
+	assert np.count_nonzero(out == 3) == 9 ** 2
+
+def test_spherical_erode_per_label():
+	labels = np.zeros((30,30,30), dtype=np.uint32)
+	labels[2:13,2:13,2:13] = 1
+	labels[15:26,15:26,15:26] = 2
+
+	res = fastmorph.spherical_erode(labels, radius={ 1: 3 })
+	assert np.all(res[labels == 2] == 2)
+	assert np.all(res == np.where(labels == 1, fastmorph.spherical_erode(labels, radius=3), labels))
+
+	lut = np.array([ 0, 3, 0 ])
+	res2 = fastmorph.spherical_erode(labels, radius=lut)
+	assert np.all(res == res2)
+
+	# every label must be in the lookup array
+	with pytest.raises(ValueError):
+		fastmorph.spherical_erode(labels, radius=np.array([ 0, 3 ]))
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.uint32, np.int64])
+def test_morph_each_label(dtype):
+	labels = np.zeros((40,40,40), dtype=dtype)
+	labels[2:18,2:18,2:18] = 1
+	labels[22:38,22:38,22:38] = 2
+	labels[5:10,25:30,5:10] = 3
+	labels[24:28,24:28,24:28] = 0 # cavity in 2
+
+	def reference(op, radius=1, **kwargs):
+		fn = getattr(fastmorph, op)
+		out = np.copy(labels)
+		for label in [1,2,3]:
+			binary = (labels == label)
+			if op in ("erode", "dilate", "opening", "closing"):
+				for _ in range(radius):
+					binary = fn(binary, **kwargs)
+			else:
+				binary = fn(binary, radius=radius, **kwargs)
+			out[(labels == label) & ~binary] = 0
+			out[(labels == 0) & binary & (out == 0)] = label
+		return out
+
+	for op in ("erode", "dilate"):
+		for radius in (1,2):
+			res = fastmorph.morph_each_label(labels, op, radius=radius, parallel=2)
+			assert np.all(res == reference(op, radius))
+
+	res = fastmorph.morph_each_label(labels, "dilate", radius=1)
+	assert np.all(res == fastmorph.dilate(labels))
+
+	for op in ("spherical_erode", "spherical_dilate"):
+		for radius in (1, np.sqrt(2), 2.5):
+			res = fastmorph.morph_each_label(labels, op, radius=radius, parallel=2)
+			assert np.all(res == reference(op, radius))
+
+	res = fastmorph.morph_each_label(labels, fastmorph.LabelOp.fill, parallel=2)
+	assert np.all(res[24:28,24:28,24:28] == 2)
+	assert np.all(res[labels != 0] == labels[labels != 0])
+	assert np.count_nonzero(res != labels) == 4 ** 3
+
+	ring = np.zeros((20,20), dtype=dtype)
+	ring[5:15,5:15] = 1
+	ring[6:14,6:14] = 0
+	res = fastmorph.morph_each_label(ring, fastmorph.LabelOp.fill)
+	assert np.count_nonzero(res) == 100
+	assert np.all(res[5:15,5:15] == 1)
+
+	res = fastmorph.morph_each_label(labels[:,:,7], "erode")
+	assert np.all(res == fastmorph.erode(labels[:,:,7]))
+
+	with pytest.raises(KeyError):
+		fastmorph.morph_each_label(labels, "not_an_op")
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.uint32, np.int16])
+def test_until_stable(dtype):
+	labels = np.zeros((100,80,70), dtype=dtype)
+	labels[5,5,5] = 1
+	labels[90,70,60] = 2
+	labels[40:60,40:42,40:60] = 3
+
+	def reference(op, mode, max_iterations=0):
+		fn = getattr(fastmorph, op)
+		out = labels
+		iterations = 0
+		while max_iterations == 0 or iterations < max_iterations:
+			nxt = fn(out, mode=mode)
+			if np.array_equal(nxt, out):
+				break
+			out = nxt
+			iterations += 1
+		return out, iterations
+
+	for mode in (fastmorph.Mode.multilabel, fastmorph.Mode.grey):
+		for op in ("dilate", "erode", "closing", "opening"):
+			ref, ref_it = reference(op, mode)
+			res, it = fastmorph.until_stable(labels, op, mode=mode, parallel=2, return_iterations=True)
+			assert it == ref_it
+			assert np.all(res == ref)
+
+	ref, ref_it = reference("dilate", fastmorph.Mode.multilabel, max_iterations=3)
+	res, it = fastmorph.until_stable(labels, "dilate", max_iterations=3, return_iterations=True)
+	assert it == 3
+	assert np.all(res == ref)
+
+	res = fastmorph.until_stable(labels[:,:,5], "dilate")
+	assert np.all(res != 0)
+
+	# the mode filter of background_only=False flips between two 
+	# states forever, without cycle detection this never returns
+	flipping = np.array([
+		[0, 2, 0, 2, 1], 
+		[0, 2, 0, 1, 0], 
+		[2, 1, 2, 1, 0], 
+		[0, 0, 2, 2, 2], 
+		[1, 0, 1, 1, 0],
+	], dtype=dtype).T
+	res, it = fastmorph.until_stable(flipping, "dilate", background_only=False, return_iterations=True)
+	nxt = fastmorph.dilate(res, background_only=False)
+	assert not np.array_equal(nxt, res)
+	assert np.array_equal(fastmorph.dilate(nxt, background_only=False), res)
+	assert it < 10
+
+	with pytest.raises(ValueError):
+		fastmorph.until_stable(labels, "not_an_op")
+	with pytest.raises(ValueError):
+		fastmorph.until_stable(np.zeros((3,3,3,3), dtype=dtype), "dilate")
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.uint32, np.int64])
+@pytest.mark.parametrize("background_only", [True, False])
+def test_dilate_contacts(dtype, background_only):
+	rng = np.random.default_rng(0)
+	labels = rng.integers(0, 5, size=(12,11,10)).astype(dtype)
+	labels[labels == 4] = 0
+
+	def reference(labels):
+		contacts = {}
+		padded = np.pad(labels, 1)
+		for x, y, z in np.ndindex(labels.shape):
+			if background_only and labels[x,y,z] != 0:
+				continue
+			window = set(np.unique(padded[x:x+3,y:y+3,z:z+3]).tolist())
+			window.discard(0)
+			window = sorted(window)
+			for i in range(len(window)):
+				for j in range(i + 1, len(window)):
+					pair = (window[i], window[j])
+					contacts[pair] = contacts.get(pair, 0) + 1
+		return contacts
+
+	out, contacts = fastmorph.dilate(
+		labels, background_only=background_only, 
+		parallel=2, return_contacts=True
+	)
+	assert np.all(out == fastmorph.dilate(labels, background_only=background_only))
+	assert contacts == reference(labels)
+
+	out, contacts = fastmorph.dilate(
+		labels[:,:,3], background_only=background_only, 
+		return_contacts=True
+	)
+	assert np.all(out == fastmorph.dilate(labels[:,:,3], background_only=background_only))
+	assert contacts == reference(labels[:,:,3:4])
+
+	with pytest.raises(ValueError):
+		fastmorph.dilate(labels, mode=fastmorph.Mode.grey, return_contacts=True)
+
+def mode_dilate_reference(labels, background_only):
+	padded = np.pad(labels, 1)
+	best = np.zeros_like(labels)
+	best_ct = np.zeros(labels.shape, dtype=np.int32)
+	shifts = [ (dx,dy,dz) for dx in range(3) for dy in range(3) for dz in range(3) ]
+	if labels.ndim == 2:
+		shifts = [ (dx,dy) for dx in range(3) for dy in range(3) ]
+	for label in np.unique(labels):
+		if label == 0:
+			continue
+		ct = np.zeros(labels.shape, dtype=np.int32)
+		for shift in shifts:
+			window = padded[tuple(slice(d, d + n) for d, n in zip(shift, labels.shape))]
+			ct += (window == label)
+		update = ct > best_ct
+		best[update] = label
+		best_ct[update] = ct[update]
+	if background_only:
+		best[labels != 0] = labels[labels != 0]
+	return best
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.uint32, np.int64])
+@pytest.mark.parametrize("background_only", [True, False])
+def test_dilate_kernel_selection(dtype, background_only):
+	rng = np.random.default_rng(0)
+	shape = (70,66,66)
+	num_blocks = 8
+
+	empty = np.zeros(shape, dtype=dtype)
+	full = np.full(shape, 7, dtype=dtype)
+	blob = np.zeros(shape, dtype=dtype)
+	blob[5:30,5:30,5:30] = 5
+	chunks = np.zeros(shape, dtype=dtype)
+	chunks[:40,:,:] = 1
+	chunks[40:,:30,:] = 2
+	chunks[40:,30:,50:] = 3
+	chunks[rng.random(shape) < 0.05] = 0
+	tangle = rng.integers(0, 12, size=shape).astype(dtype)
+
+	cases = [ 
+		(empty, "skip"), (full, "copy"), (blob, "binary"), 
+		(chunks, "palette"), (tangle, "general"),
+	]
+	for labels, kernel in cases:
+		labels = np.asfortranarray(labels)
+		out, stats = fastmorph.dilate(
+			labels, background_only=background_only, 
+			parallel=2, return_kernel_stats=True
+		)
+		assert set(stats.keys()) == set([ "skip", "copy", "binary", "palette", "general" ])
+		assert sum(stats.values()) == num_blocks
+		assert stats[kernel] > 0
+		assert np.all(out == mode_dilate_reference(labels, background_only))
+		assert np.all(out == fastmorph.dilate(labels, background_only=background_only))
+
+	slc = np.asfortranarray(chunks[:,:,55])
+	out, stats = fastmorph.dilate(slc, background_only=background_only, return_kernel_stats=True)
+	assert stats["palette"] == 1
+	assert np.all(out == mode_dilate_reference(slc, background_only))
+
+def test_dilate_background_only_keeps_labels():
+	# a background voxel whose window is dominated by one label
+	# must not spill that label onto a differently labeled neighbor
+	labels = np.full((16,3,3), 2, dtype=np.uint32, order="F")
+	labels[5:,1,1] = np.arange(15, 26)
+	labels[1,1,1] = 0
+	labels[2,1,1] = 1
+	out, stats = fastmorph.dilate(labels, background_only=True, return_kernel_stats=True)
+	assert stats["general"] == 1
+	assert out[2,1,1] == 1
+	assert np.all(out == mode_dilate_reference(labels, True))
+
+@pytest.mark.parametrize("dtype", [np.uint16, np.uint64, np.int32])
+def test_change_stats(dtype):
+	labels = np.zeros((70,70,70), dtype=dtype)
+	labels[2:40,2:40,2:40] = 1
+	labels[50:52,50:52,50:52] = 2 # erodes away
+	labels[45:65,10:30,10:30] = 3
+	labels[10:20,50:60,50:60] = 4
+
+	def reference(before, after):
+		changes = {}
+		for label in np.unique(np.concatenate([ before.ravel(), after.ravel() ])):
+			if label == 0:
+				continue
+			gained = int(np.count_nonzero((after == label) & (before != label)))
+			lost = int(np.count_nonzero((before == label) & (after != label)))
+			if gained or lost:
+				changes[int(label)] = (gained, lost)
+		eliminated = set(np.unique(before).tolist()) - set(np.unique(after).tolist())
+		return changes, eliminated
+
+	out, changes, eliminated = fastmorph.erode(
+		labels, parallel=2, return_changes=True, return_eliminated=True
+	)
+	assert np.all(out == fastmorph.erode(labels))
+	assert (changes, eliminated) == reference(labels, out)
+	assert eliminated == { 2 }
+
+	out, eliminated = fastmorph.erode(labels[:,:,51], return_eliminated=True)
+	assert eliminated == reference(labels[:,:,51], out)[1]
+
+	for background_only in (True, False):
+		out, contacts, changes = fastmorph.dilate(
+			labels, background_only=background_only, parallel=2,
+			return_contacts=True, return_changes=True,
+		)
+		assert np.all(out == fastmorph.dilate(labels, background_only=background_only))
+		assert changes == reference(labels, out)[0]
+
+	with pytest.raises(ValueError):
+		fastmorph.erode(labels, mode=fastmorph.Mode.grey, return_changes=True)
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.uint32, np.int64])
+def test_sparse_diff(dtype):
+	rng = np.random.default_rng(1)
+	labels = np.zeros((90,80,70), dtype=dtype)
+	labels[2:40,2:40,2:40] = 1
+	labels[45:85,10:30,10:60] = 2
+	labels[10:20,50:79,50:60] = 3
+	labels[rng.random(labels.shape) < 0.01] = 0
+
+	for mode in (fastmorph.Mode.multilabel, fastmorph.Mode.grey):
+		for op in ("dilate", "erode", "opening", "closing"):
+			expected = getattr(fastmorph, op)(labels, mode=mode)
+
+			indices, values = fastmorph.sparse_diff(labels, op, mode=mode, parallel=2)
+			assert np.all(np.diff(indices.astype(np.int64)) > 0)
+			assert len(indices) == np.count_nonzero(expected != labels)
+			out = np.copy(labels, order="F")
+			out.ravel(order="F")[indices] = values
+			assert np.all(out == expected)
+
+			coords, values = fastmorph.sparse_diff(labels, op, mode=mode, format="coords")
+			out = np.copy(labels)
+			out[tuple(coords.T)] = values
+			assert np.all(out == expected)
+
+	coords, values = fastmorph.sparse_diff(labels[:,:,20], "erode", format="coords")
+	out = np.copy(labels[:,:,20])
+	out[tuple(coords.T)] = values
+	assert np.all(out == fastmorph.erode(labels[:,:,20]))
+
+	with pytest.raises(ValueError):
+		fastmorph.sparse_diff(labels, "dilate", format="mask")
+	with pytest.raises(ValueError):
+		fastmorph.sparse_diff(np.zeros((3,3,3,3), dtype=dtype), "dilate")
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.uint32, np.int64])
+def test_morph_sparse(dtype):
+	rng = np.random.default_rng(2)
+	labels = np.zeros((100,90,80), dtype=dtype)
+	labels[2:20,2:20,2:20] = 1
+	labels[60:75,40:60,30:45] = 2
+	labels[70:80,50:58,40:79] = 3
+	labels[rng.random(labels.shape) < 0.001] = 4
+
+	coords = np.stack(np.nonzero(labels), axis=1)
+	values = labels[tuple(coords.T)]
+
+	for mode in (fastmorph.Mode.multilabel, fastmorph.Mode.grey):
+		for op in ("dilate", "erode", "opening", "closing"):
+			expected = labels
+			for _ in range(2):
+				expected = getattr(fastmorph, op)(expected, mode=mode)
+
+			out = fastmorph.morph_sparse(
+				coords, values, labels.shape, op, 
+				iterations=2, mode=mode, parallel=2, dense=True
+			)
+			assert out.dtype == labels.dtype
+			assert np.all(out == expected)
+
+			out_coords, out_values = fastmorph.morph_sparse(
+				coords, values, labels.shape, op, iterations=2, mode=mode
+			)
+			assert len(out_values) == np.count_nonzero(expected)
+			assert np.all(out_values != 0)
+			out = np.zeros_like(labels)
+			out[tuple(out_coords.T)] = out_values
+			assert np.all(out == expected)
+
+	slc = labels[:,:,10]
+	coords = np.stack(np.nonzero(slc), axis=1)
+	out = fastmorph.morph_sparse(coords, slc[tuple(coords.T)], slc.shape, "dilate", dense=True)
+	assert np.all(out == fastmorph.dilate(slc))
+
+	with pytest.raises(ValueError):
+		fastmorph.morph_sparse(coords, 1, slc.shape, "fill")
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.uint32, np.int64])
+def test_paint_points(dtype):
+	coords = np.array([ [5,5,5], [20,30,10], [39,0,0], [-2,10,10] ])
+	point_labels = np.array([ 1, 2, 3, 4 ], dtype=dtype)
+
+	# cube radius r is the same as r dilations of the rasterized points
+	shape = (40,40,40)
+	raster = np.zeros(shape, dtype=dtype)
+	for (x,y,z), label in zip(coords, point_labels):
+		if x >= 0:
+			raster[x,y,z] = label
+
+	res = fastmorph.paint_points(coords[:3], point_labels[:3], shape=shape, radius=2, parallel=2)
+	expected = fastmorph.dilate(fastmorph.dilate(raster))
+	assert res.dtype == dtype
+	assert np.all(res == expected)
+
+	# spheres are the voxels within radius of each point, even 
+	# when the point itself is outside of the image
+	res = fastmorph.paint_points(coords, point_labels, shape=shape, radius=3.5, footprint="sphere", parallel=2)
+	xs, ys, zs = np.meshgrid(np.arange(40), np.arange(40), np.arange(40), indexing="ij")
+	expected = np.zeros(shape, dtype=dtype)
+	for (x,y,z), label in zip(coords, point_labels):
+		expected[(xs - x) ** 2 + (ys - y) ** 2 + (zs - z) ** 2 <= 3.5 ** 2] = label
+	assert np.all(res == expected)
+
+	binary = np.zeros(shape, dtype=bool)
+	binary[5,5,5] = True
+	res = fastmorph.paint_points(coords[:1], True, shape=shape, radius=3.5, footprint="sphere")
+	assert np.all(res == fastmorph.spherical_dilate(binary, radius=3.5))
+
+	# existing labels are kept unless overwrite, ROI offsets shift the points
+	out = np.zeros(shape, dtype=dtype, order="F")
+	out[5,5,5] = 9
+	res = fastmorph.paint_points(coords[:1] + 100, 1, out=out, offset=(100,100,100))
+	assert res is out
+	assert out[5,5,5] == 9
+	assert np.count_nonzero(out == 1) == 26
+	fastmorph.paint_points(coords[:1], 1, out=out, overwrite=True)
+	assert np.count_nonzero(out == 1) == 27
+
+	# anisotropic cube and 2D
+	res = fastmorph.paint_points([[10,10]], 5, shape=(20,20), radius=2, anisotropy=(1,2))
+	assert np.count_nonzero(res) == 5 * 3
+	assert res.shape == (20,20)
+
+def test_track_memory():
+	labels = np.zeros((64,64,64), dtype=np.uint32, order="F")
+	labels[20:40,20:40,20:40] = 1
+
+	with fastmorph.track_memory() as usage:
+		res = fastmorph.dilate(labels, parallel=2)
+
+	assert usage.allocations > 0
+	assert usage.peak_bytes >= res.nbytes
+	assert usage.total_bytes >= usage.peak_bytes
+
+	# nothing is counted outside of the block
+	peak = usage.peak_bytes
+	fastmorph.dilate(labels)
+	assert usage.peak_bytes == peak
+
+def test_paint_points_far_apart():
+	# overlaps are resolved per plane, so points in opposite corners
+	# don't need scratch memory for the whole volume between them
+	shape = (256,256,256)
+	out = np.zeros(shape, dtype=np.uint8, order="F")
+	coords = np.array([ [0,0,0], [255,255,255], [3,250,1] ])
+
+	with fastmorph.track_memory() as usage:
+		fastmorph.paint_points(coords, [ 1, 2, 3 ], out=out, radius=1)
+
+	assert usage.peak_bytes < 1024 * 1024
+	assert np.count_nonzero(out == 1) == 8
+	assert np.count_nonzero(out == 2) == 8
+	assert np.count_nonzero(out == 3) == 27
+	assert np.all(out[:2,:2,:2] == 1)
+	assert np.all(out[254:,254:,254:] == 2)
+	assert np.all(out[2:5,249:252,:3] == 3)
+
+@pytest.mark.parametrize("dtype", [ np.uint8, np.uint16, np.uint32, np.uint64 ])
+def test_hot_counters(dtype):
+	rng = np.random.default_rng(0)
+	# enough labels to route blocks to the general dilate kernel
+	labels = rng.integers(0, 12, size=(70,66,20)).astype(dtype)
+	labels[:30,:30,:] = 3
+	labels = np.asfortranarray(labels)
+
+	if not fastmorph.HOT_COUNTERS_ENABLED:
+		with pytest.raises(RuntimeError):
+			fastmorph.dilate(labels, return_counters=True)
+		return
+
+	keys = set([
+		"voxels_visited", "full_sorts", "stencil_reuses", "fast_path_hits", 
+		"skipped_voxels", "blocks", "block_seconds", "max_block_seconds",
+	])
+
+	for mode in [ fastmorph.Mode.multilabel, fastmorph.Mode.grey ]:
+		for fn in [ fastmorph.dilate, fastmorph.erode ]:
+			out, counters = fn(labels, parallel=2, mode=mode, return_counters=True)
+			assert np.all(out == fn(labels, mode=mode))
+			assert set(counters.keys()) == keys
+			assert counters["blocks"] == 4
+			assert counters["voxels_visited"] > 0
+			assert counters["max_block_seconds"] <= counters["block_seconds"]
+
+			# counts don't depend on the number of threads
+			out, counters1 = fn(labels, parallel=1, mode=mode, return_counters=True)
+			for key in keys - set([ "block_seconds", "max_block_seconds" ]):
+				assert counters1[key] == counters[key]
+
+	out, counters = fastmorph.dilate(labels, background_only=False, return_counters=True)
+	assert counters["full_sorts"] > 0
+
+	out, counters = fastmorph.opening(labels, return_counters=True)
+	assert set(counters.keys()) == set([ "erode", "dilate" ])
+	assert np.all(out == fastmorph.opening(labels))
+
+def test_record_trace(tmp_path):
+	labels = np.zeros((140,130,70), dtype=np.uint32, order="F")
+	labels[20:100,20:100,10:60] = 1
+	labels[60:,60:,:] = 2
+
+	path = str(tmp_path / "trace.json")
+	with fastmorph.record_trace(path) as trace:
+		res = fastmorph.dilate(labels, parallel=2)
+		fastmorph.erode(labels, parallel=1)
+	fastmorph.dilate(labels, parallel=2)
+
+	assert np.all(res == fastmorph.dilate(labels))
+
+	blocks = [ e for e in trace.events if e.get("cat") == "block" ]
+	# 3 x 3 x 2 blocks for each op
+	assert len([ e for e in blocks if e["name"].startswith("multilabel_dilate") ]) == 18
+	assert len([ e for e in blocks if e["name"] == "multilabel_erode" ]) == 18
+	assert all("kernel" in e["args"] for e in blocks if e["name"].startswith("multilabel_dilate"))
+	assert all(e["args"]["queue_wait_us"] >= 0 and e["dur"] >= 0 for e in blocks)
+
+	with open(path, "rt") as f:
+		assert len(json.load(f)["traceEvents"]) == len(trace.events)
+
+	summary = trace.summary()
+	assert summary["multilabel_dilate"]["blocks"] == 18
+	assert summary["multilabel_erode"]["threads"] == 1
+	assert 0 < summary["multilabel_dilate"]["utilization"] <= 1.0 + 1e-6
+
+@pytest.mark.skipif(not sys.platform.startswith("linux"), reason="perf_event_open is Linux only")
+def test_perf_counters():
+	labels = np.zeros((140,130,70), dtype=np.uint32, order="F")
+	labels[20:100,20:100,10:60] = 1
+	labels[60:,60:,:] = 2
+
+	names = {
+		"cycles", "instructions", "cache_references", "cache_misses",
+		"branch_misses", "l1d_read_misses", "task_clock_ns",
+		"page_faults", "context_switches",
+	}
+
+	with fastmorph.perf_counters() as perf:
+		res = fastmorph.dilate(labels, parallel=2)
+
+	assert np.all(res == fastmorph.dilate(labels))
+	assert set(perf.counters) | set(perf.unavailable) == names
+	assert not (set(perf.counters) & set(perf.unavailable))
+	assert perf.seconds > 0
+	if "task_clock_ns" in perf.counters:
+		assert perf.counters["task_clock_ns"] > 0
+
+	with fastmorph.perf_counters(per_block=True) as perf:
+		fastmorph.dilate(labels, parallel=2)
+
+	# 3 x 3 x 2 blocks
+	assert len(perf.blocks) == 18
+	assert all(block["name"] == "multilabel_dilate" for block in perf.blocks)
+	assert all(set(block["counters"]) <= names for block in perf.blocks)
+
+def test_cpu_isa():
+	labels = np.zeros((140,130,70), dtype=np.uint16, order="F")
+	labels[20:100,20:100,10:60] = 1
+	labels[60:,60:,:] = 2
+	labels[::7,::5,::3] = 3
+
+	info = fastmorph.cpu_isa()
+	isas = [ "baseline", "avx2", "avx512" ]
+	assert info["best_supported"] in isas
+	if not info["dispatch_enabled"]:
+		assert info["best_supported"] == "baseline"
+
+	original = info["selected"]
+	try:
+		assert fastmorph.set_cpu_isa("baseline") == "baseline"
+		dilated = fastmorph.dilate(labels, parallel=2)
+		eroded = fastmorph.erode(labels, parallel=2)
+		grey = fastmorph.dilate(labels, mode=fastmorph.Mode.grey)
+
+		for isa in isas[1:isas.index(info["best_supported"]) + 1]:
+			assert fastmorph.set_cpu_isa(isa) == isa
+			assert fastmorph.cpu_isa()["selected"] == isa
+			assert np.all(fastmorph.dilate(labels, parallel=2) == dilated)
+			assert np.all(fastmorph.erode(labels, parallel=2) == eroded)
+			assert np.all(fastmorph.dilate(labels, mode=fastmorph.Mode.grey) == grey)
+
+		assert fastmorph.set_cpu_isa("auto") == info["best_supported"]
+		with pytest.raises(ValueError):
+			fastmorph.set_cpu_isa("sse9")
+	finally:
+		fastmorph.set_cpu_isa(original)
+
+def test_corpus():
+	import fastmorph.corpus
+
+	labels = fastmorph.corpus.generate_labels((60,50,40), num_labels=30, foreground=0.3, seed=3)
+	assert labels.flags.f_contiguous
+	assert labels.dtype == np.uint32
+	assert np.all(labels == fastmorph.corpus.generate_labels((60,50,40), num_labels=30, foreground=0.3, seed=3))
+	assert not np.all(labels == fastmorph.corpus.generate_labels((60,50,40), num_labels=30, foreground=0.3, seed=4))
+
+	stats = fastmorph.corpus.describe(labels)
+	assert 25 <= stats["num_labels"] <= 30
+	assert abs(stats["foreground"] - 0.3) < 0.05
+
+	rough = fastmorph.corpus.generate_labels((60,50,40), num_labels=30, roughness=1.0, seed=3)
+	smooth = fastmorph.corpus.generate_labels((60,50,40), num_labels=30, seed=3)
+	assert fastmorph.corpus.describe(rough)["boundary_density"] > fastmorph.corpus.describe(smooth)["boundary_density"]
+
+	image = fastmorph.corpus.generate_labels((100,80), num_labels=10, dtype=np.uint8, boundary_width=1)
+	assert image.shape == (100,80) and image.dtype == np.uint8
+	assert fastmorph.corpus.describe(image)["foreground"] < 1.0
+
+	huge = fastmorph.corpus.preset("huge_object", 32)
+	assert fastmorph.corpus.describe(huge)["largest_object"] > 0.5
+
+	grey = fastmorph.corpus.generate_grey((30,30,30), num_labels=5, dtype=np.float32)
+	assert grey.dtype == np.float32 and 0 <= grey.min() and grey.max() <= 1
+
+@pytest.mark.parametrize('op,dtype', [ 
+	("multilabel_erode", np.uint16), ("grey_dilate", np.int8), 
+	("grey_erode", np.float32), ("grey_dilate", np.float64),
+])
+@pytest.mark.parametrize('shape', [ (23,19,17), (31,29) ])
+def test_kernel_address(op, dtype, shape):
+	import ctypes
+	import os
+
+	assert fastmorph.fastmorphops.capi.ABI_VERSION == 1
+	assert os.path.exists(os.path.join(fastmorph.get_include(), "fastmorph_capsule.h"))
+
+	rng = np.random.default_rng(5)
+	labels = np.asfortranarray(rng.integers(0, 4, size=shape).astype(dtype))
+	ndim = len(shape)
+	sx, sy, sz = (shape + (1,))[:3]
+
+	fn_type = ctypes.CFUNCTYPE(
+		ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p, 
+		ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint64
+	)
+	fn = fn_type(fastmorph.kernel_address(op, dtype, ndim))
+	output = np.full(shape, 3, dtype=dtype, order="F")
+	assert fn(labels.ctypes.data, output.ctypes.data, sx, sy, sz, 2) == 0
+
+	mode = fastmorph.Mode.grey if op.startswith("grey") else fastmorph.Mode.multilabel
+	morph = fastmorph.dilate if op.endswith("dilate") else fastmorph.erode
+	assert np.all(output == morph(labels, mode=mode))
+
+	# 2D entry points reject a third axis
+	if ndim == 2:
+		assert fn(labels.ctypes.data, output.ctypes.data, sx, sy, 2, 1) == 1
+
+	dilate_type = ctypes.CFUNCTYPE(
+		ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p, 
+		ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint64, 
+		ctypes.c_int, ctypes.c_uint64
+	)
+	labels = labels.astype(np.uint32, order="F")
+	fn = dilate_type(fastmorph.kernel_address("multilabel_dilate", np.uint32, ndim))
+	output = np.zeros(shape, dtype=np.uint32, order="F")
+	assert fn(labels.ctypes.data, output.ctypes.data, sx, sy, sz, 1, 1) == 0
+	assert np.all(output == fastmorph.dilate(labels, background_only=True))
+
+	with pytest.raises(ValueError):
+		fastmorph.kernel_address("multilabel_erode", np.float32)
+
+@pytest.mark.parametrize('op', [ "dilate", "erode", "opening", "closing" ])
+@pytest.mark.parametrize('mode,dtype', [ 
+	(fastmorph.Mode.multilabel, np.uint32), (fastmorph.Mode.multilabel, np.uint8),
+	(fastmorph.Mode.grey, np.int16), (fastmorph.Mode.grey, np.float32),
+])
+def test_morph_batch(op, mode, dtype):
+	rng = np.random.default_rng(11)
+	shapes = [ (20,18,16), (5,4,3), (150,60,40), (33,29), (0,4,4), (17,17,17) ]
+	images = [ rng.integers(0, 4, size=shape).astype(dtype) for shape in shapes ]
+	images[1] = np.ascontiguousarray(images[1]) # C order is fine too
+
+	def expected(image):
+		if op == "dilate":
+			return fastmorph.dilate(image, mode=mode)
+		elif op == "erode":
+			return fastmorph.erode(image, mode=mode)
+		elif op == "opening":
+			return fastmorph.opening(image, mode=mode)
+		return fastmorph.closing(image, mode=mode)
+
+	for parallel in (1, 3):
+		outputs, arena = fastmorph.morph_batch(images, op, mode=mode, parallel=parallel, return_arena=True)
+		assert arena.dtype == dtype
+		assert arena.size == sum(image.size for image in images)
+		for image, output in zip(images, outputs):
+			assert output.shape == image.shape
+			assert output.flags.f_contiguous
+			assert output.size == 0 or np.shares_memory(output, arena)
+			if image.size:
+				assert np.array_equal(output, expected(image))
+
+	# packed input, e.g. the previous arena
+	outputs2 = fastmorph.morph_batch(arena, op, mode=mode, shapes=shapes, parallel=2)
+	for output, output2 in zip(outputs, outputs2):
+		if output.size:
+			assert np.array_equal(output2, expected(output))
+
+def test_morph_batch_errors():
+	assert fastmorph.morph_batch([]) == []
+	with pytest.raises(ValueError):
+		fastmorph.morph_batch([ np.zeros((5,5), dtype=np.uint8), np.zeros((5,5), dtype=np.uint16) ])
+	with pytest.raises(ValueError):
+		fastmorph.morph_batch([ np.zeros((5,5), dtype=np.float32) ])
+	with pytest.raises(ValueError):
+		fastmorph.morph_batch(np.zeros((10,), dtype=np.uint8), shapes=[ (3,3) ])
+	with pytest.raises(ValueError):
+		fastmorph.morph_batch([ np.zeros((5,5), dtype=np.uint8) ], op="fill")
+
+	# equal dtypes that are distinct objects batch together
+	tagged = np.dtype(np.uint16, metadata={ "unit": "voxel" })
+	images = [ np.ones((5,5), dtype=tagged), np.ones((4,4,4), dtype=np.uint16) ]
+	outputs = fastmorph.morph_batch(images, "erode")
+	for image, output in zip(images, outputs):
+		assert np.array_equal(output, fastmorph.erode(image))
+
+@pytest.mark.parametrize('channel_axis', [ -1, 0, 2 ])
+def test_channel_axis(channel_axis):
+	rng = np.random.default_rng(9)
+	affinities = rng.random(size=(40,35,30,3)).astype(np.float32)
+	affinities = np.moveaxis(affinities, -1, channel_axis)
+	labels = rng.integers(0, 5, size=(60,50,4), dtype=np.uint16)
+
+	for parallel in (1, 4):
+		for fn in (fastmorph.dilate, fastmorph.erode, fastmorph.opening, fastmorph.closing):
+			out = fn(affinities, mode=fastmorph.Mode.grey, parallel=parallel, channel_axis=channel_axis)
+			assert out.shape == affinities.shape and out.dtype == np.float32
+			for c in range(affinities.shape[channel_axis]):
+				channel = np.take(affinities, c, axis=channel_axis)
+				assert np.array_equal(np.take(out, c, axis=channel_axis), fn(channel, mode=fastmorph.Mode.grey))
+
+		# a stack of 2D images with the channels last
+		out = fastmorph.dilate(labels, parallel=parallel, channel_axis=-1)
+		for c in range(labels.shape[2]):
+			assert np.array_equal(out[:,:,c], fastmorph.dilate(labels[:,:,c]))
+
+	with pytest.raises(ValueError):
+		fastmorph.dilate(np.zeros((5,5,5,2), dtype=np.uint8))
+	with pytest.raises(ValueError):
+		fastmorph.dilate(labels, channel_axis=-1, return_contacts=True)
+	with pytest.raises(ValueError):
+		fastmorph.erode(labels, channel_axis=3)
@@ -0,0 +1,947 @@
+/* Standalone benchmark for the kernels in fastmorph.hpp.
+ * No Python required.
+ *
+ * Build:
+ *   g++ -std=c++17 -O3 -pthread -Ifastmorph benchmarks/benchmark.cpp -o fastmorph_benchmark
+ *
+ * or with the AVX2 and AVX-512 copies of the kernels, selected with
+ * FASTMORPH_ISA=baseline|avx2|avx512 (see cpu_dispatch.hpp):
+ *   g++ -std=c++17 -O3 -pthread -DFASTMORPH_DISPATCH -Ifastmorph benchmarks/benchmark.cpp \
+ *     fastmorph/fastmorph_avx2.cpp fastmorph/fastmorph_avx512.cpp -o fastmorph_benchmark
+ *
+ * Runs multilabel dilate (background only and full), multilabel
+ * erode, grey dilate, and grey erode in 2D and 3D plus the bare
+ * overhead of parallelize_blocks over synthetic volumes and
+ * optionally real .npy volumes for every dtype width and thread
+ * count. Reports voxels/sec, speedup and scaling efficiency vs.
+ * one thread, and the spread of the repetitions.
+ *
+ * Options (lists are comma separated):
+ *   --size N          edge of synthetic 3D volumes (default 256)
+ *   --size2d N        edge of synthetic 2D images (default 4096)
+ *   --volumes LIST    zeros,blobs,cells,noise (default all)
+ *   --npy PATH        also run on a .npy volume (repeatable).
+ *                     C ordered arrays are read as their transpose.
+ *                     Values are cast to each dtype, so labels 
+ *                     wrap around for narrow dtypes.
+ *   --kernels LIST    multilabel_dilate,multilabel_dilate_full,
+ *                     multilabel_erode,grey_dilate,grey_erode,
+ *                     parallelize_blocks (default all)
+ *   --dtypes LIST     uint8,uint16,uint32,uint64 (default all)
+ *   --dims LIST       2,3 (default both)
+ *   --threads LIST    (default 1,2,4,... up to the core count)
+ *   --repeat N        timed repetitions (default 5)
+ *   --warmup N        untimed repetitions (default 1)
+ *   --json PATH       write results as a JSON array
+ *   --csv PATH        write results as CSV
+ *   --trace PATH      write a Chrome trace (see trace.hpp) of the 
+ *                     last repetition of every run, one after another
+ *   --perf            count cycles, instructions, cache misses, etc.
+ *                     with perf_event_open (Linux only, see 
+ *                     perf_counters.hpp) over the timed repetitions
+ *                     and report IPC, miss rate, and estimated
+ *                     memory bandwidth
+ *
+ * Regression gate:
+ *   --write-baseline PATH  save this run as a baseline
+ *   --baseline PATH        compare against a baseline and exit with
+ *                          status 2 if any run regressed
+ *   --max-slowdown F       allowed drop in throughput (default 0.10)
+ *   --max-memory-growth F  allowed rise in peak memory (default 0.10)
+ *
+ * Each timed repetition is preceded by a short single threaded
+ * calibration loop and throughput in baselines is voxels/sec times
+ * the loop's time (best of the repetitions), which cancels most of
+ * the difference between machines of similar design and the drift
+ * of clock speeds and noisy neighbors during a run. Peak memory is what the
+ * kernel allocates through operator new (see memory_tracker.hpp),
+ * measured on an untimed repetition. Runs are matched on kernel,
+ * volume, dtype, shape, and thread count, so run the gate with
+ * the options the baseline was written with. Baselines should be
+ * regenerated on the machine that gates releases.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define FASTMORPH_REPLACE_OPERATOR_NEW
+#include "memory_tracker.hpp"
+#include "fastmorph.hpp"
+
+namespace {
+
+struct Volume {
+	std::string name;
+	uint64_t sx, sy, sz;
+	// values before conversion to the benchmarked dtype
+	std::vector<uint64_t> data;
+};
+
+struct Result {
+	std::string kernel;
+	std::string volume;
+	std::string dtype;
+	int ndim;
+	uint64_t sx, sy, sz;
+	uint64_t threads;
+	std::vector<double> seconds;
+	double mean = 0;
+	double stddev = 0;
+	double min = 0;
+	double median = 0;
+	double voxels_per_sec = 0;
+	double speedup = 1;
+	double efficiency = 1;
+	uint64_t peak_bytes = 0;
+	// voxels per calibration loop, --baseline and --write-baseline only
+	double normalized_throughput = 0;
+	// per repetition averages, --perf only
+	bool has_perf = false;
+	double perf[fastmorph::perf::NUM_COUNTERS] = {};
+	bool perf_valid[fastmorph::perf::NUM_COUNTERS] = {};
+};
+
+struct Options {
+	uint64_t size = 256;
+	uint64_t size2d = 4096;
+	std::vector<std::string> volumes = { "zeros", "blobs", "cells", "noise" };
+	std::vector<std::string> npy;
+	std::vector<std::string> kernels = {
+		"multilabel_dilate", "multilabel_dilate_full", "multilabel_erode",
+		"grey_dilate", "grey_erode", "parallelize_blocks"
+	};
+	std::vector<std::string> dtypes = { "uint8", "uint16", "uint32", "uint64" };
+	std::vector<int> dims = { 2, 3 };
+	std::vector<uint64_t> threads;
+	uint64_t repeat = 5;
+	uint64_t warmup = 1;
+	std::string json;
+	std::string csv;
+	std::string trace;
+	bool perf = false;
+	std::string baseline;
+	std::string write_baseline;
+	double max_slowdown = 0.10;
+	double max_memory_growth = 0.10;
+};
+
+// last repetition of each run, shifted to follow the previous run
+std::vector<fastmorph::trace::Event> trace_events;
+
+void append_trace(std::vector<fastmorph::trace::Event> events) {
+	int64_t offset = 0;
+	uint64_t tid_offset = 0;
+	for (const auto &event : trace_events) {
+		offset = std::max(offset, event.end_ns);
+		tid_offset = std::max(tid_offset, event.tid + 1);
+	}
+	for (auto &event : events) {
+		event.start_ns += offset;
+		event.end_ns += offset;
+		if (event.enqueue_ns >= 0) {
+			event.enqueue_ns += offset;
+		}
+		event.tid += tid_offset;
+		trace_events.push_back(event);
+	}
+}
+
+std::vector<std::string> split(const std::string &s) {
+	std::vector<std::string> out;
+	std::stringstream ss(s);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty()) {
+			out.push_back(item);
+		}
+	}
+	return out;
+}
+
+std::vector<uint64_t> default_threads() {
+	const uint64_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+	std::vector<uint64_t> out;
+	for (uint64_t t = 1; t < cores; t *= 2) {
+		out.push_back(t);
+	}
+	out.push_back(cores);
+	return out;
+}
+
+Options parse_args(int argc, char** argv) {
+	Options opts;
+	opts.threads = default_threads();
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		auto next = [&]() -> std::string {
+			if (i + 1 >= argc) {
+				throw std::runtime_error(arg + " requires a value.");
+			}
+			return argv[++i];
+		};
+
+		if (arg == "--size") {
+			opts.size = std::stoull(next());
+		}
+		else if (arg == "--size2d") {
+			opts.size2d = std::stoull(next());
+		}
+		else if (arg == "--volumes") {
+			opts.volumes = split(next());
+		}
+		else if (arg == "--npy") {
+			opts.npy.push_back(next());
+		}
+		else if (arg == "--kernels") {
+			opts.kernels = split(next());
+		}
+		else if (arg == "--dtypes") {
+			opts.dtypes = split(next());
+		}
+		else if (arg == "--dims") {
+			opts.dims.clear();
+			for (auto& d : split(next())) {
+				opts.dims.push_back(std::stoi(d));
+			}
+		}
+		else if (arg == "--threads") {
+			opts.threads.clear();
+			for (auto& t : split(next())) {
+				opts.threads.push_back(std::stoull(t));
+			}
+		}
+		else if (arg == "--repeat") {
+			opts.repeat = std::max(std::stoull(next()), 1ULL);
+		}
+		else if (arg == "--warmup") {
+			opts.warmup = std::stoull(next());
+		}
+		else if (arg == "--json") {
+			opts.json = next();
+		}
+		else if (arg == "--csv") {
+			opts.csv = next();
+		}
+		else if (arg == "--trace") {
+			opts.trace = next();
+		}
+		else if (arg == "--perf") {
+			opts.perf = true;
+		}
+		else if (arg == "--baseline") {
+			opts.baseline = next();
+		}
+		else if (arg == "--write-baseline") {
+			opts.write_baseline = next();
+		}
+		else if (arg == "--max-slowdown") {
+			opts.max_slowdown = std::stod(next());
+		}
+		else if (arg == "--max-memory-growth") {
+			opts.max_memory_growth = std::stod(next());
+		}
+		else if (arg == "--help" || arg == "-h") {
+			printf("See the top of benchmarks/benchmark.cpp for options.\n");
+			exit(0);
+		}
+		else {
+			throw std::runtime_error("Unknown option: " + arg);
+		}
+	}
+	return opts;
+}
+
+// Synthetic volumes. sz = 1 gives a 2D image.
+//   zeros: empty volume
+//   blobs: a few dozen boxes of a handful of labels in background
+//   cells: dense 24 voxel cells separated by one voxel membranes
+//   noise: every voxel random (dense tangle, worst case for dilate)
+Volume synthetic(const std::string &name, const uint64_t sx, const uint64_t sy, const uint64_t sz) {
+	Volume vol{ name, sx, sy, sz, std::vector<uint64_t>(sx * sy * sz) };
+	std::mt19937_64 rng(1234);
+
+	if (name == "zeros") {
+		return vol;
+	}
+	else if (name == "blobs") {
+		const uint64_t max_edge = std::max(std::max(sx, sy), sz) / 4 + 1;
+		for (int b = 0; b < 40; b++) {
+			const uint64_t x0 = rng() % sx, y0 = rng() % sy, z0 = rng() % sz;
+			const uint64_t r = 1 + rng() % max_edge;
+			const uint64_t label = 1 + rng() % 5;
+			for (uint64_t z = z0; z < std::min(z0 + r, sz); z++) {
+				for (uint64_t y = y0; y < std::min(y0 + r, sy); y++) {
+					for (uint64_t x = x0; x < std::min(x0 + r, sx); x++) {
+						vol.data[x + sx * (y + sy * z)] = label;
+					}
+				}
+			}
+		}
+	}
+	else if (name == "cells") {
+		const uint64_t cell = 24;
+		const uint64_t gx = sx / cell + 1;
+		const uint64_t gy = sy / cell + 1;
+		for (uint64_t z = 0; z < sz; z++) {
+			for (uint64_t y = 0; y < sy; y++) {
+				for (uint64_t x = 0; x < sx; x++) {
+					const bool membrane = (x % cell == 0) || (y % cell == 0) || (sz > 1 && z % cell == 0);
+					vol.data[x + sx * (y + sy * z)] = membrane
+						? 0
+						: 1 + (x / cell) + gx * ((y / cell) + gy * (z / cell));
+				}
+			}
+		}
+	}
+	else if (name == "noise") {
+		for (uint64_t i = 0; i < vol.data.size(); i++) {
+			const uint64_t val = rng() % 1000;
+			vol.data[i] = (val < 100) ? 0 : val;
+		}
+	}
+	else {
+		throw std::runtime_error("Unknown synthetic volume: " + name);
+	}
+	return vol;
+}
+
+// Minimal .npy reader for unsigned, signed, and boolean 2D and 3D arrays.
+Volume load_npy(const std::string &path) {
+	std::ifstream f(path, std::ios::binary);
+	if (!f) {
+		throw std::runtime_error("Unable to open " + path);
+	}
+
+	char magic[6];
+	f.read(magic, 6);
+	if (std::memcmp(magic, "\x93NUMPY", 6) != 0) {
+		throw std::runtime_error(path + " is not a .npy file.");
+	}
+	uint8_t version[2];
+	f.read(reinterpret_cast<char*>(version), 2);
+	uint32_t header_len = 0;
+	if (version[0] == 1) {
+		uint16_t len16 = 0;
+		f.read(reinterpret_cast<char*>(&len16), 2);
+		header_len = len16;
+	}
+	else {
+		f.read(reinterpret_cast<char*>(&header_len), 4);
+	}
+	std::string header(header_len, ' ');
+	f.read(&header[0], header_len);
+
+	auto field = [&](const std::string &key) {
+		const size_t pos = header.find("'" + key + "'");
+		if (pos == std::string::npos) {
+			throw std::runtime_error(path + ": missing " + key);
+		}
+		return header.substr(header.find(':', pos) + 1);
+	};
+
+	std::string descr = field("descr");
+	descr = descr.substr(descr.find('\'') + 1);
+	descr = descr.substr(0, descr.find('\''));
+	const char kind = descr[1];
+	const uint64_t width = std::stoull(descr.substr(2));
+	if (descr[0] == '>' && width > 1) {
+		throw std::runtime_error(path + ": big endian arrays are not supported.");
+	}
+	if (kind != 'u' && kind != 'i' && kind != 'b') {
+		throw std::runtime_error(path + ": unsupported dtype " + descr);
+	}
+
+	std::string order = field("fortran_order");
+	const bool fortran_order = order.substr(0, order.find(',')).find("True") != std::string::npos;
+
+	std::string shape_str = field("shape");
+	shape_str = shape_str.substr(shape_str.find('(') + 1);
+	shape_str = shape_str.substr(0, shape_str.find(')'));
+	std::vector<uint64_t> shape;
+	for (auto& s : split(shape_str)) {
+		if (s.find_first_of("0123456789") != std::string::npos) {
+			shape.push_back(std::stoull(s));
+		}
+	}
+	if (shape.size() < 2 || shape.size() > 3) {
+		throw std::runtime_error(path + ": only 2D and 3D arrays are supported.");
+	}
+	if (!fortran_order) {
+		std::reverse(shape.begin(), shape.end());
+	}
+	while (shape.size() < 3) {
+		shape.push_back(1);
+	}
+
+	const uint64_t voxels = shape[0] * shape[1] * shape[2];
+	std::vector<uint8_t> raw(voxels * width);
+	f.read(reinterpret_cast<char*>(raw.data()), raw.size());
+	if (static_cast<uint64_t>(f.gcount()) != raw.size()) {
+		throw std::runtime_error(path + ": truncated file.");
+	}
+
+	std::string name = path.substr(path.find_last_of("/\\") + 1);
+	Volume vol{ name, shape[0], shape[1], shape[2], std::vector<uint64_t>(voxels) };
+	for (uint64_t i = 0; i < voxels; i++) {
+		uint64_t val = 0;
+		std::memcpy(&val, raw.data() + i * width, width);
+		vol.data[i] = val;
+	}
+	return vol;
+}
+
+// single_thread_mean is the baseline for speedup, 
+// efficiency is speedup per thread (1.0 is linear scaling)
+void summarize(Result &res, const double single_thread_mean) {
+	const uint64_t n = res.seconds.size();
+	std::vector<double> sorted = res.seconds;
+	std::sort(sorted.begin(), sorted.end());
+
+	double sum = 0;
+	for (double s : sorted) {
+		sum += s;
+	}
+	res.mean = sum / n;
+
+	double var = 0;
+	for (double s : sorted) {
+		var += (s - res.mean) * (s - res.mean);
+	}
+	res.stddev = (n > 1) ? std::sqrt(var / (n - 1)) : 0;
+	res.min = sorted[0];
+	res.median = (n % 2) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+
+	const double voxels = static_cast<double>(res.sx * res.sy * res.sz);
+	res.voxels_per_sec = (res.mean > 0) ? voxels / res.mean : 0;
+	res.speedup = (res.mean > 0 && single_thread_mean > 0) ? single_thread_mean / res.mean : 1;
+	res.efficiency = res.speedup / static_cast<double>(res.threads);
+}
+
+// Seconds for a fixed mix of dependent integer arithmetic and
+// streaming over a buffer larger than most L2 caches, the fastest
+// of a few tries.
+double calibrate() {
+	static std::vector<uint32_t> buf;
+	if (buf.empty()) {
+		buf.resize(1 << 20);
+		for (uint64_t i = 0; i < buf.size(); i++) {
+			buf[i] = static_cast<uint32_t>(i * 2654435761u);
+		}
+	}
+
+	double best = 0;
+	volatile uint32_t sink = 0;
+	for (int attempt = 0; attempt < 3; attempt++) {
+		const auto start = std::chrono::steady_clock::now();
+		uint32_t acc = 0;
+		for (int pass = 0; pass < 2; pass++) {
+			for (uint64_t i = 1; i < buf.size(); i++) {
+				acc = acc * 1664525u + (buf[i] ^ (buf[i - 1] >> 3));
+				buf[i] = std::max(buf[i], acc >> 7);
+			}
+		}
+		sink = acc;
+		const double elapsed = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start
+		).count();
+		best = (attempt == 0) ? elapsed : std::min(best, elapsed);
+	}
+	(void)sink;
+	return best;
+}
+
+void print_perf(const Result &res) {
+	using namespace fastmorph::perf;
+	auto has = [&](Counter c) { return res.perf_valid[c]; };
+
+	printf("%-24s", "");
+	bool any = false;
+	if (has(CYCLES) && has(INSTRUCTIONS) && res.perf[CYCLES] > 0) {
+		printf("  IPC %5.2f", res.perf[INSTRUCTIONS] / res.perf[CYCLES]);
+		any = true;
+	}
+	if (has(CACHE_REFERENCES) && has(CACHE_MISSES) && res.perf[CACHE_REFERENCES] > 0) {
+		printf("  LLC miss %5.1f%%", 100.0 * res.perf[CACHE_MISSES] / res.perf[CACHE_REFERENCES]);
+		any = true;
+	}
+	if (has(CACHE_MISSES) && res.mean > 0) {
+		// each last level miss moves one 64 byte line from memory
+		printf("  ~%6.2f GB/s", res.perf[CACHE_MISSES] * 64 / res.mean / 1e9);
+		any = true;
+	}
+	if (has(BRANCH_MISSES)) {
+		printf("  %.3g branch misses", res.perf[BRANCH_MISSES]);
+		any = true;
+	}
+	if (has(TASK_CLOCK_NS) && res.mean > 0) {
+		printf("  cpu util %5.2f", res.perf[TASK_CLOCK_NS] / 1e9 / res.mean);
+		any = true;
+	}
+	if (!any) {
+		printf("  perf counters unavailable");
+	}
+	printf("\n");
+}
+
+template <typename LABEL>
+std::function<void(uint64_t)> make_kernel(
+	const std::string &kernel,
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz
+) {
+	const bool planar = (sz == 1);
+
+	if (kernel == "multilabel_dilate" || kernel == "multilabel_dilate_full") {
+		const bool background_only = (kernel == "multilabel_dilate");
+		if (planar) {
+			return [=](uint64_t threads) {
+				fastmorph::multilabel_dilate<LABEL>(labels, output, sx, sy, background_only, threads);
+			};
+		}
+		return [=](uint64_t threads) {
+			fastmorph::multilabel_dilate<LABEL>(labels, output, sx, sy, sz, background_only, threads);
+		};
+	}
+	else if (kernel == "multilabel_erode") {
+		if (planar) {
+			return [=](uint64_t threads) {
+				fastmorph::multilabel_erode<LABEL>(labels, output, sx, sy, threads);
+			};
+		}
+		return [=](uint64_t threads) {
+			fastmorph::multilabel_erode<LABEL>(labels, output, sx, sy, sz, threads);
+		};
+	}
+	else if (kernel == "grey_dilate") {
+		if (planar) {
+			return [=](uint64_t threads) {
+				fastmorph::grey_dilate<LABEL>(labels, output, sx, sy, threads);
+			};
+		}
+		return [=](uint64_t threads) {
+			fastmorph::grey_dilate<LABEL>(labels, output, sx, sy, sz, threads);
+		};
+	}
+	else if (kernel == "grey_erode") {
+		if (planar) {
+			return [=](uint64_t threads) {
+				fastmorph::grey_erode<LABEL>(labels, output, sx, sy, threads);
+			};
+		}
+		return [=](uint64_t threads) {
+			fastmorph::grey_erode<LABEL>(labels, output, sx, sy, sz, threads);
+		};
+	}
+	else if (kernel == "parallelize_blocks") {
+		// block dispatch with no work measures pool
+		// startup, std::function calls, and joining
+		return [=](uint64_t threads) {
+			fastmorph::parallelize_blocks(
+				[](
+					const uint64_t, const uint64_t,
+					const uint64_t, const uint64_t,
+					const uint64_t, const uint64_t
+				) {},
+				sx, sy, sz, threads, /*offset=*/0
+			);
+		};
+	}
+	throw std::runtime_error("Unknown kernel: " + kernel);
+}
+
+template <typename LABEL>
+void run_dtype(
+	const Options &opts, const Volume &vol,
+	const std::string &dtype, std::vector<Result> &results
+) {
+	const uint64_t voxels = vol.sx * vol.sy * vol.sz;
+	const bool gating = !opts.baseline.empty() || !opts.write_baseline.empty();
+	std::vector<LABEL> labels(voxels);
+	for (uint64_t i = 0; i < voxels; i++) {
+		labels[i] = static_cast<LABEL>(vol.data[i]);
+	}
+	std::vector<LABEL> output(voxels);
+
+	for (const std::string &kernel : opts.kernels) {
+		auto fn = make_kernel<LABEL>(kernel, labels.data(), output.data(), vol.sx, vol.sy, vol.sz);
+
+		double single_thread_mean = 0;
+		for (const uint64_t threads : opts.threads) {
+			Result res;
+			res.kernel = kernel;
+			res.volume = vol.name;
+			res.dtype = dtype;
+			res.ndim = (vol.sz == 1) ? 2 : 3;
+			res.sx = vol.sx;
+			res.sy = vol.sy;
+			res.sz = vol.sz;
+			res.threads = threads;
+
+			std::unique_ptr<fastmorph::perf::CounterGroup> counters;
+			fastmorph::perf::Sample perf_total;
+			if (opts.perf) {
+				counters.reset(new fastmorph::perf::CounterGroup(/*inherit=*/true));
+			}
+
+			// tracking every allocation slows the kernels down, so peak
+			// memory is measured on its own run which doubles as the
+			// first warmup
+			std::fill(output.begin(), output.end(), 0);
+			fastmorph::memory::start();
+			fn(threads);
+			res.peak_bytes = fastmorph::memory::stop().peak_bytes;
+
+			for (uint64_t i = std::min(opts.warmup, uint64_t(1)); i < opts.warmup + opts.repeat; i++) {
+				// the python bindings hand the kernels a fresh zeroed
+				// buffer, clearing it isn't part of the kernel's time
+				std::fill(output.begin(), output.end(), 0);
+
+				const bool traced = !opts.trace.empty() && i + 1 == opts.warmup + opts.repeat;
+				if (traced) {
+					fastmorph::trace::start();
+				}
+
+				const bool timed = i >= opts.warmup;
+				const double calibration = (gating && timed) ? calibrate() : 0;
+
+				const bool counted = counters && timed;
+				if (counted) {
+					counters->start();
+				}
+
+				const auto start = std::chrono::steady_clock::now();
+				fn(threads);
+				const auto end = std::chrono::steady_clock::now();
+
+				if (counted) {
+					perf_total.add(counters->stop());
+				}
+
+				if (traced) {
+					append_trace(fastmorph::trace::stop());
+				}
+				if (timed) {
+					const double seconds = std::chrono::duration<double>(end - start).count();
+					res.seconds.push_back(seconds);
+					if (gating && seconds > 0) {
+						res.normalized_throughput = std::max(
+							res.normalized_throughput, static_cast<double>(voxels) / seconds * calibration
+						);
+					}
+				}
+			}
+
+			// the first thread count is the baseline, scaled as if it
+			// ran on one thread when the list doesn't start at 1
+			if (single_thread_mean == 0) {
+				double sum = 0;
+				for (double s : res.seconds) {
+					sum += s;
+				}
+				single_thread_mean = (sum / res.seconds.size()) * threads;
+			}
+			summarize(res, single_thread_mean);
+			if (counters) {
+				res.has_perf = true;
+				for (int c = 0; c < fastmorph::perf::NUM_COUNTERS; c++) {
+					res.perf[c] = static_cast<double>(perf_total.values[c]) / res.seconds.size();
+					res.perf_valid[c] = perf_total.valid[c];
+				}
+			}
+
+			printf(
+				"%-24s %-12s %-7s %dD %5llu thr  %8.4f s +/- %6.4f  %9.2f MVx/s  x%5.2f  eff %5.1f%%  %8.2f MiB\n",
+				res.kernel.c_str(), res.volume.c_str(), res.dtype.c_str(), res.ndim,
+				static_cast<unsigned long long>(res.threads),
+				res.mean, res.stddev, res.voxels_per_sec / 1e6,
+				res.speedup, res.efficiency * 100,
+				static_cast<double>(res.peak_bytes) / (1 << 20)
+			);
+			if (res.has_perf) {
+				print_perf(res);
+			}
+			fflush(stdout);
+
+			results.push_back(res);
+		}
+	}
+}
+
+void run_volume(const Options &opts, const Volume &vol, std::vector<Result> &results) {
+	for (const std::string &dtype : opts.dtypes) {
+		if (dtype == "uint8") {
+			run_dtype<uint8_t>(opts, vol, dtype, results);
+		}
+		else if (dtype == "uint16") {
+			run_dtype<uint16_t>(opts, vol, dtype, results);
+		}
+		else if (dtype == "uint32") {
+			run_dtype<uint32_t>(opts, vol, dtype, results);
+		}
+		else if (dtype == "uint64") {
+			run_dtype<uint64_t>(opts, vol, dtype, results);
+		}
+		else {
+			throw std::runtime_error("Unknown dtype: " + dtype);
+		}
+	}
+}
+
+void write_json(const std::string &path, const std::vector<Result> &results) {
+	std::ofstream f(path);
+	f.precision(9);
+	f << "[\n";
+	for (uint64_t i = 0; i < results.size(); i++) {
+		const Result &r = results[i];
+		f << "  {"
+			<< "\"kernel\": \"" << r.kernel << "\", "
+			<< "\"volume\": \"" << r.volume << "\", "
+			<< "\"dtype\": \"" << r.dtype << "\", "
+			<< "\"ndim\": " << r.ndim << ", "
+			<< "\"shape\": [" << r.sx << ", " << r.sy << ", " << r.sz << "], "
+			<< "\"threads\": " << r.threads << ", "
+			<< "\"isa\": \"" << fastmorph::cpu::isa_name(fastmorph::cpu::selected_isa()) << "\", "
+			<< "\"seconds\": [";
+		for (uint64_t j = 0; j < r.seconds.size(); j++) {
+			f << (j ? ", " : "") << r.seconds[j];
+		}
+		f << "], "
+			<< "\"mean\": " << r.mean << ", "
+			<< "\"stddev\": " << r.stddev << ", "
+			<< "\"min\": " << r.min << ", "
+			<< "\"median\": " << r.median << ", "
+			<< "\"voxels_per_sec\": " << r.voxels_per_sec << ", "
+			<< "\"speedup\": " << r.speedup << ", "
+			<< "\"efficiency\": " << r.efficiency << ", "
+			<< "\"peak_bytes\": " << r.peak_bytes;
+		if (r.has_perf) {
+			f << ", \"perf\": {";
+			bool first = true;
+			for (int c = 0; c < fastmorph::perf::NUM_COUNTERS; c++) {
+				if (r.perf_valid[c]) {
+					f << (first ? "" : ", ") << "\"" << fastmorph::perf::counter_name(c) << "\": " << r.perf[c];
+					first = false;
+				}
+			}
+			f << "}";
+		}
+		f << "}" << ((i + 1 < results.size()) ? "," : "") << "\n";
+	}
+	f << "]\n";
+}
+
+void write_csv(const std::string &path, const std::vector<Result> &results) {
+	std::ofstream f(path);
+	f.precision(9);
+	const bool perf = std::any_of(results.begin(), results.end(),
+		[](const Result &r) { return r.has_perf; });
+
+	f << "kernel,volume,dtype,ndim,sx,sy,sz,threads,repeat,mean,stddev,min,median,voxels_per_sec,speedup,efficiency,peak_bytes";
+	if (perf) {
+		for (int c = 0; c < fastmorph::perf::NUM_COUNTERS; c++) {
+			f << "," << fastmorph::perf::counter_name(c);
+		}
+	}
+	f << "\n";
+	for (const Result &r : results) {
+		f << r.kernel << "," << r.volume << "," << r.dtype << "," << r.ndim << ","
+			<< r.sx << "," << r.sy << "," << r.sz << "," << r.threads << ","
+			<< r.seconds.size() << "," << r.mean << "," << r.stddev << ","
+			<< r.min << "," << r.median << "," << r.voxels_per_sec << ","
+			<< r.speedup << "," << r.efficiency << "," << r.peak_bytes;
+		if (perf) {
+			// unavailable counters are left empty
+			for (int c = 0; c < fastmorph::perf::NUM_COUNTERS; c++) {
+				f << ",";
+				if (r.has_perf && r.perf_valid[c]) {
+					f << r.perf[c];
+				}
+			}
+		}
+		f << "\n";
+	}
+}
+
+std::string baseline_key(
+	const std::string &kernel, const std::string &volume, const std::string &dtype,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz, const uint64_t threads
+) {
+	std::stringstream ss;
+	ss << kernel << "," << volume << "," << dtype << ","
+		<< sx << "," << sy << "," << sz << "," << threads;
+	return ss.str();
+}
+
+struct BaselineEntry {
+	double normalized_throughput = 0;
+	uint64_t peak_bytes = 0;
+};
+
+void write_baseline(const std::string &path, const std::vector<Result> &results) {
+	std::ofstream f(path);
+	f.precision(9);
+	f << "# fastmorph benchmark baseline, see benchmarks/benchmark.cpp\n"
+		<< "kernel,volume,dtype,sx,sy,sz,threads,normalized_throughput,peak_bytes\n";
+	for (const Result &r : results) {
+		f << baseline_key(r.kernel, r.volume, r.dtype, r.sx, r.sy, r.sz, r.threads) << ","
+			<< r.normalized_throughput << "," << r.peak_bytes << "\n";
+	}
+	if (!f) {
+		throw std::runtime_error("Unable to write baseline: " + path);
+	}
+}
+
+std::unordered_map<std::string, BaselineEntry> read_baseline(const std::string &path) {
+	std::ifstream f(path);
+	if (!f) {
+		throw std::runtime_error("Unable to open baseline: " + path);
+	}
+
+	std::unordered_map<std::string, BaselineEntry> baseline;
+	std::string line;
+	bool header = true;
+	while (std::getline(f, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		if (header) {
+			header = false;
+			continue;
+		}
+		const std::vector<std::string> fields = split(line);
+		if (fields.size() != 9) {
+			throw std::runtime_error("Malformed baseline line: " + line);
+		}
+		BaselineEntry entry;
+		entry.normalized_throughput = std::stod(fields[7]);
+		entry.peak_bytes = std::stoull(fields[8]);
+		baseline[baseline_key(
+			fields[0], fields[1], fields[2],
+			std::stoull(fields[3]), std::stoull(fields[4]), std::stoull(fields[5]),
+			std::stoull(fields[6])
+		)] = entry;
+	}
+	return baseline;
+}
+
+// Prints every run that regressed and returns how many did.
+uint64_t compare_baseline(
+	const Options &opts, const std::vector<Result> &results
+) {
+	const auto baseline = read_baseline(opts.baseline);
+	// allocator and thread pool bookkeeping wobble a little
+	const uint64_t memory_slack = 64 * 1024;
+
+	uint64_t regressions = 0;
+	uint64_t compared = 0;
+	printf("\nbaseline %s (max slowdown %.0f%%, max memory growth %.0f%%)\n",
+		opts.baseline.c_str(), opts.max_slowdown * 100, opts.max_memory_growth * 100);
+
+	for (const Result &r : results) {
+		const auto it = baseline.find(
+			baseline_key(r.kernel, r.volume, r.dtype, r.sx, r.sy, r.sz, r.threads)
+		);
+		if (it == baseline.end()) {
+			continue;
+		}
+		compared++;
+
+		const BaselineEntry &base = it->second;
+		const double ratio = (base.normalized_throughput > 0)
+			? r.normalized_throughput / base.normalized_throughput
+			: 1;
+		const bool slower = ratio < 1 - opts.max_slowdown;
+		const bool bigger = r.peak_bytes > memory_slack + static_cast<uint64_t>(
+			static_cast<double>(base.peak_bytes) * (1 + opts.max_memory_growth)
+		);
+		if (!slower && !bigger) {
+			continue;
+		}
+
+		regressions++;
+		printf("REGRESSION %-24s %-12s %-7s %dD %5llu thr  throughput x%.2f%s  peak %.1f -> %.1f KiB%s\n",
+			r.kernel.c_str(), r.volume.c_str(), r.dtype.c_str(), r.ndim,
+			static_cast<unsigned long long>(r.threads),
+			ratio, (slower ? " (slower)" : ""),
+			static_cast<double>(base.peak_bytes) / 1024,
+			static_cast<double>(r.peak_bytes) / 1024, (bigger ? " (bigger)" : "")
+		);
+	}
+
+	printf("%llu of %llu runs matched the baseline, %llu regressed\n",
+		static_cast<unsigned long long>(compared),
+		static_cast<unsigned long long>(results.size()),
+		static_cast<unsigned long long>(regressions)
+	);
+	if (compared == 0) {
+		throw std::runtime_error("No runs matched the baseline, were the same options used?");
+	}
+	return regressions;
+}
+
+}
+
+int main(int argc, char** argv) {
+	try {
+		const Options opts = parse_args(argc, argv);
+		printf("kernels: %s\n", fastmorph::cpu::isa_name(fastmorph::cpu::selected_isa()));
+
+		std::vector<Volume> volumes;
+		for (const int ndim : opts.dims) {
+			for (const std::string &name : opts.volumes) {
+				if (ndim == 3) {
+					volumes.push_back(synthetic(name, opts.size, opts.size, opts.size));
+				}
+				else if (ndim == 2) {
+					volumes.push_back(synthetic(name, opts.size2d, opts.size2d, 1));
+				}
+			}
+		}
+		for (const std::string &path : opts.npy) {
+			volumes.push_back(load_npy(path));
+		}
+
+		std::vector<Result> results;
+		for (const Volume &vol : volumes) {
+			run_volume(opts, vol, results);
+		}
+
+		if (!opts.json.empty()) {
+			write_json(opts.json, results);
+		}
+		if (!opts.csv.empty()) {
+			write_csv(opts.csv, results);
+		}
+		if (!opts.trace.empty()) {
+			std::ofstream f(opts.trace);
+			f << fastmorph::trace::to_chrome_json(trace_events);
+		}
+		if (!opts.write_baseline.empty()) {
+			write_baseline(opts.write_baseline, results);
+		}
+		if (!opts.baseline.empty() && compare_baseline(opts, results) > 0) {
+			return 2;
+		}
+	}
+	catch (const std::exception &e) {
+		fprintf(stderr, "fastmorph_benchmark: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,207 @@
+"""
+Reproducible memory profiles of the fastmorph operators.
+
+  python benchmarks/memory_profile.py
+  python benchmarks/memory_profile.py --volume connectomics.npy.ckl.gz --ops dilate,dilate_full --parallel 4
+  python benchmarks/memory_profile.py --json today.json --compare release.json
+
+Every (op, implementation, parallel) combination runs in a fresh
+subprocess so earlier runs don't pollute the baseline. The process
+RSS is sampled in a background thread while the op runs and the
+native allocations made by fastmorph are counted with
+fastmorph.track_memory. The ops and scipy/skimage baselines are
+the same as python -m fastmorph.benchmark.
+
+Outputs in --outdir (default memory-profiles/):
+  memory-profile-OP-IMPL-pN.png  memory over time (requires matplotlib)
+  memory_profile.json            samples and peaks for every run
+
+--compare prints the ratio of peaks against a previous JSON so
+memory regressions can be caught before a release.
+"""
+import argparse
+import json
+import os
+import subprocess
+import sys
+import threading
+import time
+
+def rss_bytes() -> int:
+  try:
+    import psutil
+    return psutil.Process().memory_info().rss
+  except ImportError:
+    pass
+
+  with open("/proc/self/statm", "rt") as f:
+    pages = int(f.read().split()[1])
+  return pages * os.sysconf("SC_PAGE_SIZE")
+
+class Sampler(threading.Thread):
+  def __init__(self, interval:float):
+    super().__init__(daemon=True)
+    self.interval = interval
+    self.samples = []
+    self.done = threading.Event()
+    self.start_time = time.perf_counter()
+
+  def run(self):
+    while not self.done.is_set():
+      self.samples.append((time.perf_counter() - self.start_time, rss_bytes()))
+      time.sleep(self.interval)
+    self.samples.append((time.perf_counter() - self.start_time, rss_bytes()))
+
+def worker(args):
+  """Runs a single op and prints its profile as JSON."""
+  import fastmorph
+  from fastmorph.benchmark import build_ops, load_volume
+
+  labels = load_volume(args.volume)
+  ops = { name: (fn, baselines) for name, fn, baselines, threaded in build_ops(labels) }
+  fn, baselines = ops[args.op]
+  if args.impl == "fastmorph":
+    run = lambda: fn(args.parallel)
+  else:
+    run = baselines[args.impl]
+
+  baseline_rss = rss_bytes()
+  sampler = Sampler(args.interval)
+  sampler.start()
+  # show the idle baseline before the op starts
+  time.sleep(args.interval * 5)
+
+  start = time.perf_counter()
+  with fastmorph.track_memory() as usage:
+    result = run()
+  elapsed = time.perf_counter() - start
+  del result
+
+  time.sleep(args.interval * 5)
+  sampler.done.set()
+  sampler.join()
+
+  peak_rss = max(rss for t, rss in sampler.samples)
+  print(json.dumps({
+    "op": args.op,
+    "impl": args.impl,
+    "parallel": args.parallel,
+    "seconds": elapsed,
+    "baseline_rss_bytes": baseline_rss,
+    "peak_rss_bytes": peak_rss,
+    "peak_rss_delta_bytes": peak_rss - baseline_rss,
+    "native_peak_bytes": usage.peak_bytes,
+    "native_total_bytes": usage.total_bytes,
+    "native_allocations": usage.allocations,
+    "samples": sampler.samples,
+  }))
+
+def plot(profile:dict, path:str):
+  import matplotlib
+  matplotlib.use("Agg")
+  import matplotlib.pyplot as plt
+
+  t = [ s[0] for s in profile["samples"] ]
+  mib = [ s[1] / 2**20 for s in profile["samples"] ]
+  fig, ax = plt.subplots(figsize=(8, 4))
+  ax.plot(t, mib)
+  ax.set_xlabel("time (sec)")
+  ax.set_ylabel("RSS (MiB)")
+  ax.set_title(
+    f"{profile['op']} / {profile['impl']} / parallel={profile['parallel']}\n"
+    f"native peak {profile['native_peak_bytes'] / 2**20:.1f} MiB, "
+    f"RSS peak +{profile['peak_rss_delta_bytes'] / 2**20:.1f} MiB"
+  )
+  fig.tight_layout()
+  fig.savefig(path)
+  plt.close(fig)
+
+def main(argv=None):
+  parser = argparse.ArgumentParser(description="Memory profiles of fastmorph operators.")
+  parser.add_argument("--volume", default=None,
+    help="volume to process (default: connectomics.npy.ckl.gz if present, else synthetic:cells:256)")
+  parser.add_argument("--ops", default=None, help="comma separated subset of ops")
+  parser.add_argument("--parallel", default="1", help="comma separated thread counts")
+  parser.add_argument("--no-baselines", action="store_true", help="skip scipy and skimage")
+  parser.add_argument("--interval", type=float, default=0.01, help="seconds between RSS samples")
+  parser.add_argument("--outdir", default="memory-profiles")
+  parser.add_argument("--format", default="png", help="image format for the plots, e.g. png or jpg")
+  parser.add_argument("--json", default=None, help="also write the results here")
+  parser.add_argument("--compare", default=None, help="previous JSON results to compare against")
+  parser.add_argument("--worker", nargs=3, metavar=("OP", "IMPL", "PARALLEL"), help=argparse.SUPPRESS)
+  args = parser.parse_args(argv)
+
+  if args.volume is None:
+    args.volume = "connectomics.npy.ckl.gz" if os.path.exists("connectomics.npy.ckl.gz") else "synthetic:cells:256"
+
+  if args.worker:
+    args.op, args.impl, args.parallel = args.worker[0], args.worker[1], int(args.worker[2])
+    worker(args)
+    return
+
+  from fastmorph.benchmark import build_ops, load_volume
+  ops = build_ops(load_volume(args.volume))
+  if args.ops:
+    selected = set(args.ops.split(","))
+    ops = [ op for op in ops if op[0] in selected ]
+
+  runs = []
+  for name, fn, baselines, threaded in ops:
+    for parallel in (args.parallel.split(",") if threaded else [ "1" ]):
+      runs.append((name, "fastmorph", parallel))
+    if not args.no_baselines:
+      runs += [ (name, impl, "1") for impl in baselines ]
+
+  previous = {}
+  if args.compare:
+    with open(args.compare, "rt") as f:
+      for res in json.load(f)["results"]:
+        previous[(res["op"], res["impl"], res["parallel"])] = res
+
+  os.makedirs(args.outdir, exist_ok=True)
+  results = []
+  print(f"{'op':<26} {'impl':<26} {'par':>3} {'native peak MiB':>16} {'RSS peak +MiB':>14} {'sec':>8}")
+  for op, impl, parallel in runs:
+    proc = subprocess.run(
+      [
+        sys.executable, os.path.abspath(__file__),
+        "--volume", args.volume, "--interval", str(args.interval),
+        "--worker", op, impl, parallel,
+      ],
+      capture_output=True, text=True,
+    )
+    if proc.returncode != 0:
+      print(f"{op} / {impl} failed:\n{proc.stderr}", file=sys.stderr)
+      continue
+
+    profile = json.loads(proc.stdout.strip().splitlines()[-1])
+    results.append(profile)
+
+    line = (
+      f"{op:<26} {impl:<26} {parallel:>3} "
+      f"{profile['native_peak_bytes'] / 2**20:>16.1f} "
+      f"{profile['peak_rss_delta_bytes'] / 2**20:>14.1f} "
+      f"{profile['seconds']:>8.3f}"
+    )
+    prev = previous.get((op, impl, profile["parallel"]))
+    if prev and prev["native_peak_bytes"] > 0:
+      line += f"  native peak x{profile['native_peak_bytes'] / prev['native_peak_bytes']:.2f} vs prev"
+    print(line)
+
+    try:
+      plot(profile, os.path.join(args.outdir, f"memory-profile-{op}-{impl}-p{parallel}.{args.format}"))
+    except ImportError:
+      pass
+
+  output = {
+    "volume": args.volume,
+    "results": results,
+  }
+  with open(os.path.join(args.outdir, "memory_profile.json"), "wt") as f:
+    json.dump(output, f)
+  if args.json:
+    with open(args.json, "wt") as f:
+      json.dump(output, f)
+
+if __name__ == "__main__":
+  main()
@@ -1,5 +1,10 @@
+from contextlib import contextmanager
 from enum import Enum
-from typing import Optional, Sequence
+from typing import Dict, Optional, Sequence, Union
+import ctypes
+import json
+import os
+import time
 import numpy as np
 import edt
 import fill_voids
@@ -10,17 +15,116 @@ import multiprocessing as mp
 import fastmorphops
 
 AnisotropyType = Optional[Sequence[int]]
+RadiusMapType = Union[Dict[int, float], np.ndarray]
 
 class Mode(Enum):
   multilabel = 1
   grey = 2
 
+HOT_COUNTERS_ENABLED = fastmorphops.HOT_COUNTERS_ENABLED
+
+def _check_counters(return_counters:bool):
+  if return_counters and not HOT_COUNTERS_ENABLED:
+    raise RuntimeError(
+      "fastmorph was built without hot path counters. "
+      "Reinstall with FASTMORPH_HOT_COUNTERS=1 set to enable return_counters."
+    )
+
+def _check_grey_dtype(labels:np.ndarray, mode:Mode, float_supported:bool = True):
+  """
+  Grey morphology of floating point images is only native for
+  float32 and float64 and only in dilate, erode, opening, and 
+  closing. Elsewhere their bits would be compared as integers.
+  """
+  if mode != Mode.grey or labels.dtype.kind != 'f':
+    return
+  if not float_supported:
+    raise ValueError(
+      "Floating point images are only supported in Mode.grey by dilate, erode, opening, and closing."
+    )
+  if labels.dtype.itemsize not in (4, 8):
+    raise ValueError(f"Only float32 and float64 are supported in Mode.grey. Got: {labels.dtype}")
+
+def _check_ndim(labels:np.ndarray):
+  if labels.ndim > 3:
+    raise ValueError(
+      f"Only 2D and 3D images are supported, use channel_axis for multichannel images. Got shape: {labels.shape}"
+    )
+
+def _check_channel_options(weights:Optional[np.ndarray], *return_options:bool):
+  if weights is not None or any(return_options):
+    raise ValueError("channel_axis is not supported with weights or the return_* options.")
+
+def _morph_channels(
+  labels:np.ndarray, op:str, channel_axis:int, 
+  background_only:bool, parallel:int, mode:Mode,
+) -> np.ndarray:
+  """
+  Applies op to every channel of a 3D or 4D image. In fortran 
+  order with the channels last each channel is contiguous, so 
+  the channels are the images of one morph_batch call and the 
+  arena it returns is the whole output.
+  """
+  labels = np.asarray(labels)
+  if labels.ndim not in (3, 4):
+    raise ValueError(f"channel_axis requires a 3D or 4D image. Got shape: {labels.shape}")
+  if not (-labels.ndim <= channel_axis < labels.ndim):
+    raise ValueError(f"channel_axis {channel_axis} is out of bounds for shape {labels.shape}.")
+
+  labels = np.asfortranarray(np.moveaxis(labels, channel_axis, -1))
+  if labels.size == 0:
+    return np.moveaxis(np.zeros_like(labels), -1, channel_axis)
+
+  channels = [ labels[..., c] for c in range(labels.shape[-1]) ]
+  _, arena = morph_batch(
+    channels, op, background_only=background_only, 
+    parallel=parallel, mode=mode, return_arena=True
+  )
+  output = arena.reshape(labels.shape, order="F")
+  return np.moveaxis(output, -1, channel_axis)
+
+def _weighted_stencil(weights:np.ndarray, labels:np.ndarray):
+  """
+  Validates a non-flat structuring element and splits it into
+  flattened weights and a uint8 footprint in fortran order.
+  Weights are rounded to int64 for integer images and kept as 
+  float64 for floating point images. Elements set to -inf are 
+  excluded from the footprint.
+  """
+  is_float = labels.dtype.kind == 'f'
+  if not (is_float or np.issubdtype(labels.dtype, np.integer)):
+    raise ValueError("Non-flat structuring elements require an integer or floating point image.")
+
+  weights = np.asarray(weights, dtype=np.float64)
+  expected_shape = (3,) * labels.ndim
+  if weights.shape != expected_shape:
+    raise ValueError(f"weights must have shape {expected_shape}. Got: {weights.shape}")
+  if np.any(np.isnan(weights)) or np.any(weights == np.inf):
+    raise ValueError("weights must be finite or -inf.")
+
+  footprint = np.isfinite(weights)
+  weights = np.where(footprint, weights, 0)
+  if not is_float:
+    weights = np.round(weights).astype(np.int64)
+
+  return (
+    np.ascontiguousarray(weights.ravel(order="F")), 
+    np.ascontiguousarray(footprint.ravel(order="F").astype(np.uint8)),
+  )
+
 def dilate(
   labels:np.ndarray,
   background_only:bool = True,
   parallel:int = 1,
   mode:Mode = Mode.multilabel,
-) -> np.ndarray:
+  weights:Optional[np.ndarray] = None,
+  return_contacts:bool = False,
+  return_changes:bool = False,
+  return_eliminated:bool = False,
+  return_kernel_stats:bool = False,
+  return_counters:bool = False,
+  channel_axis:Optional[int] = None,
+):
   """
   Dilate forground labels using a 3x3x3 stencil with
   all elements "on".
@@ -28,50 +132,228 @@ def dilate(
   The mode of the voxels surrounding the stencil wins.
 
   labels: a 3D numpy array containing integer labels
-    representing shapes to be dilated.
+    representing shapes to be dilated. Mode.grey also 
+    accepts float32 and float64 images (e.g. probability
+    maps). NaN spreads to every voxel whose neighborhood 
+    contains it, like np.maximum.
 
   background_only:
     True: Only evaluate background voxels for dilation.
     False: Allow labels to erode each other as they grow.
 
   parallel: how many pthreads to use in a threadpool
+
+  weights: (Mode.grey only) a 3x3x3 (3x3 for 2D) non-flat 
+    structuring element. Each offset adds its weight before 
+    taking the max: out[p] = max(labels[p - o] + weights[o]).
+    Offsets set to -inf are off. Integer results saturate at 
+    the limits of the dtype and weights are rounded, floating 
+    point images use the weights as given. Separable weights 
+    with a consistent sign are evaluated one axis at a time.
+
+  return_contacts: (Mode.multilabel only) also return the region
+    adjacency graph gathered while dilating as { (a, b): count }
+    with a < b. For each voxel that is evaluated (only background 
+    voxels when background_only is True), every pair of distinct 
+    labels in its 3x3x3 window counts once. Use background_only=False 
+    for the adjacency of touching labels.
+  return_changes: (Mode.multilabel only) also return 
+    { label: (voxels gained, voxels lost) } for every label
+    that changed, gathered during the same pass.
+  return_eliminated: (Mode.multilabel only) also return the 
+    set of labels that no longer appear in the output.
+  return_kernel_stats: (Mode.multilabel only) also return how many
+    blocks each kernel processed as { name: blocks }. Each block is
+    classified by the labels within reach of it:
+      skip: no labels, the output stays zero
+      copy: a single label and no background
+      binary: a single label and background (bit packed)
+      palette: a few labels (small histograms instead of sorting)
+      general: everything else (sort based mode)
+  return_counters: also return how often the kernel's shortcuts
+    fired as a dict. Requires a build with FASTMORPH_HOT_COUNTERS=1
+    (see HOT_COUNTERS_ENABLED). Not supported with weights.
+      voxels_visited: neighborhoods evaluated
+      full_sorts: (Mode.multilabel) whole neighborhoods sorted for the mode
+      stencil_reuses: evaluations that reused the previous voxel's columns
+      fast_path_hits: (Mode.multilabel) reduced stencils from the slice 
+        below and mode decided from the leading columns
+        (Mode.grey) max values that ended an evaluation early
+      skipped_voxels: voxels decided without evaluating a neighborhood
+      blocks, block_seconds, max_block_seconds: per block timing, 
+        block_seconds is summed over threads
+    Only blocks routed to the general kernel are counted in the 
+    voxel counters, see return_kernel_stats.
+  channel_axis: axis of a 3D (2D images) or 4D (3D images) array 
+    holding independent channels, e.g. -1 for an (x, y, z, channel) 
+    affinity map. Each channel is processed on its own, all of 
+    them in one call on one thread pool, into one output. Not 
+    supported with weights or the return_* options.
+
+  Return value: (dilated_labels, contacts (if specified), 
+    changes (if specified), eliminated (if specified),
+    kernel_stats (if specified), counters (if specified))
   """
   if parallel == 0:
     parallel = mp.cpu_count()
   parallel = min(parallel, mp.cpu_count())
 
+  if channel_axis is not None:
+    _check_channel_options(
+      weights, return_contacts, return_changes, return_eliminated, 
+      return_kernel_stats, return_counters
+    )
+    return _morph_channels(labels, "dilate", channel_axis, background_only, parallel, mode)
+
   labels = np.asfortranarray(labels)
   while labels.ndim < 2:
     labels = labels[..., np.newaxis]
+  _check_ndim(labels)
   
-  if mode == Mode.multilabel:
+  if weights is not None and mode != Mode.grey:
+    raise ValueError("weights are only supported for Mode.grey.")
+  _check_grey_dtype(labels, mode)
+  track_changes = return_changes or return_eliminated
+  tracked = return_contacts or track_changes or return_kernel_stats
+  if tracked and mode != Mode.multilabel:
+    raise ValueError("return_contacts, return_changes, return_eliminated, and return_kernel_stats are only supported for Mode.multilabel.")
+  if return_counters and weights is not None:
+    raise ValueError("return_counters is not supported with weights.")
+  _check_counters(return_counters)
+
+  if return_counters and mode == Mode.grey:
+    output, counters = fastmorphops.grey_dilate_tracked(labels, parallel)
+    return (output.view(labels.dtype), counters)
+  elif tracked or return_counters:
+    output, contacts, changes, kernel_stats, counters = fastmorphops.multilabel_dilate_tracked(
+      labels, background_only, parallel, 
+      return_contacts, track_changes, return_kernel_stats, return_counters
+    )
+    ret = [ output.view(labels.dtype) ]
+    if return_contacts:
+      pairs, counts = contacts
+      pairs = pairs.view(labels.dtype)
+      ret.append({
+        (a, b): ct for a, b, ct in zip(pairs[:,0].tolist(), pairs[:,1].tolist(), counts.ravel().tolist())
+      })
+    if track_changes:
+      ret += _change_stats(changes, labels.dtype, return_changes, return_eliminated)
+    if return_kernel_stats:
+      ret.append(kernel_stats)
+    if return_counters:
+      ret.append(counters)
+    return (ret[0] if len(ret) == 1 else tuple(ret))
+  elif mode == Mode.multilabel:
     output = fastmorphops.multilabel_dilate(labels, background_only, parallel)
+  elif weights is not None:
+    weights, footprint = _weighted_stencil(weights, labels)
+    output = fastmorphops.grey_dilate_weighted(labels, weights, footprint, parallel)
   else:
     output = fastmorphops.grey_dilate(labels, parallel)
   return output.view(labels.dtype)
 
+def _change_stats(changes, dtype, return_changes:bool, return_eliminated:bool) -> list:
+  """Converts the (labels, [gained, lost, before, after]) arrays of a tracked kernel."""
+  keys, counts = changes
+  keys = keys.view(dtype).ravel()
+  gained, lost, before, after = counts[:,0], counts[:,1], counts[:,2], counts[:,3]
+
+  ret = []
+  if return_changes:
+    changed = (gained > 0) | (lost > 0)
+    ret.append({
+      label: (g, l) for label, g, l in zip(
+        keys[changed].tolist(), gained[changed].tolist(), lost[changed].tolist()
+      )
+    })
+  if return_eliminated:
+    ret.append(set(keys[(before > 0) & (after == 0)].tolist()))
+  return ret
+
 def erode(
   labels:np.ndarray, 
   parallel:int = 1,
   mode:Mode = Mode.multilabel,
-) -> np.ndarray:
+  weights:Optional[np.ndarray] = None,
+  return_changes:bool = False,
+  return_eliminated:bool = False,
+  return_counters:bool = False,
+  channel_axis:Optional[int] = None,
+):
   """
   Erodes forground labels using a 3x3x3 stencil with
   all elements "on".
 
   labels: a 3D numpy array containing integer labels
-    representing shapes to be dilated.
+    representing shapes to be dilated. Mode.grey also 
+    accepts float32 and float64 images, NaN spreads 
+    like np.minimum.
+
+  weights: (Mode.grey only) a 3x3x3 (3x3 for 2D) non-flat 
+    structuring element. Each offset subtracts its weight 
+    before taking the min: out[p] = min(labels[p + o] - weights[o]).
+    Offsets set to -inf are off. Integer results saturate at 
+    the limits of the dtype.
+
+  return_changes: (Mode.multilabel only) also return 
+    { label: (0, voxels lost) } for every label that 
+    shrank, gathered during the same pass.
+  return_eliminated: (Mode.multilabel only) also return the 
+    set of labels that were eroded away entirely.
+  return_counters: also return how often the kernel's shortcuts
+    fired as a dict, see dilate. Requires a build with 
+    FASTMORPH_HOT_COUNTERS=1. Not supported with weights.
+    fast_path_hits counts (Mode.multilabel) reduced stencils
+    from the row or slice below and (Mode.grey) min values that 
+    ended an evaluation early.
+
+  channel_axis: axis holding independent channels, see dilate.
+
+  Return value: (eroded_labels, changes (if specified), 
+    eliminated (if specified), counters (if specified))
   """
   if parallel == 0:
     parallel = mp.cpu_count()
   parallel = min(parallel, mp.cpu_count())
 
+  if channel_axis is not None:
+    _check_channel_options(weights, return_changes, return_eliminated, return_counters)
+    return _morph_channels(labels, "erode", channel_axis, True, parallel, mode)
+
   labels = np.asfortranarray(labels)
   while labels.ndim < 2:
     labels = labels[..., np.newaxis]
+  _check_ndim(labels)
 
-  if mode == Mode.multilabel:
+  if weights is not None and mode != Mode.grey:
+    raise ValueError("weights are only supported for Mode.grey.")
+  _check_grey_dtype(labels, mode)
+
+  if (return_changes or return_eliminated) and mode != Mode.multilabel:
+    raise ValueError("return_changes and return_eliminated are only supported for Mode.multilabel.")
+  if return_counters and weights is not None:
+    raise ValueError("return_counters is not supported with weights.")
+  _check_counters(return_counters)
+
+  track_changes = return_changes or return_eliminated
+  if return_counters and mode == Mode.grey:
+    output, counters = fastmorphops.grey_erode_tracked(labels, parallel)
+    return (output.view(labels.dtype), counters)
+  elif track_changes or return_counters:
+    output, changes, counters = fastmorphops.multilabel_erode_tracked(
+      labels, parallel, track_changes, return_counters
+    )
+    ret = [ output.view(labels.dtype) ]
+    if track_changes:
+      ret += _change_stats(changes, labels.dtype, return_changes, return_eliminated)
+    if return_counters:
+      ret.append(counters)
+    return tuple(ret)
+  elif mode == Mode.multilabel:
     output = fastmorphops.multilabel_erode(labels, parallel)
+  elif weights is not None:
+    weights, footprint = _weighted_stencil(weights, labels)
+    output = fastmorphops.grey_erode_weighted(labels, weights, footprint, parallel)
   else:
     output = fastmorphops.grey_erode(labels, parallel)
   return output.view(labels.dtype)
@@ -81,30 +363,356 @@ def opening(
   background_only:bool = True,
   parallel:int = 1,
   mode:Mode = Mode.multilabel,
-) -> np.ndarray:
+  weights:Optional[np.ndarray] = None,
+  return_counters:bool = False,
+  channel_axis:Optional[int] = None,
+):
   """Performs morphological opening of labels.
 
   background_only is passed through to dilate.
     True: Only evaluate background voxels for dilation.
     False: Allow labels to erode each other as they grow.
   parallel: how many pthreads to use in a threadpool
+  weights: optional non-flat structuring element (Mode.grey only)
+  return_counters: also return { "erode": counters, "dilate": counters },
+    see dilate and erode.
+  channel_axis: axis holding independent channels, see dilate.
   """
-  return dilate(erode(labels, parallel, mode), background_only, parallel, mode)
+  if channel_axis is not None:
+    _check_channel_options(weights, return_counters)
+    return _morph_channels(labels, "opening", channel_axis, background_only, parallel, mode)
+
+  if return_counters:
+    eroded, erode_counters = erode(labels, parallel, mode, weights, return_counters=True)
+    output, dilate_counters = dilate(eroded, background_only, parallel, mode, weights, return_counters=True)
+    return (output, { "erode": erode_counters, "dilate": dilate_counters })
+
+  eroded = erode(labels, parallel, mode, weights)
+  return dilate(eroded, background_only, parallel, mode, weights)
 
 def closing(
   labels:np.ndarray, 
   background_only:bool = True,
   parallel:int = 1,
   mode:Mode = Mode.multilabel,
-) -> np.ndarray:
+  weights:Optional[np.ndarray] = None,
+  return_counters:bool = False,
+  channel_axis:Optional[int] = None,
+):
   """Performs morphological closing of labels.
 
   background_only is passed through to dilate.
     True: Only evaluate background voxels for dilation.
     False: Allow labels to erode each other as they grow.
   parallel: how many pthreads to use in a threadpool
+  weights: optional non-flat structuring element (Mode.grey only)
+  return_counters: also return { "dilate": counters, "erode": counters },
+    see dilate and erode.
+  channel_axis: axis holding independent channels, see dilate.
+  """
+  if channel_axis is not None:
+    _check_channel_options(weights, return_counters)
+    return _morph_channels(labels, "closing", channel_axis, background_only, parallel, mode)
+
+  if return_counters:
+    dilated, dilate_counters = dilate(labels, background_only, parallel, mode, weights, return_counters=True)
+    output, erode_counters = erode(dilated, parallel, mode, weights, return_counters=True)
+    return (output, { "dilate": dilate_counters, "erode": erode_counters })
+
+  dilated = dilate(labels, background_only, parallel, mode, weights)
+  return erode(dilated, parallel, mode, weights)
+
+_STABLE_OPS = { "dilate": 0, "erode": 1, "opening": 2, "closing": 3 }
+
+def until_stable(
+  labels:np.ndarray,
+  op:str = "dilate",
+  background_only:bool = True,
+  parallel:int = 1,
+  mode:Mode = Mode.multilabel,
+  max_iterations:int = 0,
+  return_iterations:bool = False,
+):
+  """
+  Repeat dilate, erode, opening, or closing until the image 
+  stops changing. Equivalent to calling the operator in a loop 
+  until np.array_equal(before, after), but each iteration only 
+  recomputes blocks where something nearby changed in the 
+  previous iteration, so late iterations that only touch a thin 
+  front are cheap.
+
+  op: "dilate", "erode", "opening", or "closing"
+  background_only: passed through to dilate (Mode.multilabel only)
+  parallel: how many pthreads to use in a threadpool
+  mode: Mode.multilabel or Mode.grey
+  max_iterations: stop after this many iterations even if 
+    the image is still changing (0 means no limit). Multilabel 
+    opening, closing, and dilate with background_only=False 
+    can flip between two states forever, in that case the 
+    iteration also stops once the image repeats the state from 
+    two iterations earlier.
+  return_iterations: also return how many iterations 
+    changed the image
+
+  Return value: (stable_labels, iterations (if specified))
   """
-  return erode(dilate(labels, background_only, parallel, mode), parallel, mode)
+  if op not in _STABLE_OPS:
+    raise ValueError(f"op must be one of {list(_STABLE_OPS.keys())}. Got: {op}")
+
+  if parallel == 0:
+    parallel = mp.cpu_count()
+  parallel = min(parallel, mp.cpu_count())
+
+  labels = np.asfortranarray(labels)
+  while labels.ndim < 2:
+    labels = labels[..., np.newaxis]
+  _check_ndim(labels)
+  _check_grey_dtype(labels, mode, float_supported=False)
+
+  output, iterations = fastmorphops.iterate_until_stable(
+    labels, _STABLE_OPS[op], mode == Mode.grey, 
+    background_only, int(max_iterations), parallel
+  )
+  output = output.view(labels.dtype)
+
+  if return_iterations:
+    return (output, iterations)
+  return output
+
+def sparse_diff(
+  labels:np.ndarray,
+  op:str = "dilate",
+  background_only:bool = True,
+  parallel:int = 1,
+  mode:Mode = Mode.multilabel,
+  format:str = "indices",
+):
+  """
+  Compute dilate, erode, opening, or closing but only return 
+  the voxels that changed and their new values instead of a 
+  full output image. Memory scales with the number of changes.
+
+  op: "dilate", "erode", "opening", or "closing"
+  background_only: passed through to dilate (Mode.multilabel only)
+  parallel: how many pthreads to use in a threadpool
+  mode: Mode.multilabel or Mode.grey
+  format: 
+    "indices": Fortran order linear indices (ascending), apply with
+      out.ravel(order="F")[indices] = values on a Fortran ordered copy
+    "coords": an (N, ndim) array of coordinates, apply with
+      out[tuple(coords.T)] = values
+
+  Return value: (indices or coords, values)
+  """
+  if op not in _STABLE_OPS:
+    raise ValueError(f"op must be one of {list(_STABLE_OPS.keys())}. Got: {op}")
+  if format not in ("indices", "coords"):
+    raise ValueError(f"format must be 'indices' or 'coords'. Got: {format}")
+
+  if parallel == 0:
+    parallel = mp.cpu_count()
+  parallel = min(parallel, mp.cpu_count())
+
+  shape = labels.shape
+  labels = np.asfortranarray(labels)
+  while labels.ndim < 2:
+    labels = labels[..., np.newaxis]
+  _check_ndim(labels)
+  _check_grey_dtype(labels, mode, float_supported=False)
+
+  indices, values = fastmorphops.sparse_morph(
+    labels, _STABLE_OPS[op], mode == Mode.grey, background_only, parallel
+  )
+  indices = indices.ravel()
+  values = values.view(labels.dtype).ravel()
+
+  if format == "coords":
+    coords = np.unravel_index(indices, shape, order="F")
+    return (np.stack(coords, axis=1), values)
+
+  return (indices, values)
+
+def morph_batch(
+  images:Union[Sequence[np.ndarray], np.ndarray],
+  op:str = "dilate",
+  background_only:bool = True,
+  parallel:int = 1,
+  mode:Mode = Mode.multilabel,
+  shapes:Optional[Sequence[Sequence[int]]] = None,
+  return_arena:bool = False,
+):
+  """
+  Apply dilate, erode, opening, or closing to many independent
+  images (e.g. tens of thousands of small cutouts) in one call.
+  Each image is a task on a single shared thread pool instead of
+  paying for a call, an output allocation, and a pool per image,
+  so small images keep every thread busy. Results are identical
+  to calling the operator on each image.
+
+  images: a list of 2D or 3D arrays of one dtype, or a 1D array
+    of images packed one after another in Fortran order with
+    their shapes given in shapes (e.g. the arena of a previous
+    call). Fortran ordered images aren't copied.
+  op: "dilate", "erode", "opening", or "closing"
+  background_only: passed through to dilate (Mode.multilabel only)
+  parallel: how many pthreads to use in a threadpool
+  mode: Mode.multilabel or Mode.grey
+  shapes: per image shapes when images is packed
+  return_arena: also return the 1D array holding all results
+
+  Return value: [ outputs ] as Fortran ordered views into one
+    contiguous arena, and the arena if return_arena
+  """
+  if op not in _STABLE_OPS:
+    raise ValueError(f"op must be one of {list(_STABLE_OPS.keys())}. Got: {op}")
+
+  if parallel == 0:
+    parallel = mp.cpu_count()
+  parallel = min(parallel, mp.cpu_count())
+
+  if shapes is not None:
+    arena = np.asarray(images)
+    if arena.ndim != 1:
+      raise ValueError(f"Packed images must be a 1D array. Got shape: {arena.shape}")
+    images = []
+    offset = 0
+    for shape in shapes:
+      size = int(np.prod(shape))
+      images.append(arena[offset:offset+size].reshape(shape, order="F"))
+      offset += size
+    if offset != arena.size:
+      raise ValueError(f"shapes describe {offset} voxels but images has {arena.size}.")
+
+  if len(images) == 0:
+    return ([], np.zeros((0,), dtype=np.uint8)) if return_arena else []
+
+  shapes = [ image.shape for image in images ]
+  prepared = []
+  for image in images:
+    image = np.asfortranarray(image)
+    while image.ndim < 2:
+      image = image[..., np.newaxis]
+    if image.ndim > 3:
+      raise ValueError(f"Only 2D and 3D images are supported. Got shape: {image.shape}")
+    prepared.append(image)
+
+  dtype = prepared[0].dtype
+  if any(image.dtype != dtype for image in prepared):
+    raise ValueError("All images must have the same dtype.")
+  _check_grey_dtype(prepared[0], mode)
+  if mode != Mode.grey and dtype.kind == 'f':
+    raise ValueError("Floating point images are only supported in Mode.grey.")
+
+  arena = fastmorphops.morph_batch(
+    prepared, _STABLE_OPS[op], mode == Mode.grey, background_only, parallel
+  )
+  arena = arena.view(dtype).ravel()
+
+  outputs = []
+  offset = 0
+  for shape in shapes:
+    size = int(np.prod(shape))
+    outputs.append(arena[offset:offset+size].reshape(shape, order="F"))
+    offset += size
+
+  if return_arena:
+    return (outputs, arena)
+  return outputs
+
+def _radius_map(radius:RadiusMapType, dtype:np.dtype, value_dtype:np.dtype):
+  """
+  Converts a { label: radius } dict or a lookup array
+  indexed by label into parallel key and value arrays.
+  Integer radii must be whole numbers, so 1.9 is an error
+  rather than 1.
+  """
+  if isinstance(radius, dict):
+    keys = np.fromiter(radius.keys(), dtype=dtype, count=len(radius))
+    values = np.fromiter(radius.values(), dtype=np.float64, count=len(radius))
+  else:
+    values = np.asarray(radius)
+    if values.ndim != 1:
+      raise ValueError("A radius lookup array must be one dimensional.")
+    max_label = 1 if np.dtype(dtype) == bool else int(np.iinfo(dtype).max)
+    if values.size > max_label + 1:
+      raise ValueError(
+        f"A radius lookup array for {np.dtype(dtype)} labels can have at most {max_label + 1} entries. Got: {values.size}"
+      )
+    keys = np.arange(values.size).astype(dtype)
+
+  if np.issubdtype(value_dtype, np.integer) and not np.issubdtype(values.dtype, np.integer):
+    fractional = values[np.mod(values, 1) != 0]
+    if fractional.size:
+      raise ValueError(f"Radii must be whole numbers of voxels. Got: {fractional[:5]}")
+  return keys, values.astype(value_dtype)
+
+def _per_voxel_radius(labels:np.ndarray, radius:RadiusMapType) -> np.ndarray:
+  """Expands a per label radius map into a per voxel radius image."""
+  if labels.dtype == bool:
+    labels = labels.view(np.uint8)
+
+  if isinstance(radius, np.ndarray):
+    if labels.size and (labels.min() < 0 or labels.max() >= radius.size):
+      raise ValueError(
+        f"Labels must be within the radius lookup array of {radius.size} entries. "
+        f"Got labels from {labels.min()} to {labels.max()}."
+      )
+    return radius.astype(np.float32, copy=False)[labels]
+
+  uniq = fastremap.unique(labels)
+  values = np.array([ radius.get(int(u), 0) for u in uniq ], dtype=np.float32)
+
+  if uniq.size and uniq[0] >= 0 and uniq[-1] < 4 * uniq.size + 65536:
+    lut = np.zeros(int(uniq[-1]) + 1, dtype=np.float32)
+    lut[uniq] = values
+    return lut[labels]
+
+  return values[np.searchsorted(uniq, labels)]
+
+def per_label_morph(
+  labels:np.ndarray,
+  radius:RadiusMapType,
+  default_radius:int = 0,
+  parallel:int = 1,
+) -> np.ndarray:
+  """
+  Grow and shrink each label by its own radius in a single call
+  using the same all on stencil as dilate and erode.
+
+  labels: a 2D or 3D numpy array containing integer labels
+  radius: either a { label: radius } dict or a lookup array
+    where radius[label] is that label's radius (for a 
+    compacted label space). Radii are whole numbers of voxels:
+      radius < 0: erode by -radius (like calling erode -radius times)
+      radius = 0: leave the label as is
+      radius > 0: grow into background voxels of the input
+    Where growing labels compete for a voxel, the label most common 
+    on the nearest shell of the stencil that it can reach wins. For 
+    radius 1 this matches the mode picked by dilate. Voxels freed by 
+    erosion are not grown into.
+  default_radius: radius of labels missing from the map
+  parallel: how many pthreads to use in a threadpool
+
+  Returns: relabeled image
+  """
+  if parallel == 0:
+    parallel = mp.cpu_count()
+  parallel = min(parallel, mp.cpu_count())
+
+  assert np.issubdtype(labels.dtype, np.integer) or np.issubdtype(labels.dtype, bool), "per_label_morph requires an integer or binary image."
+
+  labels = np.asfortranarray(labels)
+  while labels.ndim < 2:
+    labels = labels[..., np.newaxis]
+
+  if default_radius != int(default_radius):
+    raise ValueError(f"default_radius must be a whole number of voxels. Got: {default_radius}")
+
+  keys, values = _radius_map(radius, labels.dtype, np.int64)
+  output = fastmorphops.multilabel_radius_morph(
+    labels, keys, values, int(default_radius), parallel
+  )
+  return output.view(labels.dtype)
 
 def spherical_dilate(
   labels:np.ndarray, 
@@ -139,7 +747,7 @@ def spherical_dilate(
 
 def spherical_erode(
   labels:np.ndarray, 
-  radius:float = 1.0, 
+  radius:Union[float, RadiusMapType] = 1.0, 
   parallel:int = 1, 
   anisotropy:AnisotropyType = None,
   in_place:bool = False,
@@ -152,6 +760,10 @@ def spherical_erode(
 
   labels: input labels (must be a boolean image)
   radius: physical distance (considering anisotropy) to dilate to (inclusive range)
+    May also be a { label: radius } dict or a lookup array where 
+    radius[label] is that label's radius. Labels missing from a 
+    dict are not eroded, a lookup array must cover every label. 
+    All labels are handled in one distance transform.
   parallel: use this many threads to compute the distance transform
   anisotropy: voxel resolution in x, y, and z
   in_place: save memory by modifying labels directly instead of creating a new image
@@ -160,6 +772,9 @@ def spherical_erode(
   """
   dt = edt.edt(labels, parallel=parallel, anisotropy=anisotropy, black_border=True)
 
+  if isinstance(radius, (dict, np.ndarray)):
+    radius = _per_voxel_radius(labels, radius)
+
   binary_image = lambda: dt >= radius
   if in_place:
     labels *= binary_image()
@@ -273,3 +888,556 @@ def fill_holes(
 
   return (ret[0] if len(ret) == 1 else tuple(ret))
 
+
+class LabelOp(Enum):
+  erode = 0
+  dilate = 1
+  opening = 2
+  closing = 3
+  fill = 4
+  spherical_erode = 5
+  spherical_dilate = 6
+  spherical_open = 7
+  spherical_close = 8
+
+def morph_each_label(
+  labels:np.ndarray,
+  op:Union[LabelOp, str],
+  radius:float = 1,
+  parallel:int = 1,
+  anisotropy:AnisotropyType = None,
+) -> np.ndarray:
+  """
+  Apply a binary operation to each label separately, as if
+  each label were extracted into its own binary image. Labels
+  are cropped to their bounding box (plus whatever margin op
+  needs) and processed in parallel, so this scales to hundreds
+  of thousands of objects.
+
+  labels: a 2D or 3D numpy array containing integer labels
+  op: a LabelOp or its name:
+    erode, dilate, opening, closing: the 3x3x3 all on stencil 
+      applied radius times
+    fill: fill the holes of each label (6-connected background)
+    spherical_erode, spherical_dilate, spherical_open, spherical_close:
+      radius is a physical distance considering anisotropy
+  radius: see op
+  parallel: how many pthreads to use in a threadpool
+  anisotropy: voxel resolution in x, y, and z (spherical ops only)
+
+  A label only removes its own voxels or claims background voxels
+  of the input, so labels never overwrite each other (unlike fill_holes,
+  enclosed labels are kept). When several labels claim the same 
+  background voxel the smallest label wins.
+
+  Returns: morphed image
+  """
+  if parallel == 0:
+    parallel = mp.cpu_count()
+  parallel = min(parallel, mp.cpu_count())
+
+  assert np.issubdtype(labels.dtype, np.integer) or np.issubdtype(labels.dtype, bool), "morph_each_label requires an integer or binary image."
+
+  if isinstance(op, str):
+    op = LabelOp[op]
+
+  if anisotropy is None:
+    anisotropy = (1,1,1)
+  anisotropy = [ float(x) for x in anisotropy ]
+  while len(anisotropy) < 3:
+    anisotropy.append(1.0)
+
+  if any(x <= 0 for x in anisotropy):
+    raise ValueError(f"anisotropy must be positive. Got: {anisotropy}")
+
+  labels = np.asfortranarray(labels)
+  while labels.ndim < 2:
+    labels = labels[..., np.newaxis]
+
+  output = fastmorphops.morph_each_label(
+    labels, op.value, float(radius), anisotropy, parallel
+  )
+  return output.view(labels.dtype)
+
+def paint_points(
+  coords:np.ndarray,
+  labels:Union[int, np.ndarray],
+  shape:Optional[Sequence[int]] = None,
+  out:Optional[np.ndarray] = None,
+  radius:float = 1,
+  footprint:str = "cube",
+  anisotropy:AnisotropyType = None,
+  offset:Optional[Sequence[int]] = None,
+  overwrite:bool = False,
+  parallel:int = 1,
+) -> np.ndarray:
+  """
+  Paint a dilated footprint around each point of a coordinate 
+  list (e.g. synapses or skeleton vertices) directly into a volume
+  without rasterizing the points and dilating the whole image. 
+  Cost scales with the number of points.
+
+  coords: (N, 2) or (N, 3) integer voxel coordinates
+  labels: a single label for all points or one label per point
+  shape: shape of a new zeroed output image (when out is not given)
+  out: paint into this image instead. It is modified in place 
+    if it is Fortran contiguous, otherwise a painted copy is returned.
+  radius: physical radius of the footprint (considering anisotropy)
+  footprint: 
+    "cube": |dx| * anisotropy[0] <= radius (and likewise for y and z). 
+      For an isotropic integer radius this matches calling dilate 
+      radius times on each point.
+    "sphere": euclidean distance <= radius, like spherical_dilate
+  anisotropy: voxel resolution in x, y, and z
+  offset: coordinate of out[0,0,0] so points can be painted into 
+    a region of interest of a larger space. Points outside of 
+    the ROI still paint the part of their footprint that overlaps it.
+  overwrite: paint over voxels of out that are already labeled
+  parallel: how many pthreads to use in a threadpool
+
+  Where footprints overlap, the nearest point wins (chebyshev 
+  distance for cubes) and ties go to the smaller label.
+
+  Returns: painted image
+  """
+  if footprint not in ("cube", "sphere"):
+    raise ValueError(f"footprint must be 'cube' or 'sphere'. Got: {footprint}")
+
+  if parallel == 0:
+    parallel = mp.cpu_count()
+  parallel = min(parallel, mp.cpu_count())
+
+  labels = np.asarray(labels)
+
+  if out is None:
+    if shape is None:
+      raise ValueError("One of shape or out must be specified.")
+    dtype = labels.dtype if np.issubdtype(labels.dtype, np.integer) else np.uint32
+    out = np.zeros(shape, dtype=dtype, order="F")
+  elif not (np.issubdtype(out.dtype, np.integer) or np.issubdtype(out.dtype, bool)):
+    raise ValueError(f"out must be an integer or binary image. Got: {out.dtype}")
+
+  out = np.asfortranarray(out)
+  if out.ndim not in (2, 3):
+    raise ValueError(f"Only 2D and 3D images are supported. Got: {out.ndim}D")
+
+  coords = np.asarray(coords)
+  if coords.ndim != 2 or coords.shape[1] != out.ndim:
+    raise ValueError(f"coords must be an N x {out.ndim} array. Got: {coords.shape}")
+  coords = np.round(coords).astype(np.int64)
+
+  if offset is not None:
+    coords = coords - np.asarray(offset, dtype=np.int64)[np.newaxis, :out.ndim]
+  if out.ndim == 2:
+    coords = np.concatenate([ coords, np.zeros((coords.shape[0], 1), dtype=np.int64) ], axis=1)
+  coords = np.ascontiguousarray(coords)
+
+  labels = np.broadcast_to(labels, (coords.shape[0],))
+  labels = np.ascontiguousarray(labels.astype(out.dtype, copy=False))
+
+  if anisotropy is None:
+    anisotropy = (1,1,1)
+  anisotropy = [ float(x) for x in anisotropy ]
+  while len(anisotropy) < 3:
+    anisotropy.append(1.0)
+
+  if any(x <= 0 for x in anisotropy):
+    raise ValueError(f"anisotropy must be positive. Got: {anisotropy}")
+
+  fastmorphops.paint_points(
+    coords, labels, out, 
+    float(radius), anisotropy, 
+    (0 if footprint == "cube" else 1), 
+    overwrite, parallel
+  )
+  return out
+
+def morph_sparse(
+  coords:np.ndarray,
+  values:Union[int, np.ndarray],
+  shape:Sequence[int],
+  op:str = "dilate",
+  iterations:int = 1,
+  background_only:bool = True,
+  mode:Mode = Mode.multilabel,
+  parallel:int = 1,
+  dense:bool = False,
+):
+  """
+  Dilate, erode, open, or close a very sparse image given as a 
+  list of its nonzero voxels without allocating the dense image. 
+  Voxels are stored in 8x8x8 bricks (8x8 in 2D) keyed by position 
+  and only allocated bricks and their neighbors are visited, so cost
+  scales with the occupied bricks rather than the shape. This pays
+  off when the foreground is clustered (e.g. a few objects in a
+  huge volume), uniformly scattered points allocate nearly every 
+  brick and are faster with the dense operators.
+
+  Results are identical to calling the dense operator on the
+  rasterized image iterations times.
+
+  coords: (N, 2) or (N, 3) integer voxel coordinates of nonzero voxels
+  values: a single value for all voxels or one value per voxel.
+    When a coordinate repeats, the last value wins.
+  shape: shape of the (virtual) dense image
+  op: "dilate", "erode", "opening", or "closing"
+  iterations: number of times to apply op
+  background_only: passed through to dilate (Mode.multilabel only)
+  mode: Mode.multilabel or Mode.grey
+  parallel: how many pthreads to use in a threadpool
+  dense: return a dense image instead of a sparse result
+
+  Returns: 
+    dense=False: (coords, values) of the nonzero voxels of the 
+      result in Fortran order
+    dense=True: image of the given shape
+  """
+  if op not in _STABLE_OPS:
+    raise ValueError(f"op must be one of {list(_STABLE_OPS.keys())}. Got: {op}")
+
+  shape = tuple(int(x) for x in shape)
+  if len(shape) not in (2, 3):
+    raise ValueError(f"Only 2D and 3D images are supported. Got: {len(shape)}D")
+
+  if parallel == 0:
+    parallel = mp.cpu_count()
+  parallel = min(parallel, mp.cpu_count())
+
+  values = np.asarray(values)
+  if not (np.issubdtype(values.dtype, np.integer) or np.issubdtype(values.dtype, bool)):
+    raise ValueError(f"values must be integer or binary. Got: {values.dtype}")
+
+  coords = np.asarray(coords)
+  if coords.ndim != 2 or coords.shape[1] != len(shape):
+    raise ValueError(f"coords must be an N x {len(shape)} array. Got: {coords.shape}")
+  coords = coords.astype(np.int64, copy=False)
+  if len(shape) == 2:
+    coords = np.concatenate([ coords, np.zeros((coords.shape[0], 1), dtype=np.int64) ], axis=1)
+  coords = np.ascontiguousarray(coords)
+
+  values = np.broadcast_to(values, (coords.shape[0],))
+  values = np.ascontiguousarray(values)
+
+  result = fastmorphops.brick_morph(
+    coords, values, shape, 
+    _STABLE_OPS[op], mode == Mode.grey, background_only,
+    int(iterations), parallel, dense
+  )
+
+  if dense:
+    return result.view(values.dtype)
+
+  indices, out_values = result
+  out_coords = np.unravel_index(indices.ravel(), shape, order="F")
+  return (np.stack(out_coords, axis=1), out_values.view(values.dtype).ravel())
+
+class MemoryUsage:
+  """
+  Native allocations made by fastmorph's C++ code while
+  a track_memory block was running.
+
+  peak_bytes: highest number of bytes held at once
+  total_bytes: sum of the sizes of every allocation
+  current_bytes: still held when the block ended (e.g. returned images)
+  allocations: number of allocations
+  """
+  def __init__(self):
+    self.peak_bytes = 0
+    self.total_bytes = 0
+    self.current_bytes = 0
+    self.allocations = 0
+
+  def _update(self, stats:dict):
+    self.peak_bytes = stats["peak_bytes"]
+    self.total_bytes = stats["total_bytes"]
+    self.current_bytes = stats["current_bytes"]
+    self.allocations = stats["allocations"]
+
+  def __repr__(self):
+    return (
+      f"MemoryUsage(peak_bytes={self.peak_bytes}, total_bytes={self.total_bytes}, "
+      f"current_bytes={self.current_bytes}, allocations={self.allocations})"
+    )
+
+@contextmanager
+def track_memory():
+  """
+  Measure the native memory used by fastmorph calls.
+
+  with fastmorph.track_memory() as usage:
+    fastmorph.dilate(labels, parallel=4)
+  print(usage.peak_bytes, usage.total_bytes)
+
+  Counts output images, scratch buffers, and thread pool 
+  bookkeeping allocated by fastmorph's C++ code. Thread stacks, 
+  numpy allocations made in Python (e.g. np.asfortranarray copies), 
+  and the edt, fill_voids, and cc3d libraries that some operators 
+  call are not included. Blocks should not be nested or run 
+  concurrently from several Python threads.
+  """
+  usage = MemoryUsage()
+  fastmorphops.memory_tracking_start()
+  try:
+    yield usage
+  finally:
+    usage._update(fastmorphops.memory_tracking_stop())
+
+class Trace:
+  """
+  Timeline of the blocks processed by fastmorph's worker 
+  threads, recorded by record_trace. events are Chrome 
+  trace events (timestamps in microseconds). Save them 
+  and open the file in https://ui.perfetto.dev or 
+  chrome://tracing to inspect load balance and idle time.
+
+  Block events are named after the op (plus the block
+  kernel for multilabel dilate) and have the block bounds 
+  and the time spent waiting in the queue as arguments.
+  The calling thread records pool_start, enqueue, and 
+  join events for each multithreaded call.
+  """
+  def __init__(self):
+    self.events = []
+
+  def save(self, path:str):
+    with open(path, "wt") as f:
+      json.dump({ "displayTimeUnit": "ns", "traceEvents": self.events }, f)
+
+  def summary(self) -> dict:
+    """
+    Summarizes the blocks of each op as { op: stats }:
+
+    blocks: number of blocks
+    threads: number of threads that processed blocks
+    wall_seconds: first block start to last block end
+    busy_seconds: time spent inside blocks, summed over threads
+    utilization: busy_seconds / (wall_seconds * threads)
+    imbalance: busiest thread's busy time / mean busy time
+    max_block_seconds, mean_block_seconds
+    mean_queue_wait_seconds: enqueue to block start
+    pool_start_seconds, enqueue_seconds, join_seconds: 
+      time the calling thread spent in each phase
+
+    Repeated calls of an op are merged, so trace one 
+    call at a time for utilization and imbalance.
+    """
+    ops = {}
+    for event in self.events:
+      if event.get("ph") != "X":
+        continue
+      op = event["name"].split(":")[0]
+      stats = ops.setdefault(op, {
+        "blocks": 0, "start": None, "end": None, "busy": {}, 
+        "durations": [], "waits": [], "phases": {},
+      })
+      start, dur = event["ts"] / 1e6, event["dur"] / 1e6
+      if event["cat"] != "block":
+        stats["phases"][event["cat"]] = stats["phases"].get(event["cat"], 0) + dur
+        continue
+      stats["blocks"] += 1
+      stats["start"] = start if stats["start"] is None else min(stats["start"], start)
+      stats["end"] = start + dur if stats["end"] is None else max(stats["end"], start + dur)
+      stats["busy"][event["tid"]] = stats["busy"].get(event["tid"], 0) + dur
+      stats["durations"].append(dur)
+      stats["waits"].append(event["args"]["queue_wait_us"] / 1e6)
+
+    summary = {}
+    for op, stats in ops.items():
+      if stats["blocks"] == 0:
+        continue
+      threads = len(stats["busy"])
+      wall = stats["end"] - stats["start"]
+      busy = sum(stats["busy"].values())
+      summary[op] = {
+        "blocks": stats["blocks"],
+        "threads": threads,
+        "wall_seconds": wall,
+        "busy_seconds": busy,
+        "utilization": (busy / (wall * threads) if wall > 0 else 1.0),
+        "imbalance": (max(stats["busy"].values()) / (busy / threads) if busy > 0 else 1.0),
+        "max_block_seconds": max(stats["durations"]),
+        "mean_block_seconds": busy / stats["blocks"],
+        "mean_queue_wait_seconds": sum(stats["waits"]) / stats["blocks"],
+        "pool_start_seconds": stats["phases"].get("pool_start", 0.0),
+        "enqueue_seconds": stats["phases"].get("enqueue", 0.0),
+        "join_seconds": stats["phases"].get("join", 0.0),
+      }
+    return summary
+
+@contextmanager
+def record_trace(path:Optional[str] = None):
+  """
+  Record a timeline of the blocks each worker thread 
+  processes during fastmorph calls.
+
+  with fastmorph.record_trace("dilate.json") as trace:
+    fastmorph.dilate(labels, parallel=16)
+  print(trace.summary())
+
+  path: if provided, the Chrome trace JSON is written here 
+    when the block exits. Open it in https://ui.perfetto.dev 
+    or chrome://tracing.
+
+  Covers every op that splits the image into blocks (dilate, 
+  erode, grey and weighted variants, per_label_morph, 
+  until_stable, sparse_diff). Blocks should not be nested 
+  or run concurrently from several Python threads.
+  """
+  trace = Trace()
+  fastmorphops.trace_start()
+  try:
+    yield trace
+  finally:
+    trace.events = json.loads(fastmorphops.trace_stop())["traceEvents"]
+    if path is not None:
+      trace.save(path)
+
+def _perf_metrics(counters:dict, seconds:float) -> dict:
+  """Derived metrics for the counters that were available."""
+  metrics = {}
+  if counters.get("cycles"):
+    if "instructions" in counters:
+      metrics["ipc"] = counters["instructions"] / counters["cycles"]
+  if counters.get("cache_references") and "cache_misses" in counters:
+    metrics["cache_miss_rate"] = counters["cache_misses"] / counters["cache_references"]
+  if counters.get("instructions") and "l1d_read_misses" in counters:
+    metrics["l1d_misses_per_kiloinstruction"] = counters["l1d_read_misses"] / counters["instructions"] * 1000
+  if "cache_misses" in counters:
+    # each last level miss moves one 64 byte line from memory
+    metrics["memory_bytes_estimate"] = counters["cache_misses"] * 64
+    if seconds > 0:
+      metrics["memory_bandwidth_estimate"] = metrics["memory_bytes_estimate"] / seconds
+  if "task_clock_ns" in counters and seconds > 0:
+    metrics["cpu_utilization"] = counters["task_clock_ns"] / 1e9 / seconds
+  return metrics
+
+class PerfCounters:
+  """
+  Linux perf_event counts gathered by perf_counters.
+
+  seconds: wall time of the block
+  counters: { name: count } for cycles, instructions, 
+    cache_references, cache_misses (usually last level cache), 
+    branch_misses, l1d_read_misses, task_clock_ns (cpu time),
+    page_faults, and context_switches. Counters the CPU, VM,
+    or kernel.perf_event_paranoid setting don't allow are 
+    left out and listed in unavailable (error says why).
+  metrics: derived from counters when their inputs are available:
+    ipc, cache_miss_rate, l1d_misses_per_kiloinstruction,
+    memory_bytes_estimate (cache_misses * 64), 
+    memory_bandwidth_estimate (bytes/sec), cpu_utilization
+  blocks: (per_block=True) one dict per block with the op 
+    name, kernel (multilabel dilate), x, y, z bounds, and counters
+  """
+  def __init__(self):
+    self.seconds = 0.0
+    self.counters = {}
+    self.metrics = {}
+    self.unavailable = []
+    self.error = None
+    self.blocks = []
+
+  def __repr__(self):
+    return f"PerfCounters(seconds={self.seconds}, counters={self.counters}, metrics={self.metrics})"
+
+@contextmanager
+def perf_counters(per_block:bool = False):
+  """
+  Measure hardware and software event counts (Linux only)
+  of fastmorph calls, including their worker threads.
+
+  with fastmorph.perf_counters() as perf:
+    fastmorph.dilate(labels, parallel=8)
+  print(perf.metrics["ipc"], perf.counters["cache_misses"])
+
+  per_block: also count each block of ops that split the 
+    image into blocks (dilate, erode, etc). This adds a few 
+    syscalls per block, so compare blocks to each other 
+    rather than to the op totals.
+
+  Everything the calling thread does inside the block is 
+  counted, so keep Python work out of it. Blocks should not 
+  be nested or run concurrently from several Python threads.
+  On other platforms every counter is unavailable.
+  """
+  perf = PerfCounters()
+  fastmorphops.perf_start(per_block)
+  start = time.perf_counter()
+  try:
+    yield perf
+  finally:
+    perf.seconds = time.perf_counter() - start
+    result = fastmorphops.perf_stop()
+    perf.counters = result["counters"]
+    perf.unavailable = result["unavailable"]
+    perf.error = result["error"]
+    perf.blocks = result["blocks"]
+    perf.metrics = _perf_metrics(perf.counters, perf.seconds)
+
+def cpu_isa() -> Dict[str, Union[str, bool]]:
+  """
+  Which copy of the kernels runs on this machine.
+
+  The kernels are compiled for the baseline x86-64 instruction 
+  set and again for AVX2 and AVX-512, and the best one the CPU 
+  supports is picked at import. The FASTMORPH_ISA environment
+  variable (baseline, avx2, avx512, auto) or set_cpu_isa 
+  override the choice.
+
+  Returns: {
+    "selected": instruction set in use,
+    "best_supported": best one this CPU can run,
+    "dispatch_enabled": False if only the baseline was compiled
+      (MSVC, ARM), in which case both of the above are "baseline"
+  }
+  """
+  return fastmorphops.cpu_isa()
+
+def set_cpu_isa(isa:str) -> str:
+  """
+  Select the copy of the kernels used by later calls, 
+  e.g. to compare results or timings between them.
+
+  isa: "baseline", "avx2", "avx512", or "auto" (the best supported)
+
+  Returns the instruction set actually selected, which is 
+  lower than isa if the CPU doesn't support it.
+  """
+  return fastmorphops.set_cpu_isa(isa)
+
+def get_include() -> str:
+  """
+  Directory of fastmorph_capsule.h, which describes the C 
+  entry points in fastmorphops.capi, for compiling Cython or 
+  C extensions against them.
+  """
+  return os.path.dirname(os.path.abspath(__file__))
+
+def kernel_address(op:str, dtype, ndim:int = 3) -> int:
+  """
+  Address of the C entry point of a kernel for numba or ctypes 
+  (see fastmorph_capsule.h for the signatures and ABI). The 
+  call skips Python and numpy entirely and can run without 
+  the GIL.
+
+  op: "multilabel_dilate", "multilabel_erode", "grey_dilate", 
+    or "grey_erode"
+  dtype: integer dtype, or float32 / float64 for the grey ops
+  ndim: 2 or 3
+
+  e.g. 
+    fn_type = ctypes.CFUNCTYPE(ctypes.c_int, 
+      ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, 
+      ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint64)
+    grey_erode = fn_type(fastmorph.kernel_address("grey_erode", np.float32))
+    status = grey_erode(image.ctypes.data, output.ctypes.data, sx, sy, sz, 1)
+  """
+  name = f"{op}_{int(ndim)}d_{np.dtype(dtype).name}"
+  capsule = getattr(fastmorphops.capi, name, None)
+  if capsule is None:
+    raise ValueError(f"No C entry point for op={op} dtype={np.dtype(dtype)} ndim={ndim}.")
+
+  get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+  get_pointer.restype = ctypes.c_void_p
+  get_pointer.argtypes = [ ctypes.py_object, ctypes.c_char_p ]
+  return get_pointer(capsule, f"fastmorphops.capi.{name}".encode("utf8"))
@@ -0,0 +1,372 @@
+"""
+Throughput benchmark of the public fastmorph operators.
+
+  python -m fastmorph.benchmark
+  python -m fastmorph.benchmark --volume connectomics.npy.ckl.gz --parallel 1,2,4,8
+  python -m fastmorph.benchmark --volume synthetic:cells:256 --ops dilate,erode --no-baselines
+  python -m fastmorph.benchmark --json today.json --compare yesterday.json
+  python -m fastmorph.benchmark --corpus 256 --ops dilate,erode --no-baselines
+
+Each op is timed for every parallel value and, where an equivalent
+exists, against scipy.ndimage and skimage (single threaded). Results
+are printed as a table and optionally written as JSON. --compare
+adds a column with the ratio to a previous JSON run on matching
+(op, implementation, parallel) rows so slowdowns stand out.
+--perf runs each fastmorph op once more inside
+fastmorph.perf_counters (Linux only) and reports IPC, cache miss
+rate, and estimated memory bandwidth next to the timings.
+
+Volumes:
+  *.ckl, *.ckl.gz: crackle compressed (requires crackle-codec)
+  *.npy, *.npy.gz: numpy arrays
+  synthetic:KIND[:SIZE]: KIND is zeros, blobs, cells, or noise
+    (default size 256, the same generators as benchmarks/benchmark.cpp)
+  corpus:PRESET[:SIZE[:KEY=VALUE,...]]: a fastmorph.corpus preset,
+    e.g. corpus:dense_100k:256 or corpus:sparse:128:num_labels=5000
+
+--volume can be repeated and --corpus SIZE sweeps every corpus
+preset, results are reported per volume.
+"""
+import argparse
+import gzip
+import io
+import json
+import multiprocessing as mp
+import os
+import platform
+import sys
+import time
+
+import numpy as np
+
+import fastmorph
+
+DEFAULT_VOLUME = "connectomics.npy.ckl.gz"
+
+def synthetic_volume(kind:str, size:int = 256) -> np.ndarray:
+  rng = np.random.default_rng(1234)
+  shape = (size, size, size)
+
+  if kind == "zeros":
+    return np.zeros(shape, dtype=np.uint32, order="F")
+  elif kind == "blobs":
+    labels = np.zeros(shape, dtype=np.uint32, order="F")
+    for _ in range(40):
+      x, y, z = rng.integers(0, size, size=3)
+      r = int(rng.integers(1, size // 4 + 2))
+      labels[x:x+r, y:y+r, z:z+r] = rng.integers(1, 6)
+    return labels
+  elif kind == "cells":
+    cell = 24
+    grid = size // cell + 1
+    r = np.arange(size, dtype=np.uint32)
+    x, y, z = r[:, None, None], r[None, :, None], r[None, None, :]
+    labels = 1 + (x // cell) + grid * ((y // cell) + grid * (z // cell))
+    labels[(x % cell == 0) | (y % cell == 0) | (z % cell == 0)] = 0
+    return np.asfortranarray(labels)
+  elif kind == "noise":
+    labels = rng.integers(0, 1000, size=shape).astype(np.uint32)
+    labels[labels < 100] = 0
+    return np.asfortranarray(labels)
+
+  raise ValueError(f"Unknown synthetic volume: {kind}")
+
+def _parse_value(value:str):
+  for cast in (int, float):
+    try:
+      return cast(value)
+    except ValueError:
+      pass
+  return value
+
+def load_volume(spec:str) -> np.ndarray:
+  if spec.startswith("synthetic:"):
+    parts = spec.split(":")
+    size = int(parts[2]) if len(parts) > 2 else 256
+    return synthetic_volume(parts[1], size)
+  elif spec.startswith("corpus:"):
+    from . import corpus
+    parts = spec.split(":")
+    size = int(parts[2]) if len(parts) > 2 and parts[2] else 256
+    overrides = {}
+    if len(parts) > 3:
+      for item in parts[3].split(","):
+        key, value = item.split("=")
+        overrides[key] = _parse_value(value)
+    return corpus.preset(parts[1], size, **overrides)
+
+  opener = gzip.open if spec.endswith(".gz") else open
+  with opener(spec, "rb") as f:
+    binary = f.read()
+
+  if ".ckl" in spec:
+    try:
+      import crackle
+    except ImportError:
+      raise ImportError(
+        f"Reading {spec} requires crackle-codec (pip install crackle-codec)."
+      )
+    labels = crackle.decompress(binary)
+  else:
+    labels = np.load(io.BytesIO(binary))
+
+  return np.asfortranarray(labels)
+
+def ball(radius:int, ndim:int, inclusive:bool = True) -> np.ndarray:
+  r = np.arange(-radius, radius + 1)
+  grids = np.meshgrid(*[ r ] * ndim, indexing="ij")
+  d2 = sum(g * g for g in grids)
+  return (d2 <= radius * radius) if inclusive else (d2 < radius * radius)
+
+def _random_points(labels:np.ndarray, n:int, seed:int = 0):
+  rng = np.random.default_rng(seed)
+  coords = np.stack([ rng.integers(0, s, size=n) for s in labels.shape ], axis=1)
+  return coords, rng.integers(1, 1000, size=n).astype(labels.dtype)
+
+def build_ops(labels:np.ndarray):
+  """
+  Returns [ (op name, fastmorph fn(parallel), { baseline name: fn() }, threaded) ].
+  Inputs are prepared here so their cost isn't timed.
+  """
+  binary = labels > 0
+  points, point_labels = _random_points(labels, 1000)
+  sparse_mask = np.random.default_rng(1).random(labels.shape) < 0.001
+  sparse_coords = np.stack(np.nonzero(sparse_mask & (labels > 0)), axis=1)
+  sparse_values = labels[tuple(sparse_coords.T)]
+  radii = { int(label): 2 for label in np.unique(labels)[1:101] }
+  grey = fastmorph.Mode.grey
+  size = (3,) * labels.ndim
+  cube = np.ones(size, dtype=bool)
+  sphere = ball(3, labels.ndim)
+  # spherical_erode keeps voxels at least radius from the background,
+  # so it erodes with the ball that excludes its surface
+  open_sphere = ball(3, labels.ndim, inclusive=False)
+
+  try:
+    import scipy.ndimage as ndi
+  except ImportError:
+    ndi = None
+  try:
+    import skimage.morphology
+  except ImportError:
+    skimage = None
+
+  def baselines(**fns):
+    return { name: fn for name, fn in fns.items() if fn is not None }
+
+  def scipy(fn):
+    return fn if ndi is not None else None
+
+  def sk(fn):
+    return fn if skimage is not None else None
+
+  return [
+    # expand_labels(distance=1) only reaches face neighbors, not the 3x3x3 mode
+    ("dilate", lambda p: fastmorph.dilate(labels, parallel=p), {}, True),
+    ("dilate_full", lambda p: fastmorph.dilate(labels, background_only=False, parallel=p), {}, True),
+    # scipy has no multilabel erosion, grey_erosion only matches grey_erode
+    ("erode", lambda p: fastmorph.erode(labels, parallel=p), {}, True),
+    ("opening", lambda p: fastmorph.opening(labels, parallel=p), {}, True),
+    ("closing", lambda p: fastmorph.closing(labels, parallel=p), {}, True),
+    ("grey_dilate", lambda p: fastmorph.dilate(labels, mode=grey, parallel=p), baselines(
+      scipy_grey_dilation=scipy(lambda: ndi.grey_dilation(labels, size=size)),
+      skimage_dilation=sk(lambda: skimage.morphology.dilation(labels, footprint=cube)),
+    ), True),
+    ("grey_erode", lambda p: fastmorph.erode(labels, mode=grey, parallel=p), baselines(
+      scipy_grey_erosion=scipy(lambda: ndi.grey_erosion(labels, size=size)),
+      skimage_erosion=sk(lambda: skimage.morphology.erosion(labels, footprint=cube)),
+    ), True),
+    ("grey_opening", lambda p: fastmorph.opening(labels, mode=grey, parallel=p), baselines(
+      scipy_grey_opening=scipy(lambda: ndi.grey_opening(labels, size=size)),
+      skimage_opening=sk(lambda: skimage.morphology.opening(labels, footprint=cube)),
+    ), True),
+    ("grey_closing", lambda p: fastmorph.closing(labels, mode=grey, parallel=p), baselines(
+      scipy_grey_closing=scipy(lambda: ndi.grey_closing(labels, size=size)),
+      skimage_closing=sk(lambda: skimage.morphology.closing(labels, footprint=cube)),
+    ), True),
+    ("until_stable_closing", lambda p: fastmorph.until_stable(labels, "closing", max_iterations=4, parallel=p), {}, True),
+    ("sparse_diff", lambda p: fastmorph.sparse_diff(labels, "dilate", parallel=p), {}, True),
+    ("per_label_morph", lambda p: fastmorph.per_label_morph(labels, radii, default_radius=-1, parallel=p), {}, True),
+    ("spherical_dilate", lambda p: fastmorph.spherical_dilate(binary, radius=3, parallel=p), baselines(
+      scipy_binary_dilation=scipy(lambda: ndi.binary_dilation(binary, structure=sphere)),
+      skimage_dilation=sk(lambda: skimage.morphology.dilation(binary, footprint=sphere)),
+    ), True),
+    ("spherical_erode", lambda p: fastmorph.spherical_erode(labels, radius=3, parallel=p), {}, True),
+    ("spherical_open", lambda p: fastmorph.spherical_open(binary, radius=3, parallel=p), baselines(
+      scipy_binary_opening=scipy(lambda: ndi.binary_dilation(
+        ndi.binary_erosion(binary, structure=open_sphere), structure=sphere
+      )),
+    ), True),
+    ("spherical_close", lambda p: fastmorph.spherical_close(binary, radius=3, parallel=p), baselines(
+      scipy_binary_closing=scipy(lambda: ndi.binary_erosion(
+        ndi.binary_dilation(binary, structure=sphere), structure=open_sphere
+      )),
+    ), True),
+    ("fill_holes_binary", lambda p: fastmorph.fill_holes(binary), baselines(
+      scipy_binary_fill_holes=scipy(lambda: ndi.binary_fill_holes(binary)),
+    ), False),
+    ("fill_holes", lambda p: fastmorph.fill_holes(labels, remove_enclosed=True), {}, False),
+    ("morph_each_label_closing", lambda p: fastmorph.morph_each_label(labels, "closing", parallel=p), {}, True),
+    ("paint_points", lambda p: fastmorph.paint_points(points, point_labels, shape=labels.shape, radius=5, parallel=p), {}, True),
+    ("morph_sparse", lambda p: fastmorph.morph_sparse(sparse_coords, sparse_values, labels.shape, "dilate", parallel=p), {}, True),
+  ]
+
+def time_fn(fn, repeat:int) -> list:
+  seconds = []
+  for _ in range(repeat):
+    start = time.perf_counter()
+    fn()
+    seconds.append(time.perf_counter() - start)
+  return seconds
+
+def summarize(volume:str, op:str, impl:str, parallel:int, seconds:list, voxels:int) -> dict:
+  mean = float(np.mean(seconds))
+  return {
+    "volume": volume,
+    "op": op,
+    "impl": impl,
+    "parallel": parallel,
+    "seconds": seconds,
+    "mean": mean,
+    "min": float(np.min(seconds)),
+    "stddev": float(np.std(seconds, ddof=1)) if len(seconds) > 1 else 0.0,
+    "voxels_per_sec": voxels / mean if mean > 0 else 0.0,
+  }
+
+def measure_perf(fn) -> dict:
+  with fastmorph.perf_counters() as perf:
+    fn()
+  return {
+    "counters": perf.counters,
+    "metrics": perf.metrics,
+    "unavailable": perf.unavailable,
+    "error": perf.error,
+  }
+
+def print_perf_table(results:list):
+  header = f"{'volume':<24} {'op':<26} {'par':>3} {'IPC':>6} {'LLC miss':>9} {'est. GB/s':>10} {'cpu util':>9}"
+  print(header)
+  print("-" * len(header))
+  unavailable = set()
+  for res in results:
+    if "perf" not in res:
+      continue
+    metrics = res["perf"]["metrics"]
+    unavailable.update(res["perf"]["unavailable"])
+    fmt = lambda key, scale, spec: format(metrics[key] * scale, spec) if key in metrics else "-"
+    print(
+      f"{res['volume']:<24} {res['op']:<26} {res['parallel']:>3} "
+      f"{fmt('ipc', 1, '.2f'):>6} {fmt('cache_miss_rate', 100, '.1f') + '%':>9} "
+      f"{fmt('memory_bandwidth_estimate', 1e-9, '.2f'):>10} {fmt('cpu_utilization', 1, '.2f'):>9}"
+    )
+  if unavailable:
+    print(f"unavailable counters: {', '.join(sorted(unavailable))}")
+
+def print_table(results:list, previous:dict):
+  header = f"{'volume':<24} {'op':<26} {'impl':<26} {'par':>3} {'mean (s)':>10} {'stddev':>8} {'MVx/s':>9}"
+  if previous:
+    header += f" {'vs prev':>8}"
+  print(header)
+  print("-" * len(header))
+  for res in results:
+    line = (
+      f"{res['volume']:<24} {res['op']:<26} {res['impl']:<26} {res['parallel']:>3} "
+      f"{res['mean']:>10.4f} {res['stddev']:>8.4f} {res['voxels_per_sec'] / 1e6:>9.2f}"
+    )
+    key = (res["volume"], res["op"], res["impl"], res["parallel"])
+    if key in previous and res["mean"] > 0:
+      ratio = previous[key] / res["mean"]
+      line += f" {ratio:>7.2f}x"
+    print(line)
+
+def main(argv=None):
+  parser = argparse.ArgumentParser(
+    prog="python -m fastmorph.benchmark",
+    description="Time the public fastmorph operators against scipy and skimage.",
+  )
+  parser.add_argument("--volume", action="append", default=None,
+    help=f"volume to process, repeatable (default: {DEFAULT_VOLUME} if present, else synthetic:cells:256)")
+  parser.add_argument("--corpus", type=int, default=None, metavar="SIZE",
+    help="also run every fastmorph.corpus preset at this size")
+  parser.add_argument("--parallel", default="1,2,4", help="comma separated thread counts")
+  parser.add_argument("--repeat", type=int, default=3, help="timed repetitions per configuration")
+  parser.add_argument("--ops", default=None, help="comma separated subset of ops to run")
+  parser.add_argument("--no-baselines", action="store_true", help="skip scipy and skimage")
+  parser.add_argument("--json", default=None, help="write results to this JSON file")
+  parser.add_argument("--compare", default=None, help="previous JSON results to compare against")
+  parser.add_argument("--perf", action="store_true", help="also collect perf_event counters (Linux only)")
+  args = parser.parse_args(argv)
+
+  specs = args.volume or []
+  if args.corpus:
+    from . import corpus
+    specs += [ f"corpus:{name}:{args.corpus}" for name in corpus.PRESETS ]
+  if not specs:
+    specs = [ DEFAULT_VOLUME if os.path.exists(DEFAULT_VOLUME) else "synthetic:cells:256" ]
+
+  parallels = [ min(int(p), mp.cpu_count()) for p in args.parallel.split(",") ]
+  parallels = sorted(set(parallels))
+  repeat = max(args.repeat, 1)
+
+  previous = {}
+  if args.compare:
+    with open(args.compare, "rt") as f:
+      data = json.load(f)
+    for res in data["results"]:
+      # older results ran a single volume
+      volume = res.get("volume", data.get("volume"))
+      previous[(volume, res["op"], res["impl"], res["parallel"])] = res["mean"]
+
+  print(f"cpus: {mp.cpu_count()}")
+
+  volumes = []
+  results = []
+  for spec in specs:
+    labels = load_volume(spec)
+    voxels = labels.size
+    volumes.append({ "volume": spec, "shape": list(labels.shape), "dtype": str(labels.dtype) })
+    print(f"volume: {spec} shape: {labels.shape} dtype: {labels.dtype}")
+
+    ops = build_ops(labels)
+    if args.ops:
+      selected = set(args.ops.split(","))
+      unknown = selected - set(op[0] for op in ops)
+      if unknown:
+        parser.error(f"unknown ops: {sorted(unknown)}")
+      ops = [ op for op in ops if op[0] in selected ]
+
+    for name, fn, baselines, threaded in ops:
+      for parallel in (parallels if threaded else [ 1 ]):
+        seconds = time_fn(lambda: fn(parallel), repeat)
+        results.append(summarize(spec, name, "fastmorph", parallel, seconds, voxels))
+        if args.perf:
+          results[-1]["perf"] = measure_perf(lambda: fn(parallel))
+      if args.no_baselines:
+        continue
+      for impl, baseline in baselines.items():
+        seconds = time_fn(baseline, repeat)
+        results.append(summarize(spec, name, impl, 1, seconds, voxels))
+
+  print()
+  print_table(results, previous)
+  if args.perf:
+    print()
+    print_perf_table(results)
+
+  if args.json:
+    with open(args.json, "wt") as f:
+      json.dump({
+        "volumes": volumes,
+        "repeat": repeat,
+        "machine": {
+          "platform": platform.platform(),
+          "processor": platform.processor(),
+          "cpus": mp.cpu_count(),
+          "python": sys.version.split()[0],
+          "numpy": np.__version__,
+        },
+        "results": results,
+      }, f, indent=2)
+
+if __name__ == "__main__":
+  main()
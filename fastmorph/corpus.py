@@ -0,0 +1,375 @@
+"""
+Deterministic synthetic segmentations and grey images for benchmarks.
+
+  python -m fastmorph.corpus --list
+  python -m fastmorph.corpus --preset dense_100k --size 256 --out dense_100k.npy
+  python -m fastmorph.corpus --preset sparse --num-labels 5000 --out sparse.npy
+  python -m fastmorph.benchmark --volume corpus:empty:256 --volume corpus:huge_object:256
+  python -m fastmorph.benchmark --corpus 256
+
+The same arguments and seed always produce the same volume, so
+sweeps can be rerun on another machine without shipping data.
+Saved .npy files can be fed to benchmarks/benchmark.cpp with --npy.
+
+Volumes are built from supervoxels: a Voronoi tessellation of
+seeds jittered around a grid. The supervoxels are walked in Morton
+(Z curve) order and cut into runs, one run per object, so objects
+are spatially compact and their sizes follow size_distribution.
+Background runs are interleaved with the objects so foreground is
+spread over the whole volume.
+
+Knobs:
+  shape: volume shape (2D or 3D)
+  num_labels: number of objects (nonzero labels)
+  size_distribution: "uniform", "lognormal", or "powerlaw"
+  size_spread: sigma of the lognormal or exponent of the power law
+  foreground: fraction of voxels that are labeled, before
+    boundary_width carves out the boundaries
+  grain: edge of a supervoxel in voxels, the smallest object
+    (shrunk automatically when num_labels wouldn't fit)
+  anisotropy: per axis stretch of the supervoxels, e.g. (4,4,1)
+    for objects flattened along z as in anisotropic EM
+  roughness: jitter of the boundaries in supervoxel widths,
+    0 gives smooth convex faces, ~1 ragged surfaces with a much
+    higher boundary density
+  boundary_width: width in voxels of the background drawn
+    between touching objects (like extracellular space)
+  shuffle: give objects random label values instead of
+    numbering them along the Morton curve
+"""
+import argparse
+import math
+
+import numpy as np
+
+SIZE_DISTRIBUTIONS = ("uniform", "lognormal", "powerlaw")
+
+# regimes where fastmorph's performance differs, sized for --size
+# (the edge of a cube with the same number of voxels)
+PRESETS = {
+  "empty": dict(num_labels=20, foreground=0.01, size_distribution="lognormal"),
+  "sparse": dict(num_labels=500, foreground=0.1, size_distribution="lognormal"),
+  "dense": dict(num_labels=2000, foreground=1.0, boundary_width=1, size_distribution="lognormal"),
+  "dense_100k": dict(num_labels=100000, foreground=1.0, grain=3),
+  "rough": dict(num_labels=2000, foreground=0.8, roughness=1.0),
+  "anisotropic": dict(num_labels=2000, foreground=0.9, anisotropy=(4,4,1), aspect=(2,2,0.25)),
+  "huge_object": dict(num_labels=3, foreground=0.95, size_distribution="powerlaw", size_spread=3.0),
+}
+
+def _morton_order(grid:tuple) -> np.ndarray:
+  """Indices of a C ordered grid sorted along the Z curve."""
+  coords = np.indices(grid).reshape(len(grid), -1).astype(np.uint64)
+  bits = max(int(math.ceil(math.log2(max(g, 2)))) for g in grid)
+  code = np.zeros(coords.shape[1], dtype=np.uint64)
+  for bit in range(bits):
+    for axis in range(len(grid)):
+      b = (coords[axis] >> np.uint64(bit)) & np.uint64(1)
+      code |= b << np.uint64(bit * len(grid) + axis)
+  return np.argsort(code, kind="stable")
+
+def _object_sizes(rng, n:int, distribution:str, spread:float) -> np.ndarray:
+  if distribution == "uniform":
+    return np.ones(n)
+  elif distribution == "lognormal":
+    return rng.lognormal(0.0, spread, size=n)
+  elif distribution == "powerlaw":
+    # pareto with exponent spread, a few objects dominate
+    return (1.0 - rng.random(n)) ** (-1.0 / spread)
+  raise ValueError(f"size_distribution must be one of {SIZE_DISTRIBUTIONS}. Got: {distribution}")
+
+def _run_lengths(weights:np.ndarray, total:int) -> np.ndarray:
+  """Splits total into len(weights) positive integers proportional to weights."""
+  n = len(weights)
+  if n == 0:
+    return np.zeros(0, dtype=np.int64)
+  lengths = np.ones(n, dtype=np.int64)
+  remaining = total - n
+  if remaining > 0:
+    share = weights / weights.sum() * remaining
+    extra = np.floor(share).astype(np.int64)
+    # hand out what rounding lost to the largest remainders
+    leftover = remaining - extra.sum()
+    extra[np.argsort(extra - share, kind="stable")[:leftover]] += 1
+    lengths += extra
+  return lengths
+
+def _supervoxels(rng, shape:tuple, cell:np.ndarray, roughness:float) -> tuple:
+  """
+  Returns (supervoxel id of every voxel, grid shape). Each voxel
+  belongs to the nearest of the 2^ndim seeds around the grid corner
+  closest to it, measured in cell units so anisotropic cells stay
+  stretched. That is nearly always the true nearest seed and keeps
+  the search cheap enough for 512^3 volumes.
+  """
+  ndim = len(shape)
+  grid = tuple(int(math.ceil(s / c)) for s, c in zip(shape, cell))
+  extent = np.asarray(shape, dtype=np.float64) / cell
+
+  # a ring of unreachable seeds around the grid avoids bounds checks
+  padded = tuple(g + 2 for g in grid)
+  seeds = []
+  jitter = rng.random((ndim,) + grid)
+  for axis in range(ndim):
+    pos = np.full(padded, 1e9, dtype=np.float32)
+    inner = np.indices(grid)[axis] + jitter[axis]
+    # keep seeds of partial cells at the border inside the volume
+    inner = np.minimum(inner, extent[axis] - 1e-3)
+    pos[tuple(slice(1, -1) for _ in range(ndim))] = inner
+    seeds.append(pos.ravel())
+
+  padded_ids = np.zeros(padded, dtype=np.int64)
+  padded_ids[tuple(slice(1, -1) for _ in range(ndim))] = np.arange(int(np.prod(grid))).reshape(grid)
+  padded_ids = padded_ids.ravel()
+
+  strides = np.cumprod((1,) + padded[::-1][:-1])[::-1]
+  corners = [ int(np.dot(strides, corner)) for corner in np.indices((2,) * ndim).reshape(ndim, -1).T ]
+
+  out = np.empty(shape, dtype=np.int64, order="F")
+  # slabs along the last axis bound the memory of the search
+  slab = max(1, (1 << 20) // max(1, int(np.prod(shape[:-1]))))
+
+  for start in range(0, shape[-1], slab):
+    end = min(start + slab, shape[-1])
+    sub = shape[:-1] + (end - start,)
+    pos = np.indices(sub, dtype=np.float32)
+    pos[-1] += start
+    # voxel centers in cell units
+    pos = (pos + 0.5) / cell.reshape((ndim,) + (1,) * ndim).astype(np.float32)
+    if roughness > 0:
+      pos += (rng.random(pos.shape, dtype=np.float32) - 0.5) * roughness
+
+    first = np.zeros(sub, dtype=np.int64)
+    for axis in range(ndim):
+      # cell before the nearest corner, shifted into the padding
+      first += np.clip(np.floor(pos[axis] + 0.5).astype(np.int64), 0, grid[axis]) * strides[axis]
+
+    best = np.full(sub, np.inf, dtype=np.float32)
+    best_lin = first.copy()
+    for corner in corners:
+      lin = first + corner
+      dist = np.zeros(sub, dtype=np.float32)
+      for axis in range(ndim):
+        d = seeds[axis][lin] - pos[axis]
+        dist += d * d
+      closer = dist < best
+      best[closer] = dist[closer]
+      best_lin[closer] = lin[closer]
+    out[..., start:end] = padded_ids[best_lin]
+
+  return out, grid
+
+def _draw_boundaries(labels:np.ndarray, width:int):
+  """Zeros voxels that touch a different nonzero label, width times."""
+  for _ in range(width):
+    edge = np.zeros(labels.shape, dtype=bool)
+    for axis in range(labels.ndim):
+      lo = [ slice(None) ] * labels.ndim
+      hi = [ slice(None) ] * labels.ndim
+      lo[axis] = slice(None, -1)
+      hi[axis] = slice(1, None)
+      a, b = labels[tuple(lo)], labels[tuple(hi)]
+      differ = (a != b) & (a != 0) & (b != 0)
+      edge[tuple(lo)] |= differ
+      edge[tuple(hi)] |= differ
+    labels[edge] = 0
+
+def generate_labels(
+  shape:tuple = (256,256,256),
+  num_labels:int = 1000,
+  size_distribution:str = "lognormal",
+  size_spread:float = 1.0,
+  foreground:float = 1.0,
+  grain:float = 8.0,
+  anisotropy:tuple = None,
+  roughness:float = 0.0,
+  boundary_width:int = 0,
+  shuffle:bool = True,
+  dtype = np.uint32,
+  seed:int = 0,
+) -> np.ndarray:
+  """
+  Returns a Fortran ordered segmentation with num_labels objects
+  (a few less when there are fewer supervoxels than objects or
+  boundary_width erases the smallest ones).
+  See the module docstring for the parameters.
+  """
+  shape = tuple(int(s) for s in shape)
+  ndim = len(shape)
+  if ndim not in (2, 3):
+    raise ValueError(f"Only 2D and 3D volumes are supported. Got: {shape}")
+  if not (0.0 <= foreground <= 1.0):
+    raise ValueError(f"foreground must be between 0 and 1. Got: {foreground}")
+  if num_labels < 0:
+    raise ValueError(f"num_labels must be non-negative. Got: {num_labels}")
+
+  rng = np.random.default_rng(seed)
+  voxels = int(np.prod(shape))
+
+  # enough supervoxels for every foreground object
+  wanted = voxels * foreground / max(num_labels, 1)
+  grain = max(1.0, min(float(grain), wanted ** (1.0 / ndim)))
+
+  anisotropy = np.ones(ndim) if anisotropy is None else np.asarray(anisotropy[:ndim], dtype=np.float64)
+  cell = grain * anisotropy / np.exp(np.mean(np.log(anisotropy)))
+  cell = np.minimum(cell, shape)
+
+  ids, grid = _supervoxels(rng, shape, cell, roughness)
+  num_supervoxels = int(np.prod(grid))
+
+  order = _morton_order(grid)
+  fg_supervoxels = int(round(num_supervoxels * foreground))
+  num_objects = min(num_labels, fg_supervoxels)
+
+  sizes = _run_lengths(_object_sizes(rng, num_objects, size_distribution, size_spread), fg_supervoxels)
+  # background gaps before each object and after the last one
+  gaps = np.zeros(num_objects + 1, dtype=np.int64)
+  bg_supervoxels = num_supervoxels - int(sizes.sum())
+  if bg_supervoxels > 0:
+    gaps = np.bincount(rng.integers(0, num_objects + 1, size=bg_supervoxels), minlength=num_objects + 1)
+
+  values = np.arange(1, num_objects + 1, dtype=np.uint64)
+  if shuffle:
+    values = rng.permutation(values)
+
+  runs = np.empty(2 * num_objects + 1, dtype=np.int64)
+  runs[0::2] = gaps
+  runs[1::2] = sizes
+  run_values = np.zeros(2 * num_objects + 1, dtype=np.uint64)
+  run_values[1::2] = values
+
+  supervoxel_label = np.zeros(num_supervoxels, dtype=np.uint64)
+  supervoxel_label[order] = np.repeat(run_values, runs)
+
+  labels = np.asfortranarray(supervoxel_label[ids].astype(dtype, copy=False))
+  _draw_boundaries(labels, boundary_width)
+  return labels
+
+def grey_from_labels(labels:np.ndarray, noise:float = 0.1, dtype = np.uint8, seed:int = 0) -> np.ndarray:
+  """
+  Gives each object a random intensity, the background a dark one,
+  and adds gaussian noise with a standard deviation of noise (as a
+  fraction of the range). Floating point dtypes are in [0,1].
+  """
+  rng = np.random.default_rng(seed + 1)
+  intensity = rng.uniform(0.25, 1.0, size=int(labels.max()) + 1).astype(np.float32)
+  intensity[0] = 0.05
+  image = intensity[labels]
+  if noise > 0:
+    image += rng.normal(0.0, noise, size=labels.shape).astype(np.float32)
+  np.clip(image, 0.0, 1.0, out=image)
+
+  dtype = np.dtype(dtype)
+  if np.issubdtype(dtype, np.integer):
+    image *= np.iinfo(dtype).max
+    image = np.rint(image)
+  return np.asfortranarray(image.astype(dtype))
+
+def generate_grey(
+  shape:tuple = (256,256,256),
+  num_labels:int = 1000,
+  noise:float = 0.1,
+  dtype = np.uint8,
+  seed:int = 0,
+  **kwargs
+) -> np.ndarray:
+  """
+  Returns a Fortran ordered grey image of the objects of
+  generate_labels(shape, num_labels, seed=seed, **kwargs).
+  See grey_from_labels.
+  """
+  labels = generate_labels(shape, num_labels, dtype=np.uint32, seed=seed, **kwargs)
+  return grey_from_labels(labels, noise, dtype, seed)
+
+def preset(name:str, size:int = 256, ndim:int = 3, seed:int = 0, **overrides) -> np.ndarray:
+  """
+  Generates a PRESETS volume with as many voxels as a size^ndim
+  cube. Label counts are for size 256 in 3D and scale with the
+  number of voxels so object sizes stay the same (but don't drop
+  below 3). overrides replace preset parameters.
+  """
+  if name not in PRESETS:
+    raise ValueError(f"Unknown preset: {name}. Choices: {', '.join(PRESETS)}")
+
+  params = dict(PRESETS[name])
+  aspect = params.pop("aspect", (1,1,1))[:ndim]
+  scale = np.prod(aspect) ** (1.0 / ndim)
+  shape = tuple(max(1, int(round(size * a / scale))) for a in aspect)
+
+  voxels = float(np.prod(shape))
+  num_labels = params["num_labels"]
+  params["num_labels"] = max(min(num_labels, 3), int(round(num_labels * voxels / 256 ** 3)))
+  params.update(overrides)
+  return generate_labels(shape, seed=seed, **params)
+
+def describe(labels:np.ndarray) -> dict:
+  """Statistics for checking a generated volume."""
+  foreground = labels != 0
+  boundary = np.zeros(labels.shape, dtype=bool)
+  for axis in range(labels.ndim):
+    lo = [ slice(None) ] * labels.ndim
+    hi = [ slice(None) ] * labels.ndim
+    lo[axis] = slice(None, -1)
+    hi[axis] = slice(1, None)
+    differ = labels[tuple(lo)] != labels[tuple(hi)]
+    boundary[tuple(lo)] |= differ
+    boundary[tuple(hi)] |= differ
+
+  values, counts = np.unique(labels[foreground], return_counts=True)
+  return {
+    "shape": list(labels.shape),
+    "dtype": str(labels.dtype),
+    "num_labels": int(len(values)),
+    "foreground": float(foreground.mean()),
+    "boundary_density": float(boundary.mean()),
+    "largest_object": float(counts.max() / labels.size) if len(counts) else 0.0,
+    "median_object_voxels": float(np.median(counts)) if len(counts) else 0.0,
+  }
+
+def main(argv=None):
+  parser = argparse.ArgumentParser(
+    prog="python -m fastmorph.corpus",
+    description="Generate deterministic synthetic benchmark volumes.",
+  )
+  parser.add_argument("--list", action="store_true", help="list the presets and exit")
+  parser.add_argument("--preset", default="dense", help=f"one of {', '.join(PRESETS)}")
+  parser.add_argument("--size", type=int, default=256, help="edge of a cube with the same number of voxels")
+  parser.add_argument("--ndim", type=int, default=3, choices=(2,3))
+  parser.add_argument("--seed", type=int, default=0)
+  parser.add_argument("--dtype", default="uint32")
+  parser.add_argument("--num-labels", type=int, default=None)
+  parser.add_argument("--foreground", type=float, default=None)
+  parser.add_argument("--size-distribution", default=None, choices=SIZE_DISTRIBUTIONS)
+  parser.add_argument("--size-spread", type=float, default=None)
+  parser.add_argument("--grain", type=float, default=None)
+  parser.add_argument("--roughness", type=float, default=None)
+  parser.add_argument("--boundary-width", type=int, default=None)
+  parser.add_argument("--grey", action="store_true", help="write a grey image of the objects instead")
+  parser.add_argument("--noise", type=float, default=0.1, help="noise of --grey images")
+  parser.add_argument("--out", default=None, help="write a Fortran ordered .npy here")
+  args = parser.parse_args(argv)
+
+  if args.list:
+    for name, params in PRESETS.items():
+      print(f"{name:<12} {params}")
+    return
+
+  overrides = {
+    key: getattr(args, key) for key in (
+      "num_labels", "foreground", "size_distribution", "size_spread",
+      "grain", "roughness", "boundary_width",
+    )
+    if getattr(args, key) is not None
+  }
+  dtype = np.uint32 if args.grey else args.dtype
+  labels = preset(args.preset, args.size, args.ndim, args.seed, dtype=dtype, **overrides)
+  print(describe(labels))
+
+  if args.grey:
+    labels = grey_from_labels(labels, args.noise, args.dtype, args.seed)
+
+  if args.out:
+    # Fortran order so benchmark.cpp reads it without a transpose
+    np.save(args.out, labels)
+
+if __name__ == "__main__":
+  main()
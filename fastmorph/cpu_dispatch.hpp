@@ -0,0 +1,166 @@
+#ifndef __FASTMORPH_CPU_DISPATCH_HXX__
+#define __FASTMORPH_CPU_DISPATCH_HXX__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Runtime selection between copies of the kernels compiled for
+// several x86-64 instruction sets in one binary, so portable builds
+// (plain -O3, SSE2 only) still run AVX2 or AVX-512 code on hosts
+// that have it.
+//
+// fastmorph_avx2.cpp and fastmorph_avx512.cpp include fastmorph.hpp
+// with FASTMORPH_ISA_NAMESPACE set. The kernels are then compiled
+// under #pragma GCC target (or clang attribute) for that instruction
+// set inside an inline namespace of the same name, which keeps their
+// symbols apart from the baseline copy. Types shared with the
+// callers (RadiusMap, BrickVolume, ...) and helpers like
+// parallelize_blocks and the thread pool stay outside the namespace
+// and are compiled for the baseline everywhere. Builds that compile
+// those two files define FASTMORPH_DISPATCH, and the public kernels
+// of the baseline copy then forward to the selected copy.
+//
+// The instruction set is picked from CPUID when first used. The
+// FASTMORPH_ISA environment variable (baseline, avx2, avx512, or
+// auto) caps it, e.g. to compare results or timings. Requests for
+// an instruction set the CPU lacks fall back to the best it has.
+//
+// Only GCC and Clang on x86-64 are supported, elsewhere (MSVC, ARM)
+// FASTMORPH_DISPATCH has no effect and the baseline copy is used.
+
+#if defined(FASTMORPH_DISPATCH) && (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define FASTMORPH_DISPATCH_ENABLED 1
+#else
+#define FASTMORPH_DISPATCH_ENABLED 0
+#endif
+
+// x86-64-v3 and x86-64-v4 without the extensions the kernels can't use
+#if defined(__clang__)
+#define FASTMORPH_TARGET_AVX2_BEGIN \
+	_Pragma("clang attribute push(__attribute__((target(\"avx2,fma,bmi,bmi2,popcnt\"))), apply_to = function)")
+#define FASTMORPH_TARGET_AVX512_BEGIN \
+	_Pragma("clang attribute push(__attribute__((target(\"avx512f,avx512bw,avx512vl,avx512dq,avx2,fma,bmi,bmi2,popcnt\"))), apply_to = function)")
+#define FASTMORPH_TARGET_END _Pragma("clang attribute pop")
+#else
+#define FASTMORPH_TARGET_AVX2_BEGIN \
+	_Pragma("GCC push_options") \
+	_Pragma("GCC target(\"avx2,fma,bmi,bmi2,popcnt\")")
+#define FASTMORPH_TARGET_AVX512_BEGIN \
+	_Pragma("GCC push_options") \
+	_Pragma("GCC target(\"avx512f,avx512bw,avx512vl,avx512dq,avx2,fma,bmi,bmi2,popcnt,prefer-vector-width=512\")")
+#define FASTMORPH_TARGET_END _Pragma("GCC pop_options")
+#endif
+
+namespace fastmorph {
+namespace cpu {
+
+enum class Isa {
+	BASELINE = 0,
+	AVX2 = 1,
+	AVX512 = 2,
+	NUM_ISAS
+};
+
+inline const char* isa_name(const Isa isa) {
+	static const char* names[static_cast<int>(Isa::NUM_ISAS)] = {
+		"baseline", "avx2", "avx512"
+	};
+	return names[static_cast<int>(isa)];
+}
+
+// false if name isn't an instruction set, "auto" is the best supported
+inline bool parse_isa(const char* name, Isa &isa) {
+	if (std::strcmp(name, "auto") == 0) {
+		isa = Isa::AVX512;
+		return true;
+	}
+	for (int i = 0; i < static_cast<int>(Isa::NUM_ISAS); i++) {
+		if (std::strcmp(name, isa_name(static_cast<Isa>(i))) == 0) {
+			isa = static_cast<Isa>(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+// whether the other copies of the kernels were compiled in
+inline bool dispatch_enabled() {
+	return FASTMORPH_DISPATCH_ENABLED;
+}
+
+// The best copy this CPU can run. __builtin_cpu_supports also
+// checks that the OS saves the AVX and AVX-512 registers.
+inline Isa best_supported_isa() {
+#if FASTMORPH_DISPATCH_ENABLED
+	__builtin_cpu_init();
+	const bool avx2 = __builtin_cpu_supports("avx2")
+		&& __builtin_cpu_supports("fma")
+		&& __builtin_cpu_supports("bmi")
+		&& __builtin_cpu_supports("bmi2")
+		&& __builtin_cpu_supports("popcnt");
+	const bool avx512 = avx2
+		&& __builtin_cpu_supports("avx512f")
+		&& __builtin_cpu_supports("avx512bw")
+		&& __builtin_cpu_supports("avx512vl")
+		&& __builtin_cpu_supports("avx512dq");
+	if (avx512) {
+		return Isa::AVX512;
+	}
+	if (avx2) {
+		return Isa::AVX2;
+	}
+#endif
+	return Isa::BASELINE;
+}
+
+inline bool isa_supported(const Isa isa) {
+	return static_cast<int>(isa) <= static_cast<int>(best_supported_isa());
+}
+
+// FASTMORPH_ISA capped by what the CPU supports
+inline Isa initial_isa() {
+	Isa isa = best_supported_isa();
+	const char* env = std::getenv("FASTMORPH_ISA");
+	if (env != nullptr && env[0] != '\0') {
+		Isa requested = isa;
+		if (!parse_isa(env, requested)) {
+			fprintf(stderr,
+				"fastmorph: ignoring FASTMORPH_ISA=%s, expected baseline, avx2, avx512, or auto.\n",
+				env
+			);
+		}
+		else if (static_cast<int>(requested) < static_cast<int>(isa)) {
+			isa = requested;
+		}
+	}
+	return isa;
+}
+
+inline std::atomic<int>& selected_isa_storage() {
+	static std::atomic<int> isa(static_cast<int>(initial_isa()));
+	return isa;
+}
+
+inline Isa selected_isa() {
+	return static_cast<Isa>(selected_isa_storage().load(std::memory_order_relaxed));
+}
+
+// Switches the copy used by later calls (not calls already
+// running) and returns the one actually selected, which is lower
+// than isa if the CPU doesn't support it.
+inline Isa select_isa(Isa isa) {
+	const Isa best = best_supported_isa();
+	if (static_cast<int>(isa) > static_cast<int>(best)) {
+		isa = best;
+	}
+	selected_isa_storage().store(static_cast<int>(isa), std::memory_order_relaxed);
+	return isa;
+}
+
+}
+}
+
+#endif
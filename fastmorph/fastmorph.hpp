@@ -1,24 +1,73 @@
 #ifndef __FASTMORPH_HXX__
 #define __FASTMORPH_HXX__
 
+#include <algorithm>
+#include <chrono>
 #include <vector>
 #include <cstdlib>
 #include <cmath>
 #include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
 #include "threadpool.h"
+#include "trace.hpp"
+#include "perf_counters.hpp"
+#include "cpu_dispatch.hpp"
+
+// The kernels between FASTMORPH_KERNELS_BEGIN and END are compiled
+// once per instruction set when FASTMORPH_ISA_NAMESPACE is set by
+// fastmorph_avx2.cpp or fastmorph_avx512.cpp, see cpu_dispatch.hpp.
+// Types used by callers are defined outside of them.
+#ifdef FASTMORPH_ISA_NAMESPACE
+#define FASTMORPH_KERNELS_BEGIN FASTMORPH_ISA_TARGET_BEGIN inline namespace FASTMORPH_ISA_NAMESPACE {
+#define FASTMORPH_KERNELS_END } FASTMORPH_TARGET_END
+#else
+#define FASTMORPH_KERNELS_BEGIN
+#define FASTMORPH_KERNELS_END
+#endif
+
+// First statement of each public kernel. In the baseline copy of
+// a FASTMORPH_DISPATCH build, forwards the call to the copy for 
+// the selected instruction set unless that is the baseline.
+#if FASTMORPH_DISPATCH_ENABLED && !defined(FASTMORPH_ISA_NAMESPACE)
+#define FASTMORPH_DISPATCH_TO(LABEL, KERNEL, ...) \
+	if (const KernelTable<LABEL>* isa_kernels = dispatched_kernels<LABEL>()) { \
+		return isa_kernels->KERNEL(__VA_ARGS__); \
+	}
+#else
+#define FASTMORPH_DISPATCH_TO(LABEL, KERNEL, ...)
+#endif
 
 namespace fastmorph {
 
-void parallelize_blocks(
+template <typename LABEL>
+struct KernelTable;
+
+template <typename LABEL>
+const KernelTable<LABEL>* dispatched_kernels();
+
+// edge length of the blocks parallelize_blocks hands out
+inline uint64_t block_size_for(const uint64_t sz) {
+	return (sz > 1) ? 64 : 512;
+}
+
+// trace_name labels the blocks in trace.hpp timelines
+// and perf_counters.hpp block samples
+inline void parallelize_blocks(
 	const std::function<void(
 		const uint64_t, const uint64_t, 
 		const uint64_t, const uint64_t, 
 		const uint64_t, const uint64_t
 	)> &process_block,
 	const uint64_t sx, const uint64_t sy, const uint64_t sz,
-	const uint64_t threads, const uint64_t offset
+	const uint64_t threads, const uint64_t offset,
+	const char* trace_name = "block"
 ) {
-	const uint64_t block_size = (sz > 1) ? 64 : 512;
+	const uint64_t block_size = block_size_for(sz);
 
 	const uint64_t grid_x = std::max(static_cast<uint64_t>((sx + block_size - 1) / block_size), static_cast<uint64_t>(1));
 	const uint64_t grid_y = std::max(static_cast<uint64_t>((sy + block_size - 1) / block_size), static_cast<uint64_t>(1));
@@ -26,32 +75,715 @@ void parallelize_blocks(
 
 	const int real_threads = std::max(std::min(threads, grid_x * grid_y * grid_z), static_cast<uint64_t>(0));
 
+	const bool tracing = trace::enabled();
+	const bool sampling = perf::block_sampling_enabled();
+
+	auto run_block = [&process_block, tracing, sampling, trace_name](
+		const uint64_t xs, const uint64_t xe, 
+		const uint64_t ys, const uint64_t ye, 
+		const uint64_t zs, const uint64_t ze,
+		const int64_t enqueue_ns
+	) {
+		if (!tracing && !sampling) {
+			process_block(xs, xe, ys, ye, zs, ze);
+			return;
+		}
+
+		trace::Event event;
+		event.name = trace_name;
+		event.phase = "block";
+		event.enqueue_ns = enqueue_ns;
+		event.xs = xs; event.xe = xe;
+		event.ys = ys; event.ye = ye;
+		event.zs = zs; event.ze = ze;
+
+		std::unique_ptr<perf::CounterGroup> counters;
+		if (sampling) {
+			counters.reset(new perf::CounterGroup(/*inherit=*/false));
+			counters->start();
+		}
+
+		trace::annotate(nullptr);
+		event.start_ns = trace::tracer().now();
+		process_block(xs, xe, ys, ye, zs, ze);
+		event.end_ns = trace::tracer().now();
+		event.kernel = trace::current_kernel();
+
+		if (sampling) {
+			perf::BlockSample block;
+			block.sample = counters->stop();
+			block.name = trace_name;
+			block.kernel = event.kernel;
+			block.xs = xs; block.xe = xe;
+			block.ys = ys; block.ye = ye;
+			block.zs = zs; block.ze = ze;
+			perf::block_sampler().record(block);
+		}
+		if (tracing) {
+			trace::tracer().record(event);
+		}
+	};
+
+	// records a phase of the calling thread
+	auto record_phase = [tracing, trace_name](const char* phase, const int64_t start_ns) {
+		if (!tracing) {
+			return;
+		}
+		trace::Event event;
+		event.name = trace_name;
+		event.phase = phase;
+		event.start_ns = start_ns;
+		event.end_ns = trace::tracer().now();
+		trace::tracer().record(event);
+	};
+
+	// small volumes and per object cutouts are mostly single 
+	// threaded, don't pay for spawning and joining a pool
+	if (real_threads <= 1) {
+		for (uint64_t gz = 0; gz < grid_z; gz++) {
+			for (uint64_t gy = 0; gy < grid_y; gy++) {
+				for (uint64_t gx = 0; gx < grid_x; gx++) {
+					run_block(
+						std::max(offset, gx * block_size), std::min((gx+1) * block_size, sx - offset),
+						std::max(offset, gy * block_size), std::min((gy+1) * block_size, sy - offset),
+						std::max(offset, gz * block_size), std::min((gz+1) * block_size, sz - offset),
+						tracing ? trace::tracer().now() : -1
+					);
+				}
+			}
+		}
+		return;
+	}
+
+	int64_t phase_start = tracing ? trace::tracer().now() : 0;
 	ThreadPool pool(real_threads);
+	record_phase("pool_start", phase_start);
 
+	phase_start = tracing ? trace::tracer().now() : 0;
 	for (uint64_t gz = 0; gz < grid_z; gz++) {
 		for (uint64_t gy = 0; gy < grid_y; gy++) {
 			for (uint64_t gx = 0; gx < grid_x; gx++) {
+				const int64_t enqueue_ns = tracing ? trace::tracer().now() : -1;
 				pool.enqueue([=]() {
-					process_block(
+					run_block(
 						std::max(offset, gx * block_size), std::min((gx+1) * block_size, sx - offset),
 						std::max(offset, gy * block_size), std::min((gy+1) * block_size, sy - offset),
-						std::max(offset, gz * block_size), std::min((gz+1) * block_size, sz - offset)
+						std::max(offset, gz * block_size), std::min((gz+1) * block_size, sz - offset),
+						enqueue_ns
 					);
 				});
 			}
 		}
 	}
+	record_phase("enqueue", phase_start);
 
+	phase_start = tracing ? trace::tracer().now() : 0;
 	pool.join();
+	record_phase("join", phase_start);
+}
+
+template <typename LABEL>
+struct ContactHash {
+	size_t operator()(const std::pair<LABEL, LABEL> &p) const {
+		return std::hash<uint64_t>()(
+			(static_cast<uint64_t>(p.first) * 0x9E3779B97F4A7C15ULL) 
+			^ static_cast<uint64_t>(p.second)
+		);
+	}
+};
+
+// { (smaller label, larger label): count }
+template <typename LABEL>
+using ContactMap = std::unordered_map<std::pair<LABEL, LABEL>, uint64_t, ContactHash<LABEL>>;
+
+// Counts each pair of distinct nonzero labels in a 
+// stencil window once.
+template <typename LABEL>
+void record_contacts(
+	const std::vector<LABEL> &left, 
+	const std::vector<LABEL> &middle, 
+	const std::vector<LABEL> &right,
+	std::vector<LABEL> &window,
+	ContactMap<LABEL> &contacts
+) {
+	window.clear();
+	window.insert(window.end(), left.begin(), left.end());
+	window.insert(window.end(), middle.begin(), middle.end());
+	window.insert(window.end(), right.begin(), right.end());
+	std::sort(window.begin(), window.end());
+	window.erase(std::unique(window.begin(), window.end()), window.end());
+
+	for (uint64_t i = 0; i < window.size(); i++) {
+		for (uint64_t j = i + 1; j < window.size(); j++) {
+			contacts[std::make_pair(window[i], window[j])]++;
+		}
+	}
+}
+
+template <typename LABEL>
+void merge_contacts(
+	const ContactMap<LABEL> &local, ContactMap<LABEL> &contacts,
+	std::mutex &mtx
+) {
+	std::unique_lock<std::mutex> lock(mtx);
+	for (auto& [pair, ct] : local) {
+		contacts[pair] += ct;
+	}
+}
+
+struct LabelChange {
+	uint64_t gained = 0;
+	uint64_t lost = 0;
+	uint64_t before = 0;
+	uint64_t after = 0;
+};
+
+// { label: voxels gained, lost, and total before and after }
+template <typename LABEL>
+using ChangeStats = std::unordered_map<LABEL, LabelChange>;
+
+// Tallies how labels changed between labels and output over the
+// whole grid cell of the block starting at (xs, ys, zs). The cell 
+// rather than the block is used so that the border voxels kernels 
+// skip with an offset are still counted. Runs of equal (input, output)
+// pairs share a single map update. Call right after the block is 
+// processed so the data is still in cache.
+template <typename LABEL>
+void accumulate_changes(
+	const LABEL* labels, const LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const uint64_t xs, const uint64_t ys, const uint64_t zs,
+	ChangeStats<LABEL> &changes
+) {
+	const uint64_t block_size = block_size_for(sz);
+
+	const uint64_t bxs = (xs / block_size) * block_size;
+	const uint64_t bys = (ys / block_size) * block_size;
+	const uint64_t bzs = (zs / block_size) * block_size;
+	const uint64_t bxe = std::min(bxs + block_size, sx);
+	const uint64_t bye = std::min(bys + block_size, sy);
+	const uint64_t bze = std::min(bzs + block_size, sz);
+
+	for (uint64_t z = bzs; z < bze; z++) {
+		for (uint64_t y = bys; y < bye; y++) {
+			const uint64_t row = sx * (y + sy * z);
+			uint64_t x = bxs;
+			while (x < bxe) {
+				const LABEL before = labels[row + x];
+				const LABEL after = output[row + x];
+				uint64_t run_end = x + 1;
+				while (run_end < bxe 
+					&& labels[row + run_end] == before 
+					&& output[row + run_end] == after) {
+					run_end++;
+				}
+				const uint64_t run = run_end - x;
+
+				if (before != 0) {
+					LabelChange &change = changes[before];
+					change.before += run;
+					if (before != after) {
+						change.lost += run;
+					}
+				}
+				if (after != 0) {
+					LabelChange &change = changes[after];
+					change.after += run;
+					if (before != after) {
+						change.gained += run;
+					}
+				}
+				x = run_end;
+			}
+		}
+	}
+}
+
+template <typename LABEL>
+void merge_changes(
+	const ChangeStats<LABEL> &local, ChangeStats<LABEL> &changes,
+	std::mutex &mtx
+) {
+	std::unique_lock<std::mutex> lock(mtx);
+	for (auto& [label, change] : local) {
+		LabelChange &total = changes[label];
+		total.gained += change.gained;
+		total.lost += change.lost;
+		total.before += change.before;
+		total.after += change.after;
+	}
+}
+
+// Kernels a multilabel_dilate block can be routed to, chosen
+// from the labels within reach of the block.
+enum class BlockKernel {
+	SKIP = 0, // no labels within reach, output stays zero
+	COPY = 1, // one label and no background, fill the block
+	BINARY = 2, // one label and background, bit packed dilation
+	PALETTE = 3, // a few labels, mode from per column histograms
+	GENERAL = 4 // sort based mode
+};
+
+constexpr int NUM_BLOCK_KERNELS = 5;
+constexpr uint64_t PALETTE_MAX_LABELS = 8;
+
+inline const char* block_kernel_name(const BlockKernel kernel) {
+	static const char* names[NUM_BLOCK_KERNELS] = {
+		"skip", "copy", "binary", "palette", "general"
+	};
+	return names[static_cast<int>(kernel)];
+}
+
+// number of blocks each BlockKernel processed
+struct KernelStats {
+	uint64_t blocks[NUM_BLOCK_KERNELS] = {};
+};
+
+// How often the shortcuts of the stencil kernels fire. They are
+// only gathered when compiled with -DFASTMORPH_HOT_COUNTERS,
+// otherwise FASTMORPH_COUNT and BlockCounters compile to nothing.
+struct HotCounters {
+	uint64_t voxels_visited = 0; // voxels whose neighborhood was evaluated
+	uint64_t full_sorts = 0; // multilabel dilate: whole neighborhood sorted for the mode
+	uint64_t stencil_reuses = 0; // evaluations that kept columns of the previous voxel
+	uint64_t fast_path_hits = 0; // see each kernel
+	uint64_t skipped_voxels = 0; // voxels decided without evaluating a neighborhood
+	uint64_t blocks = 0;
+	uint64_t block_ns = 0; // summed over blocks and threads
+	uint64_t max_block_ns = 0;
+
+	void merge(const HotCounters &other) {
+		voxels_visited += other.voxels_visited;
+		full_sorts += other.full_sorts;
+		stencil_reuses += other.stencil_reuses;
+		fast_path_hits += other.fast_path_hits;
+		skipped_voxels += other.skipped_voxels;
+		blocks += other.blocks;
+		block_ns += other.block_ns;
+		max_block_ns = std::max(max_block_ns, other.max_block_ns);
+	}
+};
+
+#ifdef FASTMORPH_HOT_COUNTERS
+
+constexpr bool HOT_COUNTERS_ENABLED = true;
+
+#define FASTMORPH_COUNT(block_counters, field, n) ((block_counters).local.field += (n))
+
+// Counts one block and adds it to the op's totals
+// when the block finishes, so threads don't share
+// counters inside the loops.
+class BlockCounters {
+public:
+	HotCounters local;
+
+	BlockCounters(HotCounters* totals, std::mutex &mtx)
+		: totals(totals), mtx(mtx),
+		  start(std::chrono::steady_clock::now()) {}
+
+	~BlockCounters() {
+		if (!totals) {
+			return;
+		}
+		const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start
+		).count();
+		local.blocks = 1;
+		local.block_ns = ns;
+		local.max_block_ns = ns;
+
+		std::unique_lock<std::mutex> lock(mtx);
+		totals->merge(local);
+	}
+
+private:
+	HotCounters* totals;
+	std::mutex &mtx;
+	std::chrono::steady_clock::time_point start;
+};
+
+#else
+
+constexpr bool HOT_COUNTERS_ENABLED = false;
+
+#define FASTMORPH_COUNT(block_counters, field, n) ((void)(block_counters))
+
+class BlockCounters {
+public:
+	BlockCounters(HotCounters*, std::mutex&) {}
+};
+
+#endif
+
+// Weights of non-flat grey structuring elements. Integer images
+// take integer weights and saturate, floating point images take
+// weights of their own type.
+template <typename LABEL>
+using GreyWeight = typename std::conditional<
+	std::is_floating_point<LABEL>::value, LABEL, int64_t
+>::type;
+
+FASTMORPH_KERNELS_BEGIN
+
+// Summarizes the block plus its one voxel halo (clipped to the volume).
+// palette receives the distinct nonzero labels in ascending order. 
+// A sample of every 8th row in y and z is scanned first so dense 
+// tangles are sent to GENERAL after reading a few percent of the 
+// block. Otherwise every row is scanned (stopping once more than 
+// PALETTE_MAX_LABELS labels have been seen) since the specialized 
+// kernels need the exact set of labels.
+template <typename LABEL>
+BlockKernel classify_block(
+	const LABEL* labels,
+	const uint64_t sx, const uint64_t sy,
+	const uint64_t hxs, const uint64_t hxe,
+	const uint64_t hys, const uint64_t hye,
+	const uint64_t hzs, const uint64_t hze,
+	std::vector<LABEL> &palette
+) {
+	palette.clear();
+	bool has_background = false;
+
+	auto scan = [&](const uint64_t step) {
+		for (uint64_t z = hzs; z < hze; z += step) {
+			for (uint64_t y = hys; y < hye; y += step) {
+				const LABEL* row = labels + sx * (y + sy * z);
+				LABEL last = row[hxs];
+				for (uint64_t x = hxs; x < hxe; x++) {
+					const LABEL label = row[x];
+					if (label == last && x > hxs) {
+						continue;
+					}
+					last = label;
+					if (label == 0) {
+						has_background = true;
+					}
+					else if (std::find(palette.begin(), palette.end(), label) == palette.end()) {
+						if (palette.size() == PALETTE_MAX_LABELS) {
+							return false;
+						}
+						palette.push_back(label);
+					}
+				}
+			}
+		}
+		return true;
+	};
+
+	if (!scan(8) || !scan(1)) {
+		return BlockKernel::GENERAL;
+	}
+
+	std::sort(palette.begin(), palette.end());
+
+	if (palette.empty()) {
+		return BlockKernel::SKIP;
+	}
+	else if (palette.size() > 1) {
+		return BlockKernel::PALETTE;
+	}
+	return has_background ? BlockKernel::BINARY : BlockKernel::COPY;
+}
+
+// Dilation of a block holding a single label and background.
+// Each row of the halo is packed into bits and dilated along x
+// with shifts, then output rows are the OR of their 3x3 (or 3 
+// for 2D) neighboring rows. Any nonzero voxel in the window means
+// label, so background_only doesn't change the result.
+template <typename LABEL>
+void dilate_block_binary(
+	const LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy,
+	const uint64_t xs, const uint64_t xe,
+	const uint64_t ys, const uint64_t ye,
+	const uint64_t zs, const uint64_t ze,
+	const uint64_t hxs, const uint64_t hxe,
+	const uint64_t hys, const uint64_t hye,
+	const uint64_t hzs, const uint64_t hze,
+	const LABEL label
+) {
+	const uint64_t hw = hxe - hxs;
+	const uint64_t hh = hye - hys;
+	const uint64_t words = (hw + 63) / 64;
+
+	std::vector<uint64_t> rows(words * hh * (hze - hzs));
+	std::vector<uint64_t> packed(words);
+
+	for (uint64_t z = hzs; z < hze; z++) {
+		for (uint64_t y = hys; y < hye; y++) {
+			const LABEL* in = labels + sx * (y + sy * z) + hxs;
+			std::fill(packed.begin(), packed.end(), 0);
+			for (uint64_t i = 0; i < hw; i++) {
+				packed[i >> 6] |= static_cast<uint64_t>(in[i] != 0) << (i & 63);
+			}
+
+			uint64_t* row = rows.data() + words * ((y - hys) + hh * (z - hzs));
+			for (uint64_t w = 0; w < words; w++) {
+				row[w] = packed[w] | (packed[w] << 1) | (packed[w] >> 1)
+					| ((w > 0) ? (packed[w-1] >> 63) : 0)
+					| ((w + 1 < words) ? (packed[w+1] << 63) : 0);
+			}
+		}
+	}
+
+	std::vector<uint64_t> acc(words);
+	for (uint64_t z = zs; z < ze; z++) {
+		const uint64_t z0 = (z > hzs) ? z - 1 : z;
+		const uint64_t z1 = std::min(z + 2, hze);
+		for (uint64_t y = ys; y < ye; y++) {
+			const uint64_t y0 = (y > hys) ? y - 1 : y;
+			const uint64_t y1 = std::min(y + 2, hye);
+
+			std::fill(acc.begin(), acc.end(), 0);
+			for (uint64_t zz = z0; zz < z1; zz++) {
+				for (uint64_t yy = y0; yy < y1; yy++) {
+					const uint64_t* row = rows.data() + words * ((yy - hys) + hh * (zz - hzs));
+					for (uint64_t w = 0; w < words; w++) {
+						acc[w] |= row[w];
+					}
+				}
+			}
+
+			LABEL* out = output + sx * (y + sy * z);
+			for (uint64_t x = xs; x < xe; x++) {
+				const uint64_t bit = x - hxs;
+				out[x] = ((acc[bit >> 6] >> (bit & 63)) & 1) ? label : 0;
+			}
+		}
+	}
+}
+
+// Dilation of a block with at most PALETTE_MAX_LABELS labels.
+// Labels are replaced by their palette index and, for each output 
+// row, every column of the window gets a small histogram. The 
+// mode is the sum of three column histograms, ties go to the 
+// smaller label like the sort based kernel.
+template <typename LABEL>
+void dilate_block_palette(
+	const LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy,
+	const uint64_t xs, const uint64_t xe,
+	const uint64_t ys, const uint64_t ye,
+	const uint64_t zs, const uint64_t ze,
+	const uint64_t hxs, const uint64_t hxe,
+	const uint64_t hys, const uint64_t hye,
+	const uint64_t hzs, const uint64_t hze,
+	const std::vector<LABEL> &palette,
+	const bool background_only
+) {
+	const uint64_t hw = hxe - hxs;
+	const uint64_t hh = hye - hys;
+	const uint64_t bins = palette.size() + 1;
+
+	// 0 is background, i + 1 is palette[i]
+	std::vector<uint8_t> index(hw * hh * (hze - hzs));
+	for (uint64_t z = hzs; z < hze; z++) {
+		for (uint64_t y = hys; y < hye; y++) {
+			const LABEL* in = labels + sx * (y + sy * z) + hxs;
+			uint8_t* out = index.data() + hw * ((y - hys) + hh * (z - hzs));
+			LABEL last = 0;
+			uint8_t last_index = 0;
+			for (uint64_t i = 0; i < hw; i++) {
+				if (in[i] != last) {
+					last = in[i];
+					last_index = (last == 0) 
+						? 0 
+						: static_cast<uint8_t>(
+							std::lower_bound(palette.begin(), palette.end(), last) - palette.begin() + 1
+						);
+				}
+				out[i] = last_index;
+			}
+		}
+	}
+
+	auto mode_of = [&](const uint8_t* left, const uint8_t* middle, const uint8_t* right) {
+		uint64_t best = 0;
+		int best_ct = 0;
+		for (uint64_t k = 1; k < bins; k++) {
+			const int ct = left[k] + middle[k] + right[k];
+			if (ct > best_ct) {
+				best_ct = ct;
+				best = k;
+			}
+		}
+		return (best == 0) ? static_cast<LABEL>(0) : palette[best - 1];
+	};
+
+	std::vector<uint8_t> columns(hw * bins);
+	const std::vector<uint8_t> empty_column(bins);
+	std::vector<uint8_t> counts(bins);
+
+	// bin shared by every voxel of a column or MIXED
+	constexpr uint8_t MIXED = std::numeric_limits<uint8_t>::max();
+	std::vector<uint8_t> uniform(hw);
+
+	for (uint64_t z = zs; z < ze; z++) {
+		const uint64_t z0 = (z > hzs) ? z - 1 : z;
+		const uint64_t z1 = std::min(z + 2, hze);
+		for (uint64_t y = ys; y < ye; y++) {
+			const uint64_t y0 = (y > hys) ? y - 1 : y;
+			const uint64_t y1 = std::min(y + 2, hye);
+
+			const LABEL* in = labels + sx * (y + sy * z);
+			LABEL* out = output + sx * (y + sy * z);
+
+			if (background_only) {
+				uint64_t num_background = 0;
+				for (uint64_t x = xs; x < xe; x++) {
+					num_background += (in[x] == 0);
+				}
+				if (num_background == 0) {
+					std::copy(in + xs, in + xe, out + xs);
+					continue;
+				}
+				// a few holes are cheaper to evaluate one at a time
+				// than to histogram the whole row
+				else if (num_background * 3 < xe - xs) {
+					for (uint64_t x = xs; x < xe; x++) {
+						if (in[x] != 0) {
+							out[x] = in[x];
+							continue;
+						}
+						const uint64_t i = x - hxs;
+						const uint64_t i0 = (i > 0) ? i - 1 : i;
+						const uint64_t i1 = std::min(i + 2, hw);
+						std::fill(counts.begin(), counts.end(), 0);
+						for (uint64_t zz = z0; zz < z1; zz++) {
+							for (uint64_t yy = y0; yy < y1; yy++) {
+								const uint8_t* row = index.data() + hw * ((yy - hys) + hh * (zz - hzs));
+								for (uint64_t ii = i0; ii < i1; ii++) {
+									counts[row[ii]]++;
+								}
+							}
+						}
+						out[x] = mode_of(empty_column.data(), counts.data(), empty_column.data());
+					}
+					continue;
+				}
+			}
+
+			std::fill(columns.begin(), columns.end(), 0);
+			const uint8_t* first = index.data() + hw * ((y0 - hys) + hh * (z0 - hzs));
+			std::copy(first, first + hw, uniform.begin());
+			for (uint64_t zz = z0; zz < z1; zz++) {
+				for (uint64_t yy = y0; yy < y1; yy++) {
+					const uint8_t* row = index.data() + hw * ((yy - hys) + hh * (zz - hzs));
+					for (uint64_t i = 0; i < hw; i++) {
+						columns[i * bins + row[i]]++;
+						uniform[i] = (uniform[i] == row[i]) ? uniform[i] : MIXED;
+					}
+				}
+			}
+
+			for (uint64_t x = xs; x < xe; x++) {
+				if (background_only && in[x] != 0) {
+					out[x] = in[x];
+					continue;
+				}
+
+				const uint64_t i = x - hxs;
+				const uint8_t bin = uniform[i];
+				if (bin != MIXED
+					&& (i == 0 || uniform[i - 1] == bin)
+					&& (i + 1 == hw || uniform[i + 1] == bin)) {
+					out[x] = (bin == 0) ? 0 : palette[bin - 1];
+					continue;
+				}
+
+				out[x] = mode_of(
+					(i > 0) ? &columns[(i - 1) * bins] : empty_column.data(),
+					&columns[i * bins],
+					(i + 1 < hw) ? &columns[(i + 1) * bins] : empty_column.data()
+				);
+			}
+		}
+	}
 }
 
+// Classifies a multilabel_dilate block and runs the specialized
+// kernel for it. Returns the kernel that was selected, GENERAL
+// means the caller still has to process the block. 2D images 
+// pass sz = 1.
+template <typename LABEL>
+BlockKernel dilate_block_specialized(
+	const LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const uint64_t xs, const uint64_t xe,
+	const uint64_t ys, const uint64_t ye,
+	const uint64_t zs, const uint64_t ze,
+	const bool background_only, const bool allow_palette
+) {
+	const uint64_t hxs = (xs > 0) ? xs - 1 : 0;
+	const uint64_t hys = (ys > 0) ? ys - 1 : 0;
+	const uint64_t hzs = (zs > 0) ? zs - 1 : 0;
+	const uint64_t hxe = std::min(xe + 1, sx);
+	const uint64_t hye = std::min(ye + 1, sy);
+	const uint64_t hze = std::min(ze + 1, sz);
+
+	std::vector<LABEL> palette;
+	palette.reserve(PALETTE_MAX_LABELS);
+	BlockKernel kernel = classify_block<LABEL>(
+		labels, sx, sy, hxs, hxe, hys, hye, hzs, hze, palette
+	);
+
+	if (kernel == BlockKernel::COPY) {
+		for (uint64_t z = zs; z < ze; z++) {
+			for (uint64_t y = ys; y < ye; y++) {
+				LABEL* out = output + sx * (y + sy * z);
+				std::fill(out + xs, out + xe, palette[0]);
+			}
+		}
+	}
+	else if (kernel == BlockKernel::BINARY) {
+		dilate_block_binary<LABEL>(
+			labels, output, sx, sy, 
+			xs, xe, ys, ye, zs, ze,
+			hxs, hxe, hys, hye, hzs, hze,
+			palette[0]
+		);
+	}
+	else if (kernel == BlockKernel::PALETTE && allow_palette) {
+		dilate_block_palette<LABEL>(
+			labels, output, sx, sy, 
+			xs, xe, ys, ye, zs, ze,
+			hxs, hxe, hys, hye, hzs, hze,
+			palette, background_only
+		);
+	}
+	else if (kernel == BlockKernel::PALETTE) {
+		kernel = BlockKernel::GENERAL;
+	}
+
+	return kernel;
+}
 
+// contacts (optional): for every voxel evaluated (background 
+// voxels only when background_only), each pair of distinct 
+// labels that appears in its 3x3x3 window is counted once.
+// This is a region adjacency graph of the labels produced
+// in the same pass. Tracking disables the shortcuts 
+// that skip evaluating a voxel.
+// changes (optional): per label voxels gained and lost.
+// stats (optional): how many blocks each BlockKernel handled.
+// Blocks with few labels in reach are routed to the specialized
+// kernels of dilate_block_specialized, the rest use the sort 
+// based kernel below.
 template <typename LABEL>
 void multilabel_dilate(
 	LABEL* labels, LABEL* output,
 	const uint64_t sx, const uint64_t sy, const uint64_t sz,
-	const bool background_only, const uint64_t threads
+	const bool background_only, const uint64_t threads,
+	ContactMap<LABEL>* contacts = nullptr,
+	ChangeStats<LABEL>* changes = nullptr,
+	KernelStats* stats = nullptr,
+	HotCounters* counters = nullptr
 ) {
+	FASTMORPH_DISPATCH_TO(LABEL, multilabel_dilate_3d, labels, output, sx, sy, sz, background_only, threads, contacts, changes, stats, counters);
+	std::mutex contacts_mtx;
+	std::mutex changes_mtx;
+	std::mutex stats_mtx;
+	std::mutex counters_mtx;
 
 	// assume a 3x3x3 stencil with all voxels on
 	const uint64_t sxy = sx * sy;
@@ -121,10 +853,11 @@ void multilabel_dilate(
 		}
 	};
 
-	auto process_block = [&](
+	auto general_block = [&](
 		const uint64_t xs, const uint64_t xe, 
 		const uint64_t ys, const uint64_t ye, 
-		const uint64_t zs, const uint64_t ze
+		const uint64_t zs, const uint64_t ze,
+		BlockCounters &hot
 	){
 		// 3x3 sets of labels, as index advances 
 		// right is leading edge, middle becomes left, 
@@ -149,6 +882,12 @@ void multilabel_dilate(
 		std::vector<LABEL> neighbors;
 		neighbors.reserve(27);
 
+		ContactMap<LABEL> local_contacts;
+		std::vector<LABEL> window;
+		if (contacts) {
+			window.reserve(27);
+		}
+
 		for (uint64_t z = zs; z < ze; z++) {
 			for (uint64_t y = ys; y < ye; y++) {
 				stale_stencil = 3;
@@ -158,10 +897,13 @@ void multilabel_dilate(
 					if (background_only && labels[loc] != 0) {
 						output[loc] = labels[loc];
 						stale_stencil++;
+						FASTMORPH_COUNT(hot, skipped_voxels, 1);
 						continue;
 					}
 
+					FASTMORPH_COUNT(hot, stencil_reuses, (stale_stencil == 1 || stale_stencil == 2));
 					if (z > zs && output[loc-sxy] == 0) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
 						if (stale_stencil == 1) {
 							tmp = std::move(left);
 							left = std::move(middle);
@@ -196,6 +938,7 @@ void multilabel_dilate(
 						}
 					}
 
+					FASTMORPH_COUNT(hot, voxels_visited, 1);
 					stale_stencil = 0;
 
 					if (left.size() + middle.size() + right.size() == 0) {
@@ -203,6 +946,10 @@ void multilabel_dilate(
 						continue;
 					} 
 
+					if (contacts) {
+						record_contacts(left, middle, right, window, local_contacts);
+					}
+
 					std::sort(middle.begin(), middle.end());
 					std::sort(right.begin(), right.end());
 
@@ -211,8 +958,10 @@ void multilabel_dilate(
 						&& middle[0] == middle[middle.size() - 1]
 						&& right[0] == middle[0]) {
 
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
 						output[loc] = right[0];
-						if (x < sx - 1) {
+						if (x < sx - 1 && !contacts) {
+							FASTMORPH_COUNT(hot, skipped_voxels, 1);
 							output[loc+1] = right[0];
 							stale_stencil = 2;
 							x++;
@@ -230,6 +979,7 @@ void multilabel_dilate(
 					neighbors.insert(neighbors.end(), right.begin(), right.end());
 
 					std::sort(neighbors.begin(), neighbors.end());
+					FASTMORPH_COUNT(hot, full_sorts, 1);
 
 					int size = neighbors.size();
 
@@ -238,7 +988,8 @@ void multilabel_dilate(
 					// right so we can skip some calculation.
 					if (neighbors[0] == neighbors[size - 1]) {
 						output[loc] = neighbors[0];
-						if (size >= 23 && x < sx - 1) {
+						if (size >= 23 && x < sx - 1 && !contacts) {
+							FASTMORPH_COUNT(hot, skipped_voxels, 1);
 							output[loc+1] = neighbors[0];
 							stale_stencil = 2;
 							x++;
@@ -275,7 +1026,9 @@ void multilabel_dilate(
 
 					output[loc] = mode_label;
 
-					if (ct >= 23 && x < sx - 1) {
+					if (ct >= 23 && x < sx - 1 && !contacts 
+						&& !(background_only && labels[loc+1] != 0)) {
+						FASTMORPH_COUNT(hot, skipped_voxels, 1);
 						output[loc+1] = mode_label;
 						stale_stencil = 2;
 						x++;
@@ -286,6 +1039,43 @@ void multilabel_dilate(
 				}
 			}
 		}
+
+		if (contacts) {
+			merge_contacts(local_contacts, *contacts, contacts_mtx);
+		}
+		if (changes) {
+			ChangeStats<LABEL> local_changes;
+			accumulate_changes<LABEL>(labels, output, sx, sy, sz, xs, ys, zs, local_changes);
+			merge_changes(local_changes, *changes, changes_mtx);
+		}
+	};
+
+	auto process_block = [&](
+		const uint64_t xs, const uint64_t xe, 
+		const uint64_t ys, const uint64_t ye, 
+		const uint64_t zs, const uint64_t ze
+	){
+		BlockCounters hot(counters, counters_mtx);
+
+		const BlockKernel kernel = dilate_block_specialized<LABEL>(
+			labels, output, sx, sy, sz, 
+			xs, xe, ys, ye, zs, ze,
+			background_only, /*allow_palette=*/!contacts
+		);
+		trace::annotate(block_kernel_name(kernel));
+		if (stats) {
+			std::unique_lock<std::mutex> lock(stats_mtx);
+			stats->blocks[static_cast<int>(kernel)]++;
+		}
+
+		if (kernel == BlockKernel::GENERAL) {
+			general_block(xs, xe, ys, ye, zs, ze, hot);
+		}
+		else if (changes) {
+			ChangeStats<LABEL> local_changes;
+			accumulate_changes<LABEL>(labels, output, sx, sy, sz, xs, ys, zs, local_changes);
+			merge_changes(local_changes, *changes, changes_mtx);
+		}
 	};
 
 	parallelize_blocks(
@@ -293,7 +1083,7 @@ void multilabel_dilate(
 			const uint64_t,const uint64_t,const uint64_t,
 			const uint64_t,const uint64_t,const uint64_t
 		)>(process_block), 
-		sx, sy, sz, threads, /*offset=*/0
+		sx, sy, sz, threads, /*offset=*/0, "multilabel_dilate"
 	);
 }
 
@@ -301,8 +1091,17 @@ template <typename LABEL>
 void multilabel_dilate(
 	LABEL* labels, LABEL* output,
 	const uint64_t sx, const uint64_t sy,
-	const bool background_only, const uint64_t threads
+	const bool background_only, const uint64_t threads,
+	ContactMap<LABEL>* contacts = nullptr,
+	ChangeStats<LABEL>* changes = nullptr,
+	KernelStats* stats = nullptr,
+	HotCounters* counters = nullptr
 ) {
+	FASTMORPH_DISPATCH_TO(LABEL, multilabel_dilate_2d, labels, output, sx, sy, background_only, threads, contacts, changes, stats, counters);
+	std::mutex contacts_mtx;
+	std::mutex changes_mtx;
+	std::mutex stats_mtx;
+	std::mutex counters_mtx;
 
 	// assume a 3x3 stencil with all voxels on
 	auto fill_partial_stencil_fn = [&](
@@ -328,10 +1127,11 @@ void multilabel_dilate(
 		}
 	};
 
-	auto process_block = [&](
+	auto general_block = [&](
 		const uint64_t xs, const uint64_t xe, 
 		const uint64_t ys, const uint64_t ye, 
-		const uint64_t zs, const uint64_t ze
+		const uint64_t zs, const uint64_t ze,
+		BlockCounters &hot
 	){
 		// sets of labels representing a column of 3, as index advances 
 		// right is leading edge, middle becomes left, 
@@ -355,6 +1155,12 @@ void multilabel_dilate(
 		std::vector<LABEL> neighbors;
 		neighbors.reserve(9);
 
+		ContactMap<LABEL> local_contacts;
+		std::vector<LABEL> window;
+		if (contacts) {
+			window.reserve(9);
+		}
+
 		for (uint64_t y = ys; y < ye; y++) {
 			stale_stencil = 3;
 			for (uint64_t x = xs; x < xe; x++) {
@@ -363,9 +1169,11 @@ void multilabel_dilate(
 				if (background_only && labels[loc] != 0) {
 					output[loc] = labels[loc];
 					stale_stencil++;
+					FASTMORPH_COUNT(hot, skipped_voxels, 1);
 					continue;
 				}
 
+				FASTMORPH_COUNT(hot, stencil_reuses, (stale_stencil == 1 || stale_stencil == 2));
 				if (stale_stencil == 1) {
 					advance_stencil(x-1,y);
 				}
@@ -380,6 +1188,7 @@ void multilabel_dilate(
 					fill_partial_stencil_fn(x+1,y,right);
 				}
 
+				FASTMORPH_COUNT(hot, voxels_visited, 1);
 				stale_stencil = 0;
 
 				if (left.size() + middle.size() + right.size() == 0) {
@@ -387,6 +1196,10 @@ void multilabel_dilate(
 					continue;
 				} 
 
+				if (contacts) {
+					record_contacts(left, middle, right, window, local_contacts);
+				}
+
 				std::sort(middle.begin(), middle.end());
 				std::sort(right.begin(), right.end());
 
@@ -395,8 +1208,10 @@ void multilabel_dilate(
 					&& middle[0] == middle[middle.size() - 1]
 					&& right[0] == middle[0]) {
 
+					FASTMORPH_COUNT(hot, fast_path_hits, 1);
 					output[loc] = right[0];
-					if (x < sx - 1) {
+					if (x < sx - 1 && !contacts) {
+						FASTMORPH_COUNT(hot, skipped_voxels, 1);
 						output[loc+1] = right[0];
 						stale_stencil = 2;
 						x++;
@@ -414,6 +1229,7 @@ void multilabel_dilate(
 				neighbors.insert(neighbors.end(), right.begin(), right.end());
 
 				std::sort(neighbors.begin(), neighbors.end());
+				FASTMORPH_COUNT(hot, full_sorts, 1);
 
 				int size = neighbors.size();
 
@@ -443,7 +1259,8 @@ void multilabel_dilate(
 
 				output[loc] = mode_label;
 
-				if (ct >= 8 && x < sx - 1) {
+				if (ct >= 8 && x < sx - 1 && !contacts) {
+					FASTMORPH_COUNT(hot, skipped_voxels, 1);
 					output[loc+1] = mode_label;
 					stale_stencil = 2;
 					x++;
@@ -453,6 +1270,43 @@ void multilabel_dilate(
 				stale_stencil = 1;
 			}
 		}
+
+		if (contacts) {
+			merge_contacts(local_contacts, *contacts, contacts_mtx);
+		}
+		if (changes) {
+			ChangeStats<LABEL> local_changes;
+			accumulate_changes<LABEL>(labels, output, sx, sy, /*sz=*/1, xs, ys, /*zs=*/0, local_changes);
+			merge_changes(local_changes, *changes, changes_mtx);
+		}
+	};
+
+	auto process_block = [&](
+		const uint64_t xs, const uint64_t xe, 
+		const uint64_t ys, const uint64_t ye, 
+		const uint64_t zs, const uint64_t ze
+	){
+		BlockCounters hot(counters, counters_mtx);
+
+		const BlockKernel kernel = dilate_block_specialized<LABEL>(
+			labels, output, sx, sy, /*sz=*/1, 
+			xs, xe, ys, ye, zs, ze,
+			background_only, /*allow_palette=*/!contacts
+		);
+		trace::annotate(block_kernel_name(kernel));
+		if (stats) {
+			std::unique_lock<std::mutex> lock(stats_mtx);
+			stats->blocks[static_cast<int>(kernel)]++;
+		}
+
+		if (kernel == BlockKernel::GENERAL) {
+			general_block(xs, xe, ys, ye, zs, ze, hot);
+		}
+		else if (changes) {
+			ChangeStats<LABEL> local_changes;
+			accumulate_changes<LABEL>(labels, output, sx, sy, /*sz=*/1, xs, ys, /*zs=*/0, local_changes);
+			merge_changes(local_changes, *changes, changes_mtx);
+		}
 	};
 
 	parallelize_blocks(
@@ -460,7 +1314,7 @@ void multilabel_dilate(
 			const uint64_t,const uint64_t,const uint64_t,
 			const uint64_t,const uint64_t,const uint64_t
 		)>(process_block), 
-		sx, sy, /*sz=*/1, threads, /*offset=*/0
+		sx, sy, /*sz=*/1, threads, /*offset=*/0, "multilabel_dilate"
 	);
 }
 
@@ -468,8 +1322,13 @@ template <typename LABEL>
 void multilabel_erode(
 	LABEL* labels, LABEL* output,
 	const uint64_t sx, const uint64_t sy, const uint64_t sz,
-	const uint64_t threads
+	const uint64_t threads,
+	ChangeStats<LABEL>* changes = nullptr,
+	HotCounters* counters = nullptr
 ) {
+	FASTMORPH_DISPATCH_TO(LABEL, multilabel_erode_3d, labels, output, sx, sy, sz, threads, changes, counters);
+	std::mutex changes_mtx;
+	std::mutex counters_mtx;
 
 	// assume a 3x3x3 stencil with all voxels on
 	const uint64_t sxy = sx * sy;
@@ -525,6 +1384,8 @@ void multilabel_erode(
 		const uint64_t ys, const uint64_t ye, 
 		const uint64_t zs, const uint64_t ze
 	){
+		BlockCounters hot(counters, counters_mtx);
+
 		LABEL pure_left = 0;
 		LABEL pure_middle = 0;
 		LABEL pure_right = 0;
@@ -532,7 +1393,9 @@ void multilabel_erode(
 		int stale_stencil = 3;
 
 #define FILL_STENCIL(is_pure_fn) \
+	FASTMORPH_COUNT(hot, voxels_visited, 1);\
 	if (stale_stencil == 1) {\
+		FASTMORPH_COUNT(hot, stencil_reuses, 1);\
 		pure_left = pure_middle;\
 		pure_middle = pure_right;\
 		pure_right = is_pure_fn(x+1,y,z);\
@@ -541,22 +1404,26 @@ void multilabel_erode(
 		pure_right = is_pure_fn(x+1,y,z);\
 		if (!pure_right) {\
 			x += 2;\
+			FASTMORPH_COUNT(hot, skipped_voxels, 2);\
 			stale_stencil = 3;\
 			continue;\
 		}\
 		pure_middle = is_pure_fn(x,y,z);\
 		if (!pure_middle) {\
 			x++;\
+			FASTMORPH_COUNT(hot, skipped_voxels, 1);\
 			stale_stencil = 2;\
 			continue;\
 		}\
 		pure_left = is_pure_fn(x-1,y,z);\
 	}\
 	else if (stale_stencil == 2) {\
+		FASTMORPH_COUNT(hot, stencil_reuses, 1);\
 		pure_left = pure_right;\
 		pure_right = is_pure_fn(x+1,y,z);\
 		if (!pure_right) {\
 			x += 2;\
+			FASTMORPH_COUNT(hot, skipped_voxels, 2);\
 			stale_stencil = 3;\
 			continue;\
 		}\
@@ -570,15 +1437,18 @@ void multilabel_erode(
 					uint64_t loc = x + sx * (y + sy * z);
 
 					if (labels[loc] == 0) {
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
 						x++;
 						stale_stencil += 2;
 						continue;
 					}
 
 					if (z > zs && output[loc-sxy] == labels[loc]) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
 						FILL_STENCIL(is_pure_fast_z)
 					}
 					else if (y > ys && output[loc-sx] == labels[loc]) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
 						FILL_STENCIL(is_pure_fast_y)
 					}
 					else {
@@ -588,11 +1458,13 @@ void multilabel_erode(
 					stale_stencil = 0;
 
 					if (!pure_right) {
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
 						x += 2;
 						stale_stencil = 3;
 						continue;
 					}
 					else if (!pure_middle) {
+						FASTMORPH_COUNT(hot, skipped_voxels, 1);
 						x++;
 						stale_stencil = 2;
 						continue;
@@ -605,6 +1477,12 @@ void multilabel_erode(
 				}
 			}
 		}
+
+		if (changes) {
+			ChangeStats<LABEL> local_changes;
+			accumulate_changes<LABEL>(labels, output, sx, sy, sz, xs, ys, zs, local_changes);
+			merge_changes(local_changes, *changes, changes_mtx);
+		}
 	};
 
 #undef FILL_STENCIL
@@ -614,7 +1492,7 @@ void multilabel_erode(
 			const uint64_t,const uint64_t,const uint64_t,
 			const uint64_t,const uint64_t,const uint64_t
 		)>(process_block), 
-		sx, sy, sz, threads, /*offset=*/1
+		sx, sy, sz, threads, /*offset=*/1, "multilabel_erode"
 	);
 }
 
@@ -622,8 +1500,13 @@ template <typename LABEL>
 void multilabel_erode(
 	LABEL* labels, LABEL* output,
 	const uint64_t sx, const uint64_t sy,
-	const uint64_t threads
+	const uint64_t threads,
+	ChangeStats<LABEL>* changes = nullptr,
+	HotCounters* counters = nullptr
 ) {
+	FASTMORPH_DISPATCH_TO(LABEL, multilabel_erode_2d, labels, output, sx, sy, threads, changes, counters);
+	std::mutex changes_mtx;
+	std::mutex counters_mtx;
 
 	// assume a 3x3 stencil with all voxels on
 
@@ -643,6 +1526,8 @@ void multilabel_erode(
 		const uint64_t ys, const uint64_t ye, 
 		const uint64_t zs, const uint64_t ze
 	){
+		BlockCounters hot(counters, counters_mtx);
+
 		LABEL pure_left = 0;
 		LABEL pure_middle = 0;
 		LABEL pure_right = 0;
@@ -655,12 +1540,15 @@ void multilabel_erode(
 				uint64_t loc = x + sx * y;
 
 				if (labels[loc] == 0) {
+					FASTMORPH_COUNT(hot, skipped_voxels, 2);
 					x++;
 					stale_stencil += 2;
 					continue;
 				}
 
+				FASTMORPH_COUNT(hot, voxels_visited, 1);
 				if (stale_stencil == 1) {
+					FASTMORPH_COUNT(hot, stencil_reuses, 1);
 					pure_left = pure_middle;
 					pure_middle = pure_right;
 					pure_right = is_pure(x+1,y);
@@ -668,12 +1556,14 @@ void multilabel_erode(
 				else if (stale_stencil >= 3) {
 					pure_right = is_pure(x+1,y);
 					if (!pure_right) {
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
 						x += 2;
 						stale_stencil = 3;
 						continue;
 					}
 					pure_middle = is_pure(x,y);
 					if (!pure_middle) {
+						FASTMORPH_COUNT(hot, skipped_voxels, 1);
 						x++;
 						stale_stencil = 2;
 						continue;
@@ -681,9 +1571,11 @@ void multilabel_erode(
 					pure_left = is_pure(x-1,y);
 				}
 				else if (stale_stencil == 2) {
+					FASTMORPH_COUNT(hot, stencil_reuses, 1);
 					pure_left = pure_right;
 					pure_right = is_pure(x+1,y);
 					if (!pure_right) {
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
 						x += 2;
 						stale_stencil = 3;
 						continue;
@@ -694,11 +1586,13 @@ void multilabel_erode(
 				stale_stencil = 0;
 
 				if (!pure_right) {
+					FASTMORPH_COUNT(hot, skipped_voxels, 2);
 					x += 2;
 					stale_stencil = 3;
 					continue;
 				}
 				else if (!pure_middle) {
+					FASTMORPH_COUNT(hot, skipped_voxels, 1);
 					x++;
 					stale_stencil = 2;
 					continue;
@@ -710,23 +1604,94 @@ void multilabel_erode(
 				stale_stencil = 1;
 			}
 		}
-	};
+
+		if (changes) {
+			ChangeStats<LABEL> local_changes;
+			accumulate_changes<LABEL>(labels, output, sx, sy, /*sz=*/1, xs, ys, /*zs=*/0, local_changes);
+			merge_changes(local_changes, *changes, changes_mtx);
+		}
+	};
 
 	parallelize_blocks(
 		std::function<void(
 			const uint64_t,const uint64_t,const uint64_t,
 			const uint64_t,const uint64_t,const uint64_t
 		)>(process_block), 
-		sx, sy, /*sz=*/1, threads, /*offset=*/1
+		sx, sy, /*sz=*/1, threads, /*offset=*/1, "multilabel_erode"
 	);
 }
 
+// Identities of max and min in grey morphology. Floating point
+// images use -inf and +inf so that every value takes part.
 template <typename LABEL>
-void grey_dilate(
+constexpr LABEL grey_lowest() {
+	if constexpr (std::numeric_limits<LABEL>::has_infinity) {
+		return -std::numeric_limits<LABEL>::infinity();
+	}
+	else {
+		return std::numeric_limits<LABEL>::min();
+	}
+}
+
+template <typename LABEL>
+constexpr LABEL grey_highest() {
+	if constexpr (std::numeric_limits<LABEL>::has_infinity) {
+		return std::numeric_limits<LABEL>::infinity();
+	}
+	else {
+		return std::numeric_limits<LABEL>::max();
+	}
+}
+
+// max and min that return NaN if either side is NaN, so NaN
+// spreads to every voxel whose neighborhood contains it (like
+// np.maximum). Written as selects so loops using them vectorize.
+template <typename LABEL>
+inline LABEL grey_max(const LABEL a, const LABEL b) {
+	if constexpr (std::is_floating_point<LABEL>::value) {
+		return (a < b || b != b) ? b : a;
+	}
+	else {
+		return std::max(a, b);
+	}
+}
+
+template <typename LABEL>
+inline LABEL grey_min(const LABEL a, const LABEL b) {
+	if constexpr (std::is_floating_point<LABEL>::value) {
+		return (b < a || b != b) ? b : a;
+	}
+	else {
+		return std::min(a, b);
+	}
+}
+
+// flat 3x3x3 max (IS_MAX) or min, defined below grey_weighted_stencil
+template <typename LABEL, bool IS_MAX>
+void grey_flat_stencil(
 	LABEL* labels, LABEL* output,
 	const uint64_t sx, const uint64_t sy, const uint64_t sz,
 	const uint64_t threads
+);
+
+// Floating point images go to grey_flat_stencil, whose row passes
+// vectorize. The run skipping below only pays off in images that
+// saturate at the maximum, which float maps rarely do. Hot counters
+// aren't collected for them.
+template <typename LABEL>
+void grey_dilate(
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const uint64_t threads,
+	HotCounters* counters = nullptr
 ) {
+	FASTMORPH_DISPATCH_TO(LABEL, grey_dilate_3d, labels, output, sx, sy, sz, threads, counters);
+	if constexpr (std::is_floating_point<LABEL>::value) {
+		grey_flat_stencil<LABEL, true>(labels, output, sx, sy, sz, threads);
+		return;
+	}
+	std::mutex counters_mtx;
+
 	// assume a 3x3x3 stencil with all voxels on
 	const uint64_t sxy = sx * sy;
 	constexpr LABEL MAX_LABEL = std::numeric_limits<LABEL>::max();
@@ -777,6 +1742,14 @@ void grey_dilate(
 		const uint64_t ys, const uint64_t ye, 
 		const uint64_t zs, const uint64_t ze
 	){
+		BlockCounters hot(counters, counters_mtx);
+
+		// the voxels skipped after finding a saturated 
+		// column have it in their stencil
+		auto saturate = [&](const uint64_t loc, const uint64_t x, const uint64_t n) {
+			std::fill(output + loc, output + loc + (std::min(x + n, xe) - x), MAX_LABEL);
+		};
+
 		LABEL max_left = MAX_LABEL;
 		LABEL max_middle = MAX_LABEL;
 		LABEL max_right = MAX_LABEL;
@@ -790,12 +1763,17 @@ void grey_dilate(
 					uint64_t loc = x + sx * (y + sy * z);
 
 					if (labels[loc] == MAX_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
+						saturate(loc, x, 2);
 						x++;
 						stale_stencil += 2;
 						continue;
 					}
 
+					FASTMORPH_COUNT(hot, voxels_visited, 1);
 					if (stale_stencil == 1) {
+						FASTMORPH_COUNT(hot, stencil_reuses, 1);
 						max_left = max_middle;
 						max_middle = max_right;
 						max_right = get_max(x+1,y,z);
@@ -803,12 +1781,18 @@ void grey_dilate(
 					else if (stale_stencil >= 3) {
 						max_right = get_max(x+1,y,z);
 						if (max_right == MAX_LABEL) {
+							FASTMORPH_COUNT(hot, fast_path_hits, 1);
+							FASTMORPH_COUNT(hot, skipped_voxels, 2);
+							saturate(loc, x, 3);
 							x += 2;
 							stale_stencil = 3;
 							continue;
 						}
 						max_middle = get_max(x,y,z);
 						if (max_middle == MAX_LABEL) {
+							FASTMORPH_COUNT(hot, fast_path_hits, 1);
+							FASTMORPH_COUNT(hot, skipped_voxels, 1);
+							saturate(loc, x, 2);
 							x++;
 							stale_stencil = 2;
 							continue;
@@ -816,9 +1800,13 @@ void grey_dilate(
 						max_left = get_max(x-1,y,z);
 					}
 					else if (stale_stencil == 2) {
+						FASTMORPH_COUNT(hot, stencil_reuses, 1);
 						max_left = max_right;
 						max_right = get_max(x+1,y,z);
 						if (max_right == MAX_LABEL) {
+							FASTMORPH_COUNT(hot, fast_path_hits, 1);
+							FASTMORPH_COUNT(hot, skipped_voxels, 2);
+							saturate(loc, x, 3);
 							x += 2;
 							stale_stencil = 3;
 							continue;
@@ -829,11 +1817,17 @@ void grey_dilate(
 					stale_stencil = 0;
 
 					if (max_right == MAX_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
+						saturate(loc, x, 3);
 						x += 2;
 						stale_stencil = 3;
 						continue;
 					}
 					else if (max_middle == MAX_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 1);
+						saturate(loc, x, 2);
 						x++;
 						stale_stencil = 2;
 						continue;
@@ -855,7 +1849,7 @@ void grey_dilate(
 			const uint64_t,const uint64_t,const uint64_t,
 			const uint64_t,const uint64_t,const uint64_t
 		)>(process_block), 
-		sx, sy, sz, threads, /*offset=*/0
+		sx, sy, sz, threads, /*offset=*/0, "grey_dilate"
 	);
 }
 
@@ -863,8 +1857,16 @@ template <typename LABEL>
 void grey_dilate(
 	LABEL* labels, LABEL* output,
 	const uint64_t sx, const uint64_t sy,
-	const uint64_t threads
+	const uint64_t threads,
+	HotCounters* counters = nullptr
 ) {
+	FASTMORPH_DISPATCH_TO(LABEL, grey_dilate_2d, labels, output, sx, sy, threads, counters);
+	if constexpr (std::is_floating_point<LABEL>::value) {
+		grey_flat_stencil<LABEL, true>(labels, output, sx, sy, /*sz=*/1, threads);
+		return;
+	}
+	std::mutex counters_mtx;
+
 	// assume a 3x3 stencil with all voxels on
 	constexpr LABEL MAX_LABEL = std::numeric_limits<LABEL>::max();
 
@@ -894,6 +1896,14 @@ void grey_dilate(
 		const uint64_t ys, const uint64_t ye, 
 		const uint64_t zs, const uint64_t ze
 	){
+		BlockCounters hot(counters, counters_mtx);
+
+		// the voxels skipped after finding a saturated 
+		// column have it in their stencil
+		auto saturate = [&](const uint64_t loc, const uint64_t x, const uint64_t n) {
+			std::fill(output + loc, output + loc + (std::min(x + n, xe) - x), MAX_LABEL);
+		};
+
 		LABEL max_left = MAX_LABEL;
 		LABEL max_middle = MAX_LABEL;
 		LABEL max_right = MAX_LABEL;
@@ -906,12 +1916,17 @@ void grey_dilate(
 				uint64_t loc = x + sx * y;
 
 				if (labels[loc] == MAX_LABEL) {
+					FASTMORPH_COUNT(hot, fast_path_hits, 1);
+					FASTMORPH_COUNT(hot, skipped_voxels, 2);
+					saturate(loc, x, 2);
 					x++;
 					stale_stencil += 2;
 					continue;
 				}
 
+				FASTMORPH_COUNT(hot, voxels_visited, 1);
 				if (stale_stencil == 1) {
+					FASTMORPH_COUNT(hot, stencil_reuses, 1);
 					max_left = max_middle;
 					max_middle = max_right;
 					max_right = get_max(x+1,y);
@@ -919,12 +1934,18 @@ void grey_dilate(
 				else if (stale_stencil >= 3) {
 					max_right = get_max(x+1,y);
 					if (max_right == MAX_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
+						saturate(loc, x, 3);
 						x += 2;
 						stale_stencil = 3;
 						continue;
 					}
 					max_middle = get_max(x,y);
 					if (max_middle == MAX_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 1);
+						saturate(loc, x, 2);
 						x++;
 						stale_stencil = 2;
 						continue;
@@ -932,9 +1953,13 @@ void grey_dilate(
 					max_left = get_max(x-1,y);
 				}
 				else if (stale_stencil == 2) {
+					FASTMORPH_COUNT(hot, stencil_reuses, 1);
 					max_left = max_right;
 					max_right = get_max(x+1,y);
 					if (max_right == MAX_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
+						saturate(loc, x, 3);
 						x += 2;
 						stale_stencil = 3;
 						continue;
@@ -945,11 +1970,17 @@ void grey_dilate(
 				stale_stencil = 0;
 
 				if (max_right == MAX_LABEL) {
+					FASTMORPH_COUNT(hot, fast_path_hits, 1);
+					FASTMORPH_COUNT(hot, skipped_voxels, 2);
+					saturate(loc, x, 3);
 					x += 2;
 					stale_stencil = 3;
 					continue;
 				}
 				else if (max_middle == MAX_LABEL) {
+					FASTMORPH_COUNT(hot, fast_path_hits, 1);
+					FASTMORPH_COUNT(hot, skipped_voxels, 1);
+					saturate(loc, x, 2);
 					x++;
 					stale_stencil = 2;
 					continue;
@@ -970,7 +2001,7 @@ void grey_dilate(
 			const uint64_t,const uint64_t,const uint64_t,
 			const uint64_t,const uint64_t,const uint64_t
 		)>(process_block), 
-		sx, sy, /*sz=*/1, threads, /*offset=*/0
+		sx, sy, /*sz=*/1, threads, /*offset=*/0, "grey_dilate"
 	);
 }
 
@@ -979,8 +2010,15 @@ template <typename LABEL>
 void grey_erode(
 	LABEL* labels, LABEL* output,
 	const uint64_t sx, const uint64_t sy, const uint64_t sz,
-	const uint64_t threads
+	const uint64_t threads,
+	HotCounters* counters = nullptr
 ) {
+	FASTMORPH_DISPATCH_TO(LABEL, grey_erode_3d, labels, output, sx, sy, sz, threads, counters);
+	if constexpr (std::is_floating_point<LABEL>::value) {
+		grey_flat_stencil<LABEL, false>(labels, output, sx, sy, sz, threads);
+		return;
+	}
+	std::mutex counters_mtx;
 
 	// assume a 3x3x3 stencil with all voxels on
 	const uint64_t sxy = sx * sy;
@@ -1032,6 +2070,14 @@ void grey_erode(
 		const uint64_t ys, const uint64_t ye, 
 		const uint64_t zs, const uint64_t ze
 	){
+		BlockCounters hot(counters, counters_mtx);
+
+		// the voxels skipped after finding a saturated 
+		// column have it in their stencil
+		auto saturate = [&](const uint64_t loc, const uint64_t x, const uint64_t n) {
+			std::fill(output + loc, output + loc + (std::min(x + n, xe) - x), MIN_LABEL);
+		};
+
 		LABEL min_left = MIN_LABEL;
 		LABEL min_middle = MIN_LABEL;
 		LABEL min_right = MIN_LABEL;
@@ -1045,12 +2091,17 @@ void grey_erode(
 					uint64_t loc = x + sx * (y + sy * z);
 
 					if (labels[loc] == MIN_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
+						saturate(loc, x, 2);
 						x++;
 						stale_stencil += 2;
 						continue;
 					}
 
+					FASTMORPH_COUNT(hot, voxels_visited, 1);
 					if (stale_stencil == 1) {
+						FASTMORPH_COUNT(hot, stencil_reuses, 1);
 						min_left = min_middle;
 						min_middle = min_right;
 						min_right = get_min(x+1,y,z);
@@ -1058,12 +2109,18 @@ void grey_erode(
 					else if (stale_stencil >= 3) {
 						min_right = get_min(x+1,y,z);
 						if (min_right == MIN_LABEL) {
+							FASTMORPH_COUNT(hot, fast_path_hits, 1);
+							FASTMORPH_COUNT(hot, skipped_voxels, 2);
+							saturate(loc, x, 3);
 							x += 2;
 							stale_stencil = 3;
 							continue;
 						}
 						min_middle = get_min(x,y,z);
 						if (min_middle == MIN_LABEL) {
+							FASTMORPH_COUNT(hot, fast_path_hits, 1);
+							FASTMORPH_COUNT(hot, skipped_voxels, 1);
+							saturate(loc, x, 2);
 							x++;
 							stale_stencil = 2;
 							continue;
@@ -1071,9 +2128,13 @@ void grey_erode(
 						min_left = get_min(x-1,y,z);
 					}
 					else if (stale_stencil == 2) {
+						FASTMORPH_COUNT(hot, stencil_reuses, 1);
 						min_left = min_right;
 						min_right = get_min(x+1,y,z);
 						if (min_right == MIN_LABEL) {
+							FASTMORPH_COUNT(hot, fast_path_hits, 1);
+							FASTMORPH_COUNT(hot, skipped_voxels, 2);
+							saturate(loc, x, 3);
 							x += 2;
 							stale_stencil = 3;
 							continue;
@@ -1084,11 +2145,17 @@ void grey_erode(
 					stale_stencil = 0;
 
 					if (min_right == MIN_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
+						saturate(loc, x, 3);
 						x += 2;
 						stale_stencil = 3;
 						continue;
 					}
 					else if (min_middle == MIN_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 1);
+						saturate(loc, x, 2);
 						x++;
 						stale_stencil = 2;
 						continue;
@@ -1110,7 +2177,7 @@ void grey_erode(
 			const uint64_t,const uint64_t,const uint64_t,
 			const uint64_t,const uint64_t,const uint64_t
 		)>(process_block), 
-		sx, sy, sz, threads, /*offset=*/0
+		sx, sy, sz, threads, /*offset=*/0, "grey_erode"
 	);
 }
 
@@ -1118,8 +2185,15 @@ template <typename LABEL>
 void grey_erode(
 	LABEL* labels, LABEL* output,
 	const uint64_t sx, const uint64_t sy,
-	const uint64_t threads
+	const uint64_t threads,
+	HotCounters* counters = nullptr
 ) {
+	FASTMORPH_DISPATCH_TO(LABEL, grey_erode_2d, labels, output, sx, sy, threads, counters);
+	if constexpr (std::is_floating_point<LABEL>::value) {
+		grey_flat_stencil<LABEL, false>(labels, output, sx, sy, /*sz=*/1, threads);
+		return;
+	}
+	std::mutex counters_mtx;
 
 	// assume a 3x3 stencil with all voxels on
 	constexpr LABEL MIN_LABEL = std::numeric_limits<LABEL>::min();
@@ -1150,6 +2224,14 @@ void grey_erode(
 		const uint64_t ys, const uint64_t ye, 
 		const uint64_t zs, const uint64_t ze
 	){
+		BlockCounters hot(counters, counters_mtx);
+
+		// the voxels skipped after finding a saturated 
+		// column have it in their stencil
+		auto saturate = [&](const uint64_t loc, const uint64_t x, const uint64_t n) {
+			std::fill(output + loc, output + loc + (std::min(x + n, xe) - x), MIN_LABEL);
+		};
+
 		LABEL min_left = MIN_LABEL;
 		LABEL min_middle = MIN_LABEL;
 		LABEL min_right = MIN_LABEL;
@@ -1162,12 +2244,17 @@ void grey_erode(
 				uint64_t loc = x + sx * y;
 
 				if (labels[loc] == MIN_LABEL) {
+					FASTMORPH_COUNT(hot, fast_path_hits, 1);
+					FASTMORPH_COUNT(hot, skipped_voxels, 2);
+					saturate(loc, x, 2);
 					x++;
 					stale_stencil += 2;
 					continue;
 				}
 
+				FASTMORPH_COUNT(hot, voxels_visited, 1);
 				if (stale_stencil == 1) {
+					FASTMORPH_COUNT(hot, stencil_reuses, 1);
 					min_left = min_middle;
 					min_middle = min_right;
 					min_right = get_min(x+1,y);
@@ -1175,12 +2262,18 @@ void grey_erode(
 				else if (stale_stencil >= 3) {
 					min_right = get_min(x+1,y);
 					if (min_right == MIN_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
+						saturate(loc, x, 3);
 						x += 2;
 						stale_stencil = 3;
 						continue;
 					}
 					min_middle = get_min(x,y);
 					if (min_middle == MIN_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 1);
+						saturate(loc, x, 2);
 						x++;
 						stale_stencil = 2;
 						continue;
@@ -1188,9 +2281,13 @@ void grey_erode(
 					min_left = get_min(x-1,y);
 				}
 				else if (stale_stencil == 2) {
+					FASTMORPH_COUNT(hot, stencil_reuses, 1);
 					min_left = min_right;
 					min_right = get_min(x+1,y);
 					if (min_right == MIN_LABEL) {
+						FASTMORPH_COUNT(hot, fast_path_hits, 1);
+						FASTMORPH_COUNT(hot, skipped_voxels, 2);
+						saturate(loc, x, 3);
 						x += 2;
 						stale_stencil = 3;
 						continue;
@@ -1201,11 +2298,17 @@ void grey_erode(
 				stale_stencil = 0;
 
 				if (min_right == MIN_LABEL) {
+					FASTMORPH_COUNT(hot, fast_path_hits, 1);
+					FASTMORPH_COUNT(hot, skipped_voxels, 2);
+					saturate(loc, x, 3);
 					x += 2;
 					stale_stencil = 3;
 					continue;
 				}
 				else if (min_middle == MIN_LABEL) {
+					FASTMORPH_COUNT(hot, fast_path_hits, 1);
+					FASTMORPH_COUNT(hot, skipped_voxels, 1);
+					saturate(loc, x, 2);
 					x++;
 					stale_stencil = 2;
 					continue;
@@ -1226,12 +2329,2651 @@ void grey_erode(
 			const uint64_t,const uint64_t,const uint64_t,
 			const uint64_t,const uint64_t,const uint64_t
 		)>(process_block), 
-		sx, sy, /*sz=*/1, threads, /*offset=*/0
+		sx, sy, /*sz=*/1, threads, /*offset=*/0, "grey_erode"
+	);
+}
+
+
+
+
+// Adds a signed weight to a grey value, clamping
+// to the range of LABEL instead of wrapping around.
+// Floating point values are just added.
+template <typename LABEL>
+inline LABEL saturating_add(const LABEL val, const GreyWeight<LABEL> weight) {
+	constexpr LABEL MIN_LABEL = std::numeric_limits<LABEL>::min();
+	constexpr LABEL MAX_LABEL = std::numeric_limits<LABEL>::max();
+
+	if constexpr (std::is_floating_point<LABEL>::value) {
+		return val + weight;
+	}
+	else if constexpr (sizeof(LABEL) < sizeof(int64_t)) {
+		// weights are pre-clamped to the span of LABEL so this can't overflow
+		const int64_t res = static_cast<int64_t>(val) + weight;
+		return static_cast<LABEL>(
+			std::min(
+				std::max(res, static_cast<int64_t>(MIN_LABEL)), 
+				static_cast<int64_t>(MAX_LABEL)
+			)
+		);
+	}
+	else {
+		// unsigned arithmetic is modular so the headroom
+		// is correct for both signed and unsigned LABEL
+		if (weight >= 0) {
+			const uint64_t w = static_cast<uint64_t>(weight);
+			const uint64_t headroom = static_cast<uint64_t>(MAX_LABEL) - static_cast<uint64_t>(val);
+			return (w >= headroom)
+				? MAX_LABEL
+				: static_cast<LABEL>(static_cast<uint64_t>(val) + w);
+		}
+		const uint64_t w = static_cast<uint64_t>(0) - static_cast<uint64_t>(weight);
+		const uint64_t room = static_cast<uint64_t>(val) - static_cast<uint64_t>(MIN_LABEL);
+		return (w >= room)
+			? MIN_LABEL
+			: static_cast<LABEL>(static_cast<uint64_t>(val) - w);
+	}
+}
+
+// Tries to write a 3x3x3 weight stencil as wx[i] + wy[j] + wz[k].
+// Saturation only commutes with the axis by axis evaluation when
+// all the weights push values in the same direction, so stencils
+// mixing positive and negative weights are rejected too. So are
+// integer weights past +/-2^60, whose differences and sums below 
+// could overflow int64.
+template <typename WEIGHT>
+bool separable_weights(
+	const WEIGHT* weights, const uint8_t* footprint,
+	WEIGHT* wx, WEIGHT* wy, WEIGHT* wz
+) {
+	for (int i = 0; i < 27; i++) {
+		if (!footprint[i]) {
+			return false;
+		}
+		if constexpr (!std::is_floating_point<WEIGHT>::value) {
+			constexpr WEIGHT limit = static_cast<WEIGHT>(1) << 60;
+			if (weights[i] > limit || weights[i] < -limit) {
+				return false;
+			}
+		}
+	}
+
+	const WEIGHT center = weights[13];
+	for (int i = 0; i < 3; i++) {
+		wx[i] = weights[i + 3 + 9];
+		wy[i] = weights[1 + 3 * i + 9] - center;
+		wz[i] = weights[1 + 3 + 9 * i] - center;
+	}
+
+	for (int z = 0; z < 3; z++) {
+		for (int y = 0; y < 3; y++) {
+			for (int x = 0; x < 3; x++) {
+				if (weights[x + 3 * (y + 3 * z)] != wx[x] + wy[y] + wz[z]) {
+					return false;
+				}
+			}
+		}
+	}
+
+	// shift constants between the axes so that every
+	// term has the same sign as the whole stencil
+	const WEIGHT min_weight = *std::min_element(weights, weights + 27);
+	const WEIGHT max_weight = *std::max_element(weights, weights + 27);
+
+	WEIGHT shift_y = 0;
+	WEIGHT shift_z = 0;
+	if (min_weight >= 0) {
+		shift_y = *std::min_element(wy, wy + 3);
+		shift_z = *std::min_element(wz, wz + 3);
+	}
+	else if (max_weight <= 0) {
+		shift_y = *std::max_element(wy, wy + 3);
+		shift_z = *std::max_element(wz, wz + 3);
+	}
+	else {
+		return false;
+	}
+
+	for (int i = 0; i < 3; i++) {
+		wx[i] += shift_y + shift_z;
+		wy[i] -= shift_y;
+		wz[i] -= shift_z;
+	}
+
+	return true;
+}
+
+// Computes output[p] = max (or min) over o of labels[p + o] + weights[o]
+// for the 3x3x3 stencil o. Offsets that are outside the image
+// or off in the footprint do not participate.
+// The inner loops run along contiguous x rows and are
+// branch free so that they are auto-vectorized.
+// NaN spreads like in grey_max.
+template <typename LABEL, bool IS_MAX>
+void grey_weighted_stencil(
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const GreyWeight<LABEL>* weights, const uint8_t* footprint,
+	const uint64_t threads
+) {
+	using WEIGHT = GreyWeight<LABEL>;
+	constexpr LABEL IDENTITY = IS_MAX 
+		? grey_lowest<LABEL>()
+		: grey_highest<LABEL>();
+
+	auto extremum = [](const LABEL a, const LABEL b) {
+		if constexpr (IS_MAX) {
+			return grey_max<LABEL>(a, b);
+		}
+		else {
+			return grey_min<LABEL>(a, b);
+		}
+	};
+
+	// apply one tap of a weighted 1D stencil to dest[start, end)
+	// from a row whose neighbors are stride apart
+	auto accumulate = [&](
+		const LABEL* src, LABEL* dest, 
+		const int64_t stride, 
+		const WEIGHT weight, const int64_t delta,
+		const uint64_t start, const uint64_t end
+	) {
+		if (weight == 0) {
+			for (uint64_t i = start; i < end; i++) {
+				dest[i] = extremum(dest[i], src[i * stride + delta]);
+			}
+		}
+		else {
+			for (uint64_t i = start; i < end; i++) {
+				dest[i] = extremum(dest[i], saturating_add<LABEL>(src[i * stride + delta], weight));
+			}
+		}
+	};
+
+	WEIGHT wx[3], wy[3], wz[3];
+	bool separable = separable_weights<WEIGHT>(weights, footprint, wx, wy, wz);
+	if constexpr (std::is_floating_point<LABEL>::value) {
+		// adding the axes one at a time rounds differently
+		// than adding their sum, so only flat stencils
+		for (int i = 0; i < 3; i++) {
+			separable = separable && wx[i] == 0 && wy[i] == 0 && wz[i] == 0;
+		}
+	}
+
+	auto process_block_general = [&](
+		const uint64_t xs, const uint64_t xe, 
+		const uint64_t ys, const uint64_t ye, 
+		const uint64_t zs, const uint64_t ze
+	){
+		for (uint64_t z = zs; z < ze; z++) {
+			for (uint64_t y = ys; y < ye; y++) {
+				LABEL* row = output + sx * (y + sy * z);
+				std::fill(row + xs, row + xe, IDENTITY);
+
+				for (int64_t dz = -1; dz <= 1; dz++) {
+					if ((z == 0 && dz < 0) || (z == sz - 1 && dz > 0)) {
+						continue;
+					}
+					for (int64_t dy = -1; dy <= 1; dy++) {
+						if ((y == 0 && dy < 0) || (y == sy - 1 && dy > 0)) {
+							continue;
+						}
+						const LABEL* src = labels + sx * ((y + dy) + sy * (z + dz));
+						for (int64_t dx = -1; dx <= 1; dx++) {
+							const int idx = (dx + 1) + 3 * ((dy + 1) + 3 * (dz + 1));
+							if (!footprint[idx]) {
+								continue;
+							}
+							const uint64_t start = (xs == 0 && dx < 0) ? 1 : xs;
+							const uint64_t end = (xe == sx && dx > 0) ? sx - 1 : xe;
+							accumulate(src, row, 1, weights[idx], dx, start, end);
+						}
+					}
+				}
+			}
+		}
+	};
+
+	// separable weights are applied one axis at a time 
+	// inside of the block and its halo so that each voxel
+	// costs 9 instead of 27 stencil evaluations.
+	auto process_block_separable = [&](
+		const uint64_t xs, const uint64_t xe, 
+		const uint64_t ys, const uint64_t ye, 
+		const uint64_t zs, const uint64_t ze
+	){
+		const uint64_t hys = (ys > 0) ? ys - 1 : 0;
+		const uint64_t hye = std::min(ye + 1, sy);
+		const uint64_t hzs = (zs > 0) ? zs - 1 : 0;
+		const uint64_t hze = std::min(ze + 1, sz);
+
+		const uint64_t bx = xe - xs;
+		const uint64_t by = hye - hys;
+		const uint64_t bz = hze - hzs;
+
+		// x pass over the block plus its y and z halo
+		std::vector<LABEL> xpass(bx * by * bz, IDENTITY);
+		for (uint64_t z = hzs; z < hze; z++) {
+			for (uint64_t y = hys; y < hye; y++) {
+				const LABEL* src = labels + xs + sx * (y + sy * z);
+				LABEL* dest = xpass.data() + bx * ((y - hys) + by * (z - hzs));
+				for (int64_t dx = -1; dx <= 1; dx++) {
+					const uint64_t start = (xs == 0 && dx < 0) ? 1 : 0;
+					const uint64_t end = (xe == sx && dx > 0) ? bx - 1 : bx;
+					accumulate(src, dest, 1, wx[dx + 1], dx, start, end);
+				}
+			}
+		}
+
+		// y pass over the block plus its z halo
+		const uint64_t cy = ye - ys;
+		std::vector<LABEL> ypass(bx * cy * bz, IDENTITY);
+		for (uint64_t z = 0; z < bz; z++) {
+			for (uint64_t y = ys; y < ye; y++) {
+				LABEL* dest = ypass.data() + bx * ((y - ys) + cy * z);
+				for (int64_t dy = -1; dy <= 1; dy++) {
+					if ((y == 0 && dy < 0) || (y == sy - 1 && dy > 0)) {
+						continue;
+					}
+					const LABEL* src = xpass.data() + bx * ((y + dy - hys) + by * z);
+					accumulate(src, dest, 1, wy[dy + 1], 0, 0, bx);
+				}
+			}
+		}
+
+		// z pass into the output
+		for (uint64_t z = zs; z < ze; z++) {
+			for (uint64_t y = ys; y < ye; y++) {
+				LABEL* dest = output + xs + sx * (y + sy * z);
+				std::fill(dest, dest + bx, IDENTITY);
+				for (int64_t dz = -1; dz <= 1; dz++) {
+					if ((z == 0 && dz < 0) || (z == sz - 1 && dz > 0)) {
+						continue;
+					}
+					const LABEL* src = ypass.data() + bx * ((y - ys) + cy * (z + dz - hzs));
+					accumulate(src, dest, 1, wz[dz + 1], 0, 0, bx);
+				}
+			}
+		}
+	};
+
+	if (separable) {
+		parallelize_blocks(
+			std::function<void(
+				const uint64_t,const uint64_t,const uint64_t,
+				const uint64_t,const uint64_t,const uint64_t
+			)>(process_block_separable), 
+			sx, sy, sz, threads, /*offset=*/0, 
+			(IS_MAX ? "grey_dilate_weighted:separable" : "grey_erode_weighted:separable")
+		);
+	}
+	else {
+		parallelize_blocks(
+			std::function<void(
+				const uint64_t,const uint64_t,const uint64_t,
+				const uint64_t,const uint64_t,const uint64_t
+			)>(process_block_general), 
+			sx, sy, sz, threads, /*offset=*/0, (IS_MAX ? "grey_dilate_weighted" : "grey_erode_weighted")
+		);
+	}
+}
+
+// Weights beyond the span of a narrow LABEL saturate every value
+// anyway, clamping them keeps saturating_add's int64 sum from 
+// overflowing. 64 bit labels use the full range.
+template <typename LABEL>
+inline GreyWeight<LABEL> clamp_weight(const GreyWeight<LABEL> weight) {
+	if constexpr (std::is_floating_point<LABEL>::value || sizeof(LABEL) >= sizeof(int64_t)) {
+		return weight;
+	}
+	else {
+		constexpr int64_t limit = static_cast<int64_t>(std::numeric_limits<LABEL>::max()) 
+			- static_cast<int64_t>(std::numeric_limits<LABEL>::min());
+		return std::min(std::max(weight, -limit), limit);
+	}
+}
+
+// -2^63 has no int64 negation and erodes like -(2^63 - 1)
+template <typename LABEL>
+inline GreyWeight<LABEL> negate_weight(const GreyWeight<LABEL> weight) {
+	if constexpr (std::is_floating_point<LABEL>::value) {
+		return -weight;
+	}
+	else {
+		return (weight == std::numeric_limits<int64_t>::min())
+			? std::numeric_limits<int64_t>::max()
+			: -weight;
+	}
+}
+
+template <typename LABEL, bool IS_MAX>
+void grey_flat_stencil(
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const uint64_t threads
+) {
+	const GreyWeight<LABEL> weights[27] = {};
+	uint8_t footprint[27];
+	std::fill(footprint, footprint + 27, 1);
+
+	grey_weighted_stencil<LABEL, IS_MAX>(
+		labels, output, 
+		sx, sy, sz, 
+		weights, footprint,
+		threads
+	);
+}
+
+// Non-flat dilation: output[p] = max over o of labels[p - o] + weights[o]
+// weights and footprint are 3x3x3 in fortran order. Integer values saturate.
+template <typename LABEL>
+void grey_dilate_weighted(
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const GreyWeight<LABEL>* weights, const uint8_t* footprint,
+	const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, grey_dilate_weighted_3d, labels, output, sx, sy, sz, weights, footprint, threads);
+	// dilation uses the reflected stencil
+	GreyWeight<LABEL> reflected_weights[27];
+	uint8_t reflected_footprint[27];
+	for (int i = 0; i < 27; i++) {
+		reflected_weights[26 - i] = clamp_weight<LABEL>(weights[i]);
+		reflected_footprint[26 - i] = footprint[i];
+	}
+
+	grey_weighted_stencil<LABEL, true>(
+		labels, output, 
+		sx, sy, sz, 
+		reflected_weights, reflected_footprint,
+		threads
+	);
+}
+
+// Non-flat erosion: output[p] = min over o of labels[p + o] - weights[o]
+// weights and footprint are 3x3x3 in fortran order. Integer values saturate.
+template <typename LABEL>
+void grey_erode_weighted(
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const GreyWeight<LABEL>* weights, const uint8_t* footprint,
+	const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, grey_erode_weighted_3d, labels, output, sx, sy, sz, weights, footprint, threads);
+	GreyWeight<LABEL> negated_weights[27];
+	for (int i = 0; i < 27; i++) {
+		negated_weights[i] = negate_weight<LABEL>(clamp_weight<LABEL>(weights[i]));
+	}
+
+	grey_weighted_stencil<LABEL, false>(
+		labels, output, 
+		sx, sy, sz, 
+		negated_weights, footprint,
+		threads
+	);
+}
+
+// 2D versions take 3x3 weights and footprint
+template <typename LABEL>
+void grey_dilate_weighted(
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy,
+	const GreyWeight<LABEL>* weights, const uint8_t* footprint,
+	const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, grey_dilate_weighted_2d, labels, output, sx, sy, weights, footprint, threads);
+	// repeat in every z plane of a 3x3x3 stencil so that it stays
+	// separable, the z = +/-1 planes are outside of the image
+	GreyWeight<LABEL> weights3d[27];
+	uint8_t footprint3d[27];
+	for (int i = 0; i < 27; i++) {
+		weights3d[i] = weights[i % 9];
+		footprint3d[i] = footprint[i % 9];
+	}
+
+	grey_dilate_weighted<LABEL>(
+		labels, output, 
+		sx, sy, /*sz=*/1, 
+		weights3d, footprint3d, 
+		threads
+	);
+}
+
+template <typename LABEL>
+void grey_erode_weighted(
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy,
+	const GreyWeight<LABEL>* weights, const uint8_t* footprint,
+	const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, grey_erode_weighted_2d, labels, output, sx, sy, weights, footprint, threads);
+	GreyWeight<LABEL> weights3d[27];
+	uint8_t footprint3d[27];
+	for (int i = 0; i < 27; i++) {
+		weights3d[i] = weights[i % 9];
+		footprint3d[i] = footprint[i % 9];
+	}
+
+	grey_erode_weighted<LABEL>(
+		labels, output, 
+		sx, sy, /*sz=*/1, 
+		weights3d, footprint3d, 
+		threads
 	);
 }
 
 
+FASTMORPH_KERNELS_END
+
+// Per label radius lookup for multilabel_radius_morph.
+// Compact non-negative label spaces use a dense table,
+// anything else falls back to a hash table.
+template <typename LABEL>
+class RadiusMap {
+public:
+	RadiusMap(
+		const LABEL* keys, const int64_t* values, const uint64_t n,
+		const int64_t default_radius
+	) : default_radius(default_radius) {
+		max_dilation = std::max(default_radius, static_cast<int64_t>(0));
+		max_erosion = std::max(-default_radius, static_cast<int64_t>(0));
+
+		bool compact = true;
+		uint64_t max_key = 0;
+		for (uint64_t i = 0; i < n; i++) {
+			if constexpr (std::is_signed<LABEL>::value) {
+				if (keys[i] < 0) {
+					compact = false;
+					break;
+				}
+			}
+			max_key = std::max(max_key, static_cast<uint64_t>(keys[i]));
+		}
+		compact = compact && (max_key <= 4 * n + 65536);
+
+		if (compact) {
+			dense.resize(max_key + 1, default_radius);
+			for (uint64_t i = 0; i < n; i++) {
+				dense[static_cast<uint64_t>(keys[i])] = values[i];
+			}
+		}
+		else {
+			sparse.reserve(n);
+			for (uint64_t i = 0; i < n; i++) {
+				sparse[keys[i]] = values[i];
+			}
+		}
+
+		for (uint64_t i = 0; i < n; i++) {
+			max_dilation = std::max(max_dilation, values[i]);
+			max_erosion = std::max(max_erosion, -values[i]);
+		}
+	}
+
+	int64_t operator()(const LABEL label) const {
+		if (!sparse.empty()) {
+			auto it = sparse.find(label);
+			return (it == sparse.end()) ? default_radius : it->second;
+		}
+		// negative labels wrap to huge indices and get the default
+		const uint64_t idx = static_cast<uint64_t>(label);
+		return (idx < dense.size()) ? dense[idx] : default_radius;
+	}
+
+	int64_t max_dilation;
+	int64_t max_erosion;
+
+private:
+	int64_t default_radius;
+	std::vector<int64_t> dense;
+	std::unordered_map<LABEL, int64_t> sparse;
+};
+
+FASTMORPH_KERNELS_BEGIN
+
+// Grows or shrinks every label by its own radius in a single call. 
+// Radii are in voxels using the same all on stencil as multilabel_dilate
+// and multilabel_erode, so radius k matches k iterations of the cube:
+//   radius < 0: erode by -radius (borders of the image erode too)
+//   radius = 0: leave unchanged
+//   radius > 0: grow into background (0) voxels of the input
+// Erosion is evaluated with separable run length passes, so its
+// cost does not depend on the radius. A background voxel takes the
+// label that is most frequent on the closest shell of the cube that
+// contains a label able to reach it (ties go to the smaller label).
+// For radius 1 that is the same as the mode used by multilabel_dilate.
+template <typename LABEL>
+void multilabel_radius_morph_impl(
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const RadiusMap<LABEL> &radii, const uint64_t threads,
+	const bool planar
+) {
+	const uint64_t sxy = sx * sy;
+	const uint64_t voxels = sxy * sz;
+
+	std::vector<uint8_t> survives;
+
+	if (radii.max_erosion > 0) {
+		survives.resize(voxels, 1);
+
+		// 1D pass over a line of n voxels that are stride apart.
+		// A voxel survives when the run of same labeled survivors 
+		// it belongs to extends at least k voxels on either side.
+		auto erode_line = [&](const uint64_t start, const uint64_t stride, const uint64_t n) {
+			uint64_t i = 0;
+			while (i < n) {
+				const uint64_t loc = start + i * stride;
+				const LABEL label = labels[loc];
+
+				if (!survives[loc]) {
+					i++;
+					continue;
+				}
+
+				uint64_t j = i + 1;
+				while (j < n 
+					&& labels[start + j * stride] == label 
+					&& survives[start + j * stride]) {
+					j++;
+				}
+
+				const int64_t radius = (label == 0) ? 0 : radii(label);
+				if (radius < 0) {
+					const uint64_t k = static_cast<uint64_t>(-radius);
+					for (uint64_t r = i; r < j; r++) {
+						survives[start + r * stride] = (r - i >= k) && (j - 1 - r >= k);
+					}
+				}
+
+				i = j;
+			}
+		};
+
+		// x lines, parallelized over y and z
+		auto erode_x = [&](
+			const uint64_t /*xs*/, const uint64_t /*xe*/, 
+			const uint64_t ys, const uint64_t ye, 
+			const uint64_t zs, const uint64_t ze
+		){
+			for (uint64_t z = zs; z < ze; z++) {
+				for (uint64_t y = ys; y < ye; y++) {
+					erode_line(sx * (y + sy * z), 1, sx);
+				}
+			}
+		};
+
+		// y lines, parallelized over x and z
+		auto erode_y = [&](
+			const uint64_t xs, const uint64_t xe, 
+			const uint64_t /*ys*/, const uint64_t /*ye*/, 
+			const uint64_t zs, const uint64_t ze
+		){
+			for (uint64_t z = zs; z < ze; z++) {
+				for (uint64_t x = xs; x < xe; x++) {
+					erode_line(x + sxy * z, sx, sy);
+				}
+			}
+		};
+
+		// z lines, parallelized over x and y (passed in as z)
+		auto erode_z = [&](
+			const uint64_t xs, const uint64_t xe, 
+			const uint64_t /*ys*/, const uint64_t /*ye*/, 
+			const uint64_t zs, const uint64_t ze
+		){
+			for (uint64_t y = zs; y < ze; y++) {
+				for (uint64_t x = xs; x < xe; x++) {
+					erode_line(x + sx * y, sxy, sz);
+				}
+			}
+		};
+
+		parallelize_blocks(
+			std::function<void(
+				const uint64_t,const uint64_t,const uint64_t,
+				const uint64_t,const uint64_t,const uint64_t
+			)>(erode_x), 
+			/*sx=*/1, sy, sz, threads, /*offset=*/0, "multilabel_radius_morph:erode_x"
+		);
+		parallelize_blocks(
+			std::function<void(
+				const uint64_t,const uint64_t,const uint64_t,
+				const uint64_t,const uint64_t,const uint64_t
+			)>(erode_y), 
+			sx, /*sy=*/1, sz, threads, /*offset=*/0, "multilabel_radius_morph:erode_y"
+		);
+		if (!planar) {
+			parallelize_blocks(
+				std::function<void(
+					const uint64_t,const uint64_t,const uint64_t,
+					const uint64_t,const uint64_t,const uint64_t
+				)>(erode_z), 
+				sx, /*sy=*/1, /*sz=*/sy, threads, /*offset=*/0, "multilabel_radius_morph:erode_z"
+			);
+		}
+	}
+
+	const int64_t max_dilation = radii.max_dilation;
+
+	auto process_block = [&](
+		const uint64_t xs, const uint64_t xe, 
+		const uint64_t ys, const uint64_t ye, 
+		const uint64_t zs, const uint64_t ze
+	){
+		LABEL last_label = 0;
+		int64_t last_radius = 0;
+		auto radius_of = [&](const LABEL label) {
+			if (label != last_label) {
+				last_label = label;
+				last_radius = (label == 0) ? 0 : radii(label);
+			}
+			return last_radius;
+		};
+
+		for (uint64_t z = zs; z < ze; z++) {
+			for (uint64_t y = ys; y < ye; y++) {
+				for (uint64_t x = xs; x < xe; x++) {
+					const uint64_t loc = x + sx * (y + sy * z);
+					output[loc] = (survives.empty() || survives[loc])
+						? labels[loc]
+						: 0;
+				}
+			}
+		}
+
+		if (max_dilation <= 0) {
+			return;
+		}
+
+		const int64_t R = max_dilation;
+		const int64_t RZ = planar ? 0 : R;
+
+		const uint64_t hxs = (xs > static_cast<uint64_t>(R)) ? xs - R : 0;
+		const uint64_t hys = (ys > static_cast<uint64_t>(R)) ? ys - R : 0;
+		const uint64_t hzs = (zs > static_cast<uint64_t>(RZ)) ? zs - RZ : 0;
+		const uint64_t hxe = std::min(xe + R, sx);
+		const uint64_t hye = std::min(ye + R, sy);
+		const uint64_t hze = std::min(ze + RZ, sz);
+
+		// skip blocks that no growing label can reach
+		bool any_growing = false;
+		for (uint64_t z = hzs; z < hze && !any_growing; z++) {
+			for (uint64_t y = hys; y < hye && !any_growing; y++) {
+				for (uint64_t x = hxs; x < hxe; x++) {
+					if (radius_of(labels[x + sx * (y + sy * z)]) > 0) {
+						any_growing = true;
+						break;
+					}
+				}
+			}
+		}
+
+		if (!any_growing) {
+			return;
+		}
+
+		std::vector<LABEL> candidates;
+		candidates.reserve(27);
+
+		for (int64_t z = zs; z < static_cast<int64_t>(ze); z++) {
+			for (int64_t y = ys; y < static_cast<int64_t>(ye); y++) {
+				for (int64_t x = xs; x < static_cast<int64_t>(xe); x++) {
+					const uint64_t loc = x + sx * (y + sy * z);
+					if (labels[loc] != 0) {
+						continue;
+					}
+
+					for (int64_t d = 1; d <= R; d++) {
+						candidates.clear();
+						const int64_t dz_max = planar ? 0 : d;
+
+						for (int64_t dz = -dz_max; dz <= dz_max; dz++) {
+							const int64_t zi = z + dz;
+							if (zi < 0 || zi >= static_cast<int64_t>(sz)) {
+								continue;
+							}
+							for (int64_t dy = -d; dy <= d; dy++) {
+								const int64_t yi = y + dy;
+								if (yi < 0 || yi >= static_cast<int64_t>(sy)) {
+									continue;
+								}
+								// interior rows of the shell only touch its x faces
+								const bool on_face = (std::abs(dy) == d) || (std::abs(dz) == d);
+								const int64_t dx_step = on_face ? 1 : 2 * d;
+								for (int64_t dx = -d; dx <= d; dx += dx_step) {
+									const int64_t xi = x + dx;
+									if (xi < 0 || xi >= static_cast<int64_t>(sx)) {
+										continue;
+									}
+									const LABEL label = labels[xi + sx * (yi + sy * zi)];
+									if (label != 0 && radius_of(label) >= d) {
+										candidates.push_back(label);
+									}
+								}
+							}
+						}
+
+						if (candidates.empty()) {
+							continue;
+						}
+
+						std::sort(candidates.begin(), candidates.end());
+
+						LABEL mode_label = candidates[0];
+						uint64_t ct = 1;
+						uint64_t max_ct = 1;
+						for (uint64_t i = 1; i < candidates.size(); i++) {
+							if (candidates[i] != candidates[i-1]) {
+								ct = 1;
+							}
+							else {
+								ct++;
+							}
+							if (ct > max_ct) {
+								mode_label = candidates[i];
+								max_ct = ct;
+							}
+						}
+
+						output[loc] = mode_label;
+						break;
+					}
+				}
+			}
+		}
+	};
+
+	parallelize_blocks(
+		std::function<void(
+			const uint64_t,const uint64_t,const uint64_t,
+			const uint64_t,const uint64_t,const uint64_t
+		)>(process_block), 
+		sx, sy, sz, threads, /*offset=*/0, "multilabel_radius_morph"
+	);
+}
+
+template <typename LABEL>
+void multilabel_radius_morph(
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const RadiusMap<LABEL> &radii, const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, multilabel_radius_morph_3d, labels, output, sx, sy, sz, radii, threads);
+	multilabel_radius_morph_impl<LABEL>(
+		labels, output, 
+		sx, sy, sz, 
+		radii, threads, 
+		/*planar=*/false
+	);
+}
+
+template <typename LABEL>
+void multilabel_radius_morph(
+	LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy,
+	const RadiusMap<LABEL> &radii, const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, multilabel_radius_morph_2d, labels, output, sx, sy, radii, threads);
+	multilabel_radius_morph_impl<LABEL>(
+		labels, output, 
+		sx, sy, /*sz=*/1, 
+		radii, threads, 
+		/*planar=*/true
+	);
+}
+
+
+// Squared euclidean distance from every voxel to the 
+// nearest zero voxel of binary, considering anisotropy.
+// With black_border, voxels outside the image count as zero.
+// planar images have no z border. Uses the Felzenszwalb & Huttenlocher lower envelope of parabolas.
+inline void squared_edt(
+	const uint8_t* binary, float* dist,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const float wx, const float wy, const float wz,
+	const bool black_border, const bool planar
+) {
+	constexpr float INF = std::numeric_limits<float>::infinity();
+	const uint64_t sxy = sx * sy;
+
+	// x pass: distance to the nearest zero along each row
+	for (uint64_t z = 0; z < sz; z++) {
+		for (uint64_t y = 0; y < sy; y++) {
+			const uint64_t row = sx * (y + sy * z);
+			float d = black_border ? 0 : INF;
+			for (uint64_t x = 0; x < sx; x++) {
+				d = (binary[row + x] == 0) ? 0 : d + 1;
+				dist[row + x] = d;
+			}
+			d = black_border ? 0 : INF;
+			for (uint64_t x = sx; x-- > 0;) {
+				d = (binary[row + x] == 0) ? 0 : d + 1;
+				dist[row + x] = std::min(dist[row + x], d);
+			}
+			for (uint64_t x = 0; x < sx; x++) {
+				dist[row + x] = (dist[row + x] == INF) 
+					? INF 
+					: (wx * dist[row + x]) * (wx * dist[row + x]);
+			}
+		}
+	}
+
+	std::vector<float> f, out;
+	std::vector<int64_t> v;
+	std::vector<float> zs;
+
+	// lower envelope along a line of n voxels stride apart
+	auto envelope = [&](const uint64_t start, const uint64_t stride, const uint64_t n, const float w) {
+		const float w2 = w * w;
+		f.resize(n + 2);
+		out.resize(n);
+		v.resize(n + 2);
+		zs.resize(n + 3);
+
+		// sites are shifted by one so the black border 
+		// can be represented as zero height sites at 0 and n + 1
+		for (uint64_t i = 0; i < n; i++) {
+			f[i + 1] = dist[start + i * stride];
+		}
+		f[0] = black_border ? 0 : INF;
+		f[n + 1] = black_border ? 0 : INF;
+
+		int64_t k = -1;
+		for (int64_t q = 0; q < static_cast<int64_t>(n + 2); q++) {
+			if (f[q] == INF) {
+				continue;
+			}
+			float s = -INF;
+			while (k >= 0) {
+				const int64_t p = v[k];
+				s = ((f[q] + w2 * q * q) - (f[p] + w2 * p * p)) / (2 * w2 * (q - p));
+				if (s > zs[k]) {
+					break;
+				}
+				k--;
+			}
+			k++;
+			v[k] = q;
+			zs[k] = (k == 0) ? -INF : s;
+			zs[k + 1] = INF;
+		}
+
+		if (k < 0) {
+			return;
+		}
+
+		int64_t j = 0;
+		for (int64_t i = 1; i <= static_cast<int64_t>(n); i++) {
+			while (zs[j + 1] < i) {
+				j++;
+			}
+			const float delta = static_cast<float>(i - v[j]);
+			out[i - 1] = w2 * delta * delta + f[v[j]];
+		}
+		for (uint64_t i = 0; i < n; i++) {
+			dist[start + i * stride] = out[i];
+		}
+	};
+
+	for (uint64_t z = 0; z < sz; z++) {
+		for (uint64_t x = 0; x < sx; x++) {
+			envelope(x + sxy * z, sx, sy, wy);
+		}
+	}
+
+	if (!planar) {
+		for (uint64_t y = 0; y < sy; y++) {
+			for (uint64_t x = 0; x < sx; x++) {
+				envelope(x + sx * y, sxy, sz, wz);
+			}
+		}
+	}
+}
+
+// Fills holes in a binary image: zero voxels that can't 
+// reach the border of the image through 6-connected zeros.
+// Returns the number of voxels filled.
+inline uint64_t binary_fill_holes(
+	uint8_t* binary,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz
+) {
+	const uint64_t sxy = sx * sy;
+	const uint64_t voxels = sxy * sz;
+
+	// 0: unvisited zero, 1: foreground, 2: reachable zero
+	std::vector<uint8_t> state(binary, binary + voxels);
+	std::vector<uint64_t> stack;
+
+	auto visit = [&](const uint64_t loc) {
+		if (state[loc] == 0) {
+			state[loc] = 2;
+			stack.push_back(loc);
+		}
+	};
+
+	for (uint64_t z = 0; z < sz; z++) {
+		for (uint64_t y = 0; y < sy; y++) {
+			for (uint64_t x = 0; x < sx; x++) {
+				if (x == 0 || y == 0 || x == sx - 1 || y == sy - 1
+					|| (sz > 1 && (z == 0 || z == sz - 1))) {
+					visit(x + sx * (y + sy * z));
+				}
+			}
+		}
+	}
+
+	while (!stack.empty()) {
+		const uint64_t loc = stack.back();
+		stack.pop_back();
+
+		const uint64_t z = loc / sxy;
+		const uint64_t y = (loc - z * sxy) / sx;
+		const uint64_t x = loc - sx * (y + sy * z);
+
+		if (x > 0) { visit(loc - 1); }
+		if (x < sx - 1) { visit(loc + 1); }
+		if (y > 0) { visit(loc - sx); }
+		if (y < sy - 1) { visit(loc + sx); }
+		if (z > 0) { visit(loc - sxy); }
+		if (z < sz - 1) { visit(loc + sxy); }
+	}
+
+	uint64_t filled = 0;
+	for (uint64_t i = 0; i < voxels; i++) {
+		if (state[i] == 0) {
+			binary[i] = 1;
+			filled++;
+		}
+	}
+	return filled;
+}
+
+FASTMORPH_KERNELS_END
+
+enum class LabelOp {
+	ERODE = 0,
+	DILATE = 1,
+	OPENING = 2,
+	CLOSING = 3,
+	FILL = 4,
+	SPHERICAL_ERODE = 5,
+	SPHERICAL_DILATE = 6,
+	SPHERICAL_OPEN = 7,
+	SPHERICAL_CLOSE = 8,
+};
+
+FASTMORPH_KERNELS_BEGIN
+
+// Applies op to a binary cutout in place. Stencil ops repeat
+// radius times, spherical ops use radius as a physical distance.
+inline void binary_op(
+	std::vector<uint8_t> &binary, 
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const LabelOp op, const double radius, const float* anisotropy,
+	const bool planar
+) {
+	std::vector<uint8_t> tmp(binary.size());
+
+	auto stencil = [&](const bool dilate) {
+		std::fill(tmp.begin(), tmp.end(), 0);
+		if (dilate && planar) {
+			multilabel_dilate<uint8_t>(binary.data(), tmp.data(), sx, sy, true, 1);
+		}
+		else if (dilate) {
+			multilabel_dilate<uint8_t>(binary.data(), tmp.data(), sx, sy, sz, true, 1);
+		}
+		else if (planar) {
+			multilabel_erode<uint8_t>(binary.data(), tmp.data(), sx, sy, 1);
+		}
+		else {
+			multilabel_erode<uint8_t>(binary.data(), tmp.data(), sx, sy, sz, 1);
+		}
+		std::swap(binary, tmp);
+	};
+
+	auto repeat = [&](const bool dilate) {
+		const int iterations = std::max(static_cast<int>(std::lround(radius)), 0);
+		for (int i = 0; i < iterations; i++) {
+			stencil(dilate);
+		}
+	};
+
+	// float distances against the double radius, like the float32
+	// edt compared to a python float in spherical_dilate/erode
+	auto spherical = [&](const bool dilate) {
+		std::vector<float> dist(binary.size());
+		if (dilate) {
+			// distance to the nearest foreground voxel
+			for (uint64_t i = 0; i < binary.size(); i++) {
+				tmp[i] = binary[i] == 0;
+			}
+			squared_edt(
+				tmp.data(), dist.data(), sx, sy, sz, 
+				anisotropy[0], anisotropy[1], anisotropy[2],
+				/*black_border=*/false, planar
+			);
+			for (uint64_t i = 0; i < binary.size(); i++) {
+				binary[i] = binary[i] || (std::sqrt(dist[i]) <= radius);
+			}
+		}
+		else {
+			squared_edt(
+				binary.data(), dist.data(), sx, sy, sz, 
+				anisotropy[0], anisotropy[1], anisotropy[2],
+				/*black_border=*/true, planar
+			);
+			for (uint64_t i = 0; i < binary.size(); i++) {
+				binary[i] = binary[i] && (std::sqrt(dist[i]) >= radius);
+			}
+		}
+	};
+
+	switch (op) {
+		case LabelOp::ERODE:
+			repeat(false);
+			break;
+		case LabelOp::DILATE:
+			repeat(true);
+			break;
+		case LabelOp::OPENING:
+			repeat(false);
+			repeat(true);
+			break;
+		case LabelOp::CLOSING:
+			repeat(true);
+			repeat(false);
+			break;
+		case LabelOp::FILL:
+			binary_fill_holes(binary.data(), sx, sy, sz);
+			break;
+		case LabelOp::SPHERICAL_ERODE:
+			spherical(false);
+			break;
+		case LabelOp::SPHERICAL_DILATE:
+			spherical(true);
+			break;
+		case LabelOp::SPHERICAL_OPEN:
+			spherical(false);
+			spherical(true);
+			break;
+		case LabelOp::SPHERICAL_CLOSE:
+			spherical(true);
+			spherical(false);
+			break;
+	}
+}
+
+// How far beyond its bounding box an op can change a label.
+inline uint64_t label_op_padding(
+	const LabelOp op, const double radius, const float* anisotropy
+) {
+	switch (op) {
+		case LabelOp::FILL:
+			return 1;
+		case LabelOp::SPHERICAL_ERODE:
+		case LabelOp::SPHERICAL_DILATE:
+		case LabelOp::SPHERICAL_OPEN:
+		case LabelOp::SPHERICAL_CLOSE: {
+			const float min_anisotropy = std::min(
+				std::min(anisotropy[0], anisotropy[1]), anisotropy[2]
+			);
+			return static_cast<uint64_t>(std::ceil(std::max(radius, 0.0) / min_anisotropy)) + 1;
+		}
+		default:
+			return static_cast<uint64_t>(std::max(std::lround(radius), 0L)) + 1;
+	}
+}
+
+FASTMORPH_KERNELS_END
+
+struct BoundingBox {
+	uint64_t minx, maxx;
+	uint64_t miny, maxy;
+	uint64_t minz, maxz;
+
+	void add(const uint64_t x, const uint64_t y, const uint64_t z) {
+		minx = std::min(minx, x); maxx = std::max(maxx, x);
+		miny = std::min(miny, y); maxy = std::max(maxy, y);
+		minz = std::min(minz, z); maxz = std::max(maxz, z);
+	}
+
+	void merge(const BoundingBox &other) {
+		add(other.minx, other.miny, other.minz);
+		add(other.maxx, other.maxy, other.maxz);
+	}
+};
+
+FASTMORPH_KERNELS_BEGIN
+
+// Inclusive bounding boxes of every nonzero label.
+template <typename LABEL>
+std::unordered_map<LABEL, BoundingBox> bounding_boxes(
+	const LABEL* labels,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const uint64_t threads
+) {
+	std::unordered_map<LABEL, BoundingBox> boxes;
+	std::mutex mtx;
+
+	auto process_block = [&](
+		const uint64_t xs, const uint64_t xe, 
+		const uint64_t ys, const uint64_t ye, 
+		const uint64_t zs, const uint64_t ze
+	){
+		std::unordered_map<LABEL, BoundingBox> local;
+
+		for (uint64_t z = zs; z < ze; z++) {
+			for (uint64_t y = ys; y < ye; y++) {
+				uint64_t x = xs;
+				while (x < xe) {
+					const LABEL label = labels[x + sx * (y + sy * z)];
+					// runs of a label share a bounding box update
+					uint64_t run_end = x + 1;
+					while (run_end < xe && labels[run_end + sx * (y + sy * z)] == label) {
+						run_end++;
+					}
+					if (label != 0) {
+						auto it = local.find(label);
+						if (it == local.end()) {
+							local[label] = BoundingBox{ x, run_end - 1, y, y, z, z };
+						}
+						else {
+							it->second.add(x, y, z);
+							it->second.add(run_end - 1, y, z);
+						}
+					}
+					x = run_end;
+				}
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(mtx);
+		for (auto& [label, box] : local) {
+			auto it = boxes.find(label);
+			if (it == boxes.end()) {
+				boxes[label] = box;
+			}
+			else {
+				it->second.merge(box);
+			}
+		}
+	};
+
+	parallelize_blocks(
+		std::function<void(
+			const uint64_t,const uint64_t,const uint64_t,
+			const uint64_t,const uint64_t,const uint64_t
+		)>(process_block), 
+		sx, sy, sz, threads, /*offset=*/0, "bounding_boxes"
+	);
+
+	return boxes;
+}
+
+// Runs a binary op on the cropped cutout of every label in 
+// parallel and writes the results into output (which starts 
+// as a copy of labels). Each label can only remove its own 
+// voxels or claim background voxels of the input. When several
+// labels claim the same voxel, the smallest label wins so the 
+// result doesn't depend on the thread count.
+template <typename LABEL>
+void morph_each_label_impl(
+	const LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const LabelOp op, const double radius, const float* anisotropy,
+	const uint64_t threads, const bool planar
+) {
+	const uint64_t voxels = sx * sy * sz;
+	std::copy(labels, labels + voxels, output);
+
+	// read concurrently by the pool threads, so const (no operator[])
+	const auto boxes = bounding_boxes<LABEL>(labels, sx, sy, sz, threads);
+
+	std::vector<LABEL> order;
+	order.reserve(boxes.size());
+	for (const auto& [label, box] : boxes) {
+		order.push_back(label);
+	}
+	std::sort(order.begin(), order.end());
+
+	const uint64_t pad = label_op_padding(op, radius, anisotropy);
+	const uint64_t pad_z = planar ? 0 : pad;
+
+	struct Cutout {
+		uint64_t xs, xe, ys, ye, zs, ze;
+		std::vector<uint8_t> binary;
+	};
+
+	auto make_cutout = [&](const LABEL label) {
+		const BoundingBox &box = boxes.at(label);
+		Cutout c;
+		c.xs = (box.minx > pad) ? box.minx - pad : 0;
+		c.ys = (box.miny > pad) ? box.miny - pad : 0;
+		c.zs = (box.minz > pad_z) ? box.minz - pad_z : 0;
+		c.xe = std::min(box.maxx + pad + 1, sx);
+		c.ye = std::min(box.maxy + pad + 1, sy);
+		c.ze = std::min(box.maxz + pad_z + 1, sz);
+
+		const uint64_t cx = c.xe - c.xs;
+		const uint64_t cy = c.ye - c.ys;
+		const uint64_t cz = c.ze - c.zs;
+
+		c.binary.resize(cx * cy * cz);
+		for (uint64_t z = 0; z < cz; z++) {
+			for (uint64_t y = 0; y < cy; y++) {
+				const LABEL* row = labels + c.xs + sx * ((y + c.ys) + sy * (z + c.zs));
+				uint8_t* dest = c.binary.data() + cx * (y + cy * z);
+				for (uint64_t x = 0; x < cx; x++) {
+					dest[x] = row[x] == label;
+				}
+			}
+		}
+
+		binary_op(c.binary, cx, cy, cz, op, radius, anisotropy, planar);
+		return c;
+	};
+
+	auto write_back = [&](const LABEL label, const Cutout &c) {
+		const uint64_t cx = c.xe - c.xs;
+		const uint64_t cy = c.ye - c.ys;
+		const uint64_t cz = c.ze - c.zs;
+
+		for (uint64_t z = 0; z < cz; z++) {
+			for (uint64_t y = 0; y < cy; y++) {
+				const uint64_t row = c.xs + sx * ((y + c.ys) + sy * (z + c.zs));
+				const uint8_t* src = c.binary.data() + cx * (y + cy * z);
+				for (uint64_t x = 0; x < cx; x++) {
+					const uint64_t loc = row + x;
+					if (labels[loc] == label && !src[x]) {
+						output[loc] = 0;
+					}
+					else if (labels[loc] == 0 && src[x] && output[loc] == 0) {
+						output[loc] = label;
+					}
+				}
+			}
+		}
+	};
+
+	const uint64_t real_threads = std::max(std::min(threads, static_cast<uint64_t>(order.size())), static_cast<uint64_t>(1));
+
+	// batches bound the memory held by finished cutouts,
+	// write back is cheap compared to the ops so it stays serial
+	const uint64_t batch_size = real_threads * 16;
+	ThreadPool pool(real_threads);
+	std::vector<std::future<Cutout>> pending;
+
+	for (uint64_t batch_start = 0; batch_start < order.size(); batch_start += batch_size) {
+		const uint64_t batch_end = std::min(batch_start + batch_size, static_cast<uint64_t>(order.size()));
+
+		pending.clear();
+		for (uint64_t i = batch_start; i < batch_end; i++) {
+			const LABEL label = order[i];
+			pending.push_back(pool.enqueue(make_cutout, label));
+		}
+
+		for (uint64_t i = batch_start; i < batch_end; i++) {
+			write_back(order[i], pending[i - batch_start].get());
+		}
+	}
+
+	pool.join();
+}
+
+template <typename LABEL>
+void morph_each_label(
+	const LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const LabelOp op, const double radius, const float* anisotropy,
+	const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, morph_each_label_3d, labels, output, sx, sy, sz, op, radius, anisotropy, threads);
+	morph_each_label_impl<LABEL>(
+		labels, output, 
+		sx, sy, sz, 
+		op, radius, anisotropy, 
+		threads, /*planar=*/false
+	);
+}
+
+template <typename LABEL>
+void morph_each_label(
+	const LABEL* labels, LABEL* output,
+	const uint64_t sx, const uint64_t sy,
+	const LabelOp op, const double radius, const float* anisotropy,
+	const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, morph_each_label_2d, labels, output, sx, sy, op, radius, anisotropy, threads);
+	morph_each_label_impl<LABEL>(
+		labels, output, 
+		sx, sy, /*sz=*/1, 
+		op, radius, anisotropy, 
+		threads, /*planar=*/true
+	);
+}
+
+
+FASTMORPH_KERNELS_END
+
+enum class StableOp {
+	DILATE = 0,
+	ERODE = 1,
+	OPENING = 2,
+	CLOSING = 3,
+};
+
+FASTMORPH_KERNELS_BEGIN
+
+// the stencil passes making up op, true is a dilation
+inline std::vector<bool> stencil_passes(const StableOp op) {
+	if (op == StableOp::DILATE) {
+		return { true };
+	}
+	else if (op == StableOp::ERODE) {
+		return { false };
+	}
+	else if (op == StableOp::OPENING) {
+		return { false, true };
+	}
+	return { true, false };
+}
+
+// Single threaded dilation or erosion, output must be zeroed.
+template <typename LABEL>
+void stencil_pass(
+	LABEL* in, LABEL* out,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const bool dilate, const bool grey, const bool background_only,
+	const bool planar
+) {
+	if (grey && dilate) {
+		if (planar) {
+			grey_dilate<LABEL>(in, out, sx, sy, 1);
+		}
+		else {
+			grey_dilate<LABEL>(in, out, sx, sy, sz, 1);
+		}
+	}
+	else if (grey) {
+		if (planar) {
+			grey_erode<LABEL>(in, out, sx, sy, 1);
+		}
+		else {
+			grey_erode<LABEL>(in, out, sx, sy, sz, 1);
+		}
+	}
+	else if (dilate) {
+		if (planar) {
+			multilabel_dilate<LABEL>(in, out, sx, sy, background_only, 1);
+		}
+		else {
+			multilabel_dilate<LABEL>(in, out, sx, sy, sz, background_only, 1);
+		}
+	}
+	else {
+		if (planar) {
+			multilabel_erode<LABEL>(in, out, sx, sy, 1);
+		}
+		else {
+			multilabel_erode<LABEL>(in, out, sx, sy, sz, 1);
+		}
+	}
+}
+
+// A block of the volume plus a halo on every side, clipped at the 
+// volume boundary (and never extended in z for planar images).
+// Running n stencil passes on the tile alone with a halo of n 
+// gives the same values inside the block as running them on the 
+// whole volume, since errors from the missing neighborhood only 
+// creep in by one voxel per pass.
+template <typename LABEL>
+struct Tile {
+	uint64_t xs, ys, zs; // volume coordinates of the tile origin
+	uint64_t sx, sy, sz;
+	std::vector<LABEL> data;
+	std::vector<LABEL> scratch;
+
+	void load(
+		const LABEL* labels,
+		const uint64_t vsx, const uint64_t vsy, const uint64_t vsz,
+		const uint64_t bxs, const uint64_t bxe, 
+		const uint64_t bys, const uint64_t bye, 
+		const uint64_t bzs, const uint64_t bze,
+		const uint64_t halo, const bool planar
+	) {
+		const uint64_t halo_z = planar ? 0 : halo;
+		xs = (bxs > halo) ? bxs - halo : 0;
+		ys = (bys > halo) ? bys - halo : 0;
+		zs = (bzs > halo_z) ? bzs - halo_z : 0;
+		sx = std::min(bxe + halo, vsx) - xs;
+		sy = std::min(bye + halo, vsy) - ys;
+		sz = std::min(bze + halo_z, vsz) - zs;
+
+		data.resize(sx * sy * sz);
+		scratch.resize(sx * sy * sz);
+
+		for (uint64_t z = 0; z < sz; z++) {
+			for (uint64_t y = 0; y < sy; y++) {
+				const LABEL* src = labels + xs + vsx * ((y + ys) + vsy * (z + zs));
+				std::copy(src, src + sx, data.data() + sx * (y + sy * z));
+			}
+		}
+	}
+
+	void pass(
+		const bool dilate, const bool grey, 
+		const bool background_only, const bool planar
+	) {
+		std::fill(scratch.begin(), scratch.end(), 0);
+		stencil_pass<LABEL>(
+			data.data(), scratch.data(), sx, sy, sz, 
+			dilate, grey, background_only, planar
+		);
+		std::swap(data, scratch);
+	}
+
+	// pointer to volume coordinate (x, y, z)
+	const LABEL* at(const uint64_t x, const uint64_t y, const uint64_t z) const {
+		return data.data() + (x - xs) + sx * ((y - ys) + sy * (z - zs));
+	}
+};
+
+// Repeats op until the image stops changing (or max_iterations
+// is reached, 0 means no limit) and returns how many iterations 
+// changed the image. labels is updated in place.
+//
+// Multilabel ops that can both add and remove labels (opening, 
+// closing, and dilate with background_only=false, which is a 
+// mode filter) can flip between two states forever. For those 
+// the image is compared with its state two iterations earlier 
+// and the loop stops when it repeats.
+//
+// The volume is split into the same blocks as parallelize_blocks
+// and each pass only recomputes blocks where the block or one of 
+// its 26 neighbors changed since that pass last ran. Other blocks
+// would reproduce what they already contain. Recomputed blocks are 
+// evaluated on a Tile with a one voxel halo so that the results 
+// match running the whole volume kernels repeatedly.
+template <typename LABEL>
+uint64_t iterate_until_stable_impl(
+	LABEL* labels,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const StableOp op, const bool grey, const bool background_only,
+	const uint64_t max_iterations, const uint64_t threads,
+	const bool planar
+) {
+	const uint64_t voxels = sx * sy * sz;
+	const uint64_t block_size = block_size_for(sz);
+
+	const uint64_t grid_x = std::max(static_cast<uint64_t>((sx + block_size - 1) / block_size), static_cast<uint64_t>(1));
+	const uint64_t grid_y = std::max(static_cast<uint64_t>((sy + block_size - 1) / block_size), static_cast<uint64_t>(1));
+	const uint64_t grid_z = std::max(static_cast<uint64_t>((sz + block_size - 1) / block_size), static_cast<uint64_t>(1));
+	const uint64_t num_blocks = grid_x * grid_y * grid_z;
+
+	const std::vector<bool> stages = stencil_passes(op);
+	const uint64_t num_stages = stages.size();
+
+	// changed_since[stage][block]: block changed since stage last ran
+	std::vector<std::vector<uint8_t>> changed_since(
+		num_stages, std::vector<uint8_t>(num_blocks, 1)
+	);
+	std::vector<uint8_t> processed(num_blocks);
+	std::vector<uint8_t> changed(num_blocks);
+	std::vector<uint8_t> touched(num_blocks);
+
+	std::unique_ptr<LABEL[]> scratch(new LABEL[voxels]());
+	// copies of blocks at the start of an iteration, only needed 
+	// to tell whether a multi-pass op made a net change
+	std::unique_ptr<LABEL[]> backup;
+	if (num_stages > 1) {
+		backup.reset(new LABEL[voxels]());
+	}
+
+	const bool monotone = grey 
+		|| op == StableOp::ERODE
+		|| (op == StableOp::DILATE && background_only);
+
+	// the image at the start of every other iteration
+	std::unique_ptr<LABEL[]> snapshot;
+	if (!monotone) {
+		snapshot.reset(new LABEL[voxels]());
+	}
+
+	auto block_index = [&](const uint64_t xs, const uint64_t ys, const uint64_t zs) {
+		return (xs / block_size) + grid_x * ((ys / block_size) + grid_y * (zs / block_size));
+	};
+
+	auto neighborhood_changed = [&](const uint64_t stage, const uint64_t gx, const uint64_t gy, const uint64_t gz) {
+		const std::vector<uint8_t> &flags = changed_since[stage];
+		for (uint64_t z = (gz > 0 ? gz - 1 : 0); z <= std::min(gz + 1, grid_z - 1); z++) {
+			for (uint64_t y = (gy > 0 ? gy - 1 : 0); y <= std::min(gy + 1, grid_y - 1); y++) {
+				for (uint64_t x = (gx > 0 ? gx - 1 : 0); x <= std::min(gx + 1, grid_x - 1); x++) {
+					if (flags[x + grid_x * (y + grid_y * z)]) {
+						return true;
+					}
+				}
+			}
+		}
+		return false;
+	};
+
+	auto for_each_row = [&](
+		const uint64_t xs, const uint64_t xe, 
+		const uint64_t ys, const uint64_t ye, 
+		const uint64_t zs, const uint64_t ze,
+		const std::function<void(uint64_t, uint64_t)> &fn
+	) {
+		for (uint64_t z = zs; z < ze; z++) {
+			for (uint64_t y = ys; y < ye; y++) {
+				fn(xs + sx * (y + sy * z), xe - xs);
+			}
+		}
+	};
+
+	uint64_t iterations = 0;
+	while (max_iterations == 0 || iterations < max_iterations) {
+		if (snapshot && iterations % 2 == 0) {
+			std::copy(labels, labels + voxels, snapshot.get());
+		}
+
+		std::fill(touched.begin(), touched.end(), 0);
+		bool any_change = false;
+
+		for (uint64_t stage = 0; stage < num_stages; stage++) {
+			const bool dilate = stages[stage];
+
+			auto process_block = [&](
+				const uint64_t xs, const uint64_t xe, 
+				const uint64_t ys, const uint64_t ye, 
+				const uint64_t zs, const uint64_t ze
+			){
+				const uint64_t idx = block_index(xs, ys, zs);
+				processed[idx] = neighborhood_changed(
+					stage, xs / block_size, ys / block_size, zs / block_size
+				);
+				if (!processed[idx]) {
+					return;
+				}
+
+				Tile<LABEL> tile;
+				tile.load(
+					labels, sx, sy, sz, 
+					xs, xe, ys, ye, zs, ze, 
+					/*halo=*/1, planar
+				);
+				tile.pass(dilate, grey, background_only, planar);
+
+				for (uint64_t z = zs; z < ze; z++) {
+					for (uint64_t y = ys; y < ye; y++) {
+						const LABEL* src = tile.at(xs, y, z);
+						std::copy(src, src + (xe - xs), scratch.get() + xs + sx * (y + sy * z));
+					}
+				}
+			};
+
+			parallelize_blocks(
+				std::function<void(
+					const uint64_t,const uint64_t,const uint64_t,
+					const uint64_t,const uint64_t,const uint64_t
+				)>(process_block), 
+				sx, sy, sz, threads, /*offset=*/0, "iterate_until_stable"
+			);
+
+			std::fill(changed_since[stage].begin(), changed_since[stage].end(), 0);
+
+			// labels is only read during the pass above, 
+			// so results are committed in a second pass
+			auto commit_block = [&](
+				const uint64_t xs, const uint64_t xe, 
+				const uint64_t ys, const uint64_t ye, 
+				const uint64_t zs, const uint64_t ze
+			){
+				const uint64_t idx = block_index(xs, ys, zs);
+				changed[idx] = 0;
+				if (!processed[idx]) {
+					return;
+				}
+
+				bool differs = false;
+				for_each_row(xs, xe, ys, ye, zs, ze, [&](uint64_t loc, uint64_t n) {
+					differs = differs || !std::equal(labels + loc, labels + loc + n, scratch.get() + loc);
+				});
+				if (!differs) {
+					return;
+				}
+
+				if (backup && !touched[idx]) {
+					for_each_row(xs, xe, ys, ye, zs, ze, [&](uint64_t loc, uint64_t n) {
+						std::copy(labels + loc, labels + loc + n, backup.get() + loc);
+					});
+					touched[idx] = 1;
+				}
+
+				for_each_row(xs, xe, ys, ye, zs, ze, [&](uint64_t loc, uint64_t n) {
+					std::copy(scratch.get() + loc, scratch.get() + loc + n, labels + loc);
+				});
+				changed[idx] = 1;
+			};
+
+			parallelize_blocks(
+				std::function<void(
+					const uint64_t,const uint64_t,const uint64_t,
+					const uint64_t,const uint64_t,const uint64_t
+				)>(commit_block), 
+				sx, sy, sz, threads, /*offset=*/0, "iterate_until_stable:commit"
+			);
+
+			for (uint64_t i = 0; i < num_blocks; i++) {
+				if (!changed[i]) {
+					continue;
+				}
+				any_change = true;
+				for (uint64_t t = 0; t < num_stages; t++) {
+					changed_since[t][i] = 1;
+				}
+			}
+		}
+
+		// e.g. closing an already closed image dilates and 
+		// then erodes back, each pass changes but the result doesn't
+		if (backup && any_change) {
+			any_change = false;
+			for (uint64_t i = 0; i < num_blocks && !any_change; i++) {
+				if (!touched[i]) {
+					continue;
+				}
+				const uint64_t gx = i % grid_x;
+				const uint64_t gy = (i / grid_x) % grid_y;
+				const uint64_t gz = i / (grid_x * grid_y);
+				for_each_row(
+					gx * block_size, std::min((gx+1) * block_size, sx),
+					gy * block_size, std::min((gy+1) * block_size, sy),
+					gz * block_size, std::min((gz+1) * block_size, sz),
+					[&](uint64_t loc, uint64_t n) {
+						any_change = any_change || !std::equal(labels + loc, labels + loc + n, backup.get() + loc);
+					}
+				);
+			}
+		}
+
+		if (!any_change) {
+			break;
+		}
+		iterations++;
+
+		if (snapshot && iterations % 2 == 0 
+			&& std::equal(labels, labels + voxels, snapshot.get())) {
+			break;
+		}
+	}
+
+	return iterations;
+}
+
+template <typename LABEL>
+uint64_t iterate_until_stable(
+	LABEL* labels,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const StableOp op, const bool grey, const bool background_only,
+	const uint64_t max_iterations, const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, iterate_until_stable_3d, labels, sx, sy, sz, op, grey, background_only, max_iterations, threads);
+	return iterate_until_stable_impl<LABEL>(
+		labels, sx, sy, sz, 
+		op, grey, background_only,
+		max_iterations, threads, /*planar=*/false
+	);
+}
+
+template <typename LABEL>
+uint64_t iterate_until_stable(
+	LABEL* labels,
+	const uint64_t sx, const uint64_t sy,
+	const StableOp op, const bool grey, const bool background_only,
+	const uint64_t max_iterations, const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, iterate_until_stable_2d, labels, sx, sy, op, grey, background_only, max_iterations, threads);
+	return iterate_until_stable_impl<LABEL>(
+		labels, sx, sy, /*sz=*/1, 
+		op, grey, background_only,
+		max_iterations, threads, /*planar=*/true
+	);
+}
+
+
+// Computes op as the whole volume kernels would, but only returns 
+// the voxels whose value changed as (linear index, new value) in 
+// ascending index order. Each block is computed on a Tile and its 
+// changes are collected in a per-block buffer so no output volume 
+// is allocated and memory scales with the number of changes.
+template <typename LABEL>
+void sparse_morph_impl(
+	const LABEL* labels,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const StableOp op, const bool grey, const bool background_only,
+	const uint64_t threads, const bool planar,
+	std::vector<uint64_t> &indices, std::vector<LABEL> &values
+) {
+	const uint64_t block_size = block_size_for(sz);
+	const uint64_t grid_x = std::max(static_cast<uint64_t>((sx + block_size - 1) / block_size), static_cast<uint64_t>(1));
+	const uint64_t grid_y = std::max(static_cast<uint64_t>((sy + block_size - 1) / block_size), static_cast<uint64_t>(1));
+	const uint64_t grid_z = std::max(static_cast<uint64_t>((sz + block_size - 1) / block_size), static_cast<uint64_t>(1));
+
+	const std::vector<bool> stages = stencil_passes(op);
+
+	std::vector<std::vector<std::pair<uint64_t, LABEL>>> block_changes(grid_x * grid_y * grid_z);
+
+	auto process_block = [&](
+		const uint64_t xs, const uint64_t xe, 
+		const uint64_t ys, const uint64_t ye, 
+		const uint64_t zs, const uint64_t ze
+	){
+		Tile<LABEL> tile;
+		tile.load(
+			labels, sx, sy, sz, 
+			xs, xe, ys, ye, zs, ze, 
+			/*halo=*/stages.size(), planar
+		);
+		for (const bool dilate : stages) {
+			tile.pass(dilate, grey, background_only, planar);
+		}
+
+		std::vector<std::pair<uint64_t, LABEL>> &changes = block_changes[
+			(xs / block_size) + grid_x * ((ys / block_size) + grid_y * (zs / block_size))
+		];
+
+		for (uint64_t z = zs; z < ze; z++) {
+			for (uint64_t y = ys; y < ye; y++) {
+				const uint64_t row = sx * (y + sy * z);
+				const LABEL* result = tile.at(xs, y, z);
+				for (uint64_t x = xs; x < xe; x++) {
+					if (result[x - xs] != labels[row + x]) {
+						changes.emplace_back(row + x, result[x - xs]);
+					}
+				}
+			}
+		}
+	};
+
+	parallelize_blocks(
+		std::function<void(
+			const uint64_t,const uint64_t,const uint64_t,
+			const uint64_t,const uint64_t,const uint64_t
+		)>(process_block), 
+		sx, sy, sz, threads, /*offset=*/0, "sparse_morph"
+	);
+
+	uint64_t total = 0;
+	for (auto& changes : block_changes) {
+		total += changes.size();
+	}
+
+	std::vector<std::pair<uint64_t, LABEL>> all_changes;
+	all_changes.reserve(total);
+	for (auto& changes : block_changes) {
+		all_changes.insert(all_changes.end(), changes.begin(), changes.end());
+		std::vector<std::pair<uint64_t, LABEL>>().swap(changes);
+	}
+	std::sort(all_changes.begin(), all_changes.end(), 
+		[](const std::pair<uint64_t, LABEL> &a, const std::pair<uint64_t, LABEL> &b) {
+			return a.first < b.first;
+		}
+	);
+
+	indices.resize(total);
+	values.resize(total);
+	for (uint64_t i = 0; i < total; i++) {
+		indices[i] = all_changes[i].first;
+		values[i] = all_changes[i].second;
+	}
+}
+
+template <typename LABEL>
+void sparse_morph(
+	const LABEL* labels,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const StableOp op, const bool grey, const bool background_only,
+	const uint64_t threads,
+	std::vector<uint64_t> &indices, std::vector<LABEL> &values
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, sparse_morph_3d, labels, sx, sy, sz, op, grey, background_only, threads, indices, values);
+	sparse_morph_impl<LABEL>(
+		labels, sx, sy, sz, 
+		op, grey, background_only, 
+		threads, /*planar=*/false,
+		indices, values
+	);
+}
+
+template <typename LABEL>
+void sparse_morph(
+	const LABEL* labels,
+	const uint64_t sx, const uint64_t sy,
+	const StableOp op, const bool grey, const bool background_only,
+	const uint64_t threads,
+	std::vector<uint64_t> &indices, std::vector<LABEL> &values
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, sparse_morph_2d, labels, sx, sy, op, grey, background_only, threads, indices, values);
+	sparse_morph_impl<LABEL>(
+		labels, sx, sy, /*sz=*/1, 
+		op, grey, background_only, 
+		threads, /*planar=*/true,
+		indices, values
+	);
+}
+
+
+FASTMORPH_KERNELS_END
+
+// An image of a morph_batch call and where its result goes. Both
+// are Fortran ordered, output must be zeroed and not overlap labels.
+// planar images are 2D and have sz = 1.
+template <typename LABEL>
+struct BatchItem {
+	LABEL* labels;
+	LABEL* output;
+	uint64_t sx, sy, sz;
+	bool planar;
+};
+
+// Applies op to many independent images (e.g. tens of thousands of
+// small cutouts, or the channels of a volume) in one call. Running
+// them one call at a time costs a thread pool per call and leaves
+// most threads idle on images of only a few blocks. Here each image
+// is one task on a single shared pool, started largest first, so
+// the blocks of all images keep every thread busy. Small images
+// run single threaded. An image larger than a thread's share of
+// the batch gets threads in proportion to its size and spreads its
+// blocks over them, so a few large images run side by side instead
+// of one after another, and the pool shrinks by the extra threads.
+//
+// Floating point images only support grey morphology.
+template <typename LABEL>
+void morph_batch(
+	const BatchItem<LABEL>* items, const uint64_t num_items,
+	const StableOp op, const bool grey, const bool background_only,
+	const uint64_t threads
+) {
+	if constexpr (std::is_floating_point<LABEL>::value) {
+		if (!grey) {
+			throw std::invalid_argument("Floating point images only support grey morphology.");
+		}
+	}
+
+	const std::vector<bool> passes = stencil_passes(op);
+
+	auto stencil = [&](
+		const BatchItem<LABEL> &item, LABEL* in, LABEL* out,
+		const bool dilate, const uint64_t item_threads
+	) {
+		const uint64_t sx = item.sx, sy = item.sy, sz = item.sz;
+		if (grey && dilate) {
+			if (item.planar) {
+				grey_dilate<LABEL>(in, out, sx, sy, item_threads);
+			}
+			else {
+				grey_dilate<LABEL>(in, out, sx, sy, sz, item_threads);
+			}
+		}
+		else if (grey) {
+			if (item.planar) {
+				grey_erode<LABEL>(in, out, sx, sy, item_threads);
+			}
+			else {
+				grey_erode<LABEL>(in, out, sx, sy, sz, item_threads);
+			}
+		}
+		else if constexpr (!std::is_floating_point<LABEL>::value) {
+			if (dilate && item.planar) {
+				multilabel_dilate<LABEL>(in, out, sx, sy, background_only, item_threads);
+			}
+			else if (dilate) {
+				multilabel_dilate<LABEL>(in, out, sx, sy, sz, background_only, item_threads);
+			}
+			else if (item.planar) {
+				multilabel_erode<LABEL>(in, out, sx, sy, item_threads);
+			}
+			else {
+				multilabel_erode<LABEL>(in, out, sx, sy, sz, item_threads);
+			}
+		}
+	};
+
+	// opening and closing go through a zeroed intermediate image
+	auto run_item = [&](
+		const BatchItem<LABEL> &item, const uint64_t item_threads,
+		std::vector<LABEL> &scratch
+	) {
+		if (passes.size() == 1) {
+			stencil(item, item.labels, item.output, passes[0], item_threads);
+			return;
+		}
+		scratch.assign(item.sx * item.sy * item.sz, 0);
+		stencil(item, item.labels, scratch.data(), passes[0], item_threads);
+		stencil(item, scratch.data(), item.output, passes[1], item_threads);
+	};
+
+	uint64_t total_voxels = 0;
+	std::vector<uint64_t> order;
+	order.reserve(num_items);
+	for (uint64_t i = 0; i < num_items; i++) {
+		const uint64_t voxels = items[i].sx * items[i].sy * items[i].sz;
+		total_voxels += voxels;
+		if (voxels > 0) {
+			order.push_back(i);
+		}
+	}
+	std::stable_sort(order.begin(), order.end(), [&](const uint64_t a, const uint64_t b) {
+		return items[a].sx * items[a].sy * items[a].sz > items[b].sx * items[b].sy * items[b].sz;
+	});
+
+	std::vector<uint64_t> item_threads(num_items, 1);
+	uint64_t extra_threads = 0;
+	for (const uint64_t i : order) {
+		const uint64_t voxels = items[i].sx * items[i].sy * items[i].sz;
+		item_threads[i] = std::max(
+			static_cast<uint64_t>(static_cast<double>(threads) * voxels / total_voxels),
+			static_cast<uint64_t>(1)
+		);
+		extra_threads += item_threads[i] - 1;
+	}
+
+	const uint64_t real_threads = std::max(
+		std::min(threads - std::min(extra_threads, threads), static_cast<uint64_t>(order.size())), 
+		static_cast<uint64_t>(1)
+	);
+
+	if (real_threads <= 1) {
+		std::vector<LABEL> scratch;
+		for (const uint64_t i : order) {
+			run_item(items[i], item_threads[i], scratch);
+		}
+		return;
+	}
+
+	ThreadPool pool(real_threads);
+	std::vector<std::future<void>> pending;
+	pending.reserve(order.size());
+	for (const uint64_t i : order) {
+		pending.push_back(pool.enqueue([&, i]() {
+			std::vector<LABEL> scratch;
+			run_item(items[i], item_threads[i], scratch);
+		}));
+	}
+	pool.join();
+
+	// rethrows the first failure once every task is done
+	for (auto &result : pending) {
+		result.get();
+	}
+}
+
+enum class Footprint {
+	CUBE = 0,
+	SPHERE = 1,
+};
+
+FASTMORPH_KERNELS_BEGIN
+
+// Paints the footprint of every point directly into output 
+// (sx x sy x sz, sz = 1 for 2D images with z coordinates of 0) 
+// so the cost scales with the number of points rather than 
+// the volume. coords are num_points rows of (x, y, z) and may lie 
+// outside of output, only the part of a footprint that overlaps 
+// is painted.
+//
+// radius is physical (considering anisotropy):
+//   CUBE: |dx| * wx <= radius and likewise for y and z, which for 
+//     an isotropic integer radius is the same as calling dilate 
+//     radius times on a single point.
+//   SPHERE: the euclidean distance is within radius, like spherical_dilate.
+// Where footprints overlap the nearest point (chebyshev distance 
+// for CUBE) wins, ties go to the smaller label. Voxels already 
+// labeled in output are kept unless overwrite is set.
+//
+// Threads each take a slab of the last axis with size > 1 so 
+// writes never conflict.
+template <typename LABEL>
+void paint_points(
+	const int64_t* coords, const LABEL* point_labels, 
+	const uint64_t num_points,
+	LABEL* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const float radius, const float* anisotropy,
+	const Footprint footprint, const bool overwrite,
+	const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, paint_points, coords, point_labels, num_points, output, sx, sy, sz, radius, anisotropy, footprint, overwrite, threads);
+	if (num_points == 0 || radius < 0) {
+		return;
+	}
+
+	const float wx = anisotropy[0];
+	const float wy = anisotropy[1];
+	const float wz = anisotropy[2];
+
+	const int64_t rx = static_cast<int64_t>(std::floor(radius / wx));
+	const int64_t ry = static_cast<int64_t>(std::floor(radius / wy));
+	const int64_t rz = static_cast<int64_t>(std::floor(radius / wz));
+	const float radius2 = radius * radius;
+
+	// slabs are cut along z, or y for 2D images
+	const int axis = (sz > 1) ? 2 : 1;
+	const int64_t axis_size = (axis == 2) ? sz : sy;
+	const int64_t axis_radius = (axis == 2) ? rz : ry;
+	const int64_t cross_size = (axis == 2) ? sy : sz;
+	const int64_t cross_radius = (axis == 2) ? ry : rz;
+
+	std::vector<uint64_t> order(num_points);
+	for (uint64_t i = 0; i < num_points; i++) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](const uint64_t a, const uint64_t b) {
+		return coords[3 * a + axis] < coords[3 * b + axis];
+	});
+
+	// Overlaps are resolved one plane of the slab axis at a time 
+	// so memory scales with the footprints crossing a plane rather 
+	// than the bounding box of all points. cross is the other axis 
+	// of a plane (y for 3D images, z == 0 for 2D images).
+	auto paint_slab = [&](const int64_t slab_start, const int64_t slab_end) {
+		// distance of the point that painted each voxel of the plane's 
+		// bounding box, valid where stamp holds plane + 1 so the 
+		// buffers never need to be cleared
+		std::vector<float> best;
+		std::vector<int64_t> stamp;
+
+		auto first = std::lower_bound(order.begin(), order.end(), slab_start - axis_radius, 
+			[&](const uint64_t i, const int64_t value) {
+				return coords[3 * i + axis] < value;
+			}
+		);
+		auto last = first;
+
+		for (int64_t plane = slab_start; plane < slab_end; plane++) {
+			// points whose footprint reaches this plane are [first, last)
+			while (first != order.end() && coords[3 * *first + axis] + axis_radius < plane) {
+				++first;
+			}
+			last = std::max(last, first);
+			while (last != order.end() && coords[3 * *last + axis] - axis_radius <= plane) {
+				++last;
+			}
+			if (first == last) {
+				continue;
+			}
+
+			int64_t bxs = sx, bcs = cross_size;
+			int64_t bxe = 0, bce = 0;
+			for (auto it = first; it != last; ++it) {
+				const int64_t px = coords[3 * *it + 0];
+				const int64_t pc = coords[3 * *it + ((axis == 2) ? 1 : 2)];
+				bxs = std::min(bxs, std::max(px - rx, static_cast<int64_t>(0)));
+				bcs = std::min(bcs, std::max(pc - cross_radius, static_cast<int64_t>(0)));
+				bxe = std::max(bxe, std::min(px + rx + 1, static_cast<int64_t>(sx)));
+				bce = std::max(bce, std::min(pc + cross_radius + 1, cross_size));
+			}
+			if (bxs >= bxe || bcs >= bce) {
+				continue;
+			}
+			const int64_t bsx = bxe - bxs;
+			const uint64_t plane_voxels = static_cast<uint64_t>(bsx * (bce - bcs));
+			if (best.size() < plane_voxels) {
+				best.resize(plane_voxels);
+				stamp.resize(plane_voxels, 0);
+			}
+
+			for (auto it = first; it != last; ++it) {
+				const uint64_t i = *it;
+				const int64_t px = coords[3 * i + 0];
+				const int64_t py = coords[3 * i + 1];
+				const int64_t pz = coords[3 * i + 2];
+
+				const LABEL label = point_labels[i];
+				if (label == 0) {
+					continue;
+				}
+
+				int64_t zs = std::max(pz - rz, static_cast<int64_t>(0));
+				int64_t ze = std::min(pz + rz + 1, static_cast<int64_t>(sz));
+				int64_t ys = std::max(py - ry, static_cast<int64_t>(0));
+				int64_t ye = std::min(py + ry + 1, static_cast<int64_t>(sy));
+				const int64_t xs = std::max(px - rx, static_cast<int64_t>(0));
+				const int64_t xe = std::min(px + rx + 1, static_cast<int64_t>(sx));
+
+				if (axis == 2) {
+					zs = std::max(zs, plane);
+					ze = std::min(ze, plane + 1);
+				}
+				else {
+					ys = std::max(ys, plane);
+					ye = std::min(ye, plane + 1);
+				}
+
+				for (int64_t z = zs; z < ze; z++) {
+					const float dz = wz * static_cast<float>(z - pz);
+					for (int64_t y = ys; y < ye; y++) {
+						const float dy = wy * static_cast<float>(y - py);
+						const int64_t c = (axis == 2) ? y : z;
+						for (int64_t x = xs; x < xe; x++) {
+							const float dx = wx * static_cast<float>(x - px);
+
+							float dist;
+							if (footprint == Footprint::SPHERE) {
+								dist = dx * dx + dy * dy + dz * dz;
+								if (dist > radius2) {
+									continue;
+								}
+							}
+							else {
+								dist = std::max(std::max(std::abs(dx), std::abs(dy)), std::abs(dz));
+							}
+
+							const uint64_t loc = x + sx * (y + sy * z);
+							const uint64_t bloc = (x - bxs) + bsx * (c - bcs);
+							if (stamp[bloc] != plane + 1) {
+								if (!overwrite && output[loc] != 0) {
+									continue;
+								}
+								stamp[bloc] = plane + 1;
+							}
+							else if (dist > best[bloc] || (dist == best[bloc] && label >= output[loc])) {
+								continue;
+							}
+
+							best[bloc] = dist;
+							output[loc] = label;
+						}
+					}
+				}
+			}
+		}
+	};
+
+	const int64_t real_threads = std::max(
+		std::min(static_cast<int64_t>(threads), axis_size), 
+		static_cast<int64_t>(1)
+	);
+	const int64_t slab_size = (axis_size + real_threads - 1) / real_threads;
+
+	if (real_threads == 1) {
+		paint_slab(0, axis_size);
+		return;
+	}
+
+	ThreadPool pool(real_threads);
+	for (int64_t start = 0; start < axis_size; start += slab_size) {
+		pool.enqueue([&, start]() {
+			paint_slab(start, std::min(start + slab_size, axis_size));
+		});
+	}
+	pool.join();
+}
+
+
+FASTMORPH_KERNELS_END
+
+// A sparse volume stored as a hash of small dense bricks keyed by
+// brick coordinate, for images that are almost entirely zero. 
+// Bricks that are all zero are not stored. Bricks are 8x8x8 
+// (8x8x1 for 2D images).
+template <typename LABEL>
+class BrickVolume {
+public:
+	static constexpr uint64_t BRICK = 8;
+
+	uint64_t sx, sy, sz;
+	uint64_t bsz; // brick size along z
+	std::unordered_map<uint64_t, std::vector<LABEL>> bricks;
+
+	BrickVolume(const uint64_t sx, const uint64_t sy, const uint64_t sz)
+		: sx(sx), sy(sy), sz(sz), bsz((sz > 1) ? BRICK : 1) {}
+
+	uint64_t brick_voxels() const {
+		return BRICK * BRICK * bsz;
+	}
+
+	static uint64_t key(const uint64_t bx, const uint64_t by, const uint64_t bz) {
+		return bx | (by << 21) | (bz << 42);
+	}
+
+	static void unkey(const uint64_t k, uint64_t &bx, uint64_t &by, uint64_t &bz) {
+		constexpr uint64_t mask = (1ULL << 21) - 1;
+		bx = k & mask;
+		by = (k >> 21) & mask;
+		bz = (k >> 42) & mask;
+	}
+
+	void set(const uint64_t x, const uint64_t y, const uint64_t z, const LABEL val) {
+		const uint64_t k = key(x / BRICK, y / BRICK, z / bsz);
+		auto it = bricks.find(k);
+		if (it == bricks.end()) {
+			if (val == 0) {
+				return;
+			}
+			it = bricks.emplace(k, std::vector<LABEL>(brick_voxels())).first;
+		}
+		it->second[(x % BRICK) + BRICK * ((y % BRICK) + BRICK * (z % bsz))] = val;
+	}
+
+	// copies the box [xs,xe) x [ys,ye) x [zs,ze) into a dense buffer 
+	// of the same size, missing bricks read as zero
+	void read_box(
+		const uint64_t xs, const uint64_t xe,
+		const uint64_t ys, const uint64_t ye,
+		const uint64_t zs, const uint64_t ze,
+		LABEL* out
+	) const {
+		const uint64_t cx = xe - xs;
+		const uint64_t cy = ye - ys;
+		std::fill(out, out + cx * cy * (ze - zs), 0);
+
+		for (uint64_t bz = zs / bsz; bz * bsz < ze; bz++) {
+			for (uint64_t by = ys / BRICK; by * BRICK < ye; by++) {
+				for (uint64_t bx = xs / BRICK; bx * BRICK < xe; bx++) {
+					auto it = bricks.find(key(bx, by, bz));
+					if (it == bricks.end()) {
+						continue;
+					}
+					const LABEL* brick = it->second.data();
+
+					const uint64_t x0 = std::max(xs, bx * BRICK);
+					const uint64_t x1 = std::min(xe, (bx + 1) * BRICK);
+					for (uint64_t z = std::max(zs, bz * bsz); z < std::min(ze, (bz + 1) * bsz); z++) {
+						for (uint64_t y = std::max(ys, by * BRICK); y < std::min(ye, (by + 1) * BRICK); y++) {
+							const LABEL* src = brick + (x0 - bx * BRICK) + BRICK * ((y - by * BRICK) + BRICK * (z - bz * bsz));
+							std::copy(src, src + (x1 - x0), out + (x0 - xs) + cx * ((y - ys) + cy * (z - zs)));
+						}
+					}
+				}
+			}
+		}
+	}
+
+	void to_dense(LABEL* out) const {
+		for (auto& [k, brick] : bricks) {
+			uint64_t bx, by, bz;
+			unkey(k, bx, by, bz);
+			const uint64_t xe = std::min((bx + 1) * BRICK, sx);
+			for (uint64_t z = bz * bsz; z < std::min((bz + 1) * bsz, sz); z++) {
+				for (uint64_t y = by * BRICK; y < std::min((by + 1) * BRICK, sy); y++) {
+					const LABEL* src = brick.data() + BRICK * ((y - by * BRICK) + BRICK * (z - bz * bsz));
+					std::copy(src, src + (xe - bx * BRICK), out + bx * BRICK + sx * (y + sy * z));
+				}
+			}
+		}
+	}
+
+	// nonzero voxels as (linear index, value) in ascending index order
+	void to_sparse(std::vector<uint64_t> &indices, std::vector<LABEL> &values) const {
+		std::vector<std::pair<uint64_t, LABEL>> voxels;
+		for (auto& [k, brick] : bricks) {
+			uint64_t bx, by, bz;
+			unkey(k, bx, by, bz);
+			for (uint64_t z = 0; z < bsz; z++) {
+				for (uint64_t y = 0; y < BRICK; y++) {
+					for (uint64_t x = 0; x < BRICK; x++) {
+						const LABEL val = brick[x + BRICK * (y + BRICK * z)];
+						if (val != 0) {
+							voxels.emplace_back(
+								(bx * BRICK + x) + sx * ((by * BRICK + y) + sy * (bz * bsz + z)),
+								val
+							);
+						}
+					}
+				}
+			}
+		}
+		std::sort(voxels.begin(), voxels.end(), 
+			[](const std::pair<uint64_t, LABEL> &a, const std::pair<uint64_t, LABEL> &b) {
+				return a.first < b.first;
+			}
+		);
+		indices.resize(voxels.size());
+		values.resize(voxels.size());
+		for (uint64_t i = 0; i < voxels.size(); i++) {
+			indices[i] = voxels[i].first;
+			values[i] = voxels[i].second;
+		}
+	}
+};
+
+FASTMORPH_KERNELS_BEGIN
+
+// One dilation or erosion of a BrickVolume. Only allocated bricks 
+// (plus their neighbors when the op can grow into zeros) are 
+// visited. Each is computed as a Tile gathered from up to 27 bricks
+// with the same single threaded kernels as the dense images, so 
+// the results are identical.
+template <typename LABEL>
+BrickVolume<LABEL> brick_pass(
+	const BrickVolume<LABEL> &vol,
+	const bool dilate, const bool grey, const bool background_only,
+	const uint64_t threads
+) {
+	constexpr uint64_t BRICK = BrickVolume<LABEL>::BRICK;
+	const bool planar = vol.sz == 1;
+	const uint64_t bsz = vol.bsz;
+	const uint64_t grid_x = (vol.sx + BRICK - 1) / BRICK;
+	const uint64_t grid_y = (vol.sy + BRICK - 1) / BRICK;
+	const uint64_t grid_z = (vol.sz + bsz - 1) / bsz;
+
+	// multilabel erosion can't turn a zero into a label, but
+	// dilation can and so can grey erosion of negative values
+	const bool grows = dilate || grey;
+
+	std::vector<uint64_t> targets;
+	targets.reserve(vol.bricks.size() * (grows ? 4 : 1));
+	for (auto& [k, brick] : vol.bricks) {
+		if (!grows) {
+			targets.push_back(k);
+			continue;
+		}
+
+		// a neighboring brick can only change if this brick has 
+		// a nonzero voxel on the face, edge, or corner it touches
+		bool reaches[27] = {};
+		for (uint64_t z = 0; z < bsz; z++) {
+			const int cz = (bsz == 1) ? 0 : (z == 0 ? -1 : (z == bsz - 1 ? 1 : 0));
+			for (uint64_t y = 0; y < BRICK; y++) {
+				const int cy = (y == 0) ? -1 : (y == BRICK - 1 ? 1 : 0);
+				for (uint64_t x = 0; x < BRICK; x++) {
+					if (brick[x + BRICK * (y + BRICK * z)] == 0) {
+						continue;
+					}
+					const int cx = (x == 0) ? -1 : (x == BRICK - 1 ? 1 : 0);
+					for (int dz : { 0, cz }) {
+						for (int dy : { 0, cy }) {
+							for (int dx : { 0, cx }) {
+								reaches[(dx + 1) + 3 * ((dy + 1) + 3 * (dz + 1))] = true;
+							}
+						}
+					}
+				}
+			}
+		}
+
+		uint64_t bx, by, bz;
+		BrickVolume<LABEL>::unkey(k, bx, by, bz);
+		for (int dz = -1; dz <= 1; dz++) {
+			for (int dy = -1; dy <= 1; dy++) {
+				for (int dx = -1; dx <= 1; dx++) {
+					if (!reaches[(dx + 1) + 3 * ((dy + 1) + 3 * (dz + 1))]) {
+						continue;
+					}
+					const int64_t x = static_cast<int64_t>(bx) + dx;
+					const int64_t y = static_cast<int64_t>(by) + dy;
+					const int64_t z = static_cast<int64_t>(bz) + dz;
+					if (x < 0 || y < 0 || z < 0 
+						|| x >= static_cast<int64_t>(grid_x) 
+						|| y >= static_cast<int64_t>(grid_y) 
+						|| z >= static_cast<int64_t>(grid_z)) {
+						continue;
+					}
+					targets.push_back(BrickVolume<LABEL>::key(x, y, z));
+				}
+			}
+		}
+	}
+	std::sort(targets.begin(), targets.end());
+	targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+	std::vector<std::vector<LABEL>> results(targets.size());
+
+	auto process_brick = [&](const uint64_t i, std::vector<LABEL> &tile_in, std::vector<LABEL> &tile_out) {
+		uint64_t bx, by, bz;
+		BrickVolume<LABEL>::unkey(targets[i], bx, by, bz);
+
+		const uint64_t xs = bx * BRICK;
+		const uint64_t ys = by * BRICK;
+		const uint64_t zs = bz * bsz;
+		const uint64_t xe = std::min(xs + BRICK, vol.sx);
+		const uint64_t ye = std::min(ys + BRICK, vol.sy);
+		const uint64_t ze = std::min(zs + bsz, vol.sz);
+
+		const uint64_t txs = (xs > 0) ? xs - 1 : 0;
+		const uint64_t tys = (ys > 0) ? ys - 1 : 0;
+		const uint64_t tzs = (zs > 0 && !planar) ? zs - 1 : zs;
+		const uint64_t txe = std::min(xe + 1, vol.sx);
+		const uint64_t tye = std::min(ye + 1, vol.sy);
+		const uint64_t tze = planar ? ze : std::min(ze + 1, vol.sz);
+
+		const uint64_t tx = txe - txs;
+		const uint64_t ty = tye - tys;
+		const uint64_t tz = tze - tzs;
+
+		tile_in.resize(tx * ty * tz);
+		tile_out.resize(tx * ty * tz);
+		vol.read_box(txs, txe, tys, tye, tzs, tze, tile_in.data());
+		std::fill(tile_out.begin(), tile_out.end(), 0);
+
+		stencil_pass<LABEL>(
+			tile_in.data(), tile_out.data(), tx, ty, tz, 
+			dilate, grey, background_only, planar
+		);
+
+		std::vector<LABEL> brick(BRICK * BRICK * bsz);
+		bool any = false;
+		for (uint64_t z = zs; z < ze; z++) {
+			for (uint64_t y = ys; y < ye; y++) {
+				for (uint64_t x = xs; x < xe; x++) {
+					const LABEL val = tile_out[(x - txs) + tx * ((y - tys) + ty * (z - tzs))];
+					brick[(x - xs) + BRICK * ((y - ys) + BRICK * (z - zs))] = val;
+					any = any || (val != 0);
+				}
+			}
+		}
+		if (any) {
+			results[i] = std::move(brick);
+		}
+	};
+
+	const uint64_t real_threads = std::max(std::min(threads, static_cast<uint64_t>(targets.size())), static_cast<uint64_t>(1));
+	const uint64_t chunk = (targets.size() + real_threads - 1) / real_threads;
+
+	auto process_chunk = [&](const uint64_t start, const uint64_t end) {
+		std::vector<LABEL> tile_in, tile_out;
+		for (uint64_t i = start; i < end; i++) {
+			process_brick(i, tile_in, tile_out);
+		}
+	};
+
+	if (real_threads == 1) {
+		process_chunk(0, targets.size());
+	}
+	else {
+		ThreadPool pool(real_threads);
+		for (uint64_t start = 0; start < targets.size(); start += chunk) {
+			pool.enqueue([&, start]() {
+				process_chunk(start, std::min(start + chunk, static_cast<uint64_t>(targets.size())));
+			});
+		}
+		pool.join();
+	}
+
+	BrickVolume<LABEL> result(vol.sx, vol.sy, vol.sz);
+	result.bricks.reserve(targets.size());
+	for (uint64_t i = 0; i < targets.size(); i++) {
+		if (!results[i].empty()) {
+			result.bricks.emplace(targets[i], std::move(results[i]));
+		}
+	}
+	return result;
+}
+
+// Applies op iterations times to a BrickVolume.
+template <typename LABEL>
+BrickVolume<LABEL> brick_morph(
+	BrickVolume<LABEL> vol,
+	const StableOp op, const bool grey, const bool background_only,
+	const uint64_t iterations, const uint64_t threads
+) {
+	FASTMORPH_DISPATCH_TO(LABEL, brick_morph, std::move(vol), op, grey, background_only, iterations, threads);
+	const std::vector<bool> stages = stencil_passes(op);
+	for (uint64_t i = 0; i < iterations; i++) {
+		for (const bool dilate : stages) {
+			vol = brick_pass<LABEL>(vol, dilate, grey, background_only, threads);
+		}
+	}
+	return vol;
+}
+
+FASTMORPH_KERNELS_END
+
+// Entry points of one instruction set's copy of the kernels.
+// Floating point tables only have the grey kernels.
+template <typename LABEL>
+struct KernelTable {
+	void (*multilabel_dilate_3d)(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, bool, uint64_t, ContactMap<LABEL>*, ChangeStats<LABEL>*, KernelStats*, HotCounters*);
+	void (*multilabel_dilate_2d)(LABEL*, LABEL*, uint64_t, uint64_t, bool, uint64_t, ContactMap<LABEL>*, ChangeStats<LABEL>*, KernelStats*, HotCounters*);
+	void (*multilabel_erode_3d)(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, uint64_t, ChangeStats<LABEL>*, HotCounters*);
+	void (*multilabel_erode_2d)(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, ChangeStats<LABEL>*, HotCounters*);
+	void (*grey_dilate_3d)(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, uint64_t, HotCounters*);
+	void (*grey_dilate_2d)(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, HotCounters*);
+	void (*grey_erode_3d)(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, uint64_t, HotCounters*);
+	void (*grey_erode_2d)(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, HotCounters*);
+	void (*grey_dilate_weighted_3d)(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, const GreyWeight<LABEL>*, const uint8_t*, uint64_t);
+	void (*grey_dilate_weighted_2d)(LABEL*, LABEL*, uint64_t, uint64_t, const GreyWeight<LABEL>*, const uint8_t*, uint64_t);
+	void (*grey_erode_weighted_3d)(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, const GreyWeight<LABEL>*, const uint8_t*, uint64_t);
+	void (*grey_erode_weighted_2d)(LABEL*, LABEL*, uint64_t, uint64_t, const GreyWeight<LABEL>*, const uint8_t*, uint64_t);
+	void (*multilabel_radius_morph_3d)(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, const RadiusMap<LABEL>&, uint64_t);
+	void (*multilabel_radius_morph_2d)(LABEL*, LABEL*, uint64_t, uint64_t, const RadiusMap<LABEL>&, uint64_t);
+	void (*morph_each_label_3d)(const LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, LabelOp, double, const float*, uint64_t);
+	void (*morph_each_label_2d)(const LABEL*, LABEL*, uint64_t, uint64_t, LabelOp, double, const float*, uint64_t);
+	uint64_t (*iterate_until_stable_3d)(LABEL*, uint64_t, uint64_t, uint64_t, StableOp, bool, bool, uint64_t, uint64_t);
+	uint64_t (*iterate_until_stable_2d)(LABEL*, uint64_t, uint64_t, StableOp, bool, bool, uint64_t, uint64_t);
+	void (*sparse_morph_3d)(const LABEL*, uint64_t, uint64_t, uint64_t, StableOp, bool, bool, uint64_t, std::vector<uint64_t>&, std::vector<LABEL>&);
+	void (*sparse_morph_2d)(const LABEL*, uint64_t, uint64_t, StableOp, bool, bool, uint64_t, std::vector<uint64_t>&, std::vector<LABEL>&);
+	void (*paint_points)(const int64_t*, const LABEL*, uint64_t, LABEL*, uint64_t, uint64_t, uint64_t, float, const float*, Footprint, bool, uint64_t);
+	BrickVolume<LABEL> (*brick_morph)(BrickVolume<LABEL>, StableOp, bool, bool, uint64_t, uint64_t);
+};
+
+#ifdef FASTMORPH_ISA_NAMESPACE
+
+FASTMORPH_KERNELS_BEGIN
+
+// instantiated for every dtype by fastmorph_avx2.cpp and fastmorph_avx512.cpp
+template <typename LABEL>
+const KernelTable<LABEL>& kernel_table() {
+	static const KernelTable<LABEL> table = []() {
+		KernelTable<LABEL> t = {};
+		t.grey_dilate_3d = grey_dilate<LABEL>;
+		t.grey_dilate_2d = grey_dilate<LABEL>;
+		t.grey_erode_3d = grey_erode<LABEL>;
+		t.grey_erode_2d = grey_erode<LABEL>;
+		t.grey_dilate_weighted_3d = grey_dilate_weighted<LABEL>;
+		t.grey_dilate_weighted_2d = grey_dilate_weighted<LABEL>;
+		t.grey_erode_weighted_3d = grey_erode_weighted<LABEL>;
+		t.grey_erode_weighted_2d = grey_erode_weighted<LABEL>;
+		if constexpr (!std::is_floating_point<LABEL>::value) {
+			t.multilabel_dilate_3d = multilabel_dilate<LABEL>;
+			t.multilabel_dilate_2d = multilabel_dilate<LABEL>;
+			t.multilabel_erode_3d = multilabel_erode<LABEL>;
+			t.multilabel_erode_2d = multilabel_erode<LABEL>;
+			t.multilabel_radius_morph_3d = multilabel_radius_morph<LABEL>;
+			t.multilabel_radius_morph_2d = multilabel_radius_morph<LABEL>;
+			t.morph_each_label_3d = morph_each_label<LABEL>;
+			t.morph_each_label_2d = morph_each_label<LABEL>;
+			t.iterate_until_stable_3d = iterate_until_stable<LABEL>;
+			t.iterate_until_stable_2d = iterate_until_stable<LABEL>;
+			t.sparse_morph_3d = sparse_morph<LABEL>;
+			t.sparse_morph_2d = sparse_morph<LABEL>;
+			t.paint_points = paint_points<LABEL>;
+			t.brick_morph = brick_morph<LABEL>;
+		}
+		return t;
+	}();
+	return table;
+}
+
+FASTMORPH_KERNELS_END
+
+#elif FASTMORPH_DISPATCH_ENABLED
+
+namespace avx2 {
+template <typename LABEL>
+const KernelTable<LABEL>& kernel_table();
+}
+
+namespace avx512 {
+template <typename LABEL>
+const KernelTable<LABEL>& kernel_table();
+}
+
+// nullptr when the baseline copy is selected
+template <typename LABEL>
+const KernelTable<LABEL>* dispatched_kernels() {
+	switch (cpu::selected_isa()) {
+		case cpu::Isa::AVX512:
+			return &avx512::kernel_table<LABEL>();
+		case cpu::Isa::AVX2:
+			return &avx2::kernel_table<LABEL>();
+		default:
+			return nullptr;
+	}
+}
+
+#endif
+
+// Explicit instantiations of the kernels for every dtype the
+// python module dispatches to. fastmorph_c.cpp compiles them into
+// the fastmorph library (CMakeLists.txt). C++ code linking the
+// library gets FASTMORPH_USE_LIBRARY from the CMake target, which
+// turns these into extern declarations so the kernels aren't
+// compiled again in every translation unit. The library and its
+// users must agree on FASTMORPH_HOT_COUNTERS. Floating point
+// images only have the grey kernels.
+#define FASTMORPH_INSTANTIATE_GREY_KERNELS(PREFIX, LABEL) \
+	PREFIX template void grey_dilate<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, uint64_t, HotCounters*); \
+	PREFIX template void grey_dilate<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, HotCounters*); \
+	PREFIX template void grey_erode<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, uint64_t, HotCounters*); \
+	PREFIX template void grey_erode<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, HotCounters*); \
+	PREFIX template void grey_dilate_weighted<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, const GreyWeight<LABEL>*, const uint8_t*, uint64_t); \
+	PREFIX template void grey_dilate_weighted<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, const GreyWeight<LABEL>*, const uint8_t*, uint64_t); \
+	PREFIX template void grey_erode_weighted<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, const GreyWeight<LABEL>*, const uint8_t*, uint64_t); \
+	PREFIX template void grey_erode_weighted<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, const GreyWeight<LABEL>*, const uint8_t*, uint64_t); \
+	PREFIX template void morph_batch<LABEL>(const BatchItem<LABEL>*, uint64_t, StableOp, bool, bool, uint64_t);
+
+#define FASTMORPH_INSTANTIATE_KERNELS(PREFIX, LABEL) \
+	FASTMORPH_INSTANTIATE_GREY_KERNELS(PREFIX, LABEL) \
+	PREFIX template void multilabel_dilate<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, bool, uint64_t, ContactMap<LABEL>*, ChangeStats<LABEL>*, KernelStats*, HotCounters*); \
+	PREFIX template void multilabel_dilate<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, bool, uint64_t, ContactMap<LABEL>*, ChangeStats<LABEL>*, KernelStats*, HotCounters*); \
+	PREFIX template void multilabel_erode<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, uint64_t, ChangeStats<LABEL>*, HotCounters*); \
+	PREFIX template void multilabel_erode<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, ChangeStats<LABEL>*, HotCounters*); \
+	PREFIX template void multilabel_radius_morph<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, const RadiusMap<LABEL>&, uint64_t); \
+	PREFIX template void multilabel_radius_morph<LABEL>(LABEL*, LABEL*, uint64_t, uint64_t, const RadiusMap<LABEL>&, uint64_t); \
+	PREFIX template void morph_each_label<LABEL>(const LABEL*, LABEL*, uint64_t, uint64_t, uint64_t, LabelOp, double, const float*, uint64_t); \
+	PREFIX template void morph_each_label<LABEL>(const LABEL*, LABEL*, uint64_t, uint64_t, LabelOp, double, const float*, uint64_t); \
+	PREFIX template uint64_t iterate_until_stable<LABEL>(LABEL*, uint64_t, uint64_t, uint64_t, StableOp, bool, bool, uint64_t, uint64_t); \
+	PREFIX template uint64_t iterate_until_stable<LABEL>(LABEL*, uint64_t, uint64_t, StableOp, bool, bool, uint64_t, uint64_t); \
+	PREFIX template void sparse_morph<LABEL>(const LABEL*, uint64_t, uint64_t, uint64_t, StableOp, bool, bool, uint64_t, std::vector<uint64_t>&, std::vector<LABEL>&); \
+	PREFIX template void sparse_morph<LABEL>(const LABEL*, uint64_t, uint64_t, StableOp, bool, bool, uint64_t, std::vector<uint64_t>&, std::vector<LABEL>&); \
+	PREFIX template void paint_points<LABEL>(const int64_t*, const LABEL*, uint64_t, LABEL*, uint64_t, uint64_t, uint64_t, float, const float*, Footprint, bool, uint64_t); \
+	PREFIX template std::unordered_map<LABEL, BoundingBox> bounding_boxes<LABEL>(const LABEL*, uint64_t, uint64_t, uint64_t, uint64_t); \
+	PREFIX template BrickVolume<LABEL> brick_morph<LABEL>(BrickVolume<LABEL>, StableOp, bool, bool, uint64_t, uint64_t);
+
+#define FASTMORPH_FOR_EACH_DTYPE(MACRO, PREFIX) \
+	MACRO(PREFIX, uint8_t) \
+	MACRO(PREFIX, uint16_t) \
+	MACRO(PREFIX, uint32_t) \
+	MACRO(PREFIX, uint64_t) \
+	MACRO(PREFIX, int8_t) \
+	MACRO(PREFIX, int16_t) \
+	MACRO(PREFIX, int32_t) \
+	MACRO(PREFIX, int64_t)
+
+#define FASTMORPH_FOR_EACH_FLOAT_DTYPE(MACRO, PREFIX) \
+	MACRO(PREFIX, float) \
+	MACRO(PREFIX, double)
+
+// the copies in fastmorph_avx2.cpp and fastmorph_avx512.cpp are 
+// always compiled there
+#if defined(FASTMORPH_USE_LIBRARY) && !defined(FASTMORPH_ISA_NAMESPACE)
+FASTMORPH_FOR_EACH_DTYPE(FASTMORPH_INSTANTIATE_KERNELS, extern)
+FASTMORPH_FOR_EACH_FLOAT_DTYPE(FASTMORPH_INSTANTIATE_GREY_KERNELS, extern)
+#endif
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,25 @@
+// The kernels of fastmorph.hpp compiled for AVX-512 (x86-64-v4: AVX-512 F, BW, VL, DQ),
+// selected at runtime on CPUs that support it. See cpu_dispatch.hpp.
+// Compiles to nothing unless FASTMORPH_DISPATCH is defined on x86-64.
+
+#include "cpu_dispatch.hpp"
+
+#if FASTMORPH_DISPATCH_ENABLED
+
+#define FASTMORPH_ISA_NAMESPACE avx512
+#define FASTMORPH_ISA_TARGET_BEGIN FASTMORPH_TARGET_AVX512_BEGIN
+#include "fastmorph.hpp"
+
+namespace fastmorph {
+namespace avx512 {
+
+#define FASTMORPH_INSTANTIATE_KERNEL_TABLE(PREFIX, LABEL) \
+	template const KernelTable<LABEL>& kernel_table<LABEL>();
+
+FASTMORPH_FOR_EACH_DTYPE(FASTMORPH_INSTANTIATE_KERNEL_TABLE, )
+FASTMORPH_FOR_EACH_FLOAT_DTYPE(FASTMORPH_INSTANTIATE_KERNEL_TABLE, )
+
+}
+}
+
+#endif
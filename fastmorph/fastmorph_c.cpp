@@ -0,0 +1,433 @@
+/* C API of the fastmorph library, see fastmorph_c.h.
+ *
+ * Also holds the explicit instantiations of the fastmorph.hpp
+ * kernels for every dtype so C++ code linking the library doesn't
+ * have to compile them (see FASTMORPH_USE_LIBRARY).
+ */
+
+#include "fastmorph_c.h"
+
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fastmorph.hpp"
+
+namespace fastmorph {
+
+FASTMORPH_FOR_EACH_DTYPE(FASTMORPH_INSTANTIATE_KERNELS, )
+FASTMORPH_FOR_EACH_FLOAT_DTYPE(FASTMORPH_INSTANTIATE_GREY_KERNELS, )
+
+};
+
+namespace {
+
+struct Error : public std::runtime_error {
+	fastmorph_status status;
+	Error(const fastmorph_status status, const std::string &msg)
+		: std::runtime_error(msg), status(status) {}
+};
+
+std::string& last_error() {
+	thread_local std::string msg;
+	return msg;
+}
+
+template <typename FN>
+fastmorph_status guarded(FN &&fn) {
+	last_error().clear();
+	try {
+		fn();
+		return FASTMORPH_OK;
+	}
+	catch (const Error &e) {
+		last_error() = e.what();
+		return e.status;
+	}
+	catch (const std::bad_alloc &) {
+		last_error() = "Out of memory.";
+		return FASTMORPH_ERROR_OUT_OF_MEMORY;
+	}
+	catch (const std::exception &e) {
+		last_error() = e.what();
+		return FASTMORPH_ERROR_INTERNAL;
+	}
+	catch (...) {
+		last_error() = "Unknown error.";
+		return FASTMORPH_ERROR_INTERNAL;
+	}
+}
+
+template <typename FN>
+void dispatch(const fastmorph_dtype dtype, FN &&fn) {
+	switch (dtype) {
+		case FASTMORPH_UINT8: fn(uint8_t()); break;
+		case FASTMORPH_UINT16: fn(uint16_t()); break;
+		case FASTMORPH_UINT32: fn(uint32_t()); break;
+		case FASTMORPH_UINT64: fn(uint64_t()); break;
+		case FASTMORPH_INT8: fn(int8_t()); break;
+		case FASTMORPH_INT16: fn(int16_t()); break;
+		case FASTMORPH_INT32: fn(int32_t()); break;
+		case FASTMORPH_INT64: fn(int64_t()); break;
+		default:
+			throw Error(FASTMORPH_ERROR_UNSUPPORTED_DTYPE,
+				"Unsupported dtype: " + std::to_string(static_cast<int>(dtype)));
+	}
+}
+
+// dispatch plus the floating point dtypes of the grey kernels
+template <typename FN>
+void dispatch_grey(const fastmorph_dtype dtype, FN &&fn) {
+	switch (dtype) {
+		case FASTMORPH_FLOAT32: fn(float()); break;
+		case FASTMORPH_FLOAT64: fn(double()); break;
+		default: dispatch(dtype, fn);
+	}
+}
+
+struct Shape {
+	int ndim;
+	uint64_t sx, sy, sz;
+	uint64_t voxels;
+
+	Shape(const int ndim, const uint64_t* shape) : ndim(ndim) {
+		if (ndim != 2 && ndim != 3) {
+			throw Error(FASTMORPH_ERROR_INVALID_ARGUMENT,
+				"ndim must be 2 or 3. Got: " + std::to_string(ndim));
+		}
+		if (shape == nullptr) {
+			throw Error(FASTMORPH_ERROR_INVALID_ARGUMENT, "shape must not be NULL.");
+		}
+		sx = shape[0];
+		sy = shape[1];
+		sz = (ndim == 3) ? shape[2] : 1;
+		voxels = sx * sy * sz;
+	}
+};
+
+// An image as the kernels want it: contiguous and Fortran ordered.
+// Other layouts are copied through a temporary buffer.
+template <typename LABEL>
+class Image {
+public:
+	Image(void* data, const int64_t* strides, const Shape &shape)
+		: data(static_cast<char*>(data)), shape(shape)
+	{
+		if (data == nullptr && shape.voxels > 0) {
+			throw Error(FASTMORPH_ERROR_INVALID_ARGUMENT, "Image data must not be NULL.");
+		}
+
+		const int64_t width = sizeof(LABEL);
+		const int64_t fortran[3] = {
+			width,
+			width * static_cast<int64_t>(shape.sx),
+			width * static_cast<int64_t>(shape.sx * shape.sy)
+		};
+		direct = true;
+		for (int i = 0; i < 3; i++) {
+			this->strides[i] = fortran[i];
+		}
+		if (strides == nullptr) {
+			return;
+		}
+		for (int i = 0; i < shape.ndim; i++) {
+			this->strides[i] = strides[i];
+			// strides of axes of size 1 never matter
+			const uint64_t extent = (i == 0) ? shape.sx : ((i == 1) ? shape.sy : shape.sz);
+			direct = direct && (extent <= 1 || strides[i] == fortran[i]);
+		}
+	}
+
+	// pointer to read from, copying into a buffer if needed
+	LABEL* input() {
+		if (direct) {
+			return reinterpret_cast<LABEL*>(data);
+		}
+		buffer.resize(shape.voxels);
+		copy(/*gather=*/true);
+		return buffer.data();
+	}
+
+	// zeroed pointer to write to, the kernels expect a clean output
+	LABEL* output() {
+		if (direct) {
+			std::memset(data, 0, shape.voxels * sizeof(LABEL));
+			return reinterpret_cast<LABEL*>(data);
+		}
+		buffer.assign(shape.voxels, 0);
+		return buffer.data();
+	}
+
+	// copies a buffered output back into the caller's layout
+	void commit() {
+		if (!direct) {
+			copy(/*gather=*/false);
+		}
+	}
+
+private:
+	char* data;
+	Shape shape;
+	int64_t strides[3];
+	bool direct;
+	std::vector<LABEL> buffer;
+
+	void copy(const bool gather) {
+		uint64_t i = 0;
+		for (uint64_t z = 0; z < shape.sz; z++) {
+			for (uint64_t y = 0; y < shape.sy; y++) {
+				char* row = data
+					+ static_cast<int64_t>(y) * strides[1]
+					+ static_cast<int64_t>(z) * strides[2];
+				for (uint64_t x = 0; x < shape.sx; x++, i++) {
+					char* voxel = row + static_cast<int64_t>(x) * strides[0];
+					if (gather) {
+						std::memcpy(&buffer[i], voxel, sizeof(LABEL));
+					}
+					else {
+						std::memcpy(voxel, &buffer[i], sizeof(LABEL));
+					}
+				}
+			}
+		}
+	}
+};
+
+// Runs kernel(input, output) for image operators.
+template <typename LABEL, typename FN>
+void run_unary(
+	const void* input, const int64_t* input_strides,
+	void* output, const int64_t* output_strides,
+	const Shape &shape, FN &&kernel
+) {
+	if (shape.voxels == 0) {
+		return;
+	}
+	Image<LABEL> in(const_cast<void*>(input), input_strides, shape);
+	Image<LABEL> out(output, output_strides, shape);
+	kernel(in.input(), out.output());
+	out.commit();
+}
+
+uint64_t thread_count(const uint64_t threads) {
+	return std::max(threads, static_cast<uint64_t>(1));
+}
+
+}
+
+extern "C" {
+
+const char* fastmorph_version(void) {
+	static const std::string version =
+		std::to_string(FASTMORPH_VERSION_MAJOR) + "."
+		+ std::to_string(FASTMORPH_VERSION_MINOR) + "."
+		+ std::to_string(FASTMORPH_VERSION_PATCH);
+	return version.c_str();
+}
+
+size_t fastmorph_dtype_size(const fastmorph_dtype dtype) {
+	size_t size = 0;
+	const fastmorph_status status = guarded([&]() {
+		dispatch_grey(dtype, [&](auto tag) { size = sizeof(tag); });
+	});
+	return (status == FASTMORPH_OK) ? size : 0;
+}
+
+const char* fastmorph_status_string(const fastmorph_status status) {
+	switch (status) {
+		case FASTMORPH_OK: return "ok";
+		case FASTMORPH_ERROR_INVALID_ARGUMENT: return "invalid argument";
+		case FASTMORPH_ERROR_UNSUPPORTED_DTYPE: return "unsupported dtype";
+		case FASTMORPH_ERROR_OUT_OF_MEMORY: return "out of memory";
+		case FASTMORPH_ERROR_INTERNAL: return "internal error";
+		default: return "unknown status";
+	}
+}
+
+const char* fastmorph_last_error(void) {
+	return last_error().c_str();
+}
+
+fastmorph_status fastmorph_multilabel_dilate(
+	const fastmorph_dtype dtype,
+	const void* labels, const int64_t* label_strides,
+	void* output, const int64_t* output_strides,
+	const int ndim, const uint64_t* shape,
+	const int background_only, const uint64_t threads
+) {
+	return guarded([&]() {
+		const Shape s(ndim, shape);
+		dispatch(dtype, [&](auto tag) {
+			using LABEL = decltype(tag);
+			run_unary<LABEL>(labels, label_strides, output, output_strides, s,
+				[&](LABEL* in, LABEL* out) {
+					if (ndim == 3) {
+						fastmorph::multilabel_dilate<LABEL>(in, out, s.sx, s.sy, s.sz, background_only != 0, thread_count(threads));
+					}
+					else {
+						fastmorph::multilabel_dilate<LABEL>(in, out, s.sx, s.sy, background_only != 0, thread_count(threads));
+					}
+				}
+			);
+		});
+	});
+}
+
+fastmorph_status fastmorph_multilabel_erode(
+	const fastmorph_dtype dtype,
+	const void* labels, const int64_t* label_strides,
+	void* output, const int64_t* output_strides,
+	const int ndim, const uint64_t* shape,
+	const uint64_t threads
+) {
+	return guarded([&]() {
+		const Shape s(ndim, shape);
+		dispatch(dtype, [&](auto tag) {
+			using LABEL = decltype(tag);
+			run_unary<LABEL>(labels, label_strides, output, output_strides, s,
+				[&](LABEL* in, LABEL* out) {
+					if (ndim == 3) {
+						fastmorph::multilabel_erode<LABEL>(in, out, s.sx, s.sy, s.sz, thread_count(threads));
+					}
+					else {
+						fastmorph::multilabel_erode<LABEL>(in, out, s.sx, s.sy, thread_count(threads));
+					}
+				}
+			);
+		});
+	});
+}
+
+fastmorph_status fastmorph_grey_dilate(
+	const fastmorph_dtype dtype,
+	const void* image, const int64_t* image_strides,
+	void* output, const int64_t* output_strides,
+	const int ndim, const uint64_t* shape,
+	const uint64_t threads
+) {
+	return guarded([&]() {
+		const Shape s(ndim, shape);
+		dispatch_grey(dtype, [&](auto tag) {
+			using LABEL = decltype(tag);
+			run_unary<LABEL>(image, image_strides, output, output_strides, s,
+				[&](LABEL* in, LABEL* out) {
+					if (ndim == 3) {
+						fastmorph::grey_dilate<LABEL>(in, out, s.sx, s.sy, s.sz, thread_count(threads));
+					}
+					else {
+						fastmorph::grey_dilate<LABEL>(in, out, s.sx, s.sy, thread_count(threads));
+					}
+				}
+			);
+		});
+	});
+}
+
+fastmorph_status fastmorph_grey_erode(
+	const fastmorph_dtype dtype,
+	const void* image, const int64_t* image_strides,
+	void* output, const int64_t* output_strides,
+	const int ndim, const uint64_t* shape,
+	const uint64_t threads
+) {
+	return guarded([&]() {
+		const Shape s(ndim, shape);
+		dispatch_grey(dtype, [&](auto tag) {
+			using LABEL = decltype(tag);
+			run_unary<LABEL>(image, image_strides, output, output_strides, s,
+				[&](LABEL* in, LABEL* out) {
+					if (ndim == 3) {
+						fastmorph::grey_erode<LABEL>(in, out, s.sx, s.sy, s.sz, thread_count(threads));
+					}
+					else {
+						fastmorph::grey_erode<LABEL>(in, out, s.sx, s.sy, thread_count(threads));
+					}
+				}
+			);
+		});
+	});
+}
+
+fastmorph_status fastmorph_morph_each_label(
+	const fastmorph_dtype dtype,
+	const void* labels, const int64_t* label_strides,
+	void* output, const int64_t* output_strides,
+	const int ndim, const uint64_t* shape,
+	const fastmorph_label_op op, const float radius, const float* anisotropy,
+	const uint64_t threads
+) {
+	return guarded([&]() {
+		const Shape s(ndim, shape);
+		if (op < FASTMORPH_LABEL_ERODE || op > FASTMORPH_LABEL_SPHERICAL_CLOSE) {
+			throw Error(FASTMORPH_ERROR_INVALID_ARGUMENT, "Unsupported op.");
+		}
+
+		float aniso[3] = { 1, 1, 1 };
+		if (anisotropy != nullptr) {
+			for (int i = 0; i < ndim; i++) {
+				aniso[i] = anisotropy[i];
+			}
+		}
+
+		dispatch(dtype, [&](auto tag) {
+			using LABEL = decltype(tag);
+			run_unary<LABEL>(labels, label_strides, output, output_strides, s,
+				[&](LABEL* in, LABEL* out) {
+					const auto label_op = static_cast<fastmorph::LabelOp>(op);
+					if (ndim == 3) {
+						fastmorph::morph_each_label<LABEL>(in, out, s.sx, s.sy, s.sz, label_op, radius, aniso, thread_count(threads));
+					}
+					else {
+						fastmorph::morph_each_label<LABEL>(in, out, s.sx, s.sy, label_op, radius, aniso, thread_count(threads));
+					}
+				}
+			);
+		});
+	});
+}
+
+fastmorph_status fastmorph_iterate_until_stable(
+	const fastmorph_dtype dtype,
+	void* labels, const int64_t* label_strides,
+	const int ndim, const uint64_t* shape,
+	const fastmorph_stable_op op, const int grey, const int background_only,
+	const uint64_t max_iterations, const uint64_t threads,
+	uint64_t* iterations
+) {
+	return guarded([&]() {
+		const Shape s(ndim, shape);
+		if (op < FASTMORPH_STABLE_DILATE || op > FASTMORPH_STABLE_CLOSING) {
+			throw Error(FASTMORPH_ERROR_INVALID_ARGUMENT, "Unsupported op.");
+		}
+
+		uint64_t count = 0;
+		if (s.voxels > 0) {
+			dispatch(dtype, [&](auto tag) {
+				using LABEL = decltype(tag);
+				Image<LABEL> image(labels, label_strides, s);
+				LABEL* data = image.input();
+				const auto stable_op = static_cast<fastmorph::StableOp>(op);
+				if (ndim == 3) {
+					count = fastmorph::iterate_until_stable<LABEL>(
+						data, s.sx, s.sy, s.sz, stable_op, grey != 0, background_only != 0,
+						max_iterations, thread_count(threads)
+					);
+				}
+				else {
+					count = fastmorph::iterate_until_stable<LABEL>(
+						data, s.sx, s.sy, stable_op, grey != 0, background_only != 0,
+						max_iterations, thread_count(threads)
+					);
+				}
+				image.commit();
+			});
+		}
+		if (iterations != nullptr) {
+			*iterations = count;
+		}
+	});
+}
+
+}
@@ -0,0 +1,168 @@
+#ifndef __FASTMORPH_C_H__
+#define __FASTMORPH_C_H__
+
+/* C API of the fastmorph library (see CMakeLists.txt).
+ *
+ * Images are described by a data pointer, ndim (2 or 3), a shape,
+ * and strides in bytes per axis. NULL strides mean a contiguous
+ * Fortran ordered (x fastest) image, which the kernels run on
+ * directly. Any other layout, including C order and negative
+ * strides, is copied into a Fortran ordered buffer first (and
+ * copied back out for outputs). Inputs and outputs must not
+ * overlap unless noted.
+ *
+ * Every function returns FASTMORPH_OK or an error status, in which
+ * case fastmorph_last_error() describes what went wrong on the
+ * calling thread. No function throws C++ exceptions or aborts.
+ *
+ * The API and ABI only change in backwards compatible ways within
+ * a major version. Enum values are never renumbered.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(FASTMORPH_SHARED)
+	#ifdef FASTMORPH_BUILDING_LIBRARY
+		#define FASTMORPH_API __declspec(dllexport)
+	#else
+		#define FASTMORPH_API __declspec(dllimport)
+	#endif
+#elif defined(__GNUC__)
+	#define FASTMORPH_API __attribute__((visibility("default")))
+#else
+	#define FASTMORPH_API
+#endif
+
+#define FASTMORPH_VERSION_MAJOR 1
+#define FASTMORPH_VERSION_MINOR 2
+#define FASTMORPH_VERSION_PATCH 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	FASTMORPH_OK = 0,
+	FASTMORPH_ERROR_INVALID_ARGUMENT = 1,
+	FASTMORPH_ERROR_UNSUPPORTED_DTYPE = 2,
+	FASTMORPH_ERROR_OUT_OF_MEMORY = 3,
+	FASTMORPH_ERROR_INTERNAL = 4
+} fastmorph_status;
+
+typedef enum {
+	FASTMORPH_UINT8 = 0,
+	FASTMORPH_UINT16 = 1,
+	FASTMORPH_UINT32 = 2,
+	FASTMORPH_UINT64 = 3,
+	FASTMORPH_INT8 = 4,
+	FASTMORPH_INT16 = 5,
+	FASTMORPH_INT32 = 6,
+	FASTMORPH_INT64 = 7,
+	/* only accepted by the grey functions */
+	FASTMORPH_FLOAT32 = 8,
+	FASTMORPH_FLOAT64 = 9
+} fastmorph_dtype;
+
+/* matches fastmorph::StableOp */
+typedef enum {
+	FASTMORPH_STABLE_DILATE = 0,
+	FASTMORPH_STABLE_ERODE = 1,
+	FASTMORPH_STABLE_OPENING = 2,
+	FASTMORPH_STABLE_CLOSING = 3
+} fastmorph_stable_op;
+
+/* matches fastmorph::LabelOp */
+typedef enum {
+	FASTMORPH_LABEL_ERODE = 0,
+	FASTMORPH_LABEL_DILATE = 1,
+	FASTMORPH_LABEL_OPENING = 2,
+	FASTMORPH_LABEL_CLOSING = 3,
+	FASTMORPH_LABEL_FILL = 4,
+	FASTMORPH_LABEL_SPHERICAL_ERODE = 5,
+	FASTMORPH_LABEL_SPHERICAL_DILATE = 6,
+	FASTMORPH_LABEL_SPHERICAL_OPEN = 7,
+	FASTMORPH_LABEL_SPHERICAL_CLOSE = 8
+} fastmorph_label_op;
+
+/* "MAJOR.MINOR.PATCH" of the library actually loaded */
+FASTMORPH_API const char* fastmorph_version(void);
+
+FASTMORPH_API size_t fastmorph_dtype_size(fastmorph_dtype dtype);
+
+FASTMORPH_API const char* fastmorph_status_string(fastmorph_status status);
+
+/* Message of the last error on this thread, "" if none. */
+FASTMORPH_API const char* fastmorph_last_error(void);
+
+/* 3x3(x3) multilabel dilation: each voxel becomes the most
+ * frequent label of its neighborhood. With background_only,
+ * only zero voxels change. */
+FASTMORPH_API fastmorph_status fastmorph_multilabel_dilate(
+	fastmorph_dtype dtype,
+	const void* labels, const int64_t* label_strides,
+	void* output, const int64_t* output_strides,
+	int ndim, const uint64_t* shape,
+	int background_only, uint64_t threads
+);
+
+/* 3x3(x3) multilabel erosion: a voxel keeps its label only when
+ * its whole neighborhood has that label. */
+FASTMORPH_API fastmorph_status fastmorph_multilabel_erode(
+	fastmorph_dtype dtype,
+	const void* labels, const int64_t* label_strides,
+	void* output, const int64_t* output_strides,
+	int ndim, const uint64_t* shape,
+	uint64_t threads
+);
+
+/* 3x3(x3) grey (max) dilation. Also takes float32 and float64
+ * images, where NaN spreads to every voxel whose neighborhood 
+ * contains it. */
+FASTMORPH_API fastmorph_status fastmorph_grey_dilate(
+	fastmorph_dtype dtype,
+	const void* image, const int64_t* image_strides,
+	void* output, const int64_t* output_strides,
+	int ndim, const uint64_t* shape,
+	uint64_t threads
+);
+
+/* 3x3(x3) grey (min) erosion, dtypes as in fastmorph_grey_dilate */
+FASTMORPH_API fastmorph_status fastmorph_grey_erode(
+	fastmorph_dtype dtype,
+	const void* image, const int64_t* image_strides,
+	void* output, const int64_t* output_strides,
+	int ndim, const uint64_t* shape,
+	uint64_t threads
+);
+
+/* Applies op to each label separately (see fastmorph::LabelOp).
+ * anisotropy is ndim floats or NULL for isotropic voxels. */
+FASTMORPH_API fastmorph_status fastmorph_morph_each_label(
+	fastmorph_dtype dtype,
+	const void* labels, const int64_t* label_strides,
+	void* output, const int64_t* output_strides,
+	int ndim, const uint64_t* shape,
+	fastmorph_label_op op, float radius, const float* anisotropy,
+	uint64_t threads
+);
+
+/* Repeats op in place until nothing changes or max_iterations
+ * (0 for no limit) is reached. grey selects grey instead of
+ * multilabel morphology. Multilabel ops that can flip between 
+ * two states also stop when the image repeats itself. 
+ * iterations may be NULL. */
+FASTMORPH_API fastmorph_status fastmorph_iterate_until_stable(
+	fastmorph_dtype dtype,
+	void* labels, const int64_t* label_strides,
+	int ndim, const uint64_t* shape,
+	fastmorph_stable_op op, int grey, int background_only,
+	uint64_t max_iterations, uint64_t threads,
+	uint64_t* iterations
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
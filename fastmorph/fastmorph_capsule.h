@@ -0,0 +1,77 @@
+#ifndef __FASTMORPH_CAPSULE_H__
+#define __FASTMORPH_CAPSULE_H__
+
+/* Kernels of the fastmorphops Python extension as C function
+ * pointers, for Cython, numba, or C/C++ extensions that call them
+ * in tight loops and want to skip Python call overhead, numpy
+ * arrays, and the GIL. This header has no dependencies and isn't
+ * needed to build fastmorph, fastmorph.get_include() points at it.
+ *
+ * The submodule fastmorphops.capi holds one PyCapsule per op,
+ * dimensionality, and dtype, named after its attribute:
+ *
+ *   "fastmorphops.capi.<op>_<ndim>d_<dtype>"
+ *
+ *   op: multilabel_dilate    (fastmorph_capi_dilate_fn)
+ *       multilabel_erode     (fastmorph_capi_morph_fn)
+ *       grey_dilate          (fastmorph_capi_morph_fn)
+ *       grey_erode           (fastmorph_capi_morph_fn)
+ *   ndim: 2 or 3
+ *   dtype: uint8, uint16, uint32, uint64, int8, int16, int32,
+ *       int64, and for the grey ops float32 and float64
+ *
+ * e.g. from C, with the GIL held:
+ *
+ *   fastmorph_capi_morph_fn erode = (fastmorph_capi_morph_fn)
+ *     PyCapsule_Import("fastmorphops.capi.grey_erode_3d_float32", 0);
+ *
+ * fastmorph.kernel_address(op, dtype, ndim) returns the same
+ * pointer as an int for ctypes and numba.
+ *
+ * Images are contiguous and Fortran ordered (x fastest), of the
+ * entry point's dtype, and input and output must not overlap. The
+ * whole output is overwritten. 2D entry points take sz == 1.
+ * threads = 0 means 1. Results are those of the Python functions.
+ *
+ * The entry points don't touch Python objects, never raise or
+ * throw, and may be called without the GIL from any thread as
+ * long as fastmorphops stays imported. They return 0 on success or
+ * one of the statuses below, numbered as in fastmorph_c.h.
+ *
+ * fastmorphops.capi.ABI_VERSION is FASTMORPH_CAPI_ABI_VERSION of
+ * the build and only changes when existing signatures or
+ * semantics do. New entry points may be added without a change.
+ */
+
+#include <stdint.h>
+
+#define FASTMORPH_CAPI_ABI_VERSION 1
+
+#define FASTMORPH_CAPI_OK 0
+#define FASTMORPH_CAPI_ERROR_INVALID_ARGUMENT 1
+#define FASTMORPH_CAPI_ERROR_OUT_OF_MEMORY 3
+#define FASTMORPH_CAPI_ERROR_INTERNAL 4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* multilabel_dilate: with background_only != 0 only zero voxels change */
+typedef int (*fastmorph_capi_dilate_fn)(
+	const void* labels, void* output,
+	uint64_t sx, uint64_t sy, uint64_t sz,
+	int background_only, uint64_t threads
+);
+
+/* multilabel_erode, grey_dilate, and grey_erode */
+typedef int (*fastmorph_capi_morph_fn)(
+	const void* labels, void* output,
+	uint64_t sx, uint64_t sy, uint64_t sz,
+	uint64_t threads
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -6,8 +6,15 @@
 
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
+#include <list>
+#include <new>
 
 #include "fastmorph.hpp"
+#include "fastmorph_capsule.h"
+
+#define FASTMORPH_REPLACE_OPERATOR_NEW
+#include "memory_tracker.hpp"
 
 namespace py = pybind11;
 
@@ -54,6 +61,101 @@ py::array to_numpy(
 	);
 }
 
+template <typename LABEL>
+py::tuple contacts_to_numpy(const fastmorph::ContactMap<LABEL> &contacts) {
+	std::vector<std::pair<std::pair<LABEL, LABEL>, uint64_t>> items(
+		contacts.begin(), contacts.end()
+	);
+	std::sort(items.begin(), items.end());
+
+	const uint64_t n = items.size();
+	LABEL* pairs = new LABEL[n * 2]();
+	uint64_t* counts = new uint64_t[n]();
+
+	for (uint64_t i = 0; i < n; i++) {
+		pairs[i] = items[i].first.first;
+		pairs[i + n] = items[i].first.second;
+		counts[i] = items[i].second;
+	}
+
+	return py::make_tuple(
+		to_numpy(pairs, n, 2), 
+		to_numpy(counts, n, 1)
+	);
+}
+
+template <typename LABEL>
+py::tuple changes_to_numpy(const fastmorph::ChangeStats<LABEL> &changes) {
+	std::vector<LABEL> keys;
+	keys.reserve(changes.size());
+	for (auto& [label, change] : changes) {
+		keys.push_back(label);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	const uint64_t n = keys.size();
+	LABEL* labels = new LABEL[n]();
+	uint64_t* counts = new uint64_t[n * 4]();
+
+	for (uint64_t i = 0; i < n; i++) {
+		const fastmorph::LabelChange &change = changes.at(keys[i]);
+		labels[i] = keys[i];
+		counts[i] = change.gained;
+		counts[i + n] = change.lost;
+		counts[i + 2 * n] = change.before;
+		counts[i + 3 * n] = change.after;
+	}
+
+	return py::make_tuple(
+		to_numpy(labels, n, 1), 
+		to_numpy(counts, n, 4)
+	);
+}
+
+// { kernel name: blocks processed }
+py::dict kernels_to_dict(const fastmorph::KernelStats &stats) {
+	py::dict out;
+	for (int i = 0; i < fastmorph::NUM_BLOCK_KERNELS; i++) {
+		out[fastmorph::block_kernel_name(static_cast<fastmorph::BlockKernel>(i))] = stats.blocks[i];
+	}
+	return out;
+}
+
+// { counter name: value }, None when the module was
+// built without FASTMORPH_HOT_COUNTERS
+py::object counters_to_dict(const fastmorph::HotCounters &counters) {
+	if (!fastmorph::HOT_COUNTERS_ENABLED) {
+		return py::none();
+	}
+	py::dict out;
+	out["voxels_visited"] = counters.voxels_visited;
+	out["full_sorts"] = counters.full_sorts;
+	out["stencil_reuses"] = counters.stencil_reuses;
+	out["fast_path_hits"] = counters.fast_path_hits;
+	out["skipped_voxels"] = counters.skipped_voxels;
+	out["blocks"] = counters.blocks;
+	out["block_seconds"] = static_cast<double>(counters.block_ns) / 1e9;
+	out["max_block_seconds"] = static_cast<double>(counters.max_block_ns) / 1e9;
+	return out;
+}
+
+template <typename LABEL>
+py::tuple vectors_to_numpy(
+	const std::vector<uint64_t> &indices, 
+	const std::vector<LABEL> &values
+) {
+	const uint64_t n = indices.size();
+	uint64_t* indices_ptr = new uint64_t[n]();
+	LABEL* values_ptr = new LABEL[n]();
+	std::copy(indices.begin(), indices.end(), indices_ptr);
+	std::copy(values.begin(), values.end(), values_ptr);
+
+	return py::make_tuple(
+		to_numpy(indices_ptr, n, 1), 
+		to_numpy(values_ptr, n, 1)
+	);
+}
+
 #define DISPATCH_TO_TYPES(FUNCTION_MACRO)\
 	if (dt.kind() == 'i') {\
 		if (width == 1) {\
@@ -87,6 +189,31 @@ py::array to_numpy(
 		}\
 	}
 
+// DISPATCH_TO_TYPES plus float32 and float64 for the grey kernels
+#define DISPATCH_TO_GREY_TYPES(FUNCTION_MACRO)\
+	if (dt.kind() == 'f') {\
+		if (width == 4) {\
+			FUNCTION_MACRO(float)\
+		}\
+		else if (width == 8) {\
+			FUNCTION_MACRO(double)\
+		}\
+		else {\
+			delete[] output_ptr;\
+			throw std::runtime_error("Only float32 and float64 floating point images are supported.");\
+		}\
+	}\
+	else {\
+		DISPATCH_TO_TYPES(FUNCTION_MACRO)\
+	}
+
+// weights of non-flat structuring elements in the type the 
+// kernels take for LABEL images
+template <typename LABEL>
+py::array_t<fastmorph::GreyWeight<LABEL>> grey_weights(const py::array &weights) {
+	return py::array_t<fastmorph::GreyWeight<LABEL>, py::array::c_style | py::array::forcecast>(weights);
+}
+
 
 // assumes fortran order
 py::array multilabel_dilate(
@@ -138,6 +265,88 @@ py::array multilabel_dilate(
 #undef DILATE_HELPER_2D
 }
 
+py::tuple multilabel_dilate_tracked(
+	const py::array &labels, 
+	const bool background_only,
+	const int threads,
+	const bool track_contacts,
+	const bool track_changes,
+	const bool track_kernels,
+	const bool track_counters
+) {
+	py::dtype dt = labels.dtype();
+	int width = dt.itemsize();
+
+	const uint64_t sx = labels.shape()[0];
+	const uint64_t sy = labels.shape()[1];
+	const uint64_t sz = labels.ndim() > 2 
+		? labels.shape()[2] 
+		: 1;
+
+	void* labels_ptr = const_cast<void*>(labels.data());
+	uint8_t* output_ptr = new uint8_t[sx * sy * sz * width]();
+
+#define DILATE_TRACKED_HELPER_3D(uintx_t)\
+	{\
+		fastmorph::ContactMap<uintx_t> contacts;\
+		fastmorph::ChangeStats<uintx_t> changes;\
+		fastmorph::KernelStats kernels;\
+		fastmorph::HotCounters counters;\
+		fastmorph::multilabel_dilate(\
+			reinterpret_cast<uintx_t*>(labels_ptr),\
+			reinterpret_cast<uintx_t*>(output_ptr),\
+			sx, sy, sz,\
+			background_only, threads,\
+			(track_contacts ? &contacts : nullptr),\
+			(track_changes ? &changes : nullptr),\
+			(track_kernels ? &kernels : nullptr),\
+			(track_counters ? &counters : nullptr)\
+		);\
+		return py::make_tuple(\
+			to_numpy(reinterpret_cast<uintx_t*>(output_ptr), sx, sy, sz),\
+			(track_contacts ? py::object(contacts_to_numpy(contacts)) : py::object(py::none())),\
+			(track_changes ? py::object(changes_to_numpy(changes)) : py::object(py::none())),\
+			(track_kernels ? py::object(kernels_to_dict(kernels)) : py::object(py::none())),\
+			(track_counters ? counters_to_dict(counters) : py::object(py::none()))\
+		);\
+	}
+
+#define DILATE_TRACKED_HELPER_2D(uintx_t)\
+	{\
+		fastmorph::ContactMap<uintx_t> contacts;\
+		fastmorph::ChangeStats<uintx_t> changes;\
+		fastmorph::KernelStats kernels;\
+		fastmorph::HotCounters counters;\
+		fastmorph::multilabel_dilate(\
+			reinterpret_cast<uintx_t*>(labels_ptr),\
+			reinterpret_cast<uintx_t*>(output_ptr),\
+			sx, sy,\
+			background_only, threads,\
+			(track_contacts ? &contacts : nullptr),\
+			(track_changes ? &changes : nullptr),\
+			(track_kernels ? &kernels : nullptr),\
+			(track_counters ? &counters : nullptr)\
+		);\
+		return py::make_tuple(\
+			to_numpy(reinterpret_cast<uintx_t*>(output_ptr), sx, sy),\
+			(track_contacts ? py::object(contacts_to_numpy(contacts)) : py::object(py::none())),\
+			(track_changes ? py::object(changes_to_numpy(changes)) : py::object(py::none())),\
+			(track_kernels ? py::object(kernels_to_dict(kernels)) : py::object(py::none())),\
+			(track_counters ? counters_to_dict(counters) : py::object(py::none()))\
+		);\
+	}
+
+	if (labels.ndim() > 2) {
+		DISPATCH_TO_TYPES(DILATE_TRACKED_HELPER_3D)
+	}
+	else {
+		DISPATCH_TO_TYPES(DILATE_TRACKED_HELPER_2D)
+	}
+
+#undef DILATE_TRACKED_HELPER_3D
+#undef DILATE_TRACKED_HELPER_2D
+}
+
 // assumes fortran order
 py::array multilabel_erode(const py::array &labels, const uint64_t threads) {
 	py::dtype dt = labels.dtype();
@@ -183,6 +392,73 @@ py::array multilabel_erode(const py::array &labels, const uint64_t threads) {
 #undef ERODE_HELPER_2D
 }
 
+py::tuple multilabel_erode_tracked(
+	const py::array &labels, 
+	const uint64_t threads,
+	const bool track_changes,
+	const bool track_counters
+) {
+	py::dtype dt = labels.dtype();
+	int width = dt.itemsize();
+
+	const uint64_t sx = labels.shape()[0];
+	const uint64_t sy = labels.shape()[1];
+	const uint64_t sz = labels.ndim() > 2 
+		? labels.shape()[2] 
+		: 1;
+
+	void* labels_ptr = const_cast<void*>(labels.data());
+	uint8_t* output_ptr = new uint8_t[sx * sy * sz * width]();
+
+#define ERODE_TRACKED_HELPER_3D(uintx_t)\
+	{\
+		fastmorph::ChangeStats<uintx_t> changes;\
+		fastmorph::HotCounters counters;\
+		fastmorph::multilabel_erode(\
+			reinterpret_cast<uintx_t*>(labels_ptr),\
+			reinterpret_cast<uintx_t*>(output_ptr),\
+			sx, sy, sz,\
+			threads,\
+			(track_changes ? &changes : nullptr),\
+			(track_counters ? &counters : nullptr)\
+		);\
+		return py::make_tuple(\
+			to_numpy(reinterpret_cast<uintx_t*>(output_ptr), sx, sy, sz),\
+			(track_changes ? py::object(changes_to_numpy(changes)) : py::object(py::none())),\
+			(track_counters ? counters_to_dict(counters) : py::object(py::none()))\
+		);\
+	}
+
+#define ERODE_TRACKED_HELPER_2D(uintx_t)\
+	{\
+		fastmorph::ChangeStats<uintx_t> changes;\
+		fastmorph::HotCounters counters;\
+		fastmorph::multilabel_erode(\
+			reinterpret_cast<uintx_t*>(labels_ptr),\
+			reinterpret_cast<uintx_t*>(output_ptr),\
+			sx, sy,\
+			threads,\
+			(track_changes ? &changes : nullptr),\
+			(track_counters ? &counters : nullptr)\
+		);\
+		return py::make_tuple(\
+			to_numpy(reinterpret_cast<uintx_t*>(output_ptr), sx, sy),\
+			(track_changes ? py::object(changes_to_numpy(changes)) : py::object(py::none())),\
+			(track_counters ? counters_to_dict(counters) : py::object(py::none()))\
+		);\
+	}
+
+	if (labels.ndim() > 2) {
+		DISPATCH_TO_TYPES(ERODE_TRACKED_HELPER_3D)
+	}
+	else {
+		DISPATCH_TO_TYPES(ERODE_TRACKED_HELPER_2D)
+	}
+
+#undef ERODE_TRACKED_HELPER_3D
+#undef ERODE_TRACKED_HELPER_2D
+}
+
 // assumes fortran order
 py::array grey_dilate(const py::array &labels, const uint64_t threads) {
 	py::dtype dt = labels.dtype();
@@ -218,16 +494,70 @@ py::array grey_dilate(const py::array &labels, const uint64_t threads) {
 	return to_numpy(reinterpret_cast<int_t*>(output_ptr), sx, sy);
 
 	if (labels.ndim() > 2) {
-		DISPATCH_TO_TYPES(GREY_DILATE_HELPER_3D)
+		DISPATCH_TO_GREY_TYPES(GREY_DILATE_HELPER_3D)
 	}
 	else {
-		DISPATCH_TO_TYPES(GREY_DILATE_HELPER_2D)
+		DISPATCH_TO_GREY_TYPES(GREY_DILATE_HELPER_2D)
 	}
 
 #undef GREY_DILATE_HELPER_3D
 #undef GREY_DILATE_HELPER_2D
 }
 
+py::tuple grey_dilate_tracked(const py::array &labels, const uint64_t threads) {
+	py::dtype dt = labels.dtype();
+	int width = dt.itemsize();
+
+	const uint64_t sx = labels.shape()[0];
+	const uint64_t sy = labels.shape()[1];
+	const uint64_t sz = labels.ndim() > 2 
+		? labels.shape()[2] 
+		: 1;
+
+	void* labels_ptr = const_cast<void*>(labels.data());
+	uint8_t* output_ptr = new uint8_t[sx * sy * sz * width]();
+
+#define GREY_DILATE_TRACKED_HELPER_3D(int_t)\
+	{\
+		fastmorph::HotCounters counters;\
+		fastmorph::grey_dilate(\
+			reinterpret_cast<int_t*>(labels_ptr),\
+			reinterpret_cast<int_t*>(output_ptr),\
+			sx, sy, sz,\
+			threads, &counters\
+		);\
+		return py::make_tuple(\
+			to_numpy(reinterpret_cast<int_t*>(output_ptr), sx, sy, sz),\
+			counters_to_dict(counters)\
+		);\
+	}
+
+#define GREY_DILATE_TRACKED_HELPER_2D(int_t)\
+	{\
+		fastmorph::HotCounters counters;\
+		fastmorph::grey_dilate(\
+			reinterpret_cast<int_t*>(labels_ptr),\
+			reinterpret_cast<int_t*>(output_ptr),\
+			sx, sy,\
+			threads, &counters\
+		);\
+		return py::make_tuple(\
+			to_numpy(reinterpret_cast<int_t*>(output_ptr), sx, sy),\
+			counters_to_dict(counters)\
+		);\
+	}
+
+	if (labels.ndim() > 2) {
+		DISPATCH_TO_GREY_TYPES(GREY_DILATE_TRACKED_HELPER_3D)
+	}
+	else {
+		DISPATCH_TO_GREY_TYPES(GREY_DILATE_TRACKED_HELPER_2D)
+	}
+
+#undef GREY_DILATE_TRACKED_HELPER_3D
+#undef GREY_DILATE_TRACKED_HELPER_2D
+}
+
 // assumes fortran order
 py::array grey_erode(const py::array &labels, const uint64_t threads) {
 	py::dtype dt = labels.dtype();
@@ -263,22 +593,926 @@ py::array grey_erode(const py::array &labels, const uint64_t threads) {
 	return to_numpy(reinterpret_cast<int_t*>(output_ptr), sx, sy);
 
 	if (labels.ndim() > 2) {
-		DISPATCH_TO_TYPES(GREY_ERODE_HELPER_3D)
+		DISPATCH_TO_GREY_TYPES(GREY_ERODE_HELPER_3D)
 	}
 	else {
-		DISPATCH_TO_TYPES(GREY_ERODE_HELPER_2D)
+		DISPATCH_TO_GREY_TYPES(GREY_ERODE_HELPER_2D)
 	}
 
 #undef GREY_ERODE_HELPER_3D
 #undef GREY_ERODE_HELPER_2D
 }
 
-#undef DISPATCH_TO_TYPES
+py::tuple grey_erode_tracked(const py::array &labels, const uint64_t threads) {
+	py::dtype dt = labels.dtype();
+	int width = dt.itemsize();
 
-PYBIND11_MODULE(fastmorphops, m) {
-	m.doc() = "Accelerated fastmorph functions."; 
-	m.def("multilabel_dilate", &multilabel_dilate, "Morphological dilation of a multilabel volume using mode of a 3x3x3 structuring element.");
-	m.def("grey_dilate", &grey_dilate, "Morphological dilation of a grayscale volume using max of a 3x3x3 structuring element.");
-	m.def("multilabel_erode", &multilabel_erode, "Morphological erosion of a multilabel volume using edge contacts of a 3x3x3 structuring element.");
-	m.def("grey_erode", &grey_erode, "Morphological erosion of a grayscale volume using min of a 3x3x3 structuring element.");
+	const uint64_t sx = labels.shape()[0];
+	const uint64_t sy = labels.shape()[1];
+	const uint64_t sz = labels.ndim() > 2 
+		? labels.shape()[2] 
+		: 1;
+
+	void* labels_ptr = const_cast<void*>(labels.data());
+	uint8_t* output_ptr = new uint8_t[sx * sy * sz * width]();
+
+#define GREY_ERODE_TRACKED_HELPER_3D(int_t)\
+	{\
+		fastmorph::HotCounters counters;\
+		fastmorph::grey_erode(\
+			reinterpret_cast<int_t*>(labels_ptr),\
+			reinterpret_cast<int_t*>(output_ptr),\
+			sx, sy, sz,\
+			threads, &counters\
+		);\
+		return py::make_tuple(\
+			to_numpy(reinterpret_cast<int_t*>(output_ptr), sx, sy, sz),\
+			counters_to_dict(counters)\
+		);\
+	}
+
+#define GREY_ERODE_TRACKED_HELPER_2D(int_t)\
+	{\
+		fastmorph::HotCounters counters;\
+		fastmorph::grey_erode(\
+			reinterpret_cast<int_t*>(labels_ptr),\
+			reinterpret_cast<int_t*>(output_ptr),\
+			sx, sy,\
+			threads, &counters\
+		);\
+		return py::make_tuple(\
+			to_numpy(reinterpret_cast<int_t*>(output_ptr), sx, sy),\
+			counters_to_dict(counters)\
+		);\
+	}
+
+	if (labels.ndim() > 2) {
+		DISPATCH_TO_GREY_TYPES(GREY_ERODE_TRACKED_HELPER_3D)
+	}
+	else {
+		DISPATCH_TO_GREY_TYPES(GREY_ERODE_TRACKED_HELPER_2D)
+	}
+
+#undef GREY_ERODE_TRACKED_HELPER_3D
+#undef GREY_ERODE_TRACKED_HELPER_2D
+}
+
+// assumes fortran order
+// weights and footprint are flattened 3x3x3 (or 3x3) stencils in fortran order,
+// weights are converted to int64 (integer images) or the image's dtype
+py::array grey_dilate_weighted(
+	const py::array &labels, 
+	const py::array &weights,
+	const py::array_t<uint8_t> &footprint,
+	const uint64_t threads
+) {
+	py::dtype dt = labels.dtype();
+	int width = dt.itemsize();
+
+	const uint64_t sx = labels.shape()[0];
+	const uint64_t sy = labels.shape()[1];
+	const uint64_t sz = labels.ndim() > 2 
+		? labels.shape()[2] 
+		: 1;
+
+	const uint64_t stencil_size = labels.ndim() > 2 ? 27 : 9;
+	if (static_cast<uint64_t>(weights.size()) != stencil_size 
+		|| static_cast<uint64_t>(footprint.size()) != stencil_size) {
+		throw std::runtime_error("weights and footprint must be 3x3x3 for 3D images and 3x3 for 2D images.");
+	}
+
+	void* labels_ptr = const_cast<void*>(labels.data());
+	uint8_t* output_ptr = new uint8_t[sx * sy * sz * width]();
+
+#define GREY_DILATE_WEIGHTED_HELPER_3D(int_t)\
+	fastmorph::grey_dilate_weighted(\
+		reinterpret_cast<int_t*>(labels_ptr),\
+		reinterpret_cast<int_t*>(output_ptr),\
+		sx, sy, sz,\
+		grey_weights<int_t>(weights).data(), footprint.data(),\
+		threads\
+	);\
+	return to_numpy(reinterpret_cast<int_t*>(output_ptr), sx, sy, sz);
+
+#define GREY_DILATE_WEIGHTED_HELPER_2D(int_t)\
+	fastmorph::grey_dilate_weighted(\
+		reinterpret_cast<int_t*>(labels_ptr),\
+		reinterpret_cast<int_t*>(output_ptr),\
+		sx, sy,\
+		grey_weights<int_t>(weights).data(), footprint.data(),\
+		threads\
+	);\
+	return to_numpy(reinterpret_cast<int_t*>(output_ptr), sx, sy);
+
+	if (labels.ndim() > 2) {
+		DISPATCH_TO_GREY_TYPES(GREY_DILATE_WEIGHTED_HELPER_3D)
+	}
+	else {
+		DISPATCH_TO_GREY_TYPES(GREY_DILATE_WEIGHTED_HELPER_2D)
+	}
+
+#undef GREY_DILATE_WEIGHTED_HELPER_3D
+#undef GREY_DILATE_WEIGHTED_HELPER_2D
+}
+
+// assumes fortran order
+// weights and footprint are flattened 3x3x3 (or 3x3) stencils in fortran order,
+// weights are converted to int64 (integer images) or the image's dtype
+py::array grey_erode_weighted(
+	const py::array &labels, 
+	const py::array &weights,
+	const py::array_t<uint8_t> &footprint,
+	const uint64_t threads
+) {
+	py::dtype dt = labels.dtype();
+	int width = dt.itemsize();
+
+	const uint64_t sx = labels.shape()[0];
+	const uint64_t sy = labels.shape()[1];
+	const uint64_t sz = labels.ndim() > 2 
+		? labels.shape()[2] 
+		: 1;
+
+	const uint64_t stencil_size = labels.ndim() > 2 ? 27 : 9;
+	if (static_cast<uint64_t>(weights.size()) != stencil_size 
+		|| static_cast<uint64_t>(footprint.size()) != stencil_size) {
+		throw std::runtime_error("weights and footprint must be 3x3x3 for 3D images and 3x3 for 2D images.");
+	}
+
+	void* labels_ptr = const_cast<void*>(labels.data());
+	uint8_t* output_ptr = new uint8_t[sx * sy * sz * width]();
+
+#define GREY_ERODE_WEIGHTED_HELPER_3D(int_t)\
+	fastmorph::grey_erode_weighted(\
+		reinterpret_cast<int_t*>(labels_ptr),\
+		reinterpret_cast<int_t*>(output_ptr),\
+		sx, sy, sz,\
+		grey_weights<int_t>(weights).data(), footprint.data(),\
+		threads\
+	);\
+	return to_numpy(reinterpret_cast<int_t*>(output_ptr), sx, sy, sz);
+
+#define GREY_ERODE_WEIGHTED_HELPER_2D(int_t)\
+	fastmorph::grey_erode_weighted(\
+		reinterpret_cast<int_t*>(labels_ptr),\
+		reinterpret_cast<int_t*>(output_ptr),\
+		sx, sy,\
+		grey_weights<int_t>(weights).data(), footprint.data(),\
+		threads\
+	);\
+	return to_numpy(reinterpret_cast<int_t*>(output_ptr), sx, sy);
+
+	if (labels.ndim() > 2) {
+		DISPATCH_TO_GREY_TYPES(GREY_ERODE_WEIGHTED_HELPER_3D)
+	}
+	else {
+		DISPATCH_TO_GREY_TYPES(GREY_ERODE_WEIGHTED_HELPER_2D)
+	}
+
+#undef GREY_ERODE_WEIGHTED_HELPER_3D
+#undef GREY_ERODE_WEIGHTED_HELPER_2D
+}
+
+// assumes fortran order
+// keys must have the same dtype as labels
+py::array multilabel_radius_morph(
+	const py::array &labels, 
+	const py::array &keys,
+	const py::array_t<int64_t> &radii,
+	const int64_t default_radius,
+	const uint64_t threads
+) {
+	py::dtype dt = labels.dtype();
+	int width = dt.itemsize();
+
+	const uint64_t sx = labels.shape()[0];
+	const uint64_t sy = labels.shape()[1];
+	const uint64_t sz = labels.ndim() > 2 
+		? labels.shape()[2] 
+		: 1;
+
+	if (keys.size() != radii.size()) {
+		throw std::runtime_error("keys and radii must be the same length.");
+	}
+	if (keys.dtype().itemsize() != width) {
+		throw std::runtime_error("keys must have the same dtype as labels.");
+	}
+
+	void* labels_ptr = const_cast<void*>(labels.data());
+	const void* keys_ptr = keys.data();
+	uint8_t* output_ptr = new uint8_t[sx * sy * sz * width]();
+
+#define RADIUS_MORPH_HELPER_3D(uintx_t)\
+	fastmorph::multilabel_radius_morph(\
+		reinterpret_cast<uintx_t*>(labels_ptr),\
+		reinterpret_cast<uintx_t*>(output_ptr),\
+		sx, sy, sz,\
+		fastmorph::RadiusMap<uintx_t>(\
+			reinterpret_cast<const uintx_t*>(keys_ptr), radii.data(), keys.size(),\
+			default_radius\
+		),\
+		threads\
+	);\
+	return to_numpy(reinterpret_cast<uintx_t*>(output_ptr), sx, sy, sz);
+
+#define RADIUS_MORPH_HELPER_2D(uintx_t)\
+	fastmorph::multilabel_radius_morph(\
+		reinterpret_cast<uintx_t*>(labels_ptr),\
+		reinterpret_cast<uintx_t*>(output_ptr),\
+		sx, sy,\
+		fastmorph::RadiusMap<uintx_t>(\
+			reinterpret_cast<const uintx_t*>(keys_ptr), radii.data(), keys.size(),\
+			default_radius\
+		),\
+		threads\
+	);\
+	return to_numpy(reinterpret_cast<uintx_t*>(output_ptr), sx, sy);
+
+	if (labels.ndim() > 2) {
+		DISPATCH_TO_TYPES(RADIUS_MORPH_HELPER_3D)
+	}
+	else {
+		DISPATCH_TO_TYPES(RADIUS_MORPH_HELPER_2D)
+	}
+
+#undef RADIUS_MORPH_HELPER_3D
+#undef RADIUS_MORPH_HELPER_2D
+}
+
+py::array morph_each_label(
+	const py::array &labels, 
+	const int op,
+	const double radius,
+	const std::vector<float> &anisotropy,
+	const uint64_t threads
+) {
+	py::dtype dt = labels.dtype();
+	int width = dt.itemsize();
+
+	const uint64_t sx = labels.shape()[0];
+	const uint64_t sy = labels.shape()[1];
+	const uint64_t sz = labels.ndim() > 2 
+		? labels.shape()[2] 
+		: 1;
+
+	if (op < 0 || op > static_cast<int>(fastmorph::LabelOp::SPHERICAL_CLOSE)) {
+		throw std::runtime_error("Unsupported op.");
+	}
+
+	float aniso[3] = { 1, 1, 1 };
+	for (uint64_t i = 0; i < std::min(anisotropy.size(), static_cast<size_t>(3)); i++) {
+		aniso[i] = anisotropy[i];
+	}
+
+	void* labels_ptr = const_cast<void*>(labels.data());
+	uint8_t* output_ptr = new uint8_t[sx * sy * sz * width]();
+
+#define EACH_LABEL_HELPER_3D(uintx_t)\
+	fastmorph::morph_each_label(\
+		reinterpret_cast<uintx_t*>(labels_ptr),\
+		reinterpret_cast<uintx_t*>(output_ptr),\
+		sx, sy, sz,\
+		static_cast<fastmorph::LabelOp>(op), radius, aniso,\
+		threads\
+	);\
+	return to_numpy(reinterpret_cast<uintx_t*>(output_ptr), sx, sy, sz);
+
+#define EACH_LABEL_HELPER_2D(uintx_t)\
+	fastmorph::morph_each_label(\
+		reinterpret_cast<uintx_t*>(labels_ptr),\
+		reinterpret_cast<uintx_t*>(output_ptr),\
+		sx, sy,\
+		static_cast<fastmorph::LabelOp>(op), radius, aniso,\
+		threads\
+	);\
+	return to_numpy(reinterpret_cast<uintx_t*>(output_ptr), sx, sy);
+
+	if (labels.ndim() > 2) {
+		DISPATCH_TO_TYPES(EACH_LABEL_HELPER_3D)
+	}
+	else {
+		DISPATCH_TO_TYPES(EACH_LABEL_HELPER_2D)
+	}
+
+#undef EACH_LABEL_HELPER_3D
+#undef EACH_LABEL_HELPER_2D
+}
+
+py::tuple iterate_until_stable(
+	const py::array &labels, 
+	const int op,
+	const bool grey,
+	const bool background_only,
+	const uint64_t max_iterations,
+	const uint64_t threads
+) {
+	py::dtype dt = labels.dtype();
+	int width = dt.itemsize();
+
+	const uint64_t sx = labels.shape()[0];
+	const uint64_t sy = labels.shape()[1];
+	const uint64_t sz = labels.ndim() > 2 
+		? labels.shape()[2] 
+		: 1;
+
+	if (op < 0 || op > static_cast<int>(fastmorph::StableOp::CLOSING)) {
+		throw std::runtime_error("Unsupported op.");
+	}
+
+	const uint8_t* labels_ptr = reinterpret_cast<const uint8_t*>(labels.data());
+	uint8_t* output_ptr = new uint8_t[sx * sy * sz * width]();
+	std::copy(labels_ptr, labels_ptr + sx * sy * sz * width, output_ptr);
+
+	uint64_t iterations = 0;
+
+#define STABLE_HELPER_3D(uintx_t)\
+	iterations = fastmorph::iterate_until_stable(\
+		reinterpret_cast<uintx_t*>(output_ptr),\
+		sx, sy, sz,\
+		static_cast<fastmorph::StableOp>(op), grey, background_only,\
+		max_iterations, threads\
+	);\
+	return py::make_tuple(\
+		to_numpy(reinterpret_cast<uintx_t*>(output_ptr), sx, sy, sz),\
+		iterations\
+	);
+
+#define STABLE_HELPER_2D(uintx_t)\
+	iterations = fastmorph::iterate_until_stable(\
+		reinterpret_cast<uintx_t*>(output_ptr),\
+		sx, sy,\
+		static_cast<fastmorph::StableOp>(op), grey, background_only,\
+		max_iterations, threads\
+	);\
+	return py::make_tuple(\
+		to_numpy(reinterpret_cast<uintx_t*>(output_ptr), sx, sy),\
+		iterations\
+	);
+
+	if (labels.ndim() > 2) {
+		DISPATCH_TO_TYPES(STABLE_HELPER_3D)
+	}
+	else {
+		DISPATCH_TO_TYPES(STABLE_HELPER_2D)
+	}
+
+#undef STABLE_HELPER_3D
+#undef STABLE_HELPER_2D
+}
+
+// images are fortran ordered 2D or 3D arrays of one dtype. The 
+// results are packed one after another (each in fortran order)
+// into a single arena returned as an (N,1) array.
+py::array morph_batch(
+	const std::vector<py::array> &images,
+	const int op,
+	const bool grey,
+	const bool background_only,
+	const uint64_t threads
+) {
+	if (op < 0 || op > static_cast<int>(fastmorph::StableOp::CLOSING)) {
+		throw std::runtime_error("Unsupported op.");
+	}
+	if (images.empty()) {
+		throw std::invalid_argument("images must not be empty.");
+	}
+
+	py::dtype dt = images[0].dtype();
+	int width = dt.itemsize();
+	if (dt.kind() == 'f' && width != 4 && width != 8) {
+		throw std::invalid_argument("Only float32 and float64 floating point images are supported.");
+	}
+
+	uint64_t total_voxels = 0;
+	for (const py::array &image : images) {
+		if (!image.dtype().equal(dt)) {
+			throw std::invalid_argument("All images must have the same dtype.");
+		}
+		if (image.ndim() != 2 && image.ndim() != 3) {
+			throw std::invalid_argument("Images must be 2D or 3D.");
+		}
+		if (!(image.flags() & py::array::f_style)) {
+			throw std::invalid_argument("Images must be fortran ordered.");
+		}
+		total_voxels += image.size();
+	}
+
+	// the arena has a single owner until it is handed to the capsule
+	// inside to_numpy, so a failing batch cannot free it twice
+#define BATCH_HELPER(int_t)\
+	{\
+		std::unique_ptr<int_t[]> output(\
+			new int_t[std::max(total_voxels, static_cast<uint64_t>(1))]()\
+		);\
+		std::vector<fastmorph::BatchItem<int_t>> items;\
+		items.reserve(images.size());\
+		uint64_t offset = 0;\
+		for (const py::array &image : images) {\
+			fastmorph::BatchItem<int_t> item;\
+			item.labels = reinterpret_cast<int_t*>(const_cast<void*>(image.data()));\
+			item.output = output.get() + offset;\
+			item.sx = image.shape()[0];\
+			item.sy = image.shape()[1];\
+			item.sz = image.ndim() > 2 ? image.shape()[2] : 1;\
+			item.planar = image.ndim() == 2;\
+			items.push_back(item);\
+			offset += image.size();\
+		}\
+		fastmorph::morph_batch<int_t>(\
+			items.data(), items.size(),\
+			static_cast<fastmorph::StableOp>(op), grey, background_only,\
+			threads\
+		);\
+		return to_numpy(output.release(), total_voxels, 1);\
+	}
+
+	// float widths were validated above
+	if (dt.kind() == 'f') {
+		if (width == 4) {
+			BATCH_HELPER(float)
+		}
+		else {
+			BATCH_HELPER(double)
+		}
+	}
+	else {
+		DISPATCH_TO_TYPES(BATCH_HELPER)
+	}
+
+#undef BATCH_HELPER
+}
+
+py::tuple sparse_morph(
+	const py::array &labels, 
+	const int op,
+	const bool grey,
+	const bool background_only,
+	const uint64_t threads
+) {
+	py::dtype dt = labels.dtype();
+	int width = dt.itemsize();
+
+	const uint64_t sx = labels.shape()[0];
+	const uint64_t sy = labels.shape()[1];
+	const uint64_t sz = labels.ndim() > 2 
+		? labels.shape()[2] 
+		: 1;
+
+	if (op < 0 || op > static_cast<int>(fastmorph::StableOp::CLOSING)) {
+		throw std::runtime_error("Unsupported op.");
+	}
+
+	void* labels_ptr = const_cast<void*>(labels.data());
+
+#define SPARSE_MORPH_HELPER_3D(uintx_t)\
+	{\
+		std::vector<uint64_t> indices;\
+		std::vector<uintx_t> values;\
+		fastmorph::sparse_morph(\
+			reinterpret_cast<uintx_t*>(labels_ptr),\
+			sx, sy, sz,\
+			static_cast<fastmorph::StableOp>(op), grey, background_only,\
+			threads, indices, values\
+		);\
+		return vectors_to_numpy(indices, values);\
+	}
+
+#define SPARSE_MORPH_HELPER_2D(uintx_t)\
+	{\
+		std::vector<uint64_t> indices;\
+		std::vector<uintx_t> values;\
+		fastmorph::sparse_morph(\
+			reinterpret_cast<uintx_t*>(labels_ptr),\
+			sx, sy,\
+			static_cast<fastmorph::StableOp>(op), grey, background_only,\
+			threads, indices, values\
+		);\
+		return vectors_to_numpy(indices, values);\
+	}
+
+	if (labels.ndim() > 2) {
+		DISPATCH_TO_TYPES(SPARSE_MORPH_HELPER_3D)
+	}
+	else {
+		DISPATCH_TO_TYPES(SPARSE_MORPH_HELPER_2D)
+	}
+
+#undef SPARSE_MORPH_HELPER_3D
+#undef SPARSE_MORPH_HELPER_2D
+}
+
+void paint_points(
+	const py::array_t<int64_t> &coords,
+	const py::array &point_labels,
+	py::array output,
+	const float radius,
+	const std::vector<float> &anisotropy,
+	const int footprint,
+	const bool overwrite,
+	const uint64_t threads
+) {
+	py::dtype dt = output.dtype();
+	int width = dt.itemsize();
+
+	const uint64_t sx = output.shape()[0];
+	const uint64_t sy = output.shape()[1];
+	const uint64_t sz = output.ndim() > 2 
+		? output.shape()[2] 
+		: 1;
+
+	const uint64_t num_points = point_labels.size();
+
+	if (coords.ndim() != 2 || coords.shape()[1] != 3 || static_cast<uint64_t>(coords.shape()[0]) != num_points) {
+		throw std::runtime_error("coords must be an N x 3 array with one row per label.");
+	}
+	if (point_labels.dtype().itemsize() != width) {
+		throw std::runtime_error("labels must have the same dtype as the output.");
+	}
+	if (footprint < 0 || footprint > static_cast<int>(fastmorph::Footprint::SPHERE)) {
+		throw std::runtime_error("Unsupported footprint.");
+	}
+
+	float aniso[3] = { 1, 1, 1 };
+	for (uint64_t i = 0; i < std::min(anisotropy.size(), static_cast<size_t>(3)); i++) {
+		aniso[i] = anisotropy[i];
+	}
+
+	const void* labels_ptr = point_labels.data();
+	void* output_ptr = output.mutable_data();
+
+#define PAINT_POINTS_HELPER(uintx_t)\
+	fastmorph::paint_points(\
+		coords.data(),\
+		reinterpret_cast<const uintx_t*>(labels_ptr), num_points,\
+		reinterpret_cast<uintx_t*>(output_ptr),\
+		sx, sy, sz,\
+		radius, aniso,\
+		static_cast<fastmorph::Footprint>(footprint), overwrite,\
+		threads\
+	);\
+	return;
+
+	DISPATCH_TO_TYPES(PAINT_POINTS_HELPER)
+
+#undef PAINT_POINTS_HELPER
+}
+
+py::object brick_morph(
+	const py::array_t<int64_t> &coords,
+	const py::array &values,
+	const std::vector<uint64_t> &shape,
+	const int op,
+	const bool grey,
+	const bool background_only,
+	const uint64_t iterations,
+	const uint64_t threads,
+	const bool dense
+) {
+	py::dtype dt = values.dtype();
+	int width = dt.itemsize();
+
+	if (shape.size() < 2 || shape.size() > 3) {
+		throw std::runtime_error("shape must be 2D or 3D.");
+	}
+
+	const uint64_t sx = shape[0];
+	const uint64_t sy = shape[1];
+	const uint64_t sz = shape.size() > 2 ? shape[2] : 1;
+	const uint64_t num_points = values.size();
+
+	if (coords.ndim() != 2 || coords.shape()[1] != 3 || static_cast<uint64_t>(coords.shape()[0]) != num_points) {
+		throw std::runtime_error("coords must be an N x 3 array with one row per value.");
+	}
+	if (op < 0 || op > static_cast<int>(fastmorph::StableOp::CLOSING)) {
+		throw std::runtime_error("Unsupported op.");
+	}
+
+	auto pts = coords.unchecked<2>();
+	for (uint64_t i = 0; i < num_points; i++) {
+		if (pts(i,0) < 0 || pts(i,1) < 0 || pts(i,2) < 0
+			|| static_cast<uint64_t>(pts(i,0)) >= sx
+			|| static_cast<uint64_t>(pts(i,1)) >= sy
+			|| static_cast<uint64_t>(pts(i,2)) >= sz) {
+			throw std::runtime_error("coords must lie inside shape.");
+		}
+	}
+
+	const void* values_ptr = values.data();
+
+#define BRICK_MORPH_HELPER(uintx_t)\
+	{\
+		const uintx_t* vals = reinterpret_cast<const uintx_t*>(values_ptr);\
+		fastmorph::BrickVolume<uintx_t> vol(sx, sy, sz);\
+		for (uint64_t i = 0; i < num_points; i++) {\
+			vol.set(pts(i,0), pts(i,1), pts(i,2), vals[i]);\
+		}\
+		vol = fastmorph::brick_morph<uintx_t>(\
+			std::move(vol), static_cast<fastmorph::StableOp>(op),\
+			grey, background_only, iterations, threads\
+		);\
+		if (dense) {\
+			uintx_t* output = new uintx_t[sx * sy * sz]();\
+			vol.to_dense(output);\
+			if (shape.size() > 2) {\
+				return to_numpy(output, sx, sy, sz);\
+			}\
+			return to_numpy(output, sx, sy);\
+		}\
+		std::vector<uint64_t> indices;\
+		std::vector<uintx_t> out_values;\
+		vol.to_sparse(indices, out_values);\
+		return vectors_to_numpy(indices, out_values);\
+	}
+
+	DISPATCH_TO_TYPES(BRICK_MORPH_HELPER)
+
+#undef BRICK_MORPH_HELPER
+}
+
+#undef DISPATCH_TO_TYPES
+
+void memory_tracking_start() {
+	fastmorph::memory::start();
+}
+
+py::dict memory_usage(const fastmorph::memory::Stats &stats) {
+	py::dict out;
+	out["peak_bytes"] = stats.peak_bytes;
+	out["total_bytes"] = stats.total_bytes;
+	out["current_bytes"] = stats.current_bytes;
+	out["allocations"] = stats.allocations;
+	return out;
+}
+
+py::dict memory_tracking_snapshot() {
+	return memory_usage(fastmorph::memory::snapshot());
+}
+
+py::dict memory_tracking_stop() {
+	return memory_usage(fastmorph::memory::stop());
+}
+
+void trace_start() {
+	fastmorph::trace::start();
+}
+
+std::string trace_stop() {
+	return fastmorph::trace::to_chrome_json(fastmorph::trace::stop());
+}
+
+// opened on the thread calling perf_start, inherited by 
+// the worker threads the ops spawn
+std::unique_ptr<fastmorph::perf::CounterGroup> perf_op_counters;
+
+// { counter name: count } for the counters that could be read
+py::dict perf_sample_to_dict(const fastmorph::perf::Sample &sample) {
+	py::dict out;
+	for (int i = 0; i < fastmorph::perf::NUM_COUNTERS; i++) {
+		if (sample.valid[i]) {
+			out[fastmorph::perf::counter_name(i)] = sample.values[i];
+		}
+	}
+	return out;
+}
+
+void perf_start(const bool per_block) {
+	perf_op_counters.reset(new fastmorph::perf::CounterGroup(/*inherit=*/true));
+	if (per_block) {
+		fastmorph::perf::start_block_sampling();
+	}
+	perf_op_counters->start();
+}
+
+py::dict perf_stop() {
+	py::dict out;
+	if (!perf_op_counters) {
+		throw std::runtime_error("perf_start was not called.");
+	}
+
+	const fastmorph::perf::Sample sample = perf_op_counters->stop();
+	const int error = perf_op_counters->error;
+	perf_op_counters.reset();
+
+	py::list unavailable;
+	for (int i = 0; i < fastmorph::perf::NUM_COUNTERS; i++) {
+		if (!sample.valid[i]) {
+			unavailable.append(fastmorph::perf::counter_name(i));
+		}
+	}
+
+	py::list blocks;
+	for (const auto &block : fastmorph::perf::stop_block_sampling()) {
+		py::dict b;
+		b["name"] = block.name;
+		b["kernel"] = block.kernel ? py::object(py::str(block.kernel)) : py::object(py::none());
+		b["x"] = py::make_tuple(block.xs, block.xe);
+		b["y"] = py::make_tuple(block.ys, block.ye);
+		b["z"] = py::make_tuple(block.zs, block.ze);
+		b["counters"] = perf_sample_to_dict(block.sample);
+		blocks.append(b);
+	}
+
+	out["counters"] = perf_sample_to_dict(sample);
+	out["unavailable"] = unavailable;
+	out["error"] = error ? py::object(py::str(strerror(error))) : py::object(py::none());
+	out["blocks"] = blocks;
+	return out;
+}
+
+py::dict cpu_isa() {
+	py::dict out;
+	out["selected"] = fastmorph::cpu::isa_name(fastmorph::cpu::selected_isa());
+	out["best_supported"] = fastmorph::cpu::isa_name(fastmorph::cpu::best_supported_isa());
+	out["dispatch_enabled"] = fastmorph::cpu::dispatch_enabled();
+	return out;
+}
+
+std::string set_cpu_isa(const std::string &name) {
+	fastmorph::cpu::Isa isa;
+	if (!fastmorph::cpu::parse_isa(name.c_str(), isa)) {
+		throw std::invalid_argument("Unknown instruction set: " + name + ". Expected baseline, avx2, avx512, or auto.");
+	}
+	return fastmorph::cpu::isa_name(fastmorph::cpu::select_isa(isa));
+}
+
+// C entry points exported as capsules, see fastmorph_capsule.h
+namespace capi {
+
+// runs kernel(in, out) on a zeroed output without letting
+// exceptions escape into the caller's C code
+template <typename LABEL, int NDIM, typename FN>
+int run(
+	const void* labels, void* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	FN &&kernel
+) noexcept {
+	const uint64_t voxels = sx * sy * sz;
+	if (voxels == 0) {
+		return FASTMORPH_CAPI_OK;
+	}
+	if (labels == nullptr || output == nullptr || (NDIM == 2 && sz != 1)) {
+		return FASTMORPH_CAPI_ERROR_INVALID_ARGUMENT;
+	}
+	try {
+		LABEL* out = static_cast<LABEL*>(output);
+		std::memset(out, 0, voxels * sizeof(LABEL));
+		kernel(const_cast<LABEL*>(static_cast<const LABEL*>(labels)), out);
+		return FASTMORPH_CAPI_OK;
+	}
+	catch (const std::bad_alloc &) {
+		return FASTMORPH_CAPI_ERROR_OUT_OF_MEMORY;
+	}
+	catch (...) {
+		return FASTMORPH_CAPI_ERROR_INTERNAL;
+	}
+}
+
+uint64_t thread_count(const uint64_t threads) {
+	return std::max(threads, static_cast<uint64_t>(1));
+}
+
+template <typename LABEL, int NDIM>
+int multilabel_dilate(
+	const void* labels, void* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const int background_only, const uint64_t threads
+) noexcept {
+	return run<LABEL, NDIM>(labels, output, sx, sy, sz, [&](LABEL* in, LABEL* out) {
+		if constexpr (NDIM == 3) {
+			fastmorph::multilabel_dilate<LABEL>(in, out, sx, sy, sz, background_only != 0, thread_count(threads));
+		}
+		else {
+			fastmorph::multilabel_dilate<LABEL>(in, out, sx, sy, background_only != 0, thread_count(threads));
+		}
+	});
+}
+
+template <typename LABEL, int NDIM>
+int multilabel_erode(
+	const void* labels, void* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const uint64_t threads
+) noexcept {
+	return run<LABEL, NDIM>(labels, output, sx, sy, sz, [&](LABEL* in, LABEL* out) {
+		if constexpr (NDIM == 3) {
+			fastmorph::multilabel_erode<LABEL>(in, out, sx, sy, sz, thread_count(threads));
+		}
+		else {
+			fastmorph::multilabel_erode<LABEL>(in, out, sx, sy, thread_count(threads));
+		}
+	});
+}
+
+template <typename LABEL, int NDIM>
+int grey_dilate(
+	const void* labels, void* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const uint64_t threads
+) noexcept {
+	return run<LABEL, NDIM>(labels, output, sx, sy, sz, [&](LABEL* in, LABEL* out) {
+		if constexpr (NDIM == 3) {
+			fastmorph::grey_dilate<LABEL>(in, out, sx, sy, sz, thread_count(threads));
+		}
+		else {
+			fastmorph::grey_dilate<LABEL>(in, out, sx, sy, thread_count(threads));
+		}
+	});
+}
+
+template <typename LABEL, int NDIM>
+int grey_erode(
+	const void* labels, void* output,
+	const uint64_t sx, const uint64_t sy, const uint64_t sz,
+	const uint64_t threads
+) noexcept {
+	return run<LABEL, NDIM>(labels, output, sx, sy, sz, [&](LABEL* in, LABEL* out) {
+		if constexpr (NDIM == 3) {
+			fastmorph::grey_erode<LABEL>(in, out, sx, sy, sz, thread_count(threads));
+		}
+		else {
+			fastmorph::grey_erode<LABEL>(in, out, sx, sy, thread_count(threads));
+		}
+	});
+}
+
+// PyCapsule keeps a pointer to its name
+void add_capsule(py::module_ &module, const std::string &attr, void* fn) {
+	static std::list<std::string> names;
+	names.push_back("fastmorphops.capi." + attr);
+	PyObject* capsule = PyCapsule_New(fn, names.back().c_str(), nullptr);
+	if (capsule == nullptr) {
+		throw py::error_already_set();
+	}
+	module.attr(attr.c_str()) = py::reinterpret_steal<py::object>(capsule);
+}
+
+template <int NDIM, typename LABEL>
+void add_grey_capsules(py::module_ &module, const std::string &dtype) {
+	const std::string suffix = "_" + std::to_string(NDIM) + "d_" + dtype;
+	fastmorph_capi_morph_fn dilate = &grey_dilate<LABEL, NDIM>;
+	fastmorph_capi_morph_fn erode = &grey_erode<LABEL, NDIM>;
+	add_capsule(module, "grey_dilate" + suffix, reinterpret_cast<void*>(dilate));
+	add_capsule(module, "grey_erode" + suffix, reinterpret_cast<void*>(erode));
+}
+
+template <int NDIM, typename LABEL>
+void add_capsules(py::module_ &module, const std::string &dtype) {
+	const std::string suffix = "_" + std::to_string(NDIM) + "d_" + dtype;
+	fastmorph_capi_dilate_fn dilate = &multilabel_dilate<LABEL, NDIM>;
+	fastmorph_capi_morph_fn erode = &multilabel_erode<LABEL, NDIM>;
+	add_capsule(module, "multilabel_dilate" + suffix, reinterpret_cast<void*>(dilate));
+	add_capsule(module, "multilabel_erode" + suffix, reinterpret_cast<void*>(erode));
+	add_grey_capsules<NDIM, LABEL>(module, dtype);
+}
+
+template <int NDIM>
+void add_all_capsules(py::module_ &module) {
+	add_capsules<NDIM, uint8_t>(module, "uint8");
+	add_capsules<NDIM, uint16_t>(module, "uint16");
+	add_capsules<NDIM, uint32_t>(module, "uint32");
+	add_capsules<NDIM, uint64_t>(module, "uint64");
+	add_capsules<NDIM, int8_t>(module, "int8");
+	add_capsules<NDIM, int16_t>(module, "int16");
+	add_capsules<NDIM, int32_t>(module, "int32");
+	add_capsules<NDIM, int64_t>(module, "int64");
+	add_grey_capsules<NDIM, float>(module, "float32");
+	add_grey_capsules<NDIM, double>(module, "float64");
+}
+
+}
+
+PYBIND11_MODULE(fastmorphops, m) {
+	m.doc() = "Accelerated fastmorph functions."; 
+	m.def("multilabel_dilate", &multilabel_dilate, "Morphological dilation of a multilabel volume using mode of a 3x3x3 structuring element.");
+	m.def("multilabel_dilate_tracked", &multilabel_dilate_tracked, "multilabel_dilate that can also return label contact counts, per-label voxel changes, per-kernel block counts, and hot path counters gathered during the same pass.");
+	m.def("grey_dilate", &grey_dilate, "Morphological dilation of a grayscale volume using max of a 3x3x3 structuring element.");
+	m.def("grey_dilate_tracked", &grey_dilate_tracked, "grey_dilate that also returns hot path counters.");
+	m.def("multilabel_erode", &multilabel_erode, "Morphological erosion of a multilabel volume using edge contacts of a 3x3x3 structuring element.");
+	m.def("multilabel_erode_tracked", &multilabel_erode_tracked, "multilabel_erode that can also return per-label voxel changes and hot path counters gathered during the same pass.");
+	m.def("grey_erode", &grey_erode, "Morphological erosion of a grayscale volume using min of a 3x3x3 structuring element.");
+	m.def("grey_erode_tracked", &grey_erode_tracked, "grey_erode that also returns hot path counters.");
+	m.attr("HOT_COUNTERS_ENABLED") = fastmorph::HOT_COUNTERS_ENABLED;
+	m.def("grey_dilate_weighted", &grey_dilate_weighted, "Morphological dilation of a grayscale volume using a non-flat 3x3x3 structuring element.");
+	m.def("grey_erode_weighted", &grey_erode_weighted, "Morphological erosion of a grayscale volume using a non-flat 3x3x3 structuring element.");
+	m.def("multilabel_radius_morph", &multilabel_radius_morph, "Grows (radius > 0) or shrinks (radius < 0) each label of a multilabel volume by its own radius in one call.");
+	m.def("morph_each_label", &morph_each_label, "Applies a binary morphological op to every label's bounding box cutout in parallel.");
+	m.def("iterate_until_stable", &iterate_until_stable, "Repeats dilation, erosion, opening, or closing until the image stops changing, only recomputing blocks near changes.");
+	m.def("sparse_morph", &sparse_morph, "Dilation, erosion, opening, or closing that only returns the changed voxels as linear indices and new values.");
+	m.def("morph_batch", &morph_batch, "Dilation, erosion, opening, or closing of many independent images in one call on one thread pool, returning the results packed into one arena.");
+	m.def("paint_points", &paint_points, "Paints a cube or sphere around each point of a coordinate list into an output volume in place.");
+	m.def("brick_morph", &brick_morph, "Dilation, erosion, opening, or closing of a sparse point list stored as 8x8x8 bricks, only visiting allocated bricks and their neighbors.");
+	m.def("memory_tracking_start", &memory_tracking_start, "Starts counting native allocations made by this module.");
+	m.def("memory_tracking_snapshot", &memory_tracking_snapshot, "Returns the native allocation counts so far.");
+	m.def("memory_tracking_stop", &memory_tracking_stop, "Stops counting native allocations and returns the counts.");
+	m.def("trace_start", &trace_start, "Starts recording a timeline of the blocks processed by each worker thread.");
+	m.def("trace_stop", &trace_stop, "Stops recording and returns the timeline as Chrome trace event JSON.");
+	m.def("perf_start", &perf_start, "Starts Linux perf_event counters for the calling thread and the worker threads it spawns, and optionally for every block.");
+	m.def("perf_stop", &perf_stop, "Stops the perf_event counters and returns the counts.");
+	m.def("cpu_isa", &cpu_isa, "Returns the instruction set the kernels run with, the best this CPU supports, and whether the AVX2 and AVX-512 copies were compiled in.");
+	m.def("set_cpu_isa", &set_cpu_isa, "Selects the copy of the kernels used by later calls, capped at what the CPU supports, and returns the one selected.");
+
+	py::module_ capi_module = m.def_submodule("capi", "Kernels as C function pointers in PyCapsules for other compiled extensions, see fastmorph_capsule.h.");
+	capi_module.attr("ABI_VERSION") = FASTMORPH_CAPI_ABI_VERSION;
+	capi::add_all_capsules<2>(capi_module);
+	capi::add_all_capsules<3>(capi_module);
 }
\ No newline at end of file
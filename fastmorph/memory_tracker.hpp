@@ -0,0 +1,208 @@
+#ifndef __FASTMORPH_MEMORY_TRACKER_HXX__
+#define __FASTMORPH_MEMORY_TRACKER_HXX__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+
+// Counts the bytes allocated through operator new while tracking
+// is on, which covers output buffers, scratch vectors, hash maps,
+// and thread pool bookkeeping. Thread stacks are reserved by the
+// OS and aren't included.
+//
+// Define FASTMORPH_REPLACE_OPERATOR_NEW in exactly one translation
+// unit of a module before including this header to route that
+// module's operator new and delete through the tracker. Allocations
+// still come from malloc and free so memory can safely cross into
+// code that uses the default operators.
+
+namespace fastmorph {
+namespace memory {
+
+struct Stats {
+	uint64_t peak_bytes = 0; // highest current_bytes since start()
+	uint64_t total_bytes = 0; // sum of every allocation since start()
+	int64_t current_bytes = 0; // allocated since start() and not yet freed
+	uint64_t allocations = 0;
+};
+
+// the tracker's own bookkeeping must not recurse into operator new
+template <typename T>
+struct MallocAllocator {
+	typedef T value_type;
+
+	MallocAllocator() = default;
+	template <typename U>
+	MallocAllocator(const MallocAllocator<U>&) {}
+
+	T* allocate(const size_t n) {
+		void* ptr = std::malloc(n * sizeof(T));
+		if (!ptr) {
+			throw std::bad_alloc();
+		}
+		return static_cast<T*>(ptr);
+	}
+	void deallocate(T* ptr, size_t) {
+		std::free(ptr);
+	}
+
+	template <typename U>
+	bool operator==(const MallocAllocator<U>&) const { return true; }
+	template <typename U>
+	bool operator!=(const MallocAllocator<U>&) const { return false; }
+};
+
+class Tracker {
+public:
+	std::atomic<bool> enabled{false};
+
+	void start() {
+		std::unique_lock<std::mutex> lock(mtx);
+		sizes.clear();
+		stats = Stats();
+		enabled = true;
+	}
+
+	Stats stop() {
+		std::unique_lock<std::mutex> lock(mtx);
+		enabled = false;
+		sizes.clear();
+		return stats;
+	}
+
+	Stats snapshot() {
+		std::unique_lock<std::mutex> lock(mtx);
+		return stats;
+	}
+
+	void allocated(void* ptr, const size_t bytes) {
+		std::unique_lock<std::mutex> lock(mtx);
+		if (!enabled) {
+			return;
+		}
+		sizes[ptr] = bytes;
+		stats.allocations++;
+		stats.total_bytes += bytes;
+		stats.current_bytes += bytes;
+		if (stats.current_bytes > static_cast<int64_t>(stats.peak_bytes)) {
+			stats.peak_bytes = stats.current_bytes;
+		}
+	}
+
+	// frees of memory allocated before start() are ignored
+	void freed(void* ptr) {
+		std::unique_lock<std::mutex> lock(mtx);
+		auto it = sizes.find(ptr);
+		if (it == sizes.end()) {
+			return;
+		}
+		stats.current_bytes -= it->second;
+		sizes.erase(it);
+	}
+
+private:
+	std::mutex mtx;
+	Stats stats;
+	std::unordered_map<
+		void*, size_t,
+		std::hash<void*>, std::equal_to<void*>,
+		MallocAllocator<std::pair<void* const, size_t>>
+	> sizes;
+};
+
+// Never destroyed so that operator delete calls made
+// during static destruction still find it.
+inline Tracker& tracker() {
+	static Tracker* instance = new (std::malloc(sizeof(Tracker))) Tracker();
+	return *instance;
+}
+
+inline void start() {
+	tracker().start();
+}
+
+inline Stats stop() {
+	return tracker().stop();
+}
+
+inline Stats snapshot() {
+	return tracker().snapshot();
+}
+
+inline void* tracked_malloc(const size_t bytes) {
+	void* ptr = std::malloc(bytes ? bytes : 1);
+	if (ptr && tracker().enabled.load(std::memory_order_relaxed)) {
+		tracker().allocated(ptr, bytes);
+	}
+	return ptr;
+}
+
+inline void tracked_free(void* ptr) {
+	if (!ptr) {
+		return;
+	}
+	if (tracker().enabled.load(std::memory_order_relaxed)) {
+		tracker().freed(ptr);
+	}
+	std::free(ptr);
+}
+
+};
+};
+
+#ifdef FASTMORPH_REPLACE_OPERATOR_NEW
+
+void* operator new(size_t bytes) {
+	void* ptr = fastmorph::memory::tracked_malloc(bytes);
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void* operator new[](size_t bytes) {
+	void* ptr = fastmorph::memory::tracked_malloc(bytes);
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void* operator new(size_t bytes, const std::nothrow_t&) noexcept {
+	return fastmorph::memory::tracked_malloc(bytes);
+}
+
+void* operator new[](size_t bytes, const std::nothrow_t&) noexcept {
+	return fastmorph::memory::tracked_malloc(bytes);
+}
+
+void operator delete(void* ptr) noexcept {
+	fastmorph::memory::tracked_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+	fastmorph::memory::tracked_free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+	fastmorph::memory::tracked_free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+	fastmorph::memory::tracked_free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+	fastmorph::memory::tracked_free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+	fastmorph::memory::tracked_free(ptr);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef __FASTMORPH_PERF_COUNTERS_HXX__
+#define __FASTMORPH_PERF_COUNTERS_HXX__
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware and software event counts from Linux perf_event_open,
+// read around an op (CounterGroup with inherit = true also counts
+// the worker threads it spawns) or around each block handed out
+// by parallelize_blocks (start_block_sampling). Each counter is
+// opened separately so a counter the CPU, VM, or
+// perf_event_paranoid setting doesn't allow is just marked
+// invalid. Counts are scaled by time enabled / time running
+// when the kernel multiplexes them. On other platforms every
+// counter is invalid.
+
+namespace fastmorph {
+namespace perf {
+
+enum Counter {
+	CYCLES = 0,
+	INSTRUCTIONS,
+	CACHE_REFERENCES, // usually last level cache
+	CACHE_MISSES, // usually last level cache
+	BRANCH_MISSES,
+	L1D_READ_MISSES,
+	TASK_CLOCK_NS, // cpu time
+	PAGE_FAULTS,
+	CONTEXT_SWITCHES,
+	NUM_COUNTERS
+};
+
+inline const char* counter_name(const int counter) {
+	static const char* names[NUM_COUNTERS] = {
+		"cycles", "instructions", "cache_references", "cache_misses",
+		"branch_misses", "l1d_read_misses", "task_clock_ns",
+		"page_faults", "context_switches"
+	};
+	return names[counter];
+}
+
+struct Sample {
+	uint64_t values[NUM_COUNTERS] = {};
+	bool valid[NUM_COUNTERS] = {};
+
+	void add(const Sample &other) {
+		for (int i = 0; i < NUM_COUNTERS; i++) {
+			values[i] += other.values[i];
+			valid[i] = valid[i] || other.valid[i];
+		}
+	}
+};
+
+class CounterGroup {
+public:
+	int error = 0; // errno of the first counter that failed to open
+
+	// counts the calling thread, plus threads it creates
+	// afterwards when inherit is true
+	explicit CounterGroup(const bool inherit) {
+		for (int i = 0; i < NUM_COUNTERS; i++) {
+			fds[i] = open_counter(static_cast<Counter>(i), inherit);
+		}
+	}
+
+	~CounterGroup() {
+#if defined(__linux__)
+		for (int i = 0; i < NUM_COUNTERS; i++) {
+			if (fds[i] >= 0) {
+				close(fds[i]);
+			}
+		}
+#endif
+	}
+
+	CounterGroup(const CounterGroup&) = delete;
+	CounterGroup& operator=(const CounterGroup&) = delete;
+
+	void start() {
+#if defined(__linux__)
+		for (int i = 0; i < NUM_COUNTERS; i++) {
+			if (fds[i] >= 0) {
+				ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+				ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+	Sample stop() {
+		Sample sample;
+#if defined(__linux__)
+		for (int i = 0; i < NUM_COUNTERS; i++) {
+			if (fds[i] >= 0) {
+				ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+			}
+		}
+		for (int i = 0; i < NUM_COUNTERS; i++) {
+			if (fds[i] < 0) {
+				continue;
+			}
+			// value, time enabled, time running
+			uint64_t buf[3] = {};
+			if (read(fds[i], buf, sizeof(buf)) != sizeof(buf)) {
+				continue;
+			}
+			sample.valid[i] = true;
+			if (buf[2] > 0 && buf[2] < buf[1]) {
+				sample.values[i] = static_cast<uint64_t>(
+					static_cast<double>(buf[0]) * static_cast<double>(buf[1]) / static_cast<double>(buf[2])
+				);
+			}
+			else {
+				sample.values[i] = buf[0];
+			}
+		}
+#endif
+		return sample;
+	}
+
+private:
+	int fds[NUM_COUNTERS];
+
+	int open_counter(const Counter counter, const bool inherit) {
+#if defined(__linux__)
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.disabled = 1;
+		attr.inherit = inherit;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		switch (counter) {
+			case CYCLES:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_CPU_CYCLES;
+				break;
+			case INSTRUCTIONS:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+				break;
+			case CACHE_REFERENCES:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_CACHE_REFERENCES;
+				break;
+			case CACHE_MISSES:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_CACHE_MISSES;
+				break;
+			case BRANCH_MISSES:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+				break;
+			case L1D_READ_MISSES:
+				attr.type = PERF_TYPE_HW_CACHE;
+				attr.config = PERF_COUNT_HW_CACHE_L1D
+					| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+					| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+				break;
+			case TASK_CLOCK_NS:
+				attr.type = PERF_TYPE_SOFTWARE;
+				attr.config = PERF_COUNT_SW_TASK_CLOCK;
+				break;
+			case PAGE_FAULTS:
+				attr.type = PERF_TYPE_SOFTWARE;
+				attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+				break;
+			case CONTEXT_SWITCHES:
+				attr.type = PERF_TYPE_SOFTWARE;
+				attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+				break;
+			default:
+				return -1;
+		}
+
+		const int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+		if (fd < 0 && error == 0) {
+			error = errno;
+		}
+		return fd;
+#else
+		(void)counter;
+		(void)inherit;
+		return -1;
+#endif
+	}
+};
+
+struct BlockSample {
+	const char* name = ""; // op name passed to parallelize_blocks
+	const char* kernel = nullptr; // see trace::annotate
+	uint64_t xs = 0, xe = 0, ys = 0, ye = 0, zs = 0, ze = 0;
+	Sample sample;
+};
+
+// Collects a Sample for every block while enabled. Opening the
+// counters costs a few syscalls per block, so only use it to
+// compare blocks, not to time them.
+class BlockSampler {
+public:
+	std::atomic<bool> enabled{false};
+
+	void start() {
+		std::unique_lock<std::mutex> lock(mtx);
+		samples.clear();
+		enabled = true;
+	}
+
+	std::vector<BlockSample> stop() {
+		std::unique_lock<std::mutex> lock(mtx);
+		enabled = false;
+		std::vector<BlockSample> out;
+		std::swap(out, samples);
+		return out;
+	}
+
+	void record(const BlockSample &sample) {
+		std::unique_lock<std::mutex> lock(mtx);
+		if (enabled) {
+			samples.push_back(sample);
+		}
+	}
+
+private:
+	std::mutex mtx;
+	std::vector<BlockSample> samples;
+};
+
+inline BlockSampler& block_sampler() {
+	static BlockSampler* instance = new BlockSampler();
+	return *instance;
+}
+
+inline bool block_sampling_enabled() {
+	return block_sampler().enabled.load(std::memory_order_relaxed);
+}
+
+inline void start_block_sampling() {
+	block_sampler().start();
+}
+
+inline std::vector<BlockSample> stop_block_sampling() {
+	return block_sampler().stop();
+}
+
+};
+};
+
+#endif
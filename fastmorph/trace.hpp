@@ -0,0 +1,187 @@
+#ifndef __FASTMORPH_TRACE_HXX__
+#define __FASTMORPH_TRACE_HXX__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Opt in timeline of the blocks handed out by parallelize_blocks.
+// While tracing is on, each block records the worker it ran on,
+// when it was enqueued, started, and finished, its bounds, and the
+// op (and for multilabel_dilate the block kernel) that processed it.
+// The calling thread records pool startup, enqueueing, and joining.
+// to_chrome_json writes the Trace Event Format read by
+// chrome://tracing and https://ui.perfetto.dev
+//
+// When tracing is off each parallelize_blocks call and each block
+// only check an atomic flag.
+
+namespace fastmorph {
+namespace trace {
+
+struct Event {
+	const char* name = ""; // op name
+	const char* phase = ""; // "block", "pool_start", "enqueue", "join"
+	const char* kernel = nullptr; // set by annotate() during a block
+	uint64_t tid = 0;
+	int64_t enqueue_ns = -1; // blocks only
+	int64_t start_ns = 0;
+	int64_t end_ns = 0;
+	uint64_t xs = 0, xe = 0, ys = 0, ye = 0, zs = 0, ze = 0;
+};
+
+class Tracer {
+public:
+	std::atomic<bool> enabled{false};
+
+	void start() {
+		std::unique_lock<std::mutex> lock(mtx);
+		events.clear();
+		thread_ids.clear();
+		origin = std::chrono::steady_clock::now();
+		enabled = true;
+	}
+
+	std::vector<Event> stop() {
+		std::unique_lock<std::mutex> lock(mtx);
+		enabled = false;
+		std::vector<Event> out;
+		std::swap(out, events);
+		return out;
+	}
+
+	int64_t now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - origin
+		).count();
+	}
+
+	void record(Event event) {
+		std::unique_lock<std::mutex> lock(mtx);
+		if (!enabled) {
+			return;
+		}
+		const std::thread::id id = std::this_thread::get_id();
+		auto it = thread_ids.find(id);
+		if (it == thread_ids.end()) {
+			it = thread_ids.emplace(id, thread_ids.size()).first;
+		}
+		event.tid = it->second;
+		events.push_back(event);
+	}
+
+private:
+	std::mutex mtx;
+	std::chrono::steady_clock::time_point origin;
+	std::vector<Event> events;
+	// small sequential ids are easier to read than std::thread::id
+	std::unordered_map<std::thread::id, uint64_t> thread_ids;
+};
+
+// Never destroyed so worker threads that outlive
+// static destruction can still check it.
+inline Tracer& tracer() {
+	static Tracer* instance = new Tracer();
+	return *instance;
+}
+
+inline bool enabled() {
+	return tracer().enabled.load(std::memory_order_relaxed);
+}
+
+inline void start() {
+	tracer().start();
+}
+
+inline std::vector<Event> stop() {
+	return tracer().stop();
+}
+
+inline const char*& current_kernel() {
+	thread_local const char* kernel = nullptr;
+	return kernel;
+}
+
+// Labels the block running on this thread, e.g. with the
+// BlockKernel it was routed to. kernel must outlive the
+// trace (a string literal).
+inline void annotate(const char* kernel) {
+	current_kernel() = kernel;
+}
+
+inline void escape_json(std::string &out, const char* str) {
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			out += '\\';
+		}
+		out += *str;
+	}
+}
+
+inline std::string to_chrome_json(const std::vector<Event> &events) {
+	std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	char buf[512];
+
+	uint64_t max_tid = 0;
+	for (const Event &event : events) {
+		max_tid = std::max(max_tid, event.tid);
+	}
+	for (uint64_t tid = 0; tid <= max_tid && !events.empty(); tid++) {
+		snprintf(buf, sizeof(buf),
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%llu,\"args\":{\"name\":\"thread %llu\"}},\n",
+			static_cast<unsigned long long>(tid), static_cast<unsigned long long>(tid)
+		);
+		out += buf;
+	}
+
+	for (size_t i = 0; i < events.size(); i++) {
+		const Event &event = events[i];
+		out += "{\"name\":\"";
+		escape_json(out, event.name);
+		if (event.kernel) {
+			out += ":";
+			escape_json(out, event.kernel);
+		}
+		out += "\",\"cat\":\"";
+		escape_json(out, event.phase);
+		snprintf(buf, sizeof(buf),
+			"\",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+			static_cast<unsigned long long>(event.tid),
+			static_cast<double>(event.start_ns) / 1000.0,
+			static_cast<double>(event.end_ns - event.start_ns) / 1000.0
+		);
+		out += buf;
+
+		if (event.enqueue_ns >= 0) {
+			snprintf(buf, sizeof(buf),
+				"\"x\":[%llu,%llu],\"y\":[%llu,%llu],\"z\":[%llu,%llu],\"queue_wait_us\":%.3f",
+				static_cast<unsigned long long>(event.xs), static_cast<unsigned long long>(event.xe),
+				static_cast<unsigned long long>(event.ys), static_cast<unsigned long long>(event.ye),
+				static_cast<unsigned long long>(event.zs), static_cast<unsigned long long>(event.ze),
+				static_cast<double>(event.start_ns - event.enqueue_ns) / 1000.0
+			);
+			out += buf;
+			if (event.kernel) {
+				out += ",\"kernel\":\"";
+				escape_json(out, event.kernel);
+				out += "\"";
+			}
+		}
+		out += (i + 1 < events.size()) ? "}},\n" : "}}\n";
+	}
+
+	out += "]}\n";
+	return out;
+}
+
+};
+};
+
+#endif
@@ -18,6 +18,20 @@ else:
     '-std=c++17', '-O3'
   ]
 
+# FASTMORPH_HOT_COUNTERS=1 pip install . enables return_counters,
+# the counters are compiled out otherwise
+if os.environ.get("FASTMORPH_HOT_COUNTERS", "0") not in ("", "0"):
+  extra_compile_args += [
+    '/DFASTMORPH_HOT_COUNTERS' if sys.platform == 'win32' else '-DFASTMORPH_HOT_COUNTERS'
+  ]
+
+# Kernels are also compiled for AVX2 and AVX-512 and picked at
+# runtime (see fastmorph/cpu_dispatch.hpp). Has no effect with MSVC
+# or off x86-64.
+extra_compile_args += [
+  '/DFASTMORPH_DISPATCH' if sys.platform == 'win32' else '-DFASTMORPH_DISPATCH'
+]
+
 setuptools.setup(
   name="fastmorph",
   version="1.2.1",
@@ -30,12 +44,17 @@ setuptools.setup(
   package_data={
     'fastmorph': [
       'LICENSE',
+      'fastmorph_capsule.h',
     ],
   },
   ext_modules=[
     Pybind11Extension(
         "fastmorphops",
-        ["fastmorph/fastmorphops.cpp"],
+        [
+          "fastmorph/fastmorphops.cpp",
+          "fastmorph/fastmorph_avx2.cpp",
+          "fastmorph/fastmorph_avx512.cpp",
+        ],
         extra_compile_args=extra_compile_args,
         language="c++",
     ),
@@ -0,0 +1,246 @@
+/* Tests of the C API in fastmorph_c.h, run by ctest. */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fastmorph_c.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+#define CHECK_OK(status) do { \
+	fastmorph_status s_ = (status); \
+	if (s_ != FASTMORPH_OK) { \
+		fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, \
+			fastmorph_status_string(s_), fastmorph_last_error()); \
+		failures++; \
+	} \
+} while (0)
+
+#define N 6
+#define IDX(x, y, z) ((x) + N * ((y) + N * (z)))
+
+static void test_version(void) {
+	char expected[64];
+	snprintf(expected, sizeof(expected), "%d.%d.%d",
+		FASTMORPH_VERSION_MAJOR, FASTMORPH_VERSION_MINOR, FASTMORPH_VERSION_PATCH);
+	CHECK(strcmp(fastmorph_version(), expected) == 0);
+	CHECK(fastmorph_dtype_size(FASTMORPH_UINT8) == 1);
+	CHECK(fastmorph_dtype_size(FASTMORPH_INT16) == 2);
+	CHECK(fastmorph_dtype_size(FASTMORPH_UINT64) == 8);
+	CHECK(fastmorph_dtype_size(FASTMORPH_FLOAT32) == 4);
+	CHECK(fastmorph_dtype_size((fastmorph_dtype)99) == 0);
+}
+
+static void test_multilabel_dilate(void) {
+	uint32_t labels[N * N * N] = {0};
+	uint32_t output[N * N * N];
+	const uint64_t shape[3] = { N, N, N };
+	int x, y, z;
+
+	labels[IDX(2, 2, 2)] = 5;
+	memset(output, 0xff, sizeof(output));
+	CHECK_OK(fastmorph_multilabel_dilate(
+		FASTMORPH_UINT32, labels, NULL, output, NULL, 3, shape, 1, 2
+	));
+
+	for (z = 0; z < N; z++) {
+		for (y = 0; y < N; y++) {
+			for (x = 0; x < N; x++) {
+				const int inside = x >= 1 && x <= 3 && y >= 1 && y <= 3 && z >= 1 && z <= 3;
+				CHECK(output[IDX(x, y, z)] == (inside ? 5u : 0u));
+			}
+		}
+	}
+}
+
+static void test_multilabel_erode(void) {
+	uint16_t labels[N * N * N] = {0};
+	uint16_t output[N * N * N];
+	const uint64_t shape[3] = { N, N, N };
+	int x, y, z;
+
+	for (z = 1; z <= 3; z++) {
+		for (y = 1; y <= 3; y++) {
+			for (x = 1; x <= 3; x++) {
+				labels[IDX(x, y, z)] = 7;
+			}
+		}
+	}
+	CHECK_OK(fastmorph_multilabel_erode(
+		FASTMORPH_UINT16, labels, NULL, output, NULL, 3, shape, 1
+	));
+
+	for (x = 0; x < N * N * N; x++) {
+		CHECK(output[x] == ((x == IDX(2, 2, 2)) ? 7 : 0));
+	}
+}
+
+/* C ordered (z fastest in memory) inputs and outputs must give the
+ * same result as Fortran ordered ones */
+static void test_strides(void) {
+	uint8_t fortran[N * N * N];
+	uint8_t c_order[N * N * N];
+	uint8_t expected[N * N * N];
+	uint8_t output[N * N * N];
+	const uint64_t shape[3] = { N, N, N };
+	const int64_t c_strides[3] = { N * N, N, 1 };
+	int x, y, z;
+
+	for (z = 0; z < N; z++) {
+		for (y = 0; y < N; y++) {
+			for (x = 0; x < N; x++) {
+				const uint8_t v = (uint8_t)((x * 7 + y * 3 + z * z) % 5);
+				fortran[IDX(x, y, z)] = v;
+				c_order[z + N * (y + N * x)] = v;
+			}
+		}
+	}
+
+	CHECK_OK(fastmorph_grey_dilate(FASTMORPH_UINT8, fortran, NULL, expected, NULL, 3, shape, 1));
+	CHECK_OK(fastmorph_grey_dilate(FASTMORPH_UINT8, c_order, c_strides, output, c_strides, 3, shape, 1));
+	for (z = 0; z < N; z++) {
+		for (y = 0; y < N; y++) {
+			for (x = 0; x < N; x++) {
+				CHECK(output[z + N * (y + N * x)] == expected[IDX(x, y, z)]);
+			}
+		}
+	}
+
+	CHECK_OK(fastmorph_multilabel_dilate(FASTMORPH_UINT8, fortran, NULL, expected, NULL, 3, shape, 0, 1));
+	CHECK_OK(fastmorph_multilabel_dilate(FASTMORPH_UINT8, c_order, c_strides, output, c_strides, 3, shape, 0, 1));
+	for (z = 0; z < N; z++) {
+		for (y = 0; y < N; y++) {
+			for (x = 0; x < N; x++) {
+				CHECK(output[z + N * (y + N * x)] == expected[IDX(x, y, z)]);
+			}
+		}
+	}
+}
+
+static void test_grey_2d(void) {
+	int16_t image[N * N];
+	int16_t output[N * N];
+	const uint64_t shape[2] = { N, N };
+	int i;
+
+	for (i = 0; i < N * N; i++) {
+		image[i] = -5;
+	}
+	image[0] = 3;
+	image[N * N - 1] = -9;
+
+	CHECK_OK(fastmorph_grey_dilate(FASTMORPH_INT16, image, NULL, output, NULL, 2, shape, 1));
+	CHECK(output[0] == 3 && output[1] == 3 && output[N] == 3 && output[N + 1] == 3);
+	CHECK(output[2] == -5 && output[N * N - 1] == -5);
+
+	CHECK_OK(fastmorph_grey_erode(FASTMORPH_INT16, image, NULL, output, NULL, 2, shape, 1));
+	CHECK(output[N * N - 1] == -9 && output[N * N - 2] == -9 && output[N * (N - 1) - 1] == -9);
+	CHECK(output[0] == -5);
+}
+
+static void test_grey_float(void) {
+	float image[N * N * N];
+	float output[N * N * N];
+	const uint64_t shape[3] = { N, N, N };
+	int i;
+
+	for (i = 0; i < N * N * N; i++) {
+		image[i] = -0.5f;
+	}
+	image[IDX(1, 1, 1)] = 0.25f;
+	image[IDX(5, 5, 5)] = NAN;
+
+	CHECK_OK(fastmorph_grey_dilate(FASTMORPH_FLOAT32, image, NULL, output, NULL, 3, shape, 1));
+	CHECK(output[IDX(0, 0, 0)] == 0.25f && output[IDX(2, 2, 2)] == 0.25f);
+	CHECK(output[IDX(3, 1, 1)] == -0.5f);
+	CHECK(isnan(output[IDX(4, 4, 4)]) && !isnan(output[IDX(3, 4, 4)]));
+
+	CHECK_OK(fastmorph_grey_erode(FASTMORPH_FLOAT32, image, NULL, output, NULL, 3, shape, 1));
+	CHECK(output[IDX(1, 1, 1)] == -0.5f && output[IDX(0, 0, 0)] == -0.5f);
+	CHECK(isnan(output[IDX(4, 5, 4)]));
+
+	/* floats are only for the grey functions */
+	CHECK(fastmorph_multilabel_erode(FASTMORPH_FLOAT32, image, NULL, output, NULL, 3, shape, 1)
+		== FASTMORPH_ERROR_UNSUPPORTED_DTYPE);
+}
+
+static void test_iterate_until_stable(void) {
+	uint64_t labels[N * N] = {0};
+	const uint64_t shape[2] = { N, N };
+	uint64_t iterations = 0;
+	int i;
+
+	labels[0] = 9;
+	CHECK_OK(fastmorph_iterate_until_stable(
+		FASTMORPH_UINT64, labels, NULL, 2, shape,
+		FASTMORPH_STABLE_DILATE, 0, 1, 0, 1, &iterations
+	));
+	for (i = 0; i < N * N; i++) {
+		CHECK(labels[i] == 9);
+	}
+	CHECK(iterations >= N - 1);
+}
+
+static void test_morph_each_label(void) {
+	int32_t labels[N * N * N] = {0};
+	int32_t output[N * N * N];
+	const uint64_t shape[3] = { N, N, N };
+
+	labels[IDX(1, 1, 1)] = 3;
+	labels[IDX(4, 4, 4)] = 4;
+	CHECK_OK(fastmorph_morph_each_label(
+		FASTMORPH_INT32, labels, NULL, output, NULL, 3, shape,
+		FASTMORPH_LABEL_DILATE, 1.0f, NULL, 1
+	));
+	CHECK(output[IDX(1, 1, 1)] == 3 && output[IDX(0, 1, 1)] == 3);
+	CHECK(output[IDX(4, 4, 4)] == 4 && output[IDX(5, 4, 4)] == 4);
+}
+
+static void test_errors(void) {
+	uint8_t labels[8] = {0};
+	uint8_t output[8];
+	const uint64_t shape[3] = { 2, 2, 2 };
+
+	CHECK(fastmorph_multilabel_dilate(FASTMORPH_UINT8, labels, NULL, output, NULL, 4, shape, 0, 1)
+		== FASTMORPH_ERROR_INVALID_ARGUMENT);
+	CHECK(strlen(fastmorph_last_error()) > 0);
+
+	CHECK(fastmorph_multilabel_erode(FASTMORPH_UINT8, labels, NULL, output, NULL, 3, NULL, 1)
+		== FASTMORPH_ERROR_INVALID_ARGUMENT);
+	CHECK(fastmorph_grey_erode((fastmorph_dtype)99, labels, NULL, output, NULL, 3, shape, 1)
+		== FASTMORPH_ERROR_UNSUPPORTED_DTYPE);
+	CHECK(fastmorph_grey_erode(FASTMORPH_UINT8, NULL, NULL, output, NULL, 3, shape, 1)
+		== FASTMORPH_ERROR_INVALID_ARGUMENT);
+
+	CHECK_OK(fastmorph_grey_erode(FASTMORPH_UINT8, labels, NULL, output, NULL, 3, shape, 1));
+	CHECK(strlen(fastmorph_last_error()) == 0);
+}
+
+int main(void) {
+	test_version();
+	test_multilabel_dilate();
+	test_multilabel_erode();
+	test_strides();
+	test_grey_2d();
+	test_grey_float();
+	test_iterate_until_stable();
+	test_morph_each_label();
+	test_errors();
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,178 @@
+/* Tests of tools/fastmorph_cli.cpp, run by ctest with the path of
+ * the fastmorph_cli binary and a scratch directory. Results must
+ * match the library, and splitting the volume into slabs with
+ * --memory-budget must not change them. */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "fastmorph.hpp"
+
+namespace {
+
+int failures = 0;
+
+void check(const bool cond, const std::string &what) {
+	if (!cond) {
+		fprintf(stderr, "CHECK failed: %s\n", what.c_str());
+		failures++;
+	}
+}
+
+std::string cli;
+std::string dir;
+
+int run(const std::string &args) {
+	const std::string cmd = "\"" + cli + "\" --quiet " + args;
+	return std::system(cmd.c_str());
+}
+
+void write_npy(
+	const std::string &path, const std::vector<uint16_t> &data,
+	const std::string &shape, const bool fortran_order
+) {
+	std::string dict = "{'descr': '<u2', 'fortran_order': ";
+	dict += fortran_order ? "True" : "False";
+	dict += ", 'shape': " + shape + ", }";
+	dict.append((64 - (10 + dict.size() + 1) % 64) % 64, ' ');
+	dict += '\n';
+
+	std::ofstream f(path, std::ios::binary);
+	f.write("\x93NUMPY\x01\x00", 8);
+	const char len[2] = { static_cast<char>(dict.size() & 0xff), static_cast<char>(dict.size() >> 8) };
+	f.write(len, 2);
+	f << dict;
+	f.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(uint16_t));
+}
+
+std::vector<uint8_t> read_file(const std::string &path) {
+	std::ifstream f(path, std::ios::binary);
+	return std::vector<uint8_t>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+// the voxels of a .npy file written by the CLI (64 byte aligned header)
+std::vector<uint16_t> read_npy_data(const std::string &path) {
+	const std::vector<uint8_t> bytes = read_file(path);
+	if (bytes.size() < 10) {
+		return {};
+	}
+	const uint64_t offset = 10 + (bytes[8] | (bytes[9] << 8));
+	std::vector<uint16_t> data((bytes.size() - offset) / sizeof(uint16_t));
+	std::memcpy(data.data(), bytes.data() + offset, data.size() * sizeof(uint16_t));
+	return data;
+}
+
+// blocky labels with holes and some background
+std::vector<uint16_t> make_labels(const uint64_t sx, const uint64_t sy, const uint64_t sz) {
+	std::vector<uint16_t> labels(sx * sy * sz);
+	for (uint64_t z = 0; z < sz; z++) {
+		for (uint64_t y = 0; y < sy; y++) {
+			for (uint64_t x = 0; x < sx; x++) {
+				const uint64_t cell = (x / 9) + 7 * ((y / 8) + 7 * (z / 7));
+				const bool hole = (x % 9 == 4 && y % 8 == 4 && z % 7 == 3);
+				const bool gap = ((x * 31 + y * 17 + z * 13) % 23) == 0;
+				labels[x + sx * (y + sy * z)] = (hole || gap || cell % 5 == 0) ? 0 : static_cast<uint16_t>(cell);
+			}
+		}
+	}
+	return labels;
+}
+
+void test_3d() {
+	const uint64_t sx = 40, sy = 36, sz = 44;
+	const std::vector<uint16_t> labels = make_labels(sx, sy, sz);
+	write_npy(dir + "/f.npy", labels, "(40, 36, 44)", true);
+
+	// the same bytes are the transpose as a C ordered array
+	write_npy(dir + "/c.npy", labels, "(44, 36, 40)", false);
+
+	// expected: closing then a spherical dilation of radius 2
+	std::vector<uint16_t> a(labels.size()), b(labels.size());
+	std::vector<uint16_t> in = labels;
+	fastmorph::multilabel_dilate<uint16_t>(in.data(), a.data(), sx, sy, sz, true, 1);
+	fastmorph::multilabel_erode<uint16_t>(a.data(), b.data(), sx, sy, sz, 1);
+	const float anisotropy[3] = { 1, 1, 2 };
+	std::vector<uint16_t> expected(labels.size());
+	fastmorph::morph_each_label<uint16_t>(
+		b.data(), expected.data(), sx, sy, sz,
+		fastmorph::LabelOp::SPHERICAL_DILATE, 2.0f, anisotropy, 1
+	);
+
+	check(run("--anisotropy 1,1,2 " + dir + "/f.npy " + dir + "/whole.npy closing spherical_dilate:2") == 0, "3d whole volume");
+	check(read_npy_data(dir + "/whole.npy") == expected, "3d whole volume matches the library");
+
+	// 16 planes of buffers, a halo of 2 for closing and 2 for
+	// spherical_dilate leaves slabs of 8 planes
+	const uint64_t budget = 16 * sx * sy * (2 * sizeof(uint16_t) + 6);
+	check(run(
+		"--parallel 2 --memory-budget " + std::to_string(budget)
+		+ " --anisotropy 1,1,2 " + dir + "/f.npy " + dir + "/slabs.npy closing spherical_dilate:2"
+	) == 0, "3d slabs");
+	check(read_npy_data(dir + "/slabs.npy") == expected, "3d slabs match the whole volume");
+
+	check(run(
+		"--memory-budget " + std::to_string(budget)
+		+ " --anisotropy 2,1,1 " + dir + "/c.npy " + dir + "/c_out.npy closing spherical_dilate:2"
+	) == 0, "3d C order");
+	check(read_npy_data(dir + "/c_out.npy") == expected, "3d C order is the transpose");
+	const std::vector<uint8_t> c_out = read_file(dir + "/c_out.npy");
+	const std::string header(c_out.begin(), c_out.begin() + std::min<size_t>(c_out.size(), 128));
+	check(header.find("'fortran_order': False") != std::string::npos, "3d C order header");
+	check(header.find("(44, 36, 40)") != std::string::npos, "3d C order shape");
+
+	// fill can't be split into slabs
+	check(run("--memory-budget " + std::to_string(budget) + " " + dir + "/f.npy " + dir + "/fill.npy fill") != 0, "fill over budget fails");
+	check(read_file(dir + "/fill.npy").empty(), "no output after failure");
+	check(read_file(dir + "/fill.npy.partial").empty(), "no partial output after failure");
+}
+
+void test_2d_raw() {
+	const uint64_t sx = 70, sy = 90;
+	std::vector<uint16_t> labels = make_labels(sx, sy, 1);
+	{
+		std::ofstream f(dir + "/image.raw", std::ios::binary);
+		f.write(reinterpret_cast<const char*>(labels.data()), labels.size() * sizeof(uint16_t));
+	}
+
+	std::vector<uint16_t> a(labels.size()), expected(labels.size());
+	fastmorph::grey_erode<uint16_t>(labels.data(), a.data(), sx, sy, 1);
+	fastmorph::grey_erode<uint16_t>(a.data(), expected.data(), sx, sy, 1);
+
+	const std::string raw_args = "--grey --shape 70,90 --order F --dtype uint16 ";
+	check(run(raw_args + "--memory-budget 4000 " + dir + "/image.raw " + dir + "/image_out.raw erode:2") == 0, "2d raw");
+	const std::vector<uint8_t> out = read_file(dir + "/image_out.raw");
+	std::vector<uint16_t> got(out.size() / sizeof(uint16_t));
+	std::memcpy(got.data(), out.data(), got.size() * sizeof(uint16_t));
+	check(got == expected, "2d raw slabs match the library");
+
+	check(run(raw_args + dir + "/image.raw " + dir + "/bad.raw fill") != 0, "--grey rejects fill");
+	check(run("--shape 70,91 --dtype uint16 " + dir + "/image.raw " + dir + "/bad.raw dilate") != 0, "short raw file fails");
+}
+
+}
+
+int main(int argc, char** argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: fastmorph_cli_test FASTMORPH_CLI SCRATCH_DIR\n");
+		return 1;
+	}
+	cli = argv[1];
+	dir = argv[2];
+
+	test_3d();
+	test_2d_raw();
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,208 @@
+/* C++ use of the fastmorph library, run by ctest. fastmorph.hpp is
+ * compiled here and in the library, so this also checks that the
+ * header links into several translation units, and with
+ * FASTMORPH_USE_LIBRARY the kernels come from the library's
+ * explicit instantiations. */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+#include "fastmorph.hpp"
+#include "fastmorph_c.h"
+
+template <typename LABEL>
+int check_dtype(const fastmorph_dtype dtype) {
+	const uint64_t sx = 70, sy = 67, sz = 5;
+	std::vector<LABEL> labels(sx * sy * sz);
+	for (uint64_t i = 0; i < labels.size(); i++) {
+		labels[i] = static_cast<LABEL>((i * 2654435761u >> 7) % 4);
+	}
+
+	std::vector<LABEL> expected(labels.size());
+	std::vector<LABEL> output(labels.size());
+	const uint64_t shape[3] = { sx, sy, sz };
+
+	fastmorph::multilabel_dilate<LABEL>(labels.data(), expected.data(), sx, sy, sz, false, 2);
+	if (fastmorph_multilabel_dilate(dtype, labels.data(), nullptr, output.data(), nullptr, 3, shape, 0, 2) != FASTMORPH_OK) {
+		fprintf(stderr, "fastmorph_multilabel_dilate: %s\n", fastmorph_last_error());
+		return 1;
+	}
+	if (output != expected) {
+		fprintf(stderr, "C and C++ dilate differ for a %d byte dtype\n", static_cast<int>(sizeof(LABEL)));
+		return 1;
+	}
+
+	std::fill(expected.begin(), expected.end(), 0);
+	fastmorph::grey_erode<LABEL>(labels.data(), expected.data(), sx, sy, sz, 2);
+	fastmorph_grey_erode(dtype, labels.data(), nullptr, output.data(), nullptr, 3, shape, 2);
+	if (output != expected) {
+		fprintf(stderr, "C and C++ grey_erode differ for a %d byte dtype\n", static_cast<int>(sizeof(LABEL)));
+		return 1;
+	}
+	return 0;
+}
+
+// brute force 3x3x3 max (IS_MAX) or min clipped to the volume
+template <typename LABEL, bool IS_MAX>
+std::vector<LABEL> grey_reference(
+	const std::vector<LABEL> &labels,
+	const int64_t sx, const int64_t sy, const int64_t sz
+) {
+	std::vector<LABEL> out(labels.size());
+	for (int64_t z = 0; z < sz; z++) {
+		for (int64_t y = 0; y < sy; y++) {
+			for (int64_t x = 0; x < sx; x++) {
+				LABEL val = labels[x + sx * (y + sy * z)];
+				for (int64_t k = std::max<int64_t>(z - 1, 0); k <= std::min(z + 1, sz - 1); k++) {
+					for (int64_t j = std::max<int64_t>(y - 1, 0); j <= std::min(y + 1, sy - 1); j++) {
+						for (int64_t i = std::max<int64_t>(x - 1, 0); i <= std::min(x + 1, sx - 1); i++) {
+							const LABEL nb = labels[i + sx * (j + sy * k)];
+							val = IS_MAX ? std::max(val, nb) : std::min(val, nb);
+						}
+					}
+				}
+				out[x + sx * (y + sy * z)] = val;
+			}
+		}
+	}
+	return out;
+}
+
+// the integer grey kernels skip ahead past columns holding the
+// dtype's maximum (dilate) or minimum (erode), the skipped voxels
+// must still be written
+template <typename LABEL>
+int check_grey_saturated() {
+	const uint64_t sx = 70, sy = 9, sz = 5;
+	constexpr LABEL lowest = std::numeric_limits<LABEL>::min();
+	constexpr LABEL highest = std::numeric_limits<LABEL>::max();
+
+	std::vector<LABEL> labels(sx * sy * sz);
+	uint64_t state = 7;
+	for (uint64_t i = 0; i < labels.size(); i++) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		const uint64_t r = (state >> 58) % 8;
+		labels[i] = (r == 0) ? highest : (r == 1) ? lowest : static_cast<LABEL>(r + 10);
+	}
+
+	int failures = 0;
+	for (uint64_t threads : { 1, 2 }) {
+		std::vector<LABEL> output(labels.size());
+		fastmorph::grey_dilate<LABEL>(labels.data(), output.data(), sx, sy, sz, threads);
+		if (output != grey_reference<LABEL, true>(labels, sx, sy, sz)) {
+			fprintf(stderr, "saturated grey_dilate wrong for a %d byte dtype\n", static_cast<int>(sizeof(LABEL)));
+			failures++;
+		}
+
+		std::fill(output.begin(), output.end(), 0);
+		fastmorph::grey_erode<LABEL>(labels.data(), output.data(), sx, sy, sz, threads);
+		if (output != grey_reference<LABEL, false>(labels, sx, sy, sz)) {
+			fprintf(stderr, "saturated grey_erode wrong for a %d byte dtype\n", static_cast<int>(sizeof(LABEL)));
+			failures++;
+		}
+
+		std::fill(output.begin(), output.end(), 0);
+		fastmorph::grey_dilate<LABEL>(labels.data(), output.data(), sx, sy * sz, threads);
+		if (output != grey_reference<LABEL, true>(labels, sx, sy * sz, 1)) {
+			fprintf(stderr, "saturated 2d grey_dilate wrong for a %d byte dtype\n", static_cast<int>(sizeof(LABEL)));
+			failures++;
+		}
+
+		std::fill(output.begin(), output.end(), 0);
+		fastmorph::grey_erode<LABEL>(labels.data(), output.data(), sx, sy * sz, threads);
+		if (output != grey_reference<LABEL, false>(labels, sx, sy * sz, 1)) {
+			fprintf(stderr, "saturated 2d grey_erode wrong for a %d byte dtype\n", static_cast<int>(sizeof(LABEL)));
+			failures++;
+		}
+	}
+	return failures;
+}
+
+// morph_batch must match calling the kernels on each image
+template <typename LABEL>
+int check_batch(const fastmorph::StableOp op, const bool grey, const uint64_t threads) {
+	const uint64_t shapes[6][3] = {
+		{ 40, 33, 20 }, { 9, 7, 5 }, { 130, 70, 40 }, { 50, 61, 1 }, { 0, 4, 4 }, { 17, 17, 17 }
+	};
+	const int num_items = 6;
+
+	std::vector<std::vector<LABEL>> images(num_items), outputs(num_items);
+	std::vector<fastmorph::BatchItem<LABEL>> items(num_items);
+	for (int n = 0; n < num_items; n++) {
+		const uint64_t sx = shapes[n][0], sy = shapes[n][1], sz = shapes[n][2];
+		images[n].resize(sx * sy * sz);
+		for (uint64_t i = 0; i < images[n].size(); i++) {
+			images[n][i] = static_cast<LABEL>(((i + 31 * n) * 2654435761u >> 9) % 3);
+		}
+		outputs[n].assign(images[n].size(), 0);
+		items[n] = { images[n].data(), outputs[n].data(), sx, sy, sz, /*planar=*/n == 3 };
+	}
+
+	fastmorph::morph_batch<LABEL>(items.data(), num_items, op, grey, /*background_only=*/true, threads);
+
+	for (int n = 0; n < num_items; n++) {
+		const uint64_t sx = shapes[n][0], sy = shapes[n][1], sz = shapes[n][2];
+		std::vector<LABEL> input = images[n];
+		for (const bool dilate : fastmorph::stencil_passes(op)) {
+			std::vector<LABEL> out(input.size());
+			if (input.empty()) {
+				break;
+			}
+			else if (grey && dilate) {
+				fastmorph::grey_dilate<LABEL>(input.data(), out.data(), sx, sy, sz, 1);
+			}
+			else if (grey) {
+				fastmorph::grey_erode<LABEL>(input.data(), out.data(), sx, sy, sz, 1);
+			}
+			else if (dilate && n == 3) {
+				fastmorph::multilabel_dilate<LABEL>(input.data(), out.data(), sx, sy, true, 1);
+			}
+			else if (dilate) {
+				fastmorph::multilabel_dilate<LABEL>(input.data(), out.data(), sx, sy, sz, true, 1);
+			}
+			else if (n == 3) {
+				fastmorph::multilabel_erode<LABEL>(input.data(), out.data(), sx, sy, 1);
+			}
+			else {
+				fastmorph::multilabel_erode<LABEL>(input.data(), out.data(), sx, sy, sz, 1);
+			}
+			input = out;
+		}
+		if (outputs[n] != input) {
+			fprintf(stderr, "morph_batch differs for image %d (op %d, grey %d, %d threads)\n", n, static_cast<int>(op), grey, static_cast<int>(threads));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main() {
+	int failures = 0;
+	failures += check_dtype<uint8_t>(FASTMORPH_UINT8);
+	failures += check_dtype<uint16_t>(FASTMORPH_UINT16);
+	failures += check_dtype<uint32_t>(FASTMORPH_UINT32);
+	failures += check_dtype<uint64_t>(FASTMORPH_UINT64);
+	failures += check_dtype<int8_t>(FASTMORPH_INT8);
+	failures += check_dtype<int16_t>(FASTMORPH_INT16);
+	failures += check_dtype<int32_t>(FASTMORPH_INT32);
+	failures += check_dtype<int64_t>(FASTMORPH_INT64);
+	failures += check_batch<uint32_t>(fastmorph::StableOp::CLOSING, /*grey=*/false, 3);
+	failures += check_batch<uint16_t>(fastmorph::StableOp::DILATE, /*grey=*/false, 1);
+	failures += check_batch<uint16_t>(fastmorph::StableOp::DILATE, /*grey=*/false, 11);
+	failures += check_batch<int8_t>(fastmorph::StableOp::ERODE, /*grey=*/true, 4);
+	failures += check_batch<float>(fastmorph::StableOp::OPENING, /*grey=*/true, 3);
+
+	failures += check_grey_saturated<uint8_t>();
+	failures += check_grey_saturated<int8_t>();
+	failures += check_grey_saturated<int16_t>();
+	failures += check_grey_saturated<uint64_t>();
+
+	if (failures) {
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
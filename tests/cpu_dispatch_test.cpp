@@ -0,0 +1,227 @@
+/* Runtime CPU dispatch (cpu_dispatch.hpp), run by ctest. Every copy
+ * of the kernels this CPU supports must give the same results as
+ * the baseline copy. */
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "fastmorph.hpp"
+
+namespace {
+
+using fastmorph::cpu::Isa;
+
+int failures = 0;
+
+void check(const bool cond, const std::string &what) {
+	if (!cond) {
+		fprintf(stderr, "CHECK failed: %s\n", what.c_str());
+		failures++;
+	}
+}
+
+// labels with blobs, thin structures, and noise so every block kernel runs
+template <typename LABEL>
+std::vector<LABEL> make_labels(const uint64_t sx, const uint64_t sy, const uint64_t sz) {
+	std::vector<LABEL> labels(sx * sy * sz);
+	uint64_t state = 12345;
+	for (uint64_t z = 0; z < sz; z++) {
+		for (uint64_t y = 0; y < sy; y++) {
+			for (uint64_t x = 0; x < sx; x++) {
+				state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+				const uint64_t loc = x + sx * (y + sy * z);
+				if (x < sx / 3) {
+					labels[loc] = static_cast<LABEL>((state >> 60) % 3);
+				}
+				else if ((x / 11 + y / 7 + z / 5) % 4 != 0) {
+					labels[loc] = static_cast<LABEL>(1 + (x / 11 + 3 * (y / 7) + 5 * (z / 5)) % 40);
+				}
+			}
+		}
+	}
+	return labels;
+}
+
+template <typename LABEL>
+using Op = std::function<std::vector<LABEL>(const std::vector<LABEL>&)>;
+
+// bitwise so NaN matches NaN
+template <typename LABEL>
+bool same_bits(const std::vector<LABEL> &a, const std::vector<LABEL> &b) {
+	return a.size() == b.size()
+		&& std::memcmp(a.data(), b.data(), a.size() * sizeof(LABEL)) == 0;
+}
+
+template <typename LABEL>
+void compare_isas(const std::string &name, const std::vector<LABEL> &labels, const Op<LABEL> &op) {
+	fastmorph::cpu::select_isa(Isa::BASELINE);
+	const std::vector<LABEL> expected = op(labels);
+
+	for (int i = 1; i < static_cast<int>(Isa::NUM_ISAS); i++) {
+		const Isa isa = static_cast<Isa>(i);
+		if (!fastmorph::cpu::isa_supported(isa)) {
+			continue;
+		}
+		check(fastmorph::cpu::select_isa(isa) == isa, name + ": select " + fastmorph::cpu::isa_name(isa));
+#if FASTMORPH_DISPATCH_ENABLED
+		check(fastmorph::dispatched_kernels<LABEL>() != nullptr, name + ": dispatched to " + fastmorph::cpu::isa_name(isa));
+#endif
+		check(same_bits(op(labels), expected), name + ": " + fastmorph::cpu::isa_name(isa) + " matches the baseline");
+	}
+}
+
+template <typename LABEL>
+void test_dtype(const std::string &dtype) {
+	const uint64_t sx = 90, sy = 80, sz = 40;
+	const uint64_t threads = 2;
+	const std::vector<LABEL> labels = make_labels<LABEL>(sx, sy, sz);
+	const uint64_t voxels = labels.size();
+
+	compare_isas<LABEL>(dtype + " multilabel_dilate", labels, [&](const std::vector<LABEL> &in) {
+		std::vector<LABEL> a = in, out(voxels), full(voxels);
+		fastmorph::multilabel_dilate<LABEL>(a.data(), out.data(), sx, sy, sz, true, threads);
+		fastmorph::multilabel_dilate<LABEL>(a.data(), full.data(), sx, sy, sz, false, threads);
+		out.insert(out.end(), full.begin(), full.end());
+		return out;
+	});
+	compare_isas<LABEL>(dtype + " multilabel_dilate 2d", labels, [&](const std::vector<LABEL> &in) {
+		std::vector<LABEL> a = in, out(voxels);
+		fastmorph::multilabel_dilate<LABEL>(a.data(), out.data(), sx, sy * sz, true, threads);
+		return out;
+	});
+	compare_isas<LABEL>(dtype + " multilabel_erode", labels, [&](const std::vector<LABEL> &in) {
+		std::vector<LABEL> a = in, out(voxels);
+		fastmorph::multilabel_erode<LABEL>(a.data(), out.data(), sx, sy, sz, threads);
+		return out;
+	});
+	compare_isas<LABEL>(dtype + " grey", labels, [&](const std::vector<LABEL> &in) {
+		std::vector<LABEL> a = in, dilated(voxels), eroded(voxels);
+		fastmorph::grey_dilate<LABEL>(a.data(), dilated.data(), sx, sy, sz, threads);
+		fastmorph::grey_erode<LABEL>(a.data(), eroded.data(), sx, sy * sz, threads);
+		dilated.insert(dilated.end(), eroded.begin(), eroded.end());
+		return dilated;
+	});
+	compare_isas<LABEL>(dtype + " grey_dilate_weighted", labels, [&](const std::vector<LABEL> &in) {
+		std::vector<LABEL> a = in, out(voxels);
+		int64_t weights[27];
+		uint8_t footprint[27];
+		for (int i = 0; i < 27; i++) {
+			weights[i] = (i * 7) % 5 - 2;
+			footprint[i] = i % 4 != 0;
+		}
+		fastmorph::grey_dilate_weighted<LABEL>(a.data(), out.data(), sx, sy, sz, weights, footprint, threads);
+		return out;
+	});
+	compare_isas<LABEL>(dtype + " multilabel_radius_morph", labels, [&](const std::vector<LABEL> &in) {
+		std::vector<LABEL> a = in, out(voxels);
+		const LABEL keys[3] = { 1, 2, 3 };
+		const int64_t radii[3] = { 2, -1, 3 };
+		fastmorph::RadiusMap<LABEL> map(keys, radii, 3, 1);
+		fastmorph::multilabel_radius_morph<LABEL>(a.data(), out.data(), sx, sy, sz, map, threads);
+		return out;
+	});
+	compare_isas<LABEL>(dtype + " morph_each_label", labels, [&](const std::vector<LABEL> &in) {
+		std::vector<LABEL> out(voxels);
+		const float anisotropy[3] = { 1, 1, 1.5 };
+		fastmorph::morph_each_label<LABEL>(
+			in.data(), out.data(), sx, sy, sz,
+			fastmorph::LabelOp::SPHERICAL_CLOSE, 2.5f, anisotropy, threads
+		);
+		return out;
+	});
+	compare_isas<LABEL>(dtype + " iterate_until_stable", labels, [&](const std::vector<LABEL> &in) {
+		std::vector<LABEL> out = in;
+		fastmorph::iterate_until_stable<LABEL>(
+			out.data(), sx, sy, sz, fastmorph::StableOp::OPENING, false, true, 3, threads
+		);
+		return out;
+	});
+}
+
+// float maps with NaN and infinities
+template <typename LABEL>
+void test_float(const std::string &dtype) {
+	const uint64_t sx = 90, sy = 80, sz = 40;
+	const uint64_t threads = 2;
+	std::vector<LABEL> image(sx * sy * sz);
+	uint64_t state = 777;
+	for (LABEL &v : image) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		v = static_cast<LABEL>(static_cast<int64_t>(state >> 40) % 2001 - 1000) / 256;
+	}
+	image[1234] = NAN;
+	image[50000] = INFINITY;
+	image[90000] = -INFINITY;
+	const uint64_t voxels = image.size();
+
+	compare_isas<LABEL>(dtype + " grey", image, [&](const std::vector<LABEL> &in) {
+		std::vector<LABEL> a = in, dilated(voxels), eroded(voxels);
+		fastmorph::grey_dilate<LABEL>(a.data(), dilated.data(), sx, sy, sz, threads);
+		fastmorph::grey_erode<LABEL>(a.data(), eroded.data(), sx, sy * sz, threads);
+		dilated.insert(dilated.end(), eroded.begin(), eroded.end());
+		return dilated;
+	});
+	compare_isas<LABEL>(dtype + " grey_erode_weighted", image, [&](const std::vector<LABEL> &in) {
+		std::vector<LABEL> a = in, out(voxels);
+		LABEL weights[27];
+		uint8_t footprint[27];
+		for (int i = 0; i < 27; i++) {
+			weights[i] = static_cast<LABEL>((i * 7) % 5 - 2) / 4;
+			footprint[i] = i % 4 != 0;
+		}
+		fastmorph::grey_erode_weighted<LABEL>(a.data(), out.data(), sx, sy, sz, weights, footprint, threads);
+		return out;
+	});
+
+	// NaN spreads to its neighborhood
+	fastmorph::cpu::select_isa(Isa::AVX512);
+	std::vector<LABEL> out(voxels);
+	fastmorph::grey_dilate<LABEL>(image.data(), out.data(), sx, sy, sz, threads);
+	check(std::isnan(out[1234 + 1 + sx]) && !std::isnan(out[1234 + 2 + sx]), dtype + " NaN spreads");
+}
+
+void test_select_isa() {
+	const Isa best = fastmorph::cpu::best_supported_isa();
+	check(fastmorph::cpu::select_isa(Isa::AVX512) == best, "select_isa caps at the best supported");
+	check(fastmorph::cpu::selected_isa() == best, "selected_isa");
+	check(fastmorph::cpu::select_isa(Isa::BASELINE) == Isa::BASELINE, "select baseline");
+#if FASTMORPH_DISPATCH_ENABLED
+	check(fastmorph::dispatched_kernels<uint8_t>() == nullptr, "baseline doesn't dispatch");
+#endif
+
+	Isa isa = Isa::BASELINE;
+	check(fastmorph::cpu::parse_isa("avx2", isa) && isa == Isa::AVX2, "parse avx2");
+	check(fastmorph::cpu::parse_isa("auto", isa) && isa == Isa::AVX512, "parse auto");
+	check(!fastmorph::cpu::parse_isa("sse9", isa), "parse unknown");
+}
+
+}
+
+int main() {
+	printf("dispatch %s, best supported: %s\n",
+		fastmorph::cpu::dispatch_enabled() ? "enabled" : "disabled",
+		fastmorph::cpu::isa_name(fastmorph::cpu::best_supported_isa())
+	);
+
+	test_select_isa();
+	test_dtype<uint8_t>("uint8");
+	test_dtype<uint16_t>("uint16");
+	test_dtype<uint32_t>("uint32");
+	test_dtype<uint64_t>("uint64");
+	test_dtype<int16_t>("int16");
+	test_dtype<int64_t>("int64");
+	test_float<float>("float32");
+	test_float<double>("float64");
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,823 @@
+/* File to file morphology on .npy and raw volumes without Python.
+ *
+ * Build (or use CMakeLists.txt):
+ *   g++ -std=c++17 -O3 -pthread -Ifastmorph tools/fastmorph_cli.cpp -o fastmorph_cli
+ *
+ * Usage:
+ *   fastmorph_cli [options] INPUT OUTPUT OP [OP ...]
+ *
+ *   fastmorph_cli labels.npy closed.npy closing
+ *   fastmorph_cli --parallel 8 --memory-budget 4G labels.npy out.npy erode:2 dilate:2 fill
+ *   fastmorph_cli --shape 1024,1024,512 --dtype uint32 labels.raw out.raw spherical_dilate:3.5
+ *
+ * The ops run left to right. OP:N repeats a stencil op N times or
+ * sets the radius of a spherical op (default 1).
+ *   dilate, erode, opening, closing   3x3x3 stencils (3x3 in 2D),
+ *                                     multilabel unless --grey
+ *   fill                              fill the holes in each label
+ *   spherical_dilate, spherical_erode,
+ *   spherical_open, spherical_close   radius N in physical units
+ * fill and the spherical ops apply to each label as if it were
+ * alone in the image, like fastmorph.morph_each_label.
+ *
+ * Options:
+ *   --parallel N          threads (default 0, all cores)
+ *   --memory-budget SIZE  working memory for the ops, e.g. 512M or
+ *                         8G (default unlimited)
+ *   --grey                grey instead of multilabel stencils
+ *   --no-background-only  multilabel dilation may overwrite other
+ *                         labels too (background_only=False)
+ *   --anisotropy X,Y,Z    voxel size for the spherical ops (default 1,1,1)
+ *   --shape X,Y[,Z]       shape of a raw INPUT (required for raw files)
+ *   --dtype T             dtype of a raw INPUT: uint8, uint16, uint32,
+ *                         uint64, int8, int16, int32, int64 (default uint8)
+ *   --order C|F           memory order of a raw INPUT (default C,
+ *                         like numpy's tofile)
+ *   --offset N            bytes to skip at the start of a raw INPUT
+ *   --format npy|raw      OUTPUT format (default npy for *.npy, else raw).
+ *                         The output has the dtype, shape, and order
+ *                         of the input.
+ *   --quiet               don't print a summary to stderr
+ *
+ * INPUT is memory mapped and never copied. The volume is processed
+ * in slabs along its slowest varying axis, each padded by a halo
+ * as deep as the chain of ops can reach so the slabs give the same
+ * result as processing the whole volume, and each finished slab is
+ * appended to OUTPUT. Without --memory-budget the volume is one
+ * slab. The budget covers the two slab buffers the ops ping pong
+ * between and a per voxel estimate of the scratch space of fill
+ * and the spherical ops, not the pages of INPUT the kernel maps in
+ * (which are released as the slabs move past them). fill can reach
+ * across the whole volume, so chains with fill must fit the budget
+ * in one slab. OUTPUT is written to OUTPUT.partial and renamed when
+ * complete.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "fastmorph.hpp"
+
+namespace {
+
+enum class Dtype {
+	UINT8, UINT16, UINT32, UINT64,
+	INT8, INT16, INT32, INT64,
+};
+
+struct DtypeInfo {
+	Dtype dtype;
+	const char* name;
+	const char* descr;
+	uint64_t width;
+};
+
+const DtypeInfo DTYPES[] = {
+	{ Dtype::UINT8, "uint8", "|u1", 1 },
+	{ Dtype::UINT16, "uint16", "<u2", 2 },
+	{ Dtype::UINT32, "uint32", "<u4", 4 },
+	{ Dtype::UINT64, "uint64", "<u8", 8 },
+	{ Dtype::INT8, "int8", "|i1", 1 },
+	{ Dtype::INT16, "int16", "<i2", 2 },
+	{ Dtype::INT32, "int32", "<i4", 4 },
+	{ Dtype::INT64, "int64", "<i8", 8 },
+};
+
+const DtypeInfo& dtype_by_name(const std::string &name) {
+	for (const DtypeInfo &info : DTYPES) {
+		if (name == info.name) {
+			return info;
+		}
+	}
+	throw std::runtime_error("Unsupported dtype: " + name);
+}
+
+// numpy descr such as '<u4' or '|b1', bool is read as uint8
+const DtypeInfo& dtype_by_descr(const std::string &descr) {
+	if (descr.size() < 3) {
+		throw std::runtime_error("Unsupported dtype: " + descr);
+	}
+	const char kind = descr[1];
+	const uint64_t width = std::stoull(descr.substr(2));
+	if (descr[0] == '>' && width > 1) {
+		throw std::runtime_error("Big endian arrays are not supported.");
+	}
+	if (kind == 'b' && width == 1) {
+		return DTYPES[0];
+	}
+	for (const DtypeInfo &info : DTYPES) {
+		if (info.descr[1] == kind && info.width == width) {
+			return info;
+		}
+	}
+	throw std::runtime_error("Unsupported dtype: " + descr);
+}
+
+struct Op {
+	std::string name;
+	bool stencil; // otherwise a fastmorph::LabelOp
+	std::vector<bool> passes; // stencil passes, true is a dilation
+	fastmorph::LabelOp label_op;
+	float radius;
+};
+
+Op parse_op(const std::string &spec) {
+	const size_t colon = spec.find(':');
+	Op op;
+	op.name = spec.substr(0, colon);
+	op.radius = (colon == std::string::npos) ? 1 : std::stof(spec.substr(colon + 1));
+	op.stencil = true;
+	op.label_op = fastmorph::LabelOp::DILATE;
+
+	if (op.name == "dilate") {
+		op.passes = { true };
+	}
+	else if (op.name == "erode") {
+		op.passes = { false };
+	}
+	else if (op.name == "opening") {
+		op.passes = { false, true };
+	}
+	else if (op.name == "closing") {
+		op.passes = { true, false };
+	}
+	else {
+		op.stencil = false;
+		if (op.name == "fill") {
+			op.label_op = fastmorph::LabelOp::FILL;
+		}
+		else if (op.name == "spherical_dilate") {
+			op.label_op = fastmorph::LabelOp::SPHERICAL_DILATE;
+		}
+		else if (op.name == "spherical_erode") {
+			op.label_op = fastmorph::LabelOp::SPHERICAL_ERODE;
+		}
+		else if (op.name == "spherical_open") {
+			op.label_op = fastmorph::LabelOp::SPHERICAL_OPEN;
+		}
+		else if (op.name == "spherical_close") {
+			op.label_op = fastmorph::LabelOp::SPHERICAL_CLOSE;
+		}
+		else {
+			throw std::runtime_error("Unknown op: " + spec);
+		}
+	}
+
+	if (op.stencil) {
+		if (op.radius < 0 || op.radius != std::floor(op.radius)) {
+			throw std::runtime_error(spec + ": iterations must be a whole number.");
+		}
+		std::vector<bool> passes;
+		for (int i = 0; i < static_cast<int>(op.radius); i++) {
+			passes.insert(passes.end(), op.passes.begin(), op.passes.end());
+		}
+		op.passes = passes;
+	}
+	else if (!(op.radius >= 0)) {
+		throw std::runtime_error(spec + ": radius must be non-negative.");
+	}
+	return op;
+}
+
+struct Options {
+	std::string input;
+	std::string output;
+	std::vector<Op> ops;
+	uint64_t threads = 0;
+	uint64_t memory_budget = 0;
+	bool grey = false;
+	bool background_only = true;
+	float anisotropy[3] = { 1, 1, 1 };
+	std::vector<uint64_t> shape;
+	std::string dtype = "uint8";
+	bool fortran_order = false;
+	uint64_t offset = 0;
+	std::string format;
+	bool quiet = false;
+};
+
+std::vector<std::string> split(const std::string &s) {
+	std::vector<std::string> out;
+	std::stringstream ss(s);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty()) {
+			out.push_back(item);
+		}
+	}
+	return out;
+}
+
+// bytes with an optional K, M, G, or T (powers of 1024) suffix
+uint64_t parse_size(const std::string &s) {
+	size_t end = 0;
+	const double val = std::stod(s, &end);
+	const std::string suffix = s.substr(end);
+	double scale = 1;
+	if (suffix == "K" || suffix == "k") {
+		scale = 1ULL << 10;
+	}
+	else if (suffix == "M" || suffix == "m") {
+		scale = 1ULL << 20;
+	}
+	else if (suffix == "G" || suffix == "g") {
+		scale = 1ULL << 30;
+	}
+	else if (suffix == "T" || suffix == "t") {
+		scale = 1ULL << 40;
+	}
+	else if (!suffix.empty()) {
+		throw std::runtime_error("Invalid size: " + s);
+	}
+	if (!(val >= 0)) {
+		throw std::runtime_error("Invalid size: " + s);
+	}
+	return static_cast<uint64_t>(val * scale);
+}
+
+void print_usage() {
+	printf(
+		"usage: fastmorph_cli [options] INPUT OUTPUT OP [OP ...]\n"
+		"ops: dilate erode opening closing fill spherical_dilate\n"
+		"     spherical_erode spherical_open spherical_close (OP:N for N)\n"
+		"See the top of tools/fastmorph_cli.cpp for options.\n"
+	);
+}
+
+Options parse_args(int argc, char** argv) {
+	Options opts;
+	std::vector<std::string> positional;
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		auto next = [&]() -> std::string {
+			if (i + 1 >= argc) {
+				throw std::runtime_error(arg + " requires a value.");
+			}
+			return argv[++i];
+		};
+
+		if (arg == "--parallel") {
+			opts.threads = std::stoull(next());
+		}
+		else if (arg == "--memory-budget") {
+			opts.memory_budget = parse_size(next());
+		}
+		else if (arg == "--grey") {
+			opts.grey = true;
+		}
+		else if (arg == "--no-background-only") {
+			opts.background_only = false;
+		}
+		else if (arg == "--anisotropy") {
+			const std::vector<std::string> parts = split(next());
+			if (parts.size() < 2 || parts.size() > 3) {
+				throw std::runtime_error("--anisotropy takes 2 or 3 values.");
+			}
+			for (size_t j = 0; j < parts.size(); j++) {
+				opts.anisotropy[j] = std::stof(parts[j]);
+				if (!(opts.anisotropy[j] > 0)) {
+					throw std::runtime_error("--anisotropy must be positive.");
+				}
+			}
+		}
+		else if (arg == "--shape") {
+			for (auto& s : split(next())) {
+				opts.shape.push_back(std::stoull(s));
+			}
+		}
+		else if (arg == "--dtype") {
+			opts.dtype = next();
+		}
+		else if (arg == "--order") {
+			const std::string order = next();
+			if (order != "C" && order != "F") {
+				throw std::runtime_error("--order must be C or F.");
+			}
+			opts.fortran_order = order == "F";
+		}
+		else if (arg == "--offset") {
+			opts.offset = std::stoull(next());
+		}
+		else if (arg == "--format") {
+			opts.format = next();
+			if (opts.format != "npy" && opts.format != "raw") {
+				throw std::runtime_error("--format must be npy or raw.");
+			}
+		}
+		else if (arg == "--quiet") {
+			opts.quiet = true;
+		}
+		else if (arg == "--help" || arg == "-h") {
+			print_usage();
+			exit(0);
+		}
+		else if (arg.size() > 1 && arg[0] == '-') {
+			throw std::runtime_error("Unknown option: " + arg);
+		}
+		else {
+			positional.push_back(arg);
+		}
+	}
+
+	if (positional.size() < 3) {
+		print_usage();
+		throw std::runtime_error("INPUT, OUTPUT, and at least one OP are required.");
+	}
+	opts.input = positional[0];
+	opts.output = positional[1];
+	for (size_t i = 2; i < positional.size(); i++) {
+		opts.ops.push_back(parse_op(positional[i]));
+	}
+
+	if (opts.threads == 0) {
+		opts.threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	if (opts.format.empty()) {
+		const std::string ext = std::filesystem::path(opts.output).extension().string();
+		opts.format = (ext == ".npy") ? "npy" : "raw";
+	}
+	if (opts.grey) {
+		for (const Op &op : opts.ops) {
+			if (!op.stencil) {
+				throw std::runtime_error(op.name + " is only defined for labels, not with --grey.");
+			}
+		}
+	}
+	return opts;
+}
+
+// A read only view of a whole file. Pages are mapped copy on
+// write so a kernel can never modify the file, and can be handed
+// back to the kernel once processed. Without mmap (Windows) the
+// file is read into memory instead.
+class MappedFile {
+public:
+	explicit MappedFile(const std::string &path) {
+#ifndef _WIN32
+		fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::runtime_error("Unable to open " + path + ": " + strerror(errno));
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			throw std::runtime_error("Unable to stat " + path + ": " + strerror(errno));
+		}
+		length = static_cast<uint64_t>(st.st_size);
+		if (length > 0) {
+			void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (addr == MAP_FAILED) {
+				close(fd);
+				throw std::runtime_error("Unable to map " + path + ": " + strerror(errno));
+			}
+			bytes = static_cast<uint8_t*>(addr);
+			madvise(bytes, length, MADV_SEQUENTIAL);
+		}
+#else
+		std::ifstream f(path, std::ios::binary | std::ios::ate);
+		if (!f) {
+			throw std::runtime_error("Unable to open " + path);
+		}
+		length = static_cast<uint64_t>(f.tellg());
+		buffer.resize(length);
+		f.seekg(0);
+		f.read(reinterpret_cast<char*>(buffer.data()), length);
+		bytes = buffer.data();
+#endif
+	}
+
+	~MappedFile() {
+#ifndef _WIN32
+		if (bytes != nullptr) {
+			munmap(bytes, length);
+		}
+		close(fd);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	uint8_t* data() const {
+		return bytes;
+	}
+
+	uint64_t size() const {
+		return length;
+	}
+
+	// drops the pages entirely inside [start, end) from memory,
+	// they are read from the file again if touched
+	void release(const uint64_t start, const uint64_t end) {
+#ifndef _WIN32
+		const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+		const uint64_t first = (start + page - 1) / page * page;
+		const uint64_t last = end / page * page;
+		if (bytes != nullptr && last > first) {
+			madvise(bytes + first, last - first, MADV_DONTNEED);
+		}
+#else
+		(void)start;
+		(void)end;
+#endif
+	}
+
+private:
+	uint8_t* bytes = nullptr;
+	uint64_t length = 0;
+#ifndef _WIN32
+	int fd = -1;
+#else
+	std::vector<uint8_t> buffer;
+#endif
+};
+
+// Where the voxels are in the input file and how to describe
+// them in the output.
+struct Layout {
+	const DtypeInfo* dtype;
+	std::vector<uint64_t> shape; // as the user sees it
+	bool fortran_order;
+	uint64_t data_offset;
+};
+
+Layout read_npy_header(const MappedFile &file, const std::string &path) {
+	const uint8_t* bytes = file.data();
+	if (file.size() < 10 || std::memcmp(bytes, "\x93NUMPY", 6) != 0) {
+		throw std::runtime_error(path + " is not a .npy file.");
+	}
+	uint64_t header_len = 0;
+	uint64_t header_start = 0;
+	if (bytes[6] == 1) {
+		header_len = bytes[8] | (static_cast<uint64_t>(bytes[9]) << 8);
+		header_start = 10;
+	}
+	else {
+		if (file.size() < 12) {
+			throw std::runtime_error(path + ": truncated header.");
+		}
+		header_len = bytes[8] | (static_cast<uint64_t>(bytes[9]) << 8)
+			| (static_cast<uint64_t>(bytes[10]) << 16) | (static_cast<uint64_t>(bytes[11]) << 24);
+		header_start = 12;
+	}
+	if (header_start + header_len > file.size()) {
+		throw std::runtime_error(path + ": truncated header.");
+	}
+	const std::string header(reinterpret_cast<const char*>(bytes + header_start), header_len);
+
+	auto field = [&](const std::string &key) {
+		const size_t pos = header.find("'" + key + "'");
+		if (pos == std::string::npos) {
+			throw std::runtime_error(path + ": missing " + key);
+		}
+		return header.substr(header.find(':', pos) + 1);
+	};
+
+	std::string descr = field("descr");
+	descr = descr.substr(descr.find('\'') + 1);
+	descr = descr.substr(0, descr.find('\''));
+
+	Layout layout;
+	layout.dtype = &dtype_by_descr(descr);
+
+	std::string order = field("fortran_order");
+	layout.fortran_order = order.substr(0, order.find(',')).find("True") != std::string::npos;
+
+	std::string shape_str = field("shape");
+	shape_str = shape_str.substr(shape_str.find('(') + 1);
+	shape_str = shape_str.substr(0, shape_str.find(')'));
+	for (auto& s : split(shape_str)) {
+		if (s.find_first_of("0123456789") != std::string::npos) {
+			layout.shape.push_back(std::stoull(s));
+		}
+	}
+	layout.data_offset = header_start + header_len;
+	return layout;
+}
+
+std::string npy_header(const Layout &layout) {
+	std::string dict = "{'descr': '";
+	dict += layout.dtype->descr;
+	dict += "', 'fortran_order': ";
+	dict += layout.fortran_order ? "True" : "False";
+	dict += ", 'shape': (";
+	for (size_t i = 0; i < layout.shape.size(); i++) {
+		dict += std::to_string(layout.shape[i]);
+		dict += (layout.shape.size() == 1 || i + 1 < layout.shape.size()) ? ", " : "";
+	}
+	dict += "), }";
+
+	// version 1.0, the magic, version, length, and dict
+	// (ending in a newline) are padded to a multiple of 64 bytes
+	const uint64_t unpadded = 10 + dict.size() + 1;
+	dict.append((64 - unpadded % 64) % 64, ' ');
+	dict += '\n';
+
+	std::string out = "\x93NUMPY";
+	out += static_cast<char>(1);
+	out += static_cast<char>(0);
+	out += static_cast<char>(dict.size() & 0xff);
+	out += static_cast<char>((dict.size() >> 8) & 0xff);
+	return out + dict;
+}
+
+// Planes of the slab axis an op can see past its own slab,
+// which is how deep the halo must be for the op to give the same
+// result on a slab as on the whole volume. UINT64_MAX for fill.
+uint64_t op_reach(const Op &op, const float slab_anisotropy, const uint64_t depth) {
+	if (op.stencil) {
+		return op.passes.size();
+	}
+	if (op.label_op == fastmorph::LabelOp::FILL) {
+		return depth;
+	}
+	const uint64_t one = static_cast<uint64_t>(std::ceil(op.radius / slab_anisotropy)) + 1;
+	const bool twice = op.label_op == fastmorph::LabelOp::SPHERICAL_OPEN
+		|| op.label_op == fastmorph::LabelOp::SPHERICAL_CLOSE;
+	return twice ? 2 * one : one;
+}
+
+struct Summary {
+	uint64_t slabs = 0;
+	uint64_t slab_depth = 0;
+	uint64_t halo = 0;
+	uint64_t buffer_bytes = 0;
+};
+
+template <typename LABEL>
+Summary run(
+	const Options &opts, MappedFile &input, const Layout &layout, FILE* out
+) {
+	// C ordered arrays are processed as their transpose, which has
+	// the same memory layout and the same result for every op
+	std::vector<uint64_t> shape = layout.shape;
+	float anisotropy[3] = { opts.anisotropy[0], opts.anisotropy[1], opts.anisotropy[2] };
+	if (!layout.fortran_order) {
+		std::reverse(shape.begin(), shape.end());
+		std::reverse(anisotropy, anisotropy + shape.size());
+	}
+
+	const bool planar = shape.size() == 2;
+	const uint64_t sx = shape[0];
+	const uint64_t sy = shape[1];
+	// slabs are cut along z, or along y for 2D images
+	const uint64_t depth = planar ? sy : shape[2];
+	const uint64_t plane = planar ? sx : sx * sy;
+	const float slab_anisotropy = anisotropy[planar ? 1 : 2];
+
+	bool label_ops = false;
+	uint64_t halo = 0;
+	for (const Op &op : opts.ops) {
+		label_ops = label_ops || !op.stencil;
+		halo = std::min(halo + op_reach(op, slab_anisotropy, depth), depth);
+	}
+
+	// two slab buffers plus, for fill and the spherical ops, a
+	// byte of cutout, a byte of scratch, and a float of distance
+	const uint64_t bytes_per_voxel = 2 * sizeof(LABEL) + (label_ops ? 6 : 0);
+
+	uint64_t slab_depth = depth;
+	if (opts.memory_budget > 0) {
+		const uint64_t planes = opts.memory_budget / std::max(plane * bytes_per_voxel, static_cast<uint64_t>(1));
+		const uint64_t min_planes = std::min(2 * halo + 1, depth);
+		if (planes < min_planes) {
+			throw std::runtime_error(
+				"--memory-budget is too small for these ops, they need at least "
+				+ std::to_string(min_planes * plane * bytes_per_voxel) + " bytes."
+			);
+		}
+		slab_depth = (planes >= depth) ? depth : planes - 2 * halo;
+	}
+	slab_depth = std::max(std::min(slab_depth, depth), static_cast<uint64_t>(1));
+
+	const uint64_t buffer_planes = std::min(slab_depth + 2 * halo, depth);
+	std::vector<LABEL> buffer_a(buffer_planes * plane);
+	std::vector<LABEL> buffer_b(buffer_planes * plane);
+
+	LABEL* data = reinterpret_cast<LABEL*>(input.data() + layout.data_offset);
+
+	Summary summary;
+	summary.slab_depth = slab_depth;
+	summary.halo = halo;
+	summary.buffer_bytes = 2 * buffer_planes * plane * sizeof(LABEL);
+
+	for (uint64_t start = 0; start < depth; start += slab_depth) {
+		const uint64_t end = std::min(start + slab_depth, depth);
+		const uint64_t lo = (start > halo) ? start - halo : 0;
+		const uint64_t hi = std::min(end + halo, depth);
+		const uint64_t n = (hi - lo) * plane;
+		const uint64_t sx_slab = sx;
+		const uint64_t sy_slab = planar ? hi - lo : sy;
+		const uint64_t sz_slab = planar ? 1 : hi - lo;
+
+		LABEL* src = data + lo * plane;
+		for (const Op &op : opts.ops) {
+			if (op.stencil) {
+				for (const bool dilate : op.passes) {
+					LABEL* dest = (src == buffer_a.data()) ? buffer_b.data() : buffer_a.data();
+					std::fill(dest, dest + n, 0);
+					if (opts.grey && dilate && planar) {
+						fastmorph::grey_dilate<LABEL>(src, dest, sx_slab, sy_slab, opts.threads);
+					}
+					else if (opts.grey && dilate) {
+						fastmorph::grey_dilate<LABEL>(src, dest, sx_slab, sy_slab, sz_slab, opts.threads);
+					}
+					else if (opts.grey && planar) {
+						fastmorph::grey_erode<LABEL>(src, dest, sx_slab, sy_slab, opts.threads);
+					}
+					else if (opts.grey) {
+						fastmorph::grey_erode<LABEL>(src, dest, sx_slab, sy_slab, sz_slab, opts.threads);
+					}
+					else if (dilate && planar) {
+						fastmorph::multilabel_dilate<LABEL>(src, dest, sx_slab, sy_slab, opts.background_only, opts.threads);
+					}
+					else if (dilate) {
+						fastmorph::multilabel_dilate<LABEL>(src, dest, sx_slab, sy_slab, sz_slab, opts.background_only, opts.threads);
+					}
+					else if (planar) {
+						fastmorph::multilabel_erode<LABEL>(src, dest, sx_slab, sy_slab, opts.threads);
+					}
+					else {
+						fastmorph::multilabel_erode<LABEL>(src, dest, sx_slab, sy_slab, sz_slab, opts.threads);
+					}
+					src = dest;
+				}
+			}
+			else {
+				LABEL* dest = (src == buffer_a.data()) ? buffer_b.data() : buffer_a.data();
+				if (planar) {
+					fastmorph::morph_each_label<LABEL>(
+						src, dest, sx_slab, sy_slab,
+						op.label_op, op.radius, anisotropy, opts.threads
+					);
+				}
+				else {
+					fastmorph::morph_each_label<LABEL>(
+						src, dest, sx_slab, sy_slab, sz_slab,
+						op.label_op, op.radius, anisotropy, opts.threads
+					);
+				}
+				src = dest;
+			}
+		}
+
+		const LABEL* interior = src + (start - lo) * plane;
+		const uint64_t count = (end - start) * plane;
+		if (fwrite(interior, sizeof(LABEL), count, out) != count) {
+			throw std::runtime_error("Unable to write " + opts.output + ": " + strerror(errno));
+		}
+
+		// the next slab starts reading at end - halo
+		const uint64_t keep = (end > halo) ? end - halo : 0;
+		input.release(
+			layout.data_offset + lo * plane * sizeof(LABEL),
+			layout.data_offset + keep * plane * sizeof(LABEL)
+		);
+		summary.slabs++;
+	}
+
+	return summary;
+}
+
+Layout input_layout(const Options &opts, const MappedFile &input) {
+	const std::string ext = std::filesystem::path(opts.input).extension().string();
+
+	Layout layout;
+	if (ext == ".npy" && opts.shape.empty()) {
+		layout = read_npy_header(input, opts.input);
+	}
+	else {
+		if (opts.shape.empty()) {
+			throw std::runtime_error("--shape is required for raw input.");
+		}
+		layout.dtype = &dtype_by_name(opts.dtype);
+		layout.shape = opts.shape;
+		layout.fortran_order = opts.fortran_order;
+		layout.data_offset = opts.offset;
+	}
+
+	if (layout.shape.size() < 2 || layout.shape.size() > 3) {
+		throw std::runtime_error("Only 2D and 3D volumes are supported.");
+	}
+	uint64_t voxels = 1;
+	for (const uint64_t s : layout.shape) {
+		voxels *= s;
+	}
+	if (voxels == 0) {
+		throw std::runtime_error("The input is empty.");
+	}
+	if (layout.data_offset % layout.dtype->width != 0) {
+		throw std::runtime_error("--offset must be a multiple of the dtype's size.");
+	}
+	const uint64_t needed = layout.data_offset + voxels * layout.dtype->width;
+	if (input.size() < needed) {
+		throw std::runtime_error(
+			opts.input + " is " + std::to_string(input.size())
+			+ " bytes, but the shape and dtype need " + std::to_string(needed) + "."
+		);
+	}
+	return layout;
+}
+
+}
+
+int main(int argc, char** argv) {
+	try {
+		const Options opts = parse_args(argc, argv);
+
+		std::error_code ec;
+		if (std::filesystem::equivalent(opts.input, opts.output, ec)) {
+			throw std::runtime_error("OUTPUT must be a different file than INPUT.");
+		}
+
+		MappedFile input(opts.input);
+		const Layout layout = input_layout(opts, input);
+
+		const std::string partial = opts.output + ".partial";
+		FILE* out = fopen(partial.c_str(), "wb");
+		if (out == nullptr) {
+			throw std::runtime_error("Unable to open " + partial + ": " + strerror(errno));
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		Summary summary;
+		try {
+			if (opts.format == "npy") {
+				const std::string header = npy_header(layout);
+				if (fwrite(header.data(), 1, header.size(), out) != header.size()) {
+					throw std::runtime_error("Unable to write " + partial + ": " + strerror(errno));
+				}
+			}
+
+			switch (layout.dtype->dtype) {
+				case Dtype::UINT8: summary = run<uint8_t>(opts, input, layout, out); break;
+				case Dtype::UINT16: summary = run<uint16_t>(opts, input, layout, out); break;
+				case Dtype::UINT32: summary = run<uint32_t>(opts, input, layout, out); break;
+				case Dtype::UINT64: summary = run<uint64_t>(opts, input, layout, out); break;
+				case Dtype::INT8: summary = run<int8_t>(opts, input, layout, out); break;
+				case Dtype::INT16: summary = run<int16_t>(opts, input, layout, out); break;
+				case Dtype::INT32: summary = run<int32_t>(opts, input, layout, out); break;
+				case Dtype::INT64: summary = run<int64_t>(opts, input, layout, out); break;
+			}
+
+			if (fclose(out) != 0) {
+				out = nullptr;
+				throw std::runtime_error("Unable to write " + partial + ": " + strerror(errno));
+			}
+			out = nullptr;
+			std::filesystem::rename(partial, opts.output);
+		}
+		catch (...) {
+			if (out != nullptr) {
+				fclose(out);
+			}
+			std::filesystem::remove(partial, ec);
+			throw;
+		}
+
+		if (!opts.quiet) {
+			const double seconds = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start
+			).count();
+			std::string shape;
+			for (const uint64_t s : layout.shape) {
+				shape += (shape.empty() ? "" : "x") + std::to_string(s);
+			}
+			fprintf(stderr,
+				"fastmorph_cli: %s %s in %llu slab(s) of %llu planes (halo %llu, %.1f MiB of buffers) with %llu threads: %.3f sec\n",
+				shape.c_str(), layout.dtype->name,
+				static_cast<unsigned long long>(summary.slabs),
+				static_cast<unsigned long long>(summary.slab_depth),
+				static_cast<unsigned long long>(summary.halo),
+				summary.buffer_bytes / 1048576.0,
+				static_cast<unsigned long long>(opts.threads),
+				seconds
+			);
+		}
+	}
+	catch (const std::exception &e) {
+		fprintf(stderr, "fastmorph_cli: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}